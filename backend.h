@@ -0,0 +1,224 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "pipeline.h"
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <functional>
+
+namespace WinUpdate
+{
+
+// The MSRC rating, only security updates have one.
+enum class UpdateSeverity : uint8_t
+{
+    Unspecified,
+    Low,
+    Moderate,
+    Important,
+    Critical
+};
+
+[[nodiscard]] static inline UpdateSeverity ParseMsrcSeverity(const std::wstring_view text)
+{
+    if (text == L"Critical") {
+        return UpdateSeverity::Critical;
+    }
+    if (text == L"Important") {
+        return UpdateSeverity::Important;
+    }
+    if (text == L"Moderate") {
+        return UpdateSeverity::Moderate;
+    }
+    if (text == L"Low") {
+        return UpdateSeverity::Low;
+    }
+    return UpdateSeverity::Unspecified;
+}
+
+[[nodiscard]] static inline const char *GetSeverityName(const UpdateSeverity severity)
+{
+    switch (severity) {
+    case UpdateSeverity::Unspecified:
+        return "unspecified";
+    case UpdateSeverity::Low:
+        return "low";
+    case UpdateSeverity::Moderate:
+        return "moderate";
+    case UpdateSeverity::Important:
+        return "important";
+    case UpdateSeverity::Critical:
+        return "critical";
+    }
+    return "unknown";
+}
+
+// Same values as WUA's "UpdateType".
+enum class UpdateType : uint8_t
+{
+    Software = 1,
+    Driver
+};
+
+struct UpdateClassification
+{
+    std::wstring_view name = {};
+    std::wstring_view id = {}; // The "CategoryID", lower case.
+};
+
+// The classification categories every Windows update belongs to one of.
+static constexpr const std::array<UpdateClassification, 10> kUpdateClassifications =
+{
+    UpdateClassification{ L"Critical Updates", L"e6cf1350-c01b-414d-a61f-263d14d133b4" },
+    UpdateClassification{ L"Definition Updates", L"e0789628-ce08-4437-be74-2495b842f43b" },
+    UpdateClassification{ L"Drivers", L"ebfc1fc5-71a4-4f7b-9aca-3b9a503104a0" },
+    UpdateClassification{ L"Feature Packs", L"b54e7d24-7add-428f-8b75-90a396fa584f" },
+    UpdateClassification{ L"Security Updates", L"0fa1201d-4330-4fa8-8ae9-b877473b6441" },
+    UpdateClassification{ L"Service Packs", L"68c5b0a3-d1a6-4553-ae49-01d3a7827828" },
+    UpdateClassification{ L"Tools", L"b4832bd8-e735-4761-8daf-37f882276dab" },
+    UpdateClassification{ L"Update Rollups", L"28bc880e-0592-4cbf-8f95-c79b17911d5f" },
+    UpdateClassification{ L"Updates", L"cd5ffd1e-e932-4e3a-bf74-18bf0b1bbd83" },
+    UpdateClassification{ L"Upgrades", L"3689bdc8-b205-4af4-8d4a-a63924c5e9d5" }
+};
+
+// Same values as WUA's "DownloadPriority".
+enum class DownloadPriority : uint8_t
+{
+    Low = 1,
+    Normal,
+    High,
+    ExtraHigh
+};
+
+// Same values as WUA's "InstallationImpact".
+enum class InstallImpact : uint8_t
+{
+    Normal,
+    Minor,
+    RequiresExclusiveHandling
+};
+
+// Same values as WUA's "InstallationRebootBehavior".
+enum class RebootBehavior : uint8_t
+{
+    NeverReboots,
+    AlwaysRequiresReboot,
+    CanRequestReboot
+};
+
+// What the orchestration needs to know about a Windows update, copied out of the backend
+// once so that nothing above the backend has to talk to COM.
+struct UpdateDescriptor
+{
+    std::wstring id = {}; // "UpdateID", a GUID string.
+    int32_t revision = 0;
+    std::wstring title = {};
+    uint32_t kb = 0; // First KB article, 0 if there is none.
+    uint64_t maxDownloadSize = 0; // Bytes.
+    bool downloaded = false; // The payload is already in the local cache.
+    UpdateSeverity severity = UpdateSeverity::Unspecified;
+    UpdateType type = UpdateType::Software;
+    InstallImpact impact = InstallImpact::Normal;
+    RebootBehavior rebootBehavior = RebootBehavior::NeverReboots;
+    bool canRequestUserInput = false;
+    std::vector<std::wstring> categories = {}; // "CategoryID"s, lower case GUID strings.
+};
+
+// Windows Update as seen by "SystemUpdater". "search()" replaces the candidates,
+// "select()" picks which of them the following downloads and installs refer to:
+// pipeline index N is the N-th selected candidate.
+class SystemUpdateBackend : public PipelineBackend
+{
+public:
+    ~SystemUpdateBackend() override = default;
+
+    // May be called from any thread, keep it cheap.
+    using ProgressHandler = std::function<void(const PipelineStage, const std::size_t, const int, const uint64_t, const uint64_t)>;
+
+    virtual void setProgressHandler(ProgressHandler handler) = 0;
+    [[nodiscard]] virtual bool search(const bool online, const std::wstring &criteria, std::vector<UpdateDescriptor> &updates) = 0;
+    [[nodiscard]] virtual bool select(const std::vector<std::size_t> &candidates) = 0;
+    // Applies to the downloads of the current selection started from now on.
+    virtual void prioritize(const std::size_t index, const DownloadPriority priority) = 0;
+    // Bytes available where the payloads are downloaded to.
+    [[nodiscard]] virtual uint64_t freeDiskSpace() = 0;
+    [[nodiscard]] virtual bool commit() = 0;
+    // Waits before a failed update is tried again, nothing is in flight at that point.
+    virtual void backOff(const std::chrono::milliseconds delay) = 0;
+};
+
+enum class StoreItemState : uint8_t
+{
+    Queued,
+    Running,
+    Paused,
+    Completed,
+    Canceled,
+    Error
+};
+
+[[nodiscard]] static inline bool IsFinished(const StoreItemState state)
+{
+    return ((state == StoreItemState::Completed) || (state == StoreItemState::Canceled) || (state == StoreItemState::Error));
+}
+
+struct StoreItemDescriptor
+{
+    std::wstring productId = {};
+    std::wstring packageFamilyName = {};
+    uint64_t downloadSize = 0; // Bytes, 0 if the store doesn't know yet.
+};
+
+// The Microsoft Store install queue. A search replaces the current items, item N is the
+// N-th one returned. "start()" lets a held back item continue, an item that finished
+// while it was held back is reported by "waitForCompletion()" again, so every started
+// item is reported at least once.
+class StoreBackend
+{
+public:
+    virtual ~StoreBackend() = default;
+
+    // May be called from any thread, also for items of an earlier search, keep it cheap.
+    using ProgressHandler = std::function<void(const std::size_t, const std::wstring_view, const double)>;
+
+    virtual void setProgressHandler(ProgressHandler handler) = 0;
+    [[nodiscard]] virtual bool searchAll(std::vector<StoreItemDescriptor> &items) = 0;
+    [[nodiscard]] virtual bool searchProducts(const std::vector<std::wstring> &productIds, std::vector<StoreItemDescriptor> &items) = 0;
+    virtual void pause(const std::size_t index) = 0;
+    // Takes the item out of the queue for good, it's never started or reported.
+    virtual void cancel(const std::size_t index) = 0;
+    [[nodiscard]] virtual bool start(const std::size_t index) = 0;
+    [[nodiscard]] virtual StoreItemState state(const std::size_t index) const = 0;
+    [[nodiscard]] virtual int32_t errorCode(const std::size_t index) const = 0;
+    [[nodiscard]] virtual bool waitForCompletion(std::size_t &index) = 0;
+};
+
+} // namespace WinUpdate
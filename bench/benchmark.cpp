@@ -0,0 +1,525 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Measures what the orchestration itself costs: "SystemUpdater" and "StoreUpdater" run
+// against the simulated backends, which complete everything instantly on a virtual clock,
+// so the wall-clock time is pure scheduling, bookkeeping and reporting overhead.
+// "--startup" measures a real binary instead: how long it takes from spawning the process
+// until its first byte of output arrives, and until it exits.
+
+#include "orchestrator.h"
+#include "simulator.h"
+#include "replay.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <fstream>
+#include <iterator>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifdef _WIN32
+#  define popen _popen
+#  define pclose _pclose
+#endif
+
+namespace
+{
+
+// Every allocation carries its size in front of it so that the live heap can be tracked
+// without asking the C runtime.
+constexpr const std::size_t kAllocationHeader = alignof(std::max_align_t);
+
+std::atomic<uint64_t> g_allocations = 0;
+std::atomic<uint64_t> g_liveBytes = 0;
+std::atomic<uint64_t> g_peakBytes = 0;
+
+[[nodiscard]] void *Allocate(const std::size_t size)
+{
+    auto *block = static_cast<unsigned char *>(std::malloc(size + kAllocationHeader));
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    std::memcpy(block, &size, sizeof(size));
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    const uint64_t live = (g_liveBytes.fetch_add(size, std::memory_order_relaxed) + size);
+    uint64_t peak = g_peakBytes.load(std::memory_order_relaxed);
+    while ((live > peak) && !g_peakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+    return (block + kAllocationHeader);
+}
+
+void Deallocate(void *pointer)
+{
+    if (!pointer) {
+        return;
+    }
+    auto *block = (static_cast<unsigned char *>(pointer) - kAllocationHeader);
+    std::size_t size = 0;
+    std::memcpy(&size, block, sizeof(size));
+    g_liveBytes.fetch_sub(size, std::memory_order_relaxed);
+    std::free(block);
+}
+
+class NullReporter final : public WinUpdate::UpdateReporter
+{
+public:
+    NullReporter() = default;
+    ~NullReporter() override = default;
+
+    void info(const std::wstring_view message) override
+    {
+        (void)message;
+        ++m_messages;
+    }
+
+    void success(const std::wstring_view message) override
+    {
+        (void)message;
+        ++m_messages;
+    }
+
+    void error(const std::wstring_view message, const int32_t code) override
+    {
+        (void)message;
+        (void)code;
+        ++m_messages;
+        ++m_errors;
+    }
+
+    void progress(const std::wstring_view status) override
+    {
+        (void)status;
+    }
+
+    [[nodiscard]] std::size_t errors() const
+    {
+        return m_errors;
+    }
+
+private:
+    std::size_t m_messages = 0;
+    std::size_t m_errors = 0;
+};
+
+struct Measurement
+{
+    uint64_t wallNanoseconds = 0;
+    uint64_t virtualMilliseconds = 0;
+    uint64_t serialMilliseconds = 0;
+    uint64_t meanMilliseconds = 0; // Virtual, when an update was done on average.
+    uint64_t allocations = 0;
+    uint64_t peakBytes = 0;
+    bool succeeded = false;
+};
+
+struct BenchmarkOptions
+{
+    std::vector<std::size_t> sizes = { 10, 100, 1000, 10000 };
+    std::size_t repeat = 5;
+    WinUpdate::UpdateOptions update = {};
+    WinUpdate::SimulationProfile profile = {};
+    bool events = false;
+    std::string recordPath = {};
+    std::string replayPath = {};
+    double replaySpeed = 0.0;
+    std::string startupCommand = {};
+};
+
+// Peak and allocation counters only cover "body", the catalog generation doesn't count.
+template <typename Body>
+[[nodiscard]] Measurement Measure(Body &&body)
+{
+    Measurement measurement = {};
+    const uint64_t allocationsBefore = g_allocations.load(std::memory_order_relaxed);
+    const uint64_t liveBefore = g_liveBytes.load(std::memory_order_relaxed);
+    g_peakBytes.store(liveBefore, std::memory_order_relaxed);
+    const auto start = std::chrono::steady_clock::now();
+    body(measurement);
+    measurement.wallNanoseconds = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    measurement.allocations = (g_allocations.load(std::memory_order_relaxed) - allocationsBefore);
+    measurement.peakBytes = (g_peakBytes.load(std::memory_order_relaxed) - liveBefore);
+    return measurement;
+}
+
+[[nodiscard]] Measurement RunSystemScenario(const BenchmarkOptions &options, const std::size_t size)
+{
+    WinUpdate::SimulationProfile profile = options.profile;
+    profile.updateCount = size;
+    WinUpdate::SimulatedUpdateBackend backend(profile);
+    NullReporter reporter = {};
+    return Measure([&](Measurement &measurement){
+        WinUpdate::SystemUpdater updater(backend, reporter, options.update);
+        measurement.succeeded = updater.run();
+        measurement.virtualMilliseconds = backend.now();
+        measurement.serialMilliseconds = backend.serialTime();
+        measurement.meanMilliseconds = backend.meanCompletionTime();
+    });
+}
+
+[[nodiscard]] Measurement RunStoreScenario(const BenchmarkOptions &options, const std::size_t size)
+{
+    WinUpdate::SimulationProfile profile = options.profile;
+    profile.storeItemCount = size;
+    WinUpdate::SimulatedStoreBackend backend(profile);
+    NullReporter reporter = {};
+    return Measure([&](Measurement &measurement){
+        WinUpdate::StoreUpdater updater(backend, reporter, options.update);
+        measurement.succeeded = updater.run();
+        measurement.virtualMilliseconds = backend.now();
+        measurement.meanMilliseconds = backend.meanCompletionTime();
+    });
+}
+
+// Fills the metadata index from a search result and runs the queries a summary needs, the
+// peak shows what the index costs per update.
+[[nodiscard]] Measurement RunIndexScenario(const BenchmarkOptions &options, const std::size_t size)
+{
+    WinUpdate::SimulationProfile profile = options.profile;
+    profile.updateCount = size;
+    std::vector<WinUpdate::UpdateDescriptor> updates = {};
+    for (auto &&update : WinUpdate::GenerateSimulatedUpdates(profile)) {
+        updates.push_back(std::move(update.descriptor));
+    }
+    return Measure([&](Measurement &measurement){
+        WinUpdate::UpdateIndex index = {};
+        index.assign(updates);
+        std::vector<WinUpdate::UpdateIndex::Row> rows = index.select(options.update.filter);
+        index.sort(rows, WinUpdate::UpdateIndexKey::Size);
+        index.sort(rows, WinUpdate::UpdateIndexKey::Severity);
+        measurement.succeeded = ((index.downloadSize(rows) > 0) || rows.empty());
+    });
+}
+
+[[nodiscard]] Measurement RunReplayScenario(const BenchmarkOptions &options, const std::vector<uint8_t> &log)
+{
+    NullReporter reporter = {};
+    return Measure([&](Measurement &measurement){
+        WinUpdate::SessionReplay replay = {};
+        replay.setSpeed(options.replaySpeed);
+        measurement.succeeded = (replay.open(log) && WinUpdate::ReplaySession(replay, reporter));
+    });
+}
+
+// Writes what the largest simulated scenarios did as a session log, so that the replay
+// path can be exercised without Windows.
+[[nodiscard]] bool RecordScenarios(const BenchmarkOptions &options)
+{
+    std::ofstream file(options.recordPath, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        return false;
+    }
+    WinUpdate::SimulationProfile profile = options.profile;
+    profile.updateCount = profile.storeItemCount = (options.sizes.empty() ? 0 : *std::max_element(options.sizes.cbegin(), options.sizes.cend()));
+    NullReporter reporter = {};
+    {
+        WinUpdate::SessionRecorder recorder([&file](const void *data, const std::size_t size){
+            return bool(file.write(static_cast<const char *>(data), std::streamsize(size)));
+        });
+        {
+            WinUpdate::SimulatedStoreBackend simulated(profile);
+            WinUpdate::RecordingStoreBackend backend(simulated, recorder);
+            recorder.target(WinUpdate::SessionTarget::Store, options.update, {}, {});
+            WinUpdate::StoreUpdater updater(backend, reporter, options.update);
+            (void)updater.run();
+        }
+        {
+            WinUpdate::SimulatedUpdateBackend simulated(profile);
+            WinUpdate::RecordingSystemBackend backend(simulated, recorder);
+            recorder.target(WinUpdate::SessionTarget::System, options.update, {}, {});
+            WinUpdate::SystemUpdater updater(backend, reporter, options.update);
+            (void)updater.run();
+        }
+        recorder.flush();
+        if (!recorder.isHealthy()) {
+            return false;
+        }
+    }
+    return bool(file.flush());
+}
+
+// The median run is reported, the first one warms up the allocator and the caches.
+template <typename Scenario>
+void Report(const char *name, const BenchmarkOptions &options, Scenario &&scenario)
+{
+    for (auto &&size : std::as_const(options.sizes)) {
+        std::vector<Measurement> runs = {};
+        runs.reserve(options.repeat);
+        for (std::size_t index = 0; index != options.repeat; ++index) {
+            runs.push_back(scenario(options, size));
+        }
+        std::sort(runs.begin(), runs.end(), [](const Measurement &lhs, const Measurement &rhs){ return lhs.wallNanoseconds < rhs.wallNanoseconds; });
+        const Measurement &median = runs.at(runs.size() / 2);
+        std::printf("%-7s %8zu %12.3f %10.1f %14llu %14llu %14llu %12.2f %12.1f %s\n",
+            name, size, double(median.wallNanoseconds) / 1e6, double(median.wallNanoseconds) / double(std::max(size, std::size_t(1))),
+            static_cast<unsigned long long>(median.virtualMilliseconds), static_cast<unsigned long long>(median.serialMilliseconds), static_cast<unsigned long long>(median.meanMilliseconds),
+            double(median.allocations) / double(std::max(size, std::size_t(1))), double(median.peakBytes) / 1024.0,
+            (median.succeeded ? "ok" : "failed"));
+    }
+}
+
+struct StartupMeasurement
+{
+    uint64_t firstOutputNanoseconds = 0;
+    uint64_t exitNanoseconds = 0;
+    bool succeeded = false;
+};
+
+// The process start is approximated by the spawn request, which is what a script sees.
+[[nodiscard]] StartupMeasurement MeasureStartup(const std::string &command)
+{
+    StartupMeasurement measurement = {};
+    const auto start = std::chrono::steady_clock::now();
+    const auto elapsed = [&start](){ return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()); };
+    std::FILE *pipe = popen(command.c_str(), "r");
+    if (!pipe) {
+        return measurement;
+    }
+    bool first = true;
+    while (std::fgetc(pipe) != EOF) {
+        if (first) {
+            measurement.firstOutputNanoseconds = elapsed();
+            first = false;
+        }
+    }
+    const int status = pclose(pipe);
+    measurement.exitNanoseconds = elapsed();
+    measurement.succeeded = (!first && (status == 0));
+    return measurement;
+}
+
+[[nodiscard]] bool ReportStartup(const BenchmarkOptions &options)
+{
+    std::vector<StartupMeasurement> runs = {};
+    for (std::size_t index = 0; index != options.repeat; ++index) {
+        runs.push_back(MeasureStartup(options.startupCommand));
+        if (!runs.back().succeeded) {
+            std::fprintf(stderr, "\"%s\" failed or printed nothing.\n", options.startupCommand.c_str());
+            return false;
+        }
+    }
+    const auto print = [&runs](const char *name, uint64_t StartupMeasurement::*field){
+        std::vector<uint64_t> values = {};
+        for (auto &&run : std::as_const(runs)) {
+            values.push_back(run.*field);
+        }
+        std::sort(values.begin(), values.end());
+        std::printf("%-14s %10.3f %10.3f %10.3f\n", name, double(values.front()) / 1e6, double(values.at(values.size() / 2)) / 1e6, double(values.back()) / 1e6);
+    };
+    std::printf("%-14s %10s %10s %10s\n", "startup", "min (ms)", "med (ms)", "max (ms)");
+    print("first output", &StartupMeasurement::firstOutputNanoseconds);
+    print("exit", &StartupMeasurement::exitNanoseconds);
+    return true;
+}
+
+[[nodiscard]] std::vector<std::size_t> ParseSizes(const char *text)
+{
+    std::vector<std::size_t> sizes = {};
+    const std::string list = text;
+    std::size_t begin = 0;
+    while (begin <= list.size()) {
+        const std::size_t end = std::min(list.find(',', begin), list.size());
+        if (end > begin) {
+            sizes.push_back(std::size_t(std::strtoull(list.substr(begin, end - begin).c_str(), nullptr, 10)));
+        }
+        begin = end + 1;
+    }
+    return sizes;
+}
+
+void PrintUsage()
+{
+    std::puts("Usage: WinUpdateBenchmark [--sizes 10,100,1000,10000] [--repeat 5] [--depth 2]\n"
+              "                          [--max-in-flight 4] [--incremental] [--failure-rate 0]\n"
+              "                          [--follow-on-rate 0] [--seed 1] [--free-disk <MiB>] [--events]\n"
+              "                          [--filter \"<rules>\"]\n"
+              "                          [--record <file>] [--replay <file> [--replay-speed 0]]\n"
+              "                          [--startup \"<command line>\"]\n"
+              "Rates are per 10,000 operations. A replay speed of 0 replays as fast as possible.\n"
+              "--startup times the given command instead, e.g. \"WinUpdate.exe --version\".");
+}
+
+} // namespace
+
+void *operator new(const std::size_t size)
+{
+    return Allocate(size);
+}
+
+void *operator new[](const std::size_t size)
+{
+    return Allocate(size);
+}
+
+void *operator new(const std::size_t size, const std::nothrow_t &) noexcept
+{
+    try {
+        return Allocate(size);
+    } catch (const std::bad_alloc &) {
+        return nullptr;
+    }
+}
+
+void *operator new[](const std::size_t size, const std::nothrow_t &) noexcept
+{
+    try {
+        return Allocate(size);
+    } catch (const std::bad_alloc &) {
+        return nullptr;
+    }
+}
+
+void operator delete(void *pointer) noexcept
+{
+    Deallocate(pointer);
+}
+
+void operator delete[](void *pointer) noexcept
+{
+    Deallocate(pointer);
+}
+
+void operator delete(void *pointer, const std::size_t size) noexcept
+{
+    (void)size;
+    Deallocate(pointer);
+}
+
+void operator delete[](void *pointer, const std::size_t size) noexcept
+{
+    (void)size;
+    Deallocate(pointer);
+}
+
+void operator delete(void *pointer, const std::nothrow_t &) noexcept
+{
+    Deallocate(pointer);
+}
+
+void operator delete[](void *pointer, const std::nothrow_t &) noexcept
+{
+    Deallocate(pointer);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchmarkOptions options = {};
+    for (int index = 1; index < argc; ++index) {
+        const std::string_view argument = argv[index];
+        const char *value = (((index + 1) < argc) ? argv[index + 1] : nullptr);
+        if (argument == "--incremental") {
+            options.update.incremental = true;
+        } else if (argument == "--events") {
+            options.events = true;
+        } else if (!value) {
+            PrintUsage();
+            return EXIT_FAILURE;
+        } else if (argument == "--sizes") {
+            options.sizes = ParseSizes(value);
+            ++index;
+        } else if (argument == "--repeat") {
+            options.repeat = std::max(std::size_t(std::strtoull(value, nullptr, 10)), std::size_t(1));
+            ++index;
+        } else if (argument == "--depth") {
+            options.update.pipelineDepth = std::max(std::size_t(std::strtoull(value, nullptr, 10)), std::size_t(1));
+            ++index;
+        } else if (argument == "--max-in-flight") {
+            options.update.storeMaxInFlight = std::max(std::size_t(std::strtoull(value, nullptr, 10)), std::size_t(1));
+            ++index;
+        } else if (argument == "--failure-rate") {
+            options.profile.failureRate = uint32_t(std::strtoul(value, nullptr, 10));
+            ++index;
+        } else if (argument == "--follow-on-rate") {
+            options.profile.followOnRate = uint32_t(std::strtoul(value, nullptr, 10));
+            ++index;
+        } else if (argument == "--seed") {
+            options.profile.seed = uint32_t(std::strtoul(value, nullptr, 10));
+            ++index;
+        } else if (argument == "--free-disk") {
+            options.profile.freeDiskSpace = (uint64_t(std::strtoull(value, nullptr, 10)) << 20);
+            ++index;
+        } else if (argument == "--filter") {
+            std::wstring error = {};
+            const std::string_view rules = value;
+            if (!options.update.filter.parse(std::wstring(rules.cbegin(), rules.cend()), error)) {
+                std::fprintf(stderr, "Invalid filter: %ls\n", error.c_str());
+                return EXIT_FAILURE;
+            }
+            ++index;
+        } else if (argument == "--record") {
+            options.recordPath = value;
+            ++index;
+        } else if (argument == "--replay") {
+            options.replayPath = value;
+            ++index;
+        } else if (argument == "--replay-speed") {
+            options.replaySpeed = std::strtod(value, nullptr);
+            ++index;
+        } else if (argument == "--startup") {
+            options.startupCommand = value;
+            ++index;
+        } else {
+            PrintUsage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (!options.startupCommand.empty()) {
+        return (ReportStartup(options) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (options.events) {
+        // Formats every event but throws it away, to see what the NDJSON stream costs.
+        WinUpdate::EventStream::instance().setWriter([](const std::string_view line){ (void)line; });
+    }
+    if (!options.recordPath.empty() && !RecordScenarios(options)) {
+        std::fprintf(stderr, "Failed to write the session log \"%s\".\n", options.recordPath.c_str());
+        return EXIT_FAILURE;
+    }
+    if (!options.replayPath.empty()) {
+        std::ifstream file(options.replayPath, std::ios::binary);
+        const std::vector<uint8_t> log((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (!file.good() && !file.eof()) {
+            std::fprintf(stderr, "Failed to read the session log \"%s\".\n", options.replayPath.c_str());
+            return EXIT_FAILURE;
+        }
+        std::vector<Measurement> runs = {};
+        for (std::size_t index = 0; index != options.repeat; ++index) {
+            runs.push_back(RunReplayScenario(options, log));
+        }
+        std::sort(runs.begin(), runs.end(), [](const Measurement &lhs, const Measurement &rhs){ return lhs.wallNanoseconds < rhs.wallNanoseconds; });
+        const Measurement &median = runs.at(runs.size() / 2);
+        std::printf("replay: %zu bytes, %.3f ms, %llu allocations, peak %.1f KiB, %s\n", log.size(), double(median.wallNanoseconds) / 1e6,
+            static_cast<unsigned long long>(median.allocations), double(median.peakBytes) / 1024.0, (median.succeeded ? "ok" : "failed"));
+        return (median.succeeded ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    std::printf("%-7s %8s %12s %10s %14s %14s %14s %12s %12s %s\n", "target", "updates", "wall (ms)", "ns/update", "virtual (ms)", "serial (ms)", "mean (ms)", "allocs/upd", "peak (KiB)", "result");
+    Report("windows", options, RunSystemScenario);
+    Report("store", options, RunStoreScenario);
+    Report("index", options, RunIndexScenario);
+    return EXIT_SUCCESS;
+}
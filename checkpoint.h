@@ -0,0 +1,210 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "searchcache.h"
+#include <functional>
+#include <unordered_map>
+#include <utility>
+
+namespace WinUpdate
+{
+
+// A journal of how far every update of an unfinished run got, so that a run which was
+// killed or interrupted by a reboot can pick up where it stopped. It's append only: a
+// small header followed by fixed size records, each with its own checksum, written one
+// at a time. A torn record at the end is dropped before anything new gets appended. The
+// newest record of an update wins, the whole journal is thrown away once a run finishes.
+static constexpr const uint32_t kCheckpointMagic = 0x4A435557; // "WUCJ"
+static constexpr const uint32_t kCheckpointVersion = 1;
+
+enum class CheckpointState : uint8_t
+{
+    None,
+    Downloaded,
+    Installed,
+    Committed
+};
+
+struct CheckpointHeader
+{
+    uint32_t magic = kCheckpointMagic;
+    uint32_t version = kCheckpointVersion;
+};
+static_assert(sizeof(CheckpointHeader) == 8);
+
+struct CheckpointRecord
+{
+    UpdateGuid id = {};
+    int32_t revision = 0;
+    CheckpointState state = CheckpointState::None;
+    uint8_t reserved[3] = {};
+    uint32_t checksum = 0; // FNV-1a over everything above.
+};
+static_assert(sizeof(CheckpointRecord) == 28);
+
+class CheckpointJournal
+{
+public:
+    using Sink = std::function<bool(const void *, const std::size_t)>;
+
+    CheckpointJournal() = default;
+    ~CheckpointJournal() = default;
+
+    CheckpointJournal(const CheckpointJournal &) = delete;
+    CheckpointJournal &operator=(const CheckpointJournal &) = delete;
+
+    // "data" is what an earlier run left behind, empty or anything unrecognized starts a
+    // new journal. Returns whether the sink has to get a header first.
+    [[nodiscard]] inline bool load(const void *data, const std::size_t size)
+    {
+        m_entries.clear();
+        m_intactSize = 0;
+        if (!data || (size < sizeof(CheckpointHeader))) {
+            return true;
+        }
+        CheckpointHeader header = {};
+        std::memcpy(&header, data, sizeof(header));
+        if ((header.magic != kCheckpointMagic) || (header.version != kCheckpointVersion)) {
+            return true;
+        }
+        const auto bytes = static_cast<const uint8_t *>(data) + sizeof(header);
+        const std::size_t count = ((size - sizeof(header)) / sizeof(CheckpointRecord));
+        m_intactSize = sizeof(header);
+        for (std::size_t index = 0; index != count; ++index) {
+            CheckpointRecord record = {};
+            std::memcpy(&record, bytes + (index * sizeof(record)), sizeof(record));
+            if (record.checksum != CalculateChecksum(&record, offsetof(CheckpointRecord, checksum))) {
+                break;
+            }
+            m_entries.insert_or_assign(FormatUpdateGuid(record.id), Entry{ record.revision, record.state });
+            m_intactSize += sizeof(record);
+        }
+        return false;
+    }
+
+    // How much of what "load" got is header and valid records. Whatever follows is a torn
+    // write and has to be cut off, or every record appended after it ends up misaligned.
+    [[nodiscard]] inline std::size_t intactSize() const
+    {
+        return m_intactSize;
+    }
+
+    inline void setSink(Sink sink)
+    {
+        m_sink = std::move(sink);
+    }
+
+    [[nodiscard]] static inline std::vector<uint8_t> header()
+    {
+        const CheckpointHeader header = {};
+        std::vector<uint8_t> buffer(sizeof(header));
+        std::memcpy(buffer.data(), &header, sizeof(header));
+        return buffer;
+    }
+
+    // "id" is the "UpdateID" as WUA reports it. Failing to write is not fatal, the next
+    // run just has less to resume from.
+    inline void record(const std::wstring_view id, const int32_t revision, const CheckpointState state)
+    {
+        UpdateGuid guid = {};
+        if (!ParseUpdateGuid(id, guid)) {
+            return;
+        }
+        m_entries.insert_or_assign(FormatUpdateGuid(guid), Entry{ revision, state });
+        write(guid, revision, state);
+    }
+
+    // What the journal knows about exactly this revision.
+    [[nodiscard]] inline CheckpointState state(const std::wstring_view id, const int32_t revision) const
+    {
+        UpdateGuid guid = {};
+        if (!ParseUpdateGuid(id, guid)) {
+            return CheckpointState::None;
+        }
+        const auto it = m_entries.find(FormatUpdateGuid(guid));
+        return (((it != m_entries.cend()) && (it->second.revision == revision)) ? it->second.state : CheckpointState::None);
+    }
+
+    // Called after a successful commit, which covers everything installed so far.
+    inline void markCommitted()
+    {
+        for (auto &&[id, entry] : m_entries) {
+            if (entry.state != CheckpointState::Installed) {
+                continue;
+            }
+            UpdateGuid guid = {};
+            if (ParseUpdateGuid(id, guid)) {
+                write(guid, entry.revision, CheckpointState::Committed);
+            }
+            entry.state = CheckpointState::Committed;
+        }
+    }
+
+    // Whether an earlier run installed something it didn't get to commit.
+    [[nodiscard]] inline bool hasUncommitted() const
+    {
+        for (auto &&[id, entry] : std::as_const(m_entries)) {
+            (void)id;
+            if (entry.state == CheckpointState::Installed) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    [[nodiscard]] inline bool empty() const
+    {
+        return m_entries.empty();
+    }
+
+private:
+    inline void write(const UpdateGuid &id, const int32_t revision, const CheckpointState state)
+    {
+        if (!m_sink) {
+            return;
+        }
+        CheckpointRecord record = {};
+        record.id = id;
+        record.revision = revision;
+        record.state = state;
+        record.checksum = CalculateChecksum(&record, offsetof(CheckpointRecord, checksum));
+        if (!m_sink(&record, sizeof(record))) {
+            m_sink = nullptr;
+        }
+    }
+
+    struct Entry
+    {
+        int32_t revision = 0;
+        CheckpointState state = CheckpointState::None;
+    };
+
+    std::unordered_map<std::wstring, Entry> m_entries = {}; // Keyed by the normalized GUID.
+    Sink m_sink = nullptr;
+    std::size_t m_intactSize = 0;
+};
+
+} // namespace WinUpdate
@@ -0,0 +1,182 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <optional>
+#include <utility>
+
+namespace WinUpdate
+{
+
+// Instances started while another one is updating don't scan on their own, they hand
+// their targets to the running one (the leader) and wait for the pass that covers them.
+// The wire format below is what goes through the leader's pipe, one message each way
+// plus the final result, fixed size and little endian like everything else we persist.
+static constexpr const uint32_t kCoordinationRequestMagic = 0x51525557; // "WURQ"
+static constexpr const uint32_t kCoordinationReplyMagic = 0x53525557; // "WURS"
+static constexpr const uint32_t kCoordinationVersion = 1;
+static constexpr const std::size_t kCoordinationResultHistory = 16; // Finished passes remembered for late readers.
+
+// Bit flags, a pass updates the union of everything asked for since the previous one started.
+static constexpr const uint32_t kStoreTarget = 0x01;
+static constexpr const uint32_t kSystemTarget = 0x02;
+
+[[nodiscard]] static inline uint32_t GetRunTargets(const bool updateStoreApps, const bool updateSystem)
+{
+    return ((updateStoreApps ? kStoreTarget : 0) | (updateSystem ? kSystemTarget : 0));
+}
+
+struct CoordinationRequest
+{
+    uint32_t magic = kCoordinationRequestMagic;
+    uint32_t version = kCoordinationVersion;
+    uint32_t targets = 0;
+    uint32_t processId = 0; // Of the instance asking, only for the log.
+};
+static_assert(sizeof(CoordinationRequest) == 16);
+
+enum class CoordinationReplyKind : uint32_t
+{
+    Accepted, // "pass" will cover the request, the result follows once it's done.
+    Finished, // "exitCode" is the result of "pass".
+    Rejected // The leader is on its way out, become the next one.
+};
+
+struct CoordinationReply
+{
+    uint32_t magic = kCoordinationReplyMagic;
+    CoordinationReplyKind kind = CoordinationReplyKind::Rejected;
+    uint64_t pass = 0;
+    int32_t exitCode = 0;
+    uint32_t reserved = 0;
+};
+static_assert(sizeof(CoordinationReply) == 24);
+
+[[nodiscard]] static inline bool IsValidCoordinationRequest(const CoordinationRequest &request)
+{
+    return ((request.magic == kCoordinationRequestMagic) && (request.version == kCoordinationVersion) && (request.targets != 0) && ((request.targets & ~(kStoreTarget | kSystemTarget)) == 0));
+}
+
+// The leader's side, independent of how the requests get there. Passes are numbered from 1
+// and run strictly one after the other. Whatever is submitted is served by the next pass
+// to start, so requests arriving while a pass is running are merged into the one after it
+// instead of starting a scan of their own. All members may be called from any thread.
+class RunCoordinator
+{
+public:
+    RunCoordinator() = default;
+    ~RunCoordinator() = default;
+
+    RunCoordinator(const RunCoordinator &) = delete;
+    RunCoordinator &operator=(const RunCoordinator &) = delete;
+
+    // Returns the pass that will cover "targets", nothing once the coordinator is closed.
+    [[nodiscard]] inline std::optional<uint64_t> submit(const uint32_t targets)
+    {
+        const std::scoped_lock lock(m_mutex);
+        if (m_closed) {
+            return std::nullopt;
+        }
+        m_pendingTargets |= targets;
+        return (m_started + 1);
+    }
+
+    [[nodiscard]] inline bool hasPending() const
+    {
+        const std::scoped_lock lock(m_mutex);
+        return (m_pendingTargets != 0);
+    }
+
+    // Takes everything submitted so far. With nothing left and "closeWhenIdle" set the
+    // coordinator is closed in the same step, so no request can sneak in between the
+    // last pass and the leader going away, and 0 is returned from then on.
+    [[nodiscard]] inline uint32_t beginPass(const bool closeWhenIdle)
+    {
+        const std::scoped_lock lock(m_mutex);
+        if (m_closed) {
+            return 0;
+        }
+        if (m_pendingTargets == 0) {
+            m_closed = closeWhenIdle;
+            return 0;
+        }
+        const uint32_t targets = std::exchange(m_pendingTargets, 0);
+        ++m_started;
+        return targets;
+    }
+
+    inline void finishPass(const int exitCode)
+    {
+        {
+            const std::scoped_lock lock(m_mutex);
+            m_results.emplace_back(m_started, exitCode);
+            if (m_results.size() > kCoordinationResultHistory) {
+                m_results.pop_front();
+            }
+        }
+        m_condition.notify_all();
+    }
+
+    // Blocks until "pass" is done. Returns nothing if the coordinator was shut down before
+    // that, or the result was pushed out of the history by a reader this slow.
+    [[nodiscard]] inline std::optional<int> wait(const uint64_t pass)
+    {
+        std::unique_lock lock(m_mutex);
+        m_condition.wait(lock, [this, pass](){ return (m_shutdown || (!m_results.empty() && (m_results.back().first >= pass))); });
+        for (auto &&[number, exitCode] : m_results) {
+            if (number == pass) {
+                return exitCode;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Wakes up every waiter, for the passes that will never run.
+    inline void shutdown()
+    {
+        {
+            const std::scoped_lock lock(m_mutex);
+            m_closed = true;
+            m_shutdown = true;
+        }
+        m_condition.notify_all();
+    }
+
+private:
+    mutable std::mutex m_mutex;
+    std::condition_variable m_condition;
+    uint32_t m_pendingTargets = 0;
+    uint64_t m_started = 0;
+    std::deque<std::pair<uint64_t, int>> m_results = {};
+    bool m_closed = false;
+    bool m_shutdown = false;
+};
+
+} // namespace WinUpdate
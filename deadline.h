@@ -0,0 +1,500 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <utility>
+
+namespace WinUpdate
+{
+
+using DeadlineClock = std::chrono::steady_clock;
+
+// How long an aborted operation may take to actually finish. Whatever still hangs after
+// that is given up on, it's the service that's broken at that point, not the operation.
+static constexpr const auto kAbortGracePeriod = std::chrono::milliseconds{ 30000 };
+
+// A point in time after which something is given up on. A default constructed one never expires.
+class Deadline
+{
+public:
+    Deadline() = default;
+
+    // A budget of 0 means there is none.
+    [[nodiscard]] static inline Deadline after(const std::chrono::milliseconds budget, const DeadlineClock::time_point now = DeadlineClock::now())
+    {
+        Deadline deadline = {};
+        if (budget.count() > 0) {
+            deadline.m_timePoint = now + budget;
+        }
+        return deadline;
+    }
+
+    [[nodiscard]] inline bool isInfinite() const
+    {
+        return (m_timePoint == DeadlineClock::time_point::max());
+    }
+
+    [[nodiscard]] inline bool hasExpired(const DeadlineClock::time_point now = DeadlineClock::now()) const
+    {
+        return (!isInfinite() && (now >= m_timePoint));
+    }
+
+    // Never negative, "milliseconds::max()" for an infinite deadline.
+    [[nodiscard]] inline std::chrono::milliseconds remaining(const DeadlineClock::time_point now = DeadlineClock::now()) const
+    {
+        if (isInfinite()) {
+            return std::chrono::milliseconds::max();
+        }
+        if (now >= m_timePoint) {
+            return std::chrono::milliseconds{ 0 };
+        }
+        // Rounded up, so that waiting for "remaining()" never wakes up just before the deadline.
+        return std::chrono::ceil<std::chrono::milliseconds>(m_timePoint - now);
+    }
+
+    [[nodiscard]] inline DeadlineClock::time_point timePoint() const
+    {
+        return m_timePoint;
+    }
+
+    [[nodiscard]] inline Deadline earliest(const Deadline &other) const
+    {
+        return ((other.m_timePoint < m_timePoint) ? other : *this);
+    }
+
+private:
+    DeadlineClock::time_point m_timePoint = DeadlineClock::time_point::max();
+};
+
+// What a single watched operation is doing, each of them has a budget of its own.
+enum class WatchedPhase : uint8_t
+{
+    Search,
+    Download,
+    Install,
+    Commit,
+    Store
+};
+
+[[nodiscard]] static inline const char *GetWatchedPhaseName(const WatchedPhase phase)
+{
+    switch (phase) {
+    case WatchedPhase::Search:
+        return "search";
+    case WatchedPhase::Download:
+        return "download";
+    case WatchedPhase::Install:
+        return "install";
+    case WatchedPhase::Commit:
+        return "commit";
+    case WatchedPhase::Store:
+        return "store";
+    }
+    return "unknown";
+}
+
+// "downloading <what>", what an operation of "phase" was doing.
+[[nodiscard]] static inline std::wstring DescribeWatchedOperation(const WatchedPhase phase, const std::wstring_view what)
+{
+    switch (phase) {
+    case WatchedPhase::Search:
+        return (L"searching for " + std::wstring(what));
+    case WatchedPhase::Download:
+        return (L"downloading " + std::wstring(what));
+    case WatchedPhase::Install:
+        return (L"installing " + std::wstring(what));
+    case WatchedPhase::Commit:
+        return (L"committing " + std::wstring(what));
+    case WatchedPhase::Store:
+        return (L"updating " + std::wstring(what));
+    }
+    return std::wstring(what);
+}
+
+// 0 means no limit. "total" is for the whole run, the others for a single operation of
+// their phase: one search, one update's download or installation, one Store item. A commit
+// finishes what the installations started, it shares their budget.
+struct DeadlineBudget
+{
+    std::chrono::seconds total = {};
+    std::chrono::seconds search = {};
+    std::chrono::seconds download = {};
+    std::chrono::seconds install = {};
+    std::chrono::seconds store = {};
+
+    [[nodiscard]] inline std::chrono::seconds forPhase(const WatchedPhase phase) const
+    {
+        switch (phase) {
+        case WatchedPhase::Search:
+            return search;
+        case WatchedPhase::Download:
+            return download;
+        case WatchedPhase::Install:
+        case WatchedPhase::Commit:
+            return install;
+        case WatchedPhase::Store:
+            return store;
+        }
+        return {};
+    }
+
+    [[nodiscard]] inline bool empty() const
+    {
+        return ((total.count() < 1) && (search.count() < 1) && (download.count() < 1) && (install.count() < 1) && (store.count() < 1));
+    }
+};
+
+// Shared by everything a run does. Cancelling is sticky and only the first reason is kept.
+// Listeners are called once, on the cancelling thread, they are meant to wake up whoever
+// is blocked waiting for something that won't come anymore.
+class CancellationToken
+{
+public:
+    using Listener = std::function<void()>;
+    using Subscription = uint64_t;
+
+    CancellationToken() = default;
+    ~CancellationToken() = default;
+
+    CancellationToken(const CancellationToken &) = delete;
+    CancellationToken &operator=(const CancellationToken &) = delete;
+
+    [[nodiscard]] inline bool isCancelled() const
+    {
+        return m_cancelled.load(std::memory_order_acquire);
+    }
+
+    // Returns whether this call cancelled the token.
+    inline bool cancel(std::wstring reason)
+    {
+        const std::scoped_lock lock(m_mutex);
+        if (isCancelled()) {
+            return false;
+        }
+        m_reason = std::move(reason);
+        m_abandonDeadline = Deadline::after(kAbortGracePeriod);
+        m_cancelled.store(true, std::memory_order_release);
+        // Called with the lock held, so nobody who unsubscribed gets called afterwards.
+        for (auto &&[subscription, listener] : std::as_const(m_listeners)) {
+            (void)subscription;
+            listener();
+        }
+        return true;
+    }
+
+    [[nodiscard]] inline std::wstring reason() const
+    {
+        const std::scoped_lock lock(m_mutex);
+        return m_reason;
+    }
+
+    // Until when whatever was aborted may take to finish, infinite while not cancelled.
+    [[nodiscard]] inline Deadline abandonDeadline() const
+    {
+        const std::scoped_lock lock(m_mutex);
+        return m_abandonDeadline;
+    }
+
+    // Called right away if the token is cancelled already.
+    [[nodiscard]] inline Subscription subscribe(Listener listener)
+    {
+        const std::scoped_lock lock(m_mutex);
+        if (isCancelled()) {
+            listener();
+        }
+        const Subscription subscription = ++m_lastSubscription;
+        m_listeners.emplace(subscription, std::move(listener));
+        return subscription;
+    }
+
+    inline void unsubscribe(const Subscription subscription)
+    {
+        const std::scoped_lock lock(m_mutex);
+        m_listeners.erase(subscription);
+    }
+
+private:
+    mutable std::mutex m_mutex;
+    std::atomic_bool m_cancelled = false;
+    std::wstring m_reason = {};
+    Deadline m_abandonDeadline = {};
+    std::unordered_map<Subscription, Listener> m_listeners = {};
+    Subscription m_lastSubscription = 0;
+};
+
+// Watches every operation that might block for good. Once one of them runs past its
+// budget, or the whole run past its own, the token is cancelled and every operation still
+// running is aborted. If something still hasn't finished "kAbortGracePeriod" later, the
+// abandon handler decides what happens to the process.
+class Watchdog
+{
+public:
+    using Ticket = uint64_t;
+    using AbortHandler = std::function<void()>;
+    // "elapsed" is since the operation started, "idle" since it last made progress. An
+    // empty "what" means it's the run's own budget that ran out, "phase" is meaningless then.
+    using ExpiryHandler = std::function<void(const WatchedPhase, const std::wstring_view, const std::chrono::milliseconds, const std::chrono::milliseconds)>;
+    using AbandonHandler = std::function<void()>;
+
+    explicit Watchdog(const DeadlineBudget &budget) : m_budget(budget)
+    {
+    }
+
+    ~Watchdog()
+    {
+        stop();
+    }
+
+    Watchdog(const Watchdog &) = delete;
+    Watchdog &operator=(const Watchdog &) = delete;
+
+    // Called on the watchdog thread, before the operation is aborted and the token cancelled.
+    inline void setExpiryHandler(ExpiryHandler handler)
+    {
+        m_expiryHandler = std::move(handler);
+    }
+
+    inline void setAbandonHandler(AbandonHandler handler)
+    {
+        m_abandonHandler = std::move(handler);
+    }
+
+    // The run's own budget starts counting now. Nothing is watched without a budget.
+    inline void start()
+    {
+        if (m_budget.empty() || m_thread.joinable()) {
+            return;
+        }
+        m_deadline = Deadline::after(m_budget.total);
+        m_stopping = false;
+        m_thread = std::thread([this](){ watch(); });
+    }
+
+    inline void stop()
+    {
+        {
+            const std::scoped_lock lock(m_mutex);
+            m_stopping = true;
+        }
+        m_condition.notify_all();
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+    [[nodiscard]] inline CancellationToken &token()
+    {
+        return m_token;
+    }
+
+    [[nodiscard]] inline const CancellationToken &token() const
+    {
+        return m_token;
+    }
+
+    [[nodiscard]] inline const DeadlineBudget &budget() const
+    {
+        return m_budget;
+    }
+
+    // Starts the clock for one operation. It usually can only be aborted once it was
+    // started, which is why "arm()" is separate: an operation that runs out of time before
+    // it's armed is aborted as soon as it is.
+    [[nodiscard]] inline Ticket watch(const WatchedPhase phase, std::wstring what)
+    {
+        const auto now = DeadlineClock::now();
+        Ticket ticket = 0;
+        {
+            const std::scoped_lock lock(m_mutex);
+            ticket = ++m_lastTicket;
+            Operation operation = {};
+            operation.phase = phase;
+            operation.what = std::move(what);
+            operation.deadline = Deadline::after(m_budget.forPhase(phase), now);
+            operation.start = now;
+            operation.lastProgress = now;
+            m_operations.emplace(ticket, std::move(operation));
+        }
+        m_condition.notify_all();
+        return ticket;
+    }
+
+    inline void arm(const Ticket ticket, AbortHandler abort)
+    {
+        {
+            const std::scoped_lock lock(m_mutex);
+            const auto it = m_operations.find(ticket);
+            if (it == m_operations.end()) {
+                return;
+            }
+            if (!it->second.abortPending) {
+                it->second.abort = std::move(abort);
+                return;
+            }
+            it->second.abortPending = false;
+        }
+        if (abort) {
+            abort();
+        }
+    }
+
+    // Cheap enough for progress callbacks, which may come from any thread.
+    inline void progress(const Ticket ticket)
+    {
+        const std::scoped_lock lock(m_mutex);
+        const auto it = m_operations.find(ticket);
+        if (it != m_operations.end()) {
+            it->second.lastProgress = DeadlineClock::now();
+        }
+    }
+
+    inline void finish(const Ticket ticket)
+    {
+        const std::scoped_lock lock(m_mutex);
+        m_operations.erase(ticket);
+    }
+
+private:
+    struct Operation
+    {
+        WatchedPhase phase = WatchedPhase::Search;
+        std::wstring what = {};
+        Deadline deadline = {};
+        DeadlineClock::time_point start = {};
+        DeadlineClock::time_point lastProgress = {};
+        AbortHandler abort = nullptr;
+        bool aborted = false;
+        bool abortPending = false; // Ran out of time before it was armed.
+    };
+
+    struct Expiry
+    {
+        WatchedPhase phase = WatchedPhase::Search;
+        std::wstring what = {};
+        std::chrono::milliseconds elapsed = {};
+        std::chrono::milliseconds idle = {};
+    };
+
+    inline void watch()
+    {
+        std::unique_lock lock(m_mutex);
+        bool abandoned = false;
+        while (!m_stopping) {
+            const auto now = DeadlineClock::now();
+            std::vector<Expiry> expired = {};
+            if (!m_token.isCancelled()) {
+                for (auto &&[ticket, operation] : std::as_const(m_operations)) {
+                    (void)ticket;
+                    if (operation.deadline.hasExpired(now)) {
+                        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - operation.start);
+                        const auto idle = std::chrono::duration_cast<std::chrono::milliseconds>(now - operation.lastProgress);
+                        expired.push_back(Expiry{ operation.phase, operation.what, elapsed, idle });
+                    }
+                }
+                if (expired.empty() && m_deadline.hasExpired(now)) {
+                    expired.push_back(Expiry{ WatchedPhase::Search, {}, std::chrono::milliseconds{ m_budget.total }, {} });
+                }
+            }
+            std::vector<AbortHandler> aborts = {};
+            if (!expired.empty() || m_token.isCancelled()) {
+                for (auto &&[ticket, operation] : m_operations) {
+                    (void)ticket;
+                    if (operation.aborted) {
+                        continue;
+                    }
+                    operation.aborted = true;
+                    if (operation.abort) {
+                        aborts.push_back(operation.abort);
+                    } else {
+                        operation.abortPending = true;
+                    }
+                }
+            }
+            const bool abandon = (!abandoned && !m_operations.empty() && m_token.isCancelled() && m_token.abandonDeadline().hasExpired(now));
+            if (!expired.empty() || !aborts.empty() || abandon) {
+                lock.unlock();
+                for (auto &&expiry : std::as_const(expired)) {
+                    if (m_expiryHandler) {
+                        m_expiryHandler(expiry.phase, expiry.what, expiry.elapsed, expiry.idle);
+                    }
+                }
+                if (!expired.empty()) {
+                    const Expiry &first = expired.front();
+                    m_token.cancel((first.what.empty() ? std::wstring(L"the run") : DescribeWatchedOperation(first.phase, first.what)) + L" ran out of time");
+                }
+                for (auto &&abort : std::as_const(aborts)) {
+                    abort();
+                }
+                if (abandon) {
+                    abandoned = true;
+                    if (m_abandonHandler) {
+                        m_abandonHandler();
+                    }
+                }
+                lock.lock();
+                continue;
+            }
+            Deadline next = m_deadline;
+            if (m_token.isCancelled()) {
+                next = (m_operations.empty() || abandoned) ? Deadline{} : m_token.abandonDeadline();
+            } else {
+                for (auto &&[ticket, operation] : std::as_const(m_operations)) {
+                    (void)ticket;
+                    next = next.earliest(operation.deadline);
+                }
+            }
+            if (next.isInfinite()) {
+                m_condition.wait(lock);
+            } else {
+                m_condition.wait_until(lock, next.timePoint());
+            }
+        }
+    }
+
+    DeadlineBudget m_budget = {};
+    Deadline m_deadline = {}; // Of the whole run.
+    CancellationToken m_token = {};
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::unordered_map<Ticket, Operation> m_operations = {};
+    Ticket m_lastTicket = 0;
+    ExpiryHandler m_expiryHandler = nullptr;
+    AbandonHandler m_abandonHandler = nullptr;
+    std::thread m_thread = {};
+    bool m_stopping = false;
+};
+
+} // namespace WinUpdate
@@ -0,0 +1,302 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <charconv>
+#include <chrono>
+#include <type_traits>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <initializer_list>
+
+namespace WinUpdate
+{
+
+// One key/value pair of an event. Only views are stored, so building the field list on
+// the stack costs nothing; the values must stay alive until "emit()" returns.
+struct EventField
+{
+    enum class Kind : uint8_t
+    {
+        Signed,
+        Unsigned,
+        Float,
+        Boolean,
+        Text, // UTF-16 (UTF-32 on non-Windows platforms)
+        Ascii
+    };
+
+    EventField(const std::string_view name, const int32_t value) : key(name), kind(Kind::Signed), i(value) {}
+    EventField(const std::string_view name, const int64_t value) : key(name), kind(Kind::Signed), i(value) {}
+    EventField(const std::string_view name, const uint32_t value) : key(name), kind(Kind::Unsigned), u(value) {}
+    EventField(const std::string_view name, const uint64_t value) : key(name), kind(Kind::Unsigned), u(value) {}
+    EventField(const std::string_view name, const double value) : key(name), kind(Kind::Float), d(value) {}
+    EventField(const std::string_view name, const bool value) : key(name), kind(Kind::Boolean), b(value) {}
+    EventField(const std::string_view name, const std::wstring_view value) : key(name), kind(Kind::Text), text(value) {}
+    EventField(const std::string_view name, const wchar_t *value) : key(name), kind(Kind::Text), text(value) {}
+    EventField(const std::string_view name, const char *value) : key(name), kind(Kind::Ascii), ascii(value) {}
+
+    std::string_view key = {};
+    Kind kind = Kind::Signed;
+    union
+    {
+        int64_t i = 0;
+        uint64_t u;
+        double d;
+        bool b;
+    };
+    std::wstring_view text = {};
+    std::string_view ascii = {};
+};
+
+static inline void AppendJsonCharacter(std::string &out, const char ch)
+{
+    static constexpr const char kHex[] = "0123456789abcdef";
+    const auto c = static_cast<unsigned char>(ch);
+    if ((c == '"') || (c == '\\')) {
+        out.push_back('\\');
+        out.push_back(ch);
+    } else if (c < 0x20) {
+        out += "\\u00";
+        out.push_back(kHex[c >> 4]);
+        out.push_back(kHex[c & 0x0F]);
+    } else {
+        out.push_back(ch);
+    }
+}
+
+static inline void AppendJsonString(std::string &out, const std::string_view text)
+{
+    out.push_back('"');
+    for (auto &&ch : text) {
+        AppendJsonCharacter(out, ch);
+    }
+    out.push_back('"');
+}
+
+// Calls "sink" with every code point of "text", lone surrogates are passed through as is.
+template <typename Sink>
+static inline void ForEachCodePoint(const std::wstring_view text, Sink &&sink)
+{
+    for (std::size_t index = 0; index != text.size(); ++index) {
+        auto cp = uint32_t(text[index]);
+        if ((cp >= 0xD800) && (cp <= 0xDBFF) && ((index + 1) < text.size())) {
+            const auto low = uint32_t(text[index + 1]);
+            if ((low >= 0xDC00) && (low <= 0xDFFF)) {
+                cp = (0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00));
+                ++index;
+            }
+        }
+        sink(cp);
+    }
+}
+
+static inline void AppendUtf8(std::string &out, const uint32_t cp)
+{
+    if (cp < 0x80) {
+        out.push_back(char(cp));
+    } else if (cp < 0x800) {
+        out.push_back(char(0xC0 | (cp >> 6)));
+        out.push_back(char(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        out.push_back(char(0xE0 | (cp >> 12)));
+        out.push_back(char(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(char(0x80 | (cp & 0x3F)));
+    } else {
+        out.push_back(char(0xF0 | (cp >> 18)));
+        out.push_back(char(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back(char(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(char(0x80 | (cp & 0x3F)));
+    }
+}
+
+[[nodiscard]] static inline std::string EncodeUtf8(const std::wstring_view text)
+{
+    std::string result = {};
+    result.reserve(text.size());
+    ForEachCodePoint(text, [&result](const uint32_t cp){ AppendUtf8(result, cp); });
+    return result;
+}
+
+// Malformed sequences become U+FFFD.
+[[nodiscard]] static inline std::wstring DecodeUtf8(const std::string_view text)
+{
+    std::wstring result = {};
+    result.reserve(text.size());
+    std::size_t index = 0;
+    while (index < text.size()) {
+        const auto lead = uint8_t(text[index]);
+        const std::size_t length = ((lead < 0x80) ? 1 : ((lead >> 5) == 0x06) ? 2 : ((lead >> 4) == 0x0E) ? 3 : ((lead >> 3) == 0x1E) ? 4 : 0);
+        if ((length < 1) || ((index + length) > text.size())) {
+            result.push_back(wchar_t(0xFFFD));
+            ++index;
+            continue;
+        }
+        uint32_t cp = ((length == 1) ? lead : (lead & (0x7F >> length)));
+        bool valid = true;
+        for (std::size_t offset = 1; offset != length; ++offset) {
+            const auto trail = uint8_t(text[index + offset]);
+            if ((trail >> 6) != 0x02) {
+                valid = false;
+                break;
+            }
+            cp = ((cp << 6) | (trail & 0x3F));
+        }
+        if (!valid || (cp > 0x10FFFF)) {
+            result.push_back(wchar_t(0xFFFD));
+            ++index;
+            continue;
+        }
+        if constexpr (sizeof(wchar_t) == 2) {
+            if (cp >= 0x10000) {
+                result.push_back(wchar_t(0xD800 + ((cp - 0x10000) >> 10)));
+                result.push_back(wchar_t(0xDC00 + ((cp - 0x10000) & 0x3FF)));
+            } else {
+                result.push_back(wchar_t(cp));
+            }
+        } else {
+            result.push_back(wchar_t(cp));
+        }
+        index += length;
+    }
+    return result;
+}
+
+// Encodes to UTF-8 on the fly, no intermediate string is allocated.
+static inline void AppendJsonString(std::string &out, const std::wstring_view text)
+{
+    out.push_back('"');
+    ForEachCodePoint(text, [&out](const uint32_t cp){
+        if (cp < 0x80) {
+            AppendJsonCharacter(out, char(cp));
+        } else {
+            AppendUtf8(out, cp);
+        }
+    });
+    out.push_back('"');
+}
+
+// Newline delimited JSON events for machine consumers, one object per line:
+// {"ts":<milliseconds since start>,"event":"<type>",<fields...>}
+// Every thread formats into its own reused buffer, so after warming up emitting an
+// event doesn't allocate. The writer receives complete lines and must be thread safe.
+class EventStream
+{
+public:
+    using Writer = std::function<void(const std::string_view)>;
+
+    [[nodiscard]] static inline EventStream &instance()
+    {
+        static EventStream stream = {};
+        return stream;
+    }
+
+    inline void setWriter(Writer writer)
+    {
+        m_writer = std::move(writer);
+    }
+
+    [[nodiscard]] inline bool isEnabled() const
+    {
+        return static_cast<bool>(m_writer);
+    }
+
+    inline void emit(const std::string_view type, const std::initializer_list<EventField> fields)
+    {
+        if (!m_writer) {
+            return;
+        }
+        thread_local std::string line = {};
+        line.clear();
+        line += "{\"ts\":";
+        appendNumber(line, uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_start).count()));
+        line += ",\"event\":";
+        AppendJsonString(line, type);
+        for (auto &&field : fields) {
+            line.push_back(',');
+            AppendJsonString(line, field.key);
+            line.push_back(':');
+            switch (field.kind) {
+            case EventField::Kind::Signed:
+                appendNumber(line, field.i);
+                break;
+            case EventField::Kind::Unsigned:
+                appendNumber(line, field.u);
+                break;
+            case EventField::Kind::Float:
+                appendNumber(line, field.d);
+                break;
+            case EventField::Kind::Boolean:
+                line += (field.b ? "true" : "false");
+                break;
+            case EventField::Kind::Text:
+                AppendJsonString(line, field.text);
+                break;
+            case EventField::Kind::Ascii:
+                AppendJsonString(line, field.ascii);
+                break;
+            }
+        }
+        line += "}\n";
+        m_writer(line);
+    }
+
+private:
+    EventStream() = default;
+
+    // "std::to_chars()" is locale independent, unlike the printf family.
+    template <typename T>
+    static inline void appendNumber(std::string &out, const T value)
+    {
+        char buffer[32] = {};
+        std::to_chars_result result = {};
+        if constexpr (std::is_floating_point_v<T>) {
+            result = std::to_chars(buffer, buffer + sizeof(buffer), value, std::chars_format::fixed, 3);
+        } else {
+            result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        }
+        if (result.ec == std::errc{}) {
+            out.append(buffer, result.ptr);
+        }
+    }
+
+    std::chrono::steady_clock::time_point m_start = std::chrono::steady_clock::now();
+    Writer m_writer = nullptr;
+};
+
+[[nodiscard]] static inline uint64_t ElapsedMilliseconds(const std::chrono::steady_clock::time_point since)
+{
+    return uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - since).count());
+}
+
+static inline void EmitEvent(const std::string_view type, const std::initializer_list<EventField> fields = {})
+{
+    EventStream::instance().emit(type, fields);
+}
+
+} // namespace WinUpdate
@@ -0,0 +1,418 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "backend.h"
+#include "searchcache.h"
+#include <algorithm>
+#include <cwctype>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace WinUpdate
+{
+
+// WUA only accepts "OR" at the top level, every alternative repeats the whole criteria.
+static constexpr const std::size_t kMaximumCriteriaTerms = 8;
+
+enum class FilterField : uint8_t
+{
+    Category,
+    Kb,
+    Severity,
+    Size,
+    Type,
+    Package
+};
+
+enum class FilterOperator : uint8_t
+{
+    Equal,
+    NotEqual,
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual
+};
+
+// "field op value[,value...]". Several values mean any of them for "=" and none of them
+// for "!=", the other operators take exactly one.
+struct FilterClause
+{
+    FilterField field = FilterField::Category;
+    FilterOperator op = FilterOperator::Equal;
+    std::vector<std::wstring> values = {}; // Category IDs and package prefixes.
+    std::vector<uint64_t> numbers = {}; // KB numbers, severities, sizes in bytes and types.
+};
+
+// Package family names are plain ASCII, no need for locale aware comparisons.
+[[nodiscard]] static inline bool StartsWithNoCase(const std::wstring_view text, const std::wstring_view prefix)
+{
+    if (prefix.empty() || (text.size() < prefix.size())) {
+        return false;
+    }
+    return std::equal(prefix.cbegin(), prefix.cend(), text.cbegin(), [](const wchar_t lhs, const wchar_t rhs){
+        return (std::towlower(std::wint_t(lhs)) == std::towlower(std::wint_t(rhs)));
+    });
+}
+
+[[nodiscard]] static inline bool EqualsNoCase(const std::wstring_view lhs, const std::wstring_view rhs)
+{
+    return ((lhs.size() == rhs.size()) && (lhs.empty() || StartsWithNoCase(lhs, rhs)));
+}
+
+[[nodiscard]] static inline std::wstring_view TrimFilterText(std::wstring_view text)
+{
+    while (!text.empty() && std::iswspace(std::wint_t(text.front()))) {
+        text.remove_prefix(1);
+    }
+    while (!text.empty() && std::iswspace(std::wint_t(text.back()))) {
+        text.remove_suffix(1);
+    }
+    return text;
+}
+
+[[nodiscard]] static inline bool CompareFilterValue(const FilterOperator op, const uint64_t lhs, const uint64_t rhs)
+{
+    switch (op) {
+    case FilterOperator::Equal:
+        return (lhs == rhs);
+    case FilterOperator::NotEqual:
+        return (lhs != rhs);
+    case FilterOperator::Less:
+        return (lhs < rhs);
+    case FilterOperator::LessEqual:
+        return (lhs <= rhs);
+    case FilterOperator::Greater:
+        return (lhs > rhs);
+    case FilterOperator::GreaterEqual:
+        return (lhs >= rhs);
+    }
+    return false;
+}
+
+// Operator chosen rules over Windows updates and Microsoft Store packages, separated by
+// semicolons, all of which have to hold:
+//   category=<name or CategoryID>  kb=<number>  severity=<unspecified|low|moderate|important|critical>
+//   size=<MiB>  type=<software|driver>  package=<package family name prefix>
+// Rules about something a target doesn't have are ignored for it, only "size" and
+// "package" apply to Store packages. "category" and "type" compile into the WUA search
+// criteria as far as WUA can express them, so excluded payloads never even show up.
+// Everything is evaluated locally again regardless, which keeps backends that don't
+// interpret the criteria honest.
+class UpdateFilter
+{
+public:
+    UpdateFilter() = default;
+    ~UpdateFilter() = default;
+
+    // Leaves the filter empty and says why in "error" if "text" is not a valid filter.
+    [[nodiscard]] inline bool parse(const std::wstring_view text, std::wstring &error)
+    {
+        m_source.clear();
+        m_clauses.clear();
+        std::size_t begin = 0;
+        while (begin <= text.size()) {
+            const std::size_t end = std::min(text.find(L';', begin), text.size());
+            const std::wstring_view rule = TrimFilterText(text.substr(begin, end - begin));
+            begin = end + 1;
+            if (rule.empty()) {
+                continue;
+            }
+            FilterClause clause = {};
+            if (!parseClause(rule, clause, error)) {
+                m_clauses.clear();
+                return false;
+            }
+            m_clauses.push_back(std::move(clause));
+        }
+        m_source = text;
+        return true;
+    }
+
+    [[nodiscard]] inline const std::wstring &source() const
+    {
+        return m_source;
+    }
+
+    [[nodiscard]] inline bool empty() const
+    {
+        return m_clauses.empty();
+    }
+
+    [[nodiscard]] inline bool matches(const UpdateDescriptor &update) const
+    {
+        return matchesUpdate(update.kb, update.severity, update.maxDownloadSize, update.type, [&update](const std::wstring_view categoryId){
+            return std::any_of(update.categories.cbegin(), update.categories.cend(), [categoryId](const std::wstring &category){ return EqualsNoCase(category, categoryId); });
+        });
+    }
+
+    // For updates that aren't kept as descriptors. "hasCategory" is given lower case IDs.
+    template <typename CategoryTest>
+    [[nodiscard]] inline bool matchesUpdate(const uint32_t kb, const UpdateSeverity severity, const uint64_t size, const UpdateType type, CategoryTest &&hasCategory) const
+    {
+        for (auto &&clause : std::as_const(m_clauses)) {
+            bool result = true;
+            switch (clause.field) {
+            case FilterField::Category:
+                result = matchesAny(clause, [&hasCategory](const std::size_t index, const FilterClause &self){ return hasCategory(std::wstring_view(self.values.at(index))); });
+                break;
+            case FilterField::Kb:
+                result = matchesAny(clause, [kb](const std::size_t index, const FilterClause &self){ return (kb == self.numbers.at(index)); });
+                break;
+            case FilterField::Severity:
+                result = compare(clause, uint64_t(severity));
+                break;
+            case FilterField::Size:
+                result = compare(clause, size);
+                break;
+            case FilterField::Type:
+                result = compare(clause, uint64_t(type));
+                break;
+            case FilterField::Package:
+                break;
+            }
+            if (!result) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    [[nodiscard]] inline bool matches(const StoreItemDescriptor &item) const
+    {
+        for (auto &&clause : std::as_const(m_clauses)) {
+            bool result = true;
+            if (clause.field == FilterField::Package) {
+                result = matchesAny(clause, [&item](const std::size_t index, const FilterClause &self){ return StartsWithNoCase(item.packageFamilyName, self.values.at(index)); });
+            } else if ((clause.field == FilterField::Size) && (item.downloadSize > 0)) {
+                result = compare(clause, item.downloadSize);
+            }
+            if (!result) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The alternatives WUA has to search for, "AND" joined conditions each, to be OR-ed
+    // at the top level. A single empty term means no restriction. Clauses that would blow
+    // up the number of alternatives beyond "kMaximumCriteriaTerms" are left to "matches()".
+    [[nodiscard]] inline std::vector<std::wstring> criteriaTerms() const
+    {
+        std::vector<std::wstring> terms = { std::wstring{} };
+        for (auto &&clause : std::as_const(m_clauses)) {
+            std::vector<std::wstring> conditions = {};
+            if (clause.field == FilterField::Type) {
+                for (auto &&type : { UpdateType::Software, UpdateType::Driver }) {
+                    if (compare(clause, uint64_t(type))) {
+                        conditions.push_back((type == UpdateType::Driver) ? L"Type = 'Driver'" : L"Type = 'Software'");
+                    }
+                }
+                if (conditions.size() > 1) {
+                    continue; // Both types, no restriction at all.
+                }
+            } else if ((clause.field == FilterField::Category) && (clause.op == FilterOperator::Equal)) {
+                for (auto &&id : std::as_const(clause.values)) {
+                    conditions.push_back(L"CategoryIDs contains '" + id + L'\'');
+                }
+            }
+            if (conditions.empty() || ((terms.size() * conditions.size()) > kMaximumCriteriaTerms)) {
+                continue;
+            }
+            std::vector<std::wstring> combined = {};
+            combined.reserve(terms.size() * conditions.size());
+            for (auto &&term : std::as_const(terms)) {
+                for (auto &&condition : std::as_const(conditions)) {
+                    combined.push_back(term.empty() ? condition : (term + L" AND " + condition));
+                }
+            }
+            terms = std::move(combined);
+        }
+        return terms;
+    }
+
+private:
+    template <typename Predicate>
+    [[nodiscard]] static inline bool matchesAny(const FilterClause &clause, Predicate &&predicate)
+    {
+        const std::size_t count = std::max(clause.values.size(), clause.numbers.size());
+        bool found = false;
+        for (std::size_t index = 0; !found && (index != count); ++index) {
+            found = predicate(index, clause);
+        }
+        return ((clause.op == FilterOperator::NotEqual) ? !found : found);
+    }
+
+    [[nodiscard]] static inline bool compare(const FilterClause &clause, const uint64_t value)
+    {
+        if ((clause.op == FilterOperator::Equal) || (clause.op == FilterOperator::NotEqual)) {
+            return matchesAny(clause, [value](const std::size_t index, const FilterClause &self){ return (value == self.numbers.at(index)); });
+        }
+        return CompareFilterValue(clause.op, value, clause.numbers.front());
+    }
+
+    [[nodiscard]] static inline bool parseClause(const std::wstring_view rule, FilterClause &clause, std::wstring &error)
+    {
+        const std::size_t position = rule.find_first_of(L"!=<>");
+        if ((position == std::wstring_view::npos) || (position < 1)) {
+            error = L"Expected \"field operator value\": " + std::wstring(rule);
+            return false;
+        }
+        const wchar_t first = rule.at(position);
+        const bool twoCharacters = (((position + 1) < rule.size()) && (rule.at(position + 1) == L'='));
+        if (first == L'!') {
+            if (!twoCharacters) {
+                error = L"Unknown operator in: " + std::wstring(rule);
+                return false;
+            }
+            clause.op = FilterOperator::NotEqual;
+        } else if (first == L'=') {
+            clause.op = FilterOperator::Equal;
+        } else if (first == L'<') {
+            clause.op = (twoCharacters ? FilterOperator::LessEqual : FilterOperator::Less);
+        } else {
+            clause.op = (twoCharacters ? FilterOperator::GreaterEqual : FilterOperator::Greater);
+        }
+        const std::wstring_view field = TrimFilterText(rule.substr(0, position));
+        const std::wstring_view valueList = rule.substr(position + ((twoCharacters && (first != L'=')) ? 2 : 1));
+        if (EqualsNoCase(field, L"category")) {
+            clause.field = FilterField::Category;
+        } else if (EqualsNoCase(field, L"kb")) {
+            clause.field = FilterField::Kb;
+        } else if (EqualsNoCase(field, L"severity")) {
+            clause.field = FilterField::Severity;
+        } else if (EqualsNoCase(field, L"size")) {
+            clause.field = FilterField::Size;
+        } else if (EqualsNoCase(field, L"type")) {
+            clause.field = FilterField::Type;
+        } else if (EqualsNoCase(field, L"package")) {
+            clause.field = FilterField::Package;
+        } else {
+            error = L"Unknown filter field: " + std::wstring(field);
+            return false;
+        }
+        const bool ordered = ((clause.field == FilterField::Severity) || (clause.field == FilterField::Size));
+        const bool equality = ((clause.op == FilterOperator::Equal) || (clause.op == FilterOperator::NotEqual));
+        if (!equality && !ordered) {
+            error = L"Only \"=\" and \"!=\" work for " + std::wstring(field);
+            return false;
+        }
+        std::size_t begin = 0;
+        while (begin <= valueList.size()) {
+            const std::size_t end = std::min(valueList.find(L',', begin), valueList.size());
+            const std::wstring_view value = TrimFilterText(valueList.substr(begin, end - begin));
+            begin = end + 1;
+            if (value.empty()) {
+                continue;
+            }
+            if (!parseValue(value, clause)) {
+                error = L"Invalid " + std::wstring(field) + L" value: " + std::wstring(value);
+                return false;
+            }
+        }
+        const std::size_t count = std::max(clause.values.size(), clause.numbers.size());
+        if ((count < 1) || (!equality && (count > 1))) {
+            error = L"Expected " + std::wstring(equality ? L"at least one value" : L"exactly one value") + L" in: " + std::wstring(rule);
+            return false;
+        }
+        return true;
+    }
+
+    [[nodiscard]] static inline bool parseValue(const std::wstring_view value, FilterClause &clause)
+    {
+        const auto parseNumber = [](const std::wstring_view text, uint64_t &number) -> bool {
+            if (text.empty() || (text.size() > 12)) {
+                return false;
+            }
+            number = 0;
+            for (auto &&ch : text) {
+                if ((ch < L'0') || (ch > L'9')) {
+                    return false;
+                }
+                number = ((number * 10) + uint64_t(ch - L'0'));
+            }
+            return true;
+        };
+        uint64_t number = 0;
+        switch (clause.field) {
+        case FilterField::Category: {
+            for (auto &&classification : kUpdateClassifications) {
+                if (EqualsNoCase(value, classification.name)) {
+                    clause.values.emplace_back(classification.id);
+                    return true;
+                }
+            }
+            UpdateGuid id = {};
+            if (!ParseUpdateGuid(value, id)) {
+                return false;
+            }
+            clause.values.push_back(FormatUpdateGuid(id));
+            return true;
+        }
+        case FilterField::Kb:
+            if (!parseNumber(StartsWithNoCase(value, L"KB") ? value.substr(2) : value, number)) {
+                return false;
+            }
+            clause.numbers.push_back(number);
+            return true;
+        case FilterField::Severity:
+            for (auto &&severity : { UpdateSeverity::Unspecified, UpdateSeverity::Low, UpdateSeverity::Moderate, UpdateSeverity::Important, UpdateSeverity::Critical }) {
+                const std::string_view name = GetSeverityName(severity);
+                if (EqualsNoCase(value, std::wstring(name.cbegin(), name.cend()))) {
+                    clause.numbers.push_back(uint64_t(severity));
+                    return true;
+                }
+            }
+            return false;
+        case FilterField::Size:
+            if (!parseNumber(value, number)) {
+                return false;
+            }
+            clause.numbers.push_back(number << 20);
+            return true;
+        case FilterField::Type:
+            if (EqualsNoCase(value, L"software")) {
+                clause.numbers.push_back(uint64_t(UpdateType::Software));
+                return true;
+            }
+            if (EqualsNoCase(value, L"driver")) {
+                clause.numbers.push_back(uint64_t(UpdateType::Driver));
+                return true;
+            }
+            return false;
+        case FilterField::Package:
+            clause.values.emplace_back(value);
+            return true;
+        }
+        return false;
+    }
+
+    std::wstring m_source = {};
+    std::vector<FilterClause> m_clauses = {};
+};
+
+} // namespace WinUpdate
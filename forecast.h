@@ -0,0 +1,354 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "backend.h"
+#include "searchcache.h"
+#include <cmath>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <mutex>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace WinUpdate
+{
+
+// What earlier runs observed, kept as running statistics per series. The file is a flat
+// array of fixed size records behind a small header, same as the search cache.
+static constexpr const uint32_t kThroughputHistoryMagic = 0x48545557; // "WUTH"
+static constexpr const uint32_t kThroughputHistoryVersion = 1;
+// The last this many samples of a series carry the statistics, older ones fade out.
+static constexpr const uint32_t kThroughputHistoryWindow = 32;
+// Per KB records beyond this are dropped, the least recently updated first.
+static constexpr const std::size_t kThroughputHistoryCapacity = 4096;
+// Downloads smaller than this say more about latency than about the bandwidth.
+static constexpr const uint64_t kMinimumThroughputSample = 1ull << 20;
+// Bounds are the 5th and 95th percentile, assuming a normal distribution.
+static constexpr const double kForecastZ = 1.645;
+// Until a machine has history of its own, every estimate is a rough guess from these.
+static constexpr const double kDefaultDownloadRate = 4.0 * 1024 * 1024; // Bytes per second.
+static constexpr const double kDefaultInstallTime = 90.0; // Seconds.
+static constexpr const double kDefaultStoreItemTime = 60.0; // Seconds.
+
+enum class ThroughputSeries : uint32_t
+{
+    WindowsDownload = 1, // Bytes per second, all downloads of a pass together.
+    WindowsInstall, // Seconds per update.
+    WindowsInstallByKb, // Seconds per update, keyed by its KB number.
+    StoreItem // Seconds per application, download and installation.
+};
+
+// Welford's algorithm. Once "kThroughputHistoryWindow" samples are in, the older ones
+// are scaled down to make room, so a machine that got faster is believed eventually.
+struct RunningStatistics
+{
+    uint32_t count = 0;
+    double mean = 0.0;
+    double m2 = 0.0; // Sum of squared differences from the mean.
+
+    inline void add(const double value)
+    {
+        if (count >= kThroughputHistoryWindow) {
+            m2 *= (double(kThroughputHistoryWindow - 1) / double(count));
+            count = (kThroughputHistoryWindow - 1);
+        }
+        ++count;
+        const double delta = (value - mean);
+        mean += (delta / double(count));
+        m2 += (delta * (value - mean));
+    }
+
+    [[nodiscard]] inline double variance() const
+    {
+        return ((count > 1) ? (m2 / double(count - 1)) : 0.0);
+    }
+
+    [[nodiscard]] inline double deviation() const
+    {
+        return std::sqrt(variance());
+    }
+};
+
+struct ThroughputHistoryHeader
+{
+    uint32_t magic = kThroughputHistoryMagic;
+    uint32_t version = kThroughputHistoryVersion;
+    uint32_t count = 0;
+    uint32_t checksum = 0; // FNV-1a over all records.
+};
+static_assert(sizeof(ThroughputHistoryHeader) == 16);
+
+struct ThroughputRecord
+{
+    ThroughputSeries series = ThroughputSeries::WindowsDownload;
+    uint32_t key = 0; // The KB number for "WindowsInstallByKb", 0 otherwise.
+    uint32_t count = 0;
+    uint32_t reserved = 0;
+    double mean = 0.0;
+    double m2 = 0.0;
+    int64_t updated = 0; // Seconds since the Unix epoch, UTC.
+};
+static_assert(sizeof(ThroughputRecord) == 40);
+
+// Fed by the updaters as they go, which may run on different threads at the same time.
+class ThroughputHistory
+{
+public:
+    ThroughputHistory() = default;
+    ~ThroughputHistory() = default;
+
+    ThroughputHistory(const ThroughputHistory &) = delete;
+    ThroughputHistory &operator=(const ThroughputHistory &) = delete;
+
+    // Returns false for anything which is not an intact history of our version, the
+    // history is empty then.
+    [[nodiscard]] inline bool load(const void *data, const std::size_t size)
+    {
+        const std::scoped_lock lock(m_mutex);
+        m_records.clear();
+        if (!data || (size < sizeof(ThroughputHistoryHeader))) {
+            return false;
+        }
+        ThroughputHistoryHeader header = {};
+        std::memcpy(&header, data, sizeof(header));
+        if ((header.magic != kThroughputHistoryMagic) || (header.version != kThroughputHistoryVersion)) {
+            return false;
+        }
+        const auto bytes = (static_cast<const uint8_t *>(data) + sizeof(header));
+        if ((size - sizeof(header)) != (std::size_t(header.count) * sizeof(ThroughputRecord)) || (CalculateChecksum(bytes, header.count * sizeof(ThroughputRecord)) != header.checksum)) {
+            return false;
+        }
+        for (uint32_t index = 0; index != header.count; ++index) {
+            ThroughputRecord record = {};
+            std::memcpy(&record, bytes + (index * sizeof(ThroughputRecord)), sizeof(record));
+            m_records.insert_or_assign(makeKey(record.series, record.key), record);
+        }
+        return true;
+    }
+
+    [[nodiscard]] inline std::vector<uint8_t> serialize() const
+    {
+        const std::scoped_lock lock(m_mutex);
+        std::vector<ThroughputRecord> records = {};
+        records.reserve(m_records.size());
+        for (auto &&[key, record] : std::as_const(m_records)) {
+            records.push_back(record);
+        }
+        // The series records are few and always kept, the KB ones compete for the space.
+        const auto byKb = std::stable_partition(records.begin(), records.end(), [](const ThroughputRecord &record){ return (record.series != ThroughputSeries::WindowsInstallByKb); });
+        std::stable_sort(byKb, records.end(), [](const ThroughputRecord &lhs, const ThroughputRecord &rhs){ return (lhs.updated > rhs.updated); });
+        if (std::size_t(records.end() - byKb) > kThroughputHistoryCapacity) {
+            records.erase(byKb + kThroughputHistoryCapacity, records.end());
+        }
+        ThroughputHistoryHeader header = {};
+        header.count = uint32_t(records.size());
+        header.checksum = CalculateChecksum(records.data(), records.size() * sizeof(ThroughputRecord));
+        std::vector<uint8_t> buffer(sizeof(header) + records.size() * sizeof(ThroughputRecord));
+        std::memcpy(buffer.data(), &header, sizeof(header));
+        if (!records.empty()) {
+            std::memcpy(buffer.data() + sizeof(header), records.data(), records.size() * sizeof(ThroughputRecord));
+        }
+        return buffer;
+    }
+
+    [[nodiscard]] inline bool isEmpty() const
+    {
+        const std::scoped_lock lock(m_mutex);
+        return m_records.empty();
+    }
+
+    // "bytes" downloaded in "duration", by however many downloads side by side.
+    inline void recordDownload(const uint64_t bytes, const std::chrono::milliseconds duration)
+    {
+        if ((bytes < kMinimumThroughputSample) || (duration.count() < 1)) {
+            return;
+        }
+        add(ThroughputSeries::WindowsDownload, 0, (double(bytes) * 1000.0 / double(duration.count())));
+    }
+
+    inline void recordInstall(const uint32_t kb, const std::chrono::milliseconds duration)
+    {
+        const double seconds = (double(duration.count()) / 1000.0);
+        add(ThroughputSeries::WindowsInstall, 0, seconds);
+        if (kb > 0) {
+            add(ThroughputSeries::WindowsInstallByKb, kb, seconds);
+        }
+    }
+
+    inline void recordStoreItem(const std::chrono::milliseconds duration)
+    {
+        add(ThroughputSeries::StoreItem, 0, (double(duration.count()) / 1000.0));
+    }
+
+    [[nodiscard]] inline RunningStatistics statistics(const ThroughputSeries series, const uint32_t key = 0) const
+    {
+        const std::scoped_lock lock(m_mutex);
+        const auto it = m_records.find(makeKey(series, key));
+        if (it == m_records.cend()) {
+            return {};
+        }
+        return RunningStatistics{ it->second.count, it->second.mean, it->second.m2 };
+    }
+
+private:
+    [[nodiscard]] static inline uint64_t makeKey(const ThroughputSeries series, const uint32_t key)
+    {
+        return ((uint64_t(series) << 32) | key);
+    }
+
+    inline void add(const ThroughputSeries series, const uint32_t key, const double value)
+    {
+        const std::scoped_lock lock(m_mutex);
+        ThroughputRecord &record = m_records[makeKey(series, key)];
+        RunningStatistics statistics{ record.count, record.mean, record.m2 };
+        statistics.add(value);
+        record.series = series;
+        record.key = key;
+        record.count = statistics.count;
+        record.mean = statistics.mean;
+        record.m2 = statistics.m2;
+        record.updated = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    mutable std::mutex m_mutex;
+    std::map<uint64_t, ThroughputRecord> m_records = {};
+};
+
+// Seconds, "expected" is the mean and the bounds are what "kForecastZ" makes of the spread.
+struct DurationEstimate
+{
+    double expected = 0.0;
+    double low = 0.0;
+    double high = 0.0;
+    uint32_t samples = 0; // What the estimate is based on, 0 means it's a default.
+};
+
+struct RunForecast
+{
+    std::size_t windowsUpdates = 0;
+    uint64_t downloadSize = 0; // Bytes, what's already downloaded doesn't count.
+    std::size_t installsWithHistory = 0; // Updates installed before on this machine, by KB.
+    DurationEstimate download = {};
+    DurationEstimate install = {};
+    DurationEstimate windows = {}; // Download and install one after the other, the pipeline only makes it shorter.
+    std::size_t storeItems = 0;
+    DurationEstimate store = {};
+    DurationEstimate total = {}; // Windows and the Store run side by side.
+};
+
+// Adds up independent durations: the means add up, and so do the variances.
+struct DurationSum
+{
+    double mean = 0.0;
+    double variance = 0.0;
+    uint32_t samples = 0;
+
+    inline void add(const RunningStatistics &statistics, const double fallback)
+    {
+        if (statistics.count < 1) {
+            mean += fallback;
+            variance += ((fallback * fallback) / 4.0);
+            return;
+        }
+        mean += statistics.mean;
+        // A single sample says nothing about the spread, assume it's as bad as a default's.
+        variance += ((statistics.count > 1) ? statistics.variance() : ((statistics.mean * statistics.mean) / 4.0));
+        samples = std::max(samples, statistics.count);
+    }
+
+    [[nodiscard]] inline DurationEstimate estimate(const double scale = 1.0) const
+    {
+        const double spread = (kForecastZ * std::sqrt(variance));
+        return DurationEstimate{ (mean * scale), (std::max(mean - spread, 0.0) * scale), ((mean + spread) * scale), samples };
+    }
+};
+
+// The download time of "bytes" at the observed rate. The bounds come from the spread of
+// the rate, which is never trusted to be below a tenth of its mean.
+[[nodiscard]] static inline DurationEstimate EstimateDownload(const RunningStatistics &rate, const uint64_t bytes)
+{
+    const double mean = ((rate.count > 0) ? rate.mean : kDefaultDownloadRate);
+    const double deviation = ((rate.count > 1) ? rate.deviation() : (mean / 2.0));
+    const double fastest = (mean + (kForecastZ * deviation));
+    const double slowest = std::max(mean - (kForecastZ * deviation), (mean / 10.0));
+    return DurationEstimate{ (double(bytes) / mean), (double(bytes) / fastest), (double(bytes) / slowest), rate.count };
+}
+
+// "order" indexes "updates" like a "DownloadPlan", "storeItems" is what the Store would
+// update "storeMaxInFlight" at a time.
+[[nodiscard]] static inline RunForecast ForecastRun(const ThroughputHistory &history, const std::vector<UpdateDescriptor> &updates, const std::vector<std::size_t> &order, const std::vector<StoreItemDescriptor> &storeItems, const std::size_t storeMaxInFlight)
+{
+    RunForecast forecast = {};
+    forecast.windowsUpdates = order.size();
+    const RunningStatistics installs = history.statistics(ThroughputSeries::WindowsInstall);
+    DurationSum install = {};
+    for (auto &&index : std::as_const(order)) {
+        const UpdateDescriptor &update = updates.at(index);
+        forecast.downloadSize += (update.downloaded ? 0 : update.maxDownloadSize);
+        const RunningStatistics byKb = ((update.kb > 0) ? history.statistics(ThroughputSeries::WindowsInstallByKb, update.kb) : RunningStatistics{});
+        if (byKb.count > 0) {
+            ++forecast.installsWithHistory;
+            install.add(byKb, kDefaultInstallTime);
+        } else {
+            install.add(installs, kDefaultInstallTime);
+        }
+    }
+    forecast.download = EstimateDownload(history.statistics(ThroughputSeries::WindowsDownload), forecast.downloadSize);
+    forecast.install = install.estimate();
+    forecast.windows = DurationEstimate{ (forecast.download.expected + forecast.install.expected), (forecast.download.low + forecast.install.low), (forecast.download.high + forecast.install.high), std::min(forecast.download.samples, forecast.install.samples) };
+
+    forecast.storeItems = storeItems.size();
+    if (!storeItems.empty()) {
+        const RunningStatistics items = history.statistics(ThroughputSeries::StoreItem);
+        DurationSum store = {};
+        for (std::size_t index = 0; index != storeItems.size(); ++index) {
+            store.add(items, kDefaultStoreItemTime);
+        }
+        forecast.store = store.estimate(1.0 / double(std::clamp(storeMaxInFlight, std::size_t(1), storeItems.size())));
+    }
+
+    forecast.total = DurationEstimate{ std::max(forecast.windows.expected, forecast.store.expected), std::max(forecast.windows.low, forecast.store.low), std::max(forecast.windows.high, forecast.store.high), 0 };
+    return forecast;
+}
+
+// "1 h 05 min", "12 min" or "40 s".
+[[nodiscard]] static inline std::wstring FormatDuration(const double seconds)
+{
+    const auto total = uint64_t(std::llround(std::max(seconds, 0.0)));
+    if (total < 60) {
+        return (std::to_wstring(total) + L" s");
+    }
+    const uint64_t minutes = ((total + 30) / 60);
+    if (minutes < 60) {
+        return (std::to_wstring(minutes) + L" min");
+    }
+    const uint64_t rest = (minutes % 60);
+    return (std::to_wstring(minutes / 60) + L" h " + ((rest < 10) ? L"0" : L"") + std::to_wstring(rest) + L" min");
+}
+
+} // namespace WinUpdate
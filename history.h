@@ -0,0 +1,234 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "pipeline.h"
+#include "searchcache.h"
+#include "events.h"
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+
+namespace WinUpdate
+{
+
+// WUA keeps the history newest first, so whatever happened since the last export is at
+// the front. An export reads it in pages from there and stops at the entry it ended
+// with last time, which is what the high-water mark remembers.
+static constexpr const std::size_t kHistoryPageSize = 100;
+static constexpr const uint32_t kHistoryMarkMagic = 0x4D485557; // "WUHM"
+static constexpr const uint32_t kHistoryMarkVersion = 1;
+
+// Same values as WUA's "UpdateOperation".
+enum class HistoryOperation : uint8_t
+{
+    Installation = 1,
+    Uninstallation
+};
+
+[[nodiscard]] static inline const char *GetHistoryOperationName(const HistoryOperation operation)
+{
+    switch (operation) {
+    case HistoryOperation::Installation:
+        return "installation";
+    case HistoryOperation::Uninstallation:
+        return "uninstallation";
+    }
+    return "unknown";
+}
+
+struct HistoryEntry
+{
+    int64_t timestamp = 0; // Milliseconds since the Unix epoch, UTC.
+    HistoryOperation operation = HistoryOperation::Installation;
+    OperationResult result = OperationResult::NotStarted;
+    int32_t hresult = 0;
+    std::wstring id = {}; // "UpdateID", a GUID string.
+    int32_t revision = 0;
+    std::wstring title = {};
+    std::wstring clientApplicationId = {}; // Who installed it, e.g. "UpdateOrchestrator".
+};
+
+// Where the history comes from, WUA's "IUpdateSearcher" in practice.
+class HistorySource
+{
+public:
+    virtual ~HistorySource() = default;
+
+    [[nodiscard]] virtual bool historyCount(std::size_t &count) = 0;
+    // Entries [start, start + count) in WUA's order, fewer if the history ends earlier.
+    [[nodiscard]] virtual bool queryHistory(const std::size_t start, const std::size_t count, std::vector<HistoryEntry> &entries) = 0;
+};
+
+// The newest entry an export has written. Entries are told apart by their time and a hash
+// over the rest, a history WUA has cleared or trimmed in between is no problem either way.
+struct HistoryMark
+{
+    uint32_t magic = kHistoryMarkMagic;
+    uint32_t version = kHistoryMarkVersion;
+    int64_t timestamp = 0; // Of the newest entry exported, 0 if nothing was exported yet.
+    uint32_t key = 0; // "GetHistoryEntryKey()" of that entry.
+    uint32_t checksum = 0; // FNV-1a over everything above.
+    uint64_t exported = 0; // How many entries all exports wrote together, informational.
+};
+static_assert(sizeof(HistoryMark) == 32);
+
+[[nodiscard]] static inline uint32_t GetHistoryEntryKey(const HistoryEntry &entry)
+{
+    const std::string text = (EncodeUtf8(entry.id) + ':' + std::to_string(entry.revision) + ':' + std::to_string(int(entry.operation)) + ':' + std::to_string(int(entry.result)) + ':' + EncodeUtf8(entry.title));
+    return CalculateChecksum(text.data(), text.size());
+}
+
+[[nodiscard]] static inline uint32_t GetHistoryMarkChecksum(const HistoryMark &mark)
+{
+    return CalculateChecksum(&mark, offsetof(HistoryMark, checksum));
+}
+
+// Anything that isn't an intact mark of our version means "export everything".
+[[nodiscard]] static inline HistoryMark ParseHistoryMark(const void *data, const std::size_t size)
+{
+    HistoryMark mark = {};
+    if (!data || (size != sizeof(HistoryMark))) {
+        return {};
+    }
+    std::memcpy(&mark, data, sizeof(mark));
+    if ((mark.magic != kHistoryMarkMagic) || (mark.version != kHistoryMarkVersion) || (mark.checksum != GetHistoryMarkChecksum(mark))) {
+        return {};
+    }
+    return mark;
+}
+
+[[nodiscard]] static inline HistoryMark MakeHistoryMark(const int64_t timestamp, const uint32_t key, const uint64_t exported)
+{
+    HistoryMark mark = {};
+    mark.timestamp = timestamp;
+    mark.key = key;
+    mark.exported = exported;
+    mark.checksum = GetHistoryMarkChecksum(mark);
+    return mark;
+}
+
+// Whether "entry" is the marked one or older than it, that's where an export stops.
+[[nodiscard]] static inline bool IsExported(const HistoryEntry &entry, const HistoryMark &mark)
+{
+    if (mark.timestamp == 0) {
+        return false;
+    }
+    return ((entry.timestamp < mark.timestamp) || ((entry.timestamp == mark.timestamp) && (GetHistoryEntryKey(entry) == mark.key)));
+}
+
+// One JSON object per line, appended to "out":
+// {"time":"2023-05-09T17:04:11.250Z","operation":"installation","result":"succeeded",...}
+static inline void FormatHistoryEntry(std::string &out, const HistoryEntry &entry)
+{
+    using namespace std::chrono;
+    const sys_time<milliseconds> time{ milliseconds(entry.timestamp) };
+    const sys_days day = floor<days>(time);
+    const year_month_day date{ day };
+    const hh_mm_ss<milliseconds> clock{ time - day };
+    char buffer[32] = {};
+    std::snprintf(buffer, sizeof(buffer), "%04d-%02u-%02uT%02d:%02d:%02d.%03dZ", int(date.year()), unsigned(date.month()), unsigned(date.day()),
+        int(clock.hours().count()), int(clock.minutes().count()), int(clock.seconds().count()), int(clock.subseconds().count()));
+    out += "{\"time\":\"";
+    out += buffer;
+    out += "\",\"operation\":\"";
+    out += GetHistoryOperationName(entry.operation);
+    out += "\",\"result\":\"";
+    out += GetOperationResultName(entry.result);
+    out += "\",\"hresult\":";
+    out += std::to_string(entry.hresult);
+    out += ",\"id\":";
+    AppendJsonString(out, entry.id);
+    out += ",\"revision\":";
+    out += std::to_string(entry.revision);
+    out += ",\"title\":";
+    AppendJsonString(out, entry.title);
+    out += ",\"client\":";
+    AppendJsonString(out, entry.clientApplicationId);
+    out += "}\n";
+}
+
+struct HistoryExport
+{
+    std::size_t total = 0; // What WUA has.
+    std::size_t exported = 0; // Written by this export.
+    HistoryMark mark = {}; // To start from next time, the old one if nothing was written.
+};
+
+// Streams every entry newer than "since" into "write", newest first. Only one page is
+// held at a time and formatted into a single buffer, so the memory an export needs
+// doesn't grow with the history. "write" gets whole lines and returns false on failure.
+// Entries that WUA adds while the export is running may show up twice, never not at all.
+[[nodiscard]] static inline bool ExportHistory(HistorySource &source, const HistoryMark &since, const std::function<bool(const std::string_view)> &write, HistoryExport &result)
+{
+    result = {};
+    result.mark = since;
+    if (!source.historyCount(result.total)) {
+        return false;
+    }
+    std::vector<HistoryEntry> page = {};
+    page.reserve(kHistoryPageSize);
+    std::string buffer = {};
+    for (std::size_t start = 0; start < result.total; start += kHistoryPageSize) {
+        page.clear();
+        if (!source.queryHistory(start, std::min(kHistoryPageSize, (result.total - start)), page)) {
+            return false;
+        }
+        if (page.empty()) {
+            break;
+        }
+        buffer.clear();
+        bool reachedMark = false;
+        for (auto &&entry : std::as_const(page)) {
+            if (IsExported(entry, since)) {
+                reachedMark = true;
+                break;
+            }
+            if (result.exported == 0) {
+                result.mark = MakeHistoryMark(entry.timestamp, GetHistoryEntryKey(entry), 0);
+            }
+            FormatHistoryEntry(buffer, entry);
+            ++result.exported;
+        }
+        if (!buffer.empty() && !write(buffer)) {
+            return false;
+        }
+        if (reachedMark) {
+            break;
+        }
+    }
+    if (result.exported > 0) {
+        result.mark = MakeHistoryMark(result.mark.timestamp, result.mark.key, (since.exported + result.exported));
+    }
+    return true;
+}
+
+} // namespace WinUpdate
@@ -49,18 +49,35 @@
 #include <windows.h>
 #include <wuapi.h>
 #include <netlistmgr.h>
-#include <io.h>
-#include <fcntl.h>
+#include <shlobj.h>
 #include <versionhelpers.h>
 #include <wrl/client.h>
+#include <wrl/implements.h>
 #include <winrt/windows.foundation.collections.h>
 #include <winrt/windows.applicationmodel.store.preview.installcontrol.h>
 #include <clocale>
+#include <cmath>
+#include <chrono>
 #include <array>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <optional>
 #include <syscmdline/system.h>
 #include <syscmdline/option.h>
 #include <syscmdline/command.h>
 #include <syscmdline/parser.h>
+#include "mpscqueue.h"
+#include "orchestrator.h"
+#include "simulator.h"
+#include "replay.h"
+#include "history.h"
+#include "progress.h"
+#include "coordinator.h"
+#include "scanpackage.h"
 
 namespace WinUpdate
 {
@@ -80,6 +97,19 @@ enum class ConsoleTextColor : uint8_t
 
 static constexpr const wchar_t kAppName[] = L"Windows Updater";
 static constexpr const auto kCodePage = UINT{ CP_UTF8 };
+static constexpr const wchar_t kSearchCacheFileName[] = L"search.cache";
+static constexpr const wchar_t kCheckpointFileName[] = L"checkpoint.journal";
+static constexpr const wchar_t kThroughputHistoryFileName[] = L"throughput.history";
+static constexpr const wchar_t kScanPackageFileName[] = L"scanpackage.registration";
+static constexpr const wchar_t kScanPackageServiceName[] = L"Windows Updater offline scan package";
+static constexpr const auto kScanPackageChunkSize = DWORD{ 1024 * 1024 }; // Packages are far too large to map as a whole.
+static constexpr const wchar_t kRescanEventName[] = L"Global\\WinUpdate.Rescan"; // Wakes up a daemon.
+static constexpr const wchar_t kProgressRegionName[] = L"Global\\WinUpdate.Progress"; // See "progress.h".
+static constexpr const wchar_t kLeaderMutexName[] = L"Global\\WinUpdate.Leader"; // Owned by the instance doing the updating.
+static constexpr const wchar_t kCoordinationPipeName[] = L"\\\\.\\pipe\\WinUpdate.Coordination"; // See "coordinator.h".
+static constexpr const auto kPipeConnectTimeout = DWORD{ 5000 };
+static constexpr const auto kFollowInterval = DWORD{ 1000 }; // How often a follower looks at the leader's progress.
+static constexpr const int kDeadlineExitCode = 124; // Same as GNU timeout, for scripts.
 
 static constexpr const std::array<uint8_t, 9> kVirtualTerminalForegroundColor =
 {
@@ -109,6 +139,8 @@ static constexpr const std::array<WORD, 9> kClassicForegroundColor =
 
 struct ScopedBSTR
 {
+    ScopedBSTR() = default;
+
     ScopedBSTR(const OLECHAR *psz)
     {
         str = ::SysAllocString(psz);
@@ -137,6 +169,18 @@ struct ScopedBSTR
         }
     }
 
+    // For "get_*()" style out parameters, frees whatever is held at the moment.
+    [[nodiscard]] inline BSTR *address()
+    {
+        release();
+        return &str;
+    }
+
+    [[nodiscard]] inline std::wstring toString() const
+    {
+        return (str ? std::wstring(str, ::SysStringLen(str)) : std::wstring{});
+    }
+
     inline operator bool() const
     {
         return is_valid();
@@ -151,66 +195,269 @@ private:
     BSTR str = nullptr;
 };
 
-struct LocaleGuard
+[[nodiscard]] static inline bool IsVirtualTerminalSequencesSupported()
+{
+    static const bool support = ::IsWindows10OrGreater();
+    return support;
+}
+
+// All console output goes through one background thread: callers (including the WinRT
+// and WUA callback threads) only push into a lock-free queue and never wait for the
+// console. The writer drains the queue in batches, and applies title changes at most
+// "kTitleUpdateInterval" apart, whatever rate they are requested at.
+class ConsoleWriter
 {
-    LocaleGuard()
+public:
+    [[nodiscard]] static inline ConsoleWriter &instance()
     {
-        m_outMode = _setmode(_fileno(stdout), _O_U16TEXT);
-        m_errMode = _setmode(_fileno(stderr), _O_U16TEXT);
+        static ConsoleWriter writer = {};
+        return writer;
     }
 
-    ~LocaleGuard()
+    ~ConsoleWriter()
     {
-        _setmode(_fileno(stdout), m_outMode);
-        _setmode(_fileno(stderr), m_errMode);
+        shutdown();
     }
 
-private:
-    int m_outMode = 0;
-    int m_errMode = 0;
-};
+    ConsoleWriter(const ConsoleWriter &) = delete;
+    ConsoleWriter &operator=(const ConsoleWriter &) = delete;
 
-[[nodiscard]] static inline bool IsVirtualTerminalSequencesSupported()
-{
-    static const bool support = ::IsWindows10OrGreater();
-    return support;
-}
+    inline void write(const std::wstring_view text, const ConsoleTextColor color, const bool error)
+    {
+        Entry entry = {};
+        entry.text = text;
+        entry.color = color;
+        entry.error = (error || m_outputReserved.load(std::memory_order_relaxed));
+        m_queue.push(std::move(entry));
+        m_enqueued.fetch_add(1, std::memory_order_release);
+        wake();
+    }
 
-static inline void PrintToConsole(const std::wstring_view text, const ConsoleTextColor color, const bool error)
-{
-    if (text.empty()) {
-        return;
+    inline void setTitle(const std::wstring_view title)
+    {
+        const auto previous = m_title.exchange(new std::wstring(title), std::memory_order_acq_rel);
+        if (previous) {
+            delete previous;
+        } else {
+            wake();
+        }
     }
-    FILE *channel = (error ? stderr : stdout);
-    if (IsVirtualTerminalSequencesSupported()) {
-        const LocaleGuard localeGuard{};
-        if (std::fwprintf(channel, L"\x1b[1;%dm%s\x1b[0m\n", kVirtualTerminalForegroundColor.at(static_cast<uint8_t>(color)), text.data()) < 1) {
-            // ###
+
+    // Someone else (the NDJSON event stream) owns stdout, send all text to stderr.
+    inline void reserveStandardOutput()
+    {
+        m_outputReserved.store(true, std::memory_order_relaxed);
+    }
+
+    // Blocks until everything written before the call reached the console.
+    inline void flush()
+    {
+        const uint64_t target = m_enqueued.load(std::memory_order_acquire);
+        wake();
+        while (m_written.load(std::memory_order_acquire) < target) {
+            if (!m_thread.joinable()) {
+                return;
+            }
+            ::WaitForSingleObject(m_flushedEvent, 10);
         }
-    } else {
-        const HANDLE hCon = ::GetStdHandle(error ? STD_ERROR_HANDLE : STD_OUTPUT_HANDLE);
-        if (!hCon || (hCon == INVALID_HANDLE_VALUE)) {
+    }
+
+    inline void shutdown()
+    {
+        if (!m_thread.joinable()) {
+            return;
+        }
+        m_stopping.store(true, std::memory_order_release);
+        m_signaled.store(true, std::memory_order_release);
+        ::SetEvent(m_wakeEvent);
+        m_thread.join();
+        if (const auto title = m_title.exchange(nullptr, std::memory_order_acq_rel)) {
+            delete title;
+        }
+        ::CloseHandle(m_wakeEvent);
+        m_wakeEvent = nullptr;
+        ::CloseHandle(m_flushedEvent);
+        m_flushedEvent = nullptr;
+    }
+
+private:
+    struct Entry
+    {
+        std::wstring text = {};
+        ConsoleTextColor color = ConsoleTextColor::Default;
+        bool error = false;
+    };
+
+    struct Channel
+    {
+        HANDLE handle = nullptr;
+        bool console = false;
+        bool virtualTerminal = false;
+        ConsoleTextColor color = ConsoleTextColor::Default;
+        std::wstring buffer = {};
+    };
+
+    static constexpr const auto kTitleUpdateInterval = DWORD{ 100 }; // Milliseconds.
+
+    ConsoleWriter()
+    {
+        m_wakeEvent = ::CreateEventExW(nullptr, nullptr, 0, EVENT_ALL_ACCESS);
+        m_flushedEvent = ::CreateEventExW(nullptr, nullptr, 0, EVENT_ALL_ACCESS);
+        initializeChannel(m_output, STD_OUTPUT_HANDLE);
+        initializeChannel(m_error, STD_ERROR_HANDLE);
+        if (m_wakeEvent && m_flushedEvent) {
+            m_thread = std::thread([this](){ run(); });
+        }
+    }
+
+    // Redirected handles get plain UTF-8 text without any escape sequences.
+    static inline void initializeChannel(Channel &channel, const DWORD handleId)
+    {
+        channel.handle = ::GetStdHandle(handleId);
+        if (!channel.handle || (channel.handle == INVALID_HANDLE_VALUE)) {
+            channel.handle = nullptr;
             return;
         }
-        CONSOLE_SCREEN_BUFFER_INFO csbi;
-        SecureZeroMemory(&csbi, sizeof(csbi));
-        if (::GetConsoleScreenBufferInfo(hCon, &csbi) == FALSE) {
+        DWORD mode = 0;
+        channel.console = ((::GetFileType(channel.handle) == FILE_TYPE_CHAR) && (::GetConsoleMode(channel.handle, &mode) != FALSE));
+        channel.virtualTerminal = (channel.console && IsVirtualTerminalSequencesSupported());
+    }
+
+    inline void wake()
+    {
+        if (!m_signaled.exchange(true, std::memory_order_acq_rel)) {
+            ::SetEvent(m_wakeEvent);
+        }
+    }
+
+    inline void run()
+    {
+        ULONGLONG lastTitleUpdate = 0;
+        while (true) {
+            DWORD timeout = INFINITE;
+            if (m_title.load(std::memory_order_acquire)) {
+                const ULONGLONG elapsed = (::GetTickCount64() - lastTitleUpdate);
+                timeout = ((elapsed >= kTitleUpdateInterval) ? 0 : DWORD(kTitleUpdateInterval - elapsed));
+            }
+            ::WaitForSingleObject(m_wakeEvent, timeout);
+            m_signaled.store(false, std::memory_order_release);
+
+            uint64_t written = 0;
+            Entry entry = {};
+            Channel *current = nullptr;
+            while (m_queue.pop(entry)) {
+                Channel &channel = (entry.error ? m_error : m_output);
+                if (current && (current != &channel)) {
+                    commit(*current);
+                }
+                current = &channel;
+                append(channel, entry);
+                ++written;
+            }
+            if (current) {
+                commit(*current);
+            }
+            if (written > 0) {
+                m_written.fetch_add(written, std::memory_order_release);
+                ::SetEvent(m_flushedEvent);
+            }
+
+            const ULONGLONG now = ::GetTickCount64();
+            if ((now - lastTitleUpdate) >= kTitleUpdateInterval) {
+                if (const auto title = m_title.exchange(nullptr, std::memory_order_acq_rel)) {
+                    ::SetConsoleTitleW(title->c_str());
+                    delete title;
+                    lastTitleUpdate = now;
+                }
+            }
+
+            if (m_stopping.load(std::memory_order_acquire) && (m_written.load(std::memory_order_acquire) >= m_enqueued.load(std::memory_order_acquire))) {
+                break;
+            }
+        }
+    }
+
+    inline void append(Channel &channel, const Entry &entry)
+    {
+        if (channel.virtualTerminal) {
+            channel.buffer += L"\x1b[1;" + std::to_wstring(kVirtualTerminalForegroundColor.at(static_cast<uint8_t>(entry.color))) + L'm';
+            channel.buffer += entry.text;
+            channel.buffer += L"\x1b[0m\n";
             return;
         }
-        const WORD originalColor = csbi.wAttributes;
-        const WORD newColor = ((color == ConsoleTextColor::Default) ? 0 : (kClassicForegroundColor.at(static_cast<uint8_t>(color)) | FOREGROUND_INTENSITY));
-        if (::SetConsoleTextAttribute(hCon, (newColor | (originalColor & 0xF0))) == FALSE) {
+        // The classic console can only change colors between two writes.
+        if (channel.console && (entry.color != channel.color)) {
+            commit(channel);
+            channel.color = entry.color;
+        }
+        channel.buffer += entry.text;
+        channel.buffer += L'\n';
+    }
+
+    inline void commit(Channel &channel)
+    {
+        if (!channel.handle || channel.buffer.empty()) {
+            channel.buffer.clear();
             return;
         }
-        {
-            const LocaleGuard localeGuard{};
-            if (std::fwprintf(channel, L"%s\n", text.data()) < 1) {
+        if (channel.console) {
+            WORD originalColor = 0;
+            bool colored = false;
+            if (!channel.virtualTerminal && (channel.color != ConsoleTextColor::Default)) {
+                CONSOLE_SCREEN_BUFFER_INFO csbi;
+                SecureZeroMemory(&csbi, sizeof(csbi));
+                if (::GetConsoleScreenBufferInfo(channel.handle, &csbi) != FALSE) {
+                    originalColor = csbi.wAttributes;
+                    colored = (::SetConsoleTextAttribute(channel.handle, (kClassicForegroundColor.at(static_cast<uint8_t>(channel.color)) | FOREGROUND_INTENSITY | (originalColor & 0xF0))) != FALSE);
+                }
+            }
+            DWORD written = 0;
+            if (::WriteConsoleW(channel.handle, channel.buffer.data(), DWORD(channel.buffer.size()), &written, nullptr) == FALSE) {
                 // ###
             }
+            if (colored) {
+                ::SetConsoleTextAttribute(channel.handle, originalColor);
+            }
+        } else {
+            const int length = ::WideCharToMultiByte(CP_UTF8, 0, channel.buffer.data(), int(channel.buffer.size()), nullptr, 0, nullptr, nullptr);
+            if (length > 0) {
+                m_encoded.resize(std::size_t(length));
+                ::WideCharToMultiByte(CP_UTF8, 0, channel.buffer.data(), int(channel.buffer.size()), m_encoded.data(), length, nullptr, nullptr);
+                DWORD written = 0;
+                if (::WriteFile(channel.handle, m_encoded.data(), DWORD(length), &written, nullptr) == FALSE) {
+                    // ###
+                }
+            }
         }
-        if (::SetConsoleTextAttribute(hCon, originalColor) == FALSE) {
-        }
+        channel.buffer.clear();
+    }
+
+    MpscQueue<Entry> m_queue = {};
+    std::atomic<std::wstring *> m_title = nullptr;
+    std::atomic<uint64_t> m_enqueued = 0;
+    std::atomic<uint64_t> m_written = 0;
+    std::atomic<bool> m_signaled = false;
+    std::atomic<bool> m_stopping = false;
+    std::atomic<bool> m_outputReserved = false;
+    HANDLE m_wakeEvent = nullptr;
+    HANDLE m_flushedEvent = nullptr;
+    Channel m_output = {};
+    Channel m_error = {};
+    std::string m_encoded = {};
+    std::thread m_thread = {};
+};
+
+static inline void PrintToConsole(const std::wstring_view text, const ConsoleTextColor color, const bool error)
+{
+    if (text.empty()) {
+        return;
     }
+    ConsoleWriter::instance().write(text, color, error);
+}
+
+static inline void SetTitle(const std::wstring_view title)
+{
+    ConsoleWriter::instance().setTitle(title);
 }
 
 [[nodiscard]] static inline std::wstring GetSystemErrorMessage(const DWORD dwError)
@@ -233,6 +480,7 @@ static inline void PrintError(const std::wstring_view message)
     if (message.empty()) {
         return;
     }
+    EmitEvent("error", { { "message", message } });
     PrintToConsole(message, ConsoleTextColor::Red, true);
 }
 
@@ -241,7 +489,8 @@ static inline void PrintError(const std::wstring_view name, const DWORD dwError)
     if (name.empty() || (dwError == ERROR_SUCCESS)) {
         return;
     }
-    PrintError(L"Function \"" + std::wstring(name) + L"\" failed with error message: " + GetSystemErrorMessage(dwError));
+    EmitEvent("error", { { "function", name }, { "code", uint32_t(dwError) } });
+    PrintToConsole(L"Function \"" + std::wstring(name) + L"\" failed with error message: " + GetSystemErrorMessage(dwError), ConsoleTextColor::Red, true);
 }
 
 static inline void PrintInfo(const std::wstring_view message)
@@ -262,6 +511,7 @@ static inline void PrintSuccess(const std::wstring_view message)
 
 [[nodiscard]] static inline bool IsInternetAvailable()
 {
+    const TraceSpan span("IsInternetAvailable");
     Microsoft::WRL::ComPtr<IUnknown> pUnknown = nullptr;
     HRESULT hr = ::CoCreateInstance(CLSID_NetworkListManager, nullptr, CLSCTX_ALL, IID_PPV_ARGS(pUnknown.GetAddressOf()));
     if (FAILED(hr)) {
@@ -296,296 +546,2860 @@ static inline void PrintSuccess(const std::wstring_view message)
 #endif
 }
 
-static inline void UpdateMicrosoftStoreApps()
+[[nodiscard]] static inline std::wstring Utf8ToUtf16(const std::string_view text)
 {
-    static const bool win10 = ::IsWindows10OrGreater();
-    if (!win10) {
-        return;
+    if (text.empty()) {
+        return {};
+    }
+    const int length = ::MultiByteToWideChar(CP_UTF8, 0, text.data(), int(text.size()), nullptr, 0);
+    if (length <= 0) {
+        PrintError(L"MultiByteToWideChar", ::GetLastError());
+        return {};
+    }
+    std::wstring result(std::size_t(length), L'\0');
+    if (::MultiByteToWideChar(CP_UTF8, 0, text.data(), int(text.size()), result.data(), length) <= 0) {
+        PrintError(L"MultiByteToWideChar", ::GetLastError());
+        return {};
     }
+    return result;
+}
 
-    PrintToConsole(L"Start updating Microsoft Store applications ......", ConsoleTextColor::Cyan, false);
+[[nodiscard]] static inline std::vector<std::wstring> SplitList(const std::wstring_view text)
+{
+    std::vector<std::wstring> result = {};
+    std::size_t begin = 0;
+    while (begin <= text.size()) {
+        const std::size_t end = std::min(text.find_first_of(L",;", begin), text.size());
+        if (end > begin) {
+            result.emplace_back(text.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+    return result;
+}
 
-    while (true) {
-        std::vector<HANDLE> completeSignals = {};
+enum class ProgressSource : uint8_t
+{
+    Store,
+    Windows
+};
 
-        winrt::Windows::ApplicationModel::Store::Preview::InstallControl::AppInstallManager appInstallManager = {};
-        const winrt::Windows::Foundation::Collections::IVectorView<winrt::Windows::ApplicationModel::Store::Preview::InstallControl::AppInstallItem> updateList = appInstallManager.SearchForAllUpdatesAsync().get();
+// The Store and Windows paths may run at the same time, the console title shows the
+// latest status of both.
+class ProgressBoard
+{
+public:
+    [[nodiscard]] static inline ProgressBoard &instance()
+    {
+        static ProgressBoard board = {};
+        return board;
+    }
 
-        const uint32_t count = updateList.Size();
-        if (count < 1) {
-            break;
+    inline void update(const ProgressSource source, const std::wstring_view status)
+    {
+        const std::scoped_lock lock(m_mutex);
+        m_status.at(std::size_t(source)) = status;
+        std::wstring title = {};
+        for (auto &&text : std::as_const(m_status)) {
+            if (text.empty()) {
+                continue;
+            }
+            if (!title.empty()) {
+                title += L"  |  ";
+            }
+            title += text;
         }
+        SetTitle(title);
+    }
 
-        for (auto &&update : std::as_const(updateList)) {
-            const std::wstring message = std::wstring(L"Updating ") + update.PackageFamilyName().c_str() + std::wstring(L" ......");
-            PrintInfo(message);
+private:
+    std::mutex m_mutex;
+    std::array<std::wstring, 2> m_status = {};
+};
 
-            const HANDLE completeSignal = ::CreateEventExW(nullptr, nullptr, 0, EVENT_ALL_ACCESS);
-            if (!completeSignal) {
-                PrintError(L"CreateEventExW", ::GetLastError());
-                return;
-            }
+class ConsoleReporter final : public UpdateReporter
+{
+public:
+    explicit ConsoleReporter(const ProgressSource source = ProgressSource::Windows) : m_source(source)
+    {
+    }
 
-            completeSignals.push_back(completeSignal);
+    ~ConsoleReporter() override = default;
 
-            update.Completed([completeSignal](winrt::Windows::ApplicationModel::Store::Preview::InstallControl::AppInstallItem const &sender, winrt::Windows::Foundation::IInspectable const &args){
-                UNREFERENCED_PARAMETER(args);
+    inline void info(const std::wstring_view message) override
+    {
+        PrintInfo(message);
+    }
 
-                const std::wstring message = sender.PackageFamilyName().c_str() + std::wstring(L" has been successfully updated.");
-                PrintSuccess(message);
+    inline void success(const std::wstring_view message) override
+    {
+        PrintSuccess(message);
+    }
 
-                if (::SetEvent(completeSignal) == FALSE) {
-                    PrintError(L"SetEvent", ::GetLastError());
-                }
-            });
+    inline void error(const std::wstring_view message, const int32_t code) override
+    {
+        if (code == 0) {
+            PrintError(message);
+            return;
+        }
+        PrintError(std::wstring(message) + L": " + GetSystemErrorMessage(DWORD(code)));
+    }
 
-            update.StatusChanged([](winrt::Windows::ApplicationModel::Store::Preview::InstallControl::AppInstallItem const &sender, winrt::Windows::Foundation::IInspectable const &args){
-                UNREFERENCED_PARAMETER(args);
+    inline void progress(const std::wstring_view status) override
+    {
+        ProgressBoard::instance().update(m_source, status);
+    }
 
-                const std::wstring title = std::wstring(L"Downloading ") + sender.PackageFamilyName().c_str() + std::wstring(L": ") + std::to_wstring(sender.GetCurrentStatus().PercentComplete()) + L'%';
-                if (::SetConsoleTitleW(title.c_str()) == FALSE) {
-                    PrintError(L"SetConsoleTitleW", ::GetLastError());
-                }
-            });
-        }
+private:
+    ProgressSource m_source = ProgressSource::Windows;
+};
 
-        if (completeSignals.empty()) {
-            break;
-        } else {
-            if (::WaitForMultipleObjectsEx(DWORD(completeSignals.size()), completeSignals.data(), TRUE, INFINITE, FALSE) == WAIT_FAILED) {
-                PrintError(L"WaitForMultipleObjectsEx", ::GetLastError());
+namespace InstallControl = winrt::Windows::ApplicationModel::Store::Preview::InstallControl;
+
+// Drives the Store install queue through "AppInstallManager". Everything a search returns
+// starts on its own right away. "Completed" may fire on any thread, it only queues the index.
+// Every search gets a new completion queue, so late notifications from the items of an
+// earlier search can't be mistaken for the current ones. With a watchdog, the searches and
+// every item that got a slot are cancelled once they run out of time, that's reported as
+// an ordinary completion.
+class InstallControlStoreBackend final : public StoreBackend
+{
+public:
+    InstallControlStoreBackend() = default;
+    ~InstallControlStoreBackend() override = default;
+
+    inline void setProgressHandler(ProgressHandler handler) override
+    {
+        m_progressHandler = std::move(handler);
+    }
+
+    // Only for the duration of one run.
+    inline void setWatchdog(Watchdog *watchdog)
+    {
+        m_watchdog = watchdog;
+    }
+
+    [[nodiscard]] inline bool searchAll(std::vector<StoreItemDescriptor> &items) override
+    {
+        Watchdog::Ticket ticket = 0;
+        try {
+            const winrt::Windows::Foundation::IAsyncOperation<winrt::Windows::Foundation::Collections::IVectorView<InstallControl::AppInstallItem>> search = m_appInstallManager.SearchForAllUpdatesAsync();
+            ticket = watch(WatchedPhase::Search, L"Microsoft Store updates", [search](){ search.Cancel(); });
+            const winrt::Windows::Foundation::Collections::IVectorView<InstallControl::AppInstallItem> updateList = search.get();
+            unwatch(ticket);
+            std::vector<InstallControl::AppInstallItem> found = {};
+            found.reserve(updateList.Size());
+            for (auto &&update : std::as_const(updateList)) {
+                found.push_back(update);
             }
+            attach(std::move(found), items);
+        } catch (const winrt::hresult_error &error) {
+            unwatch(ticket);
+            if (!isCancelled()) {
+                PrintError(L"AppInstallManager::SearchForAllUpdatesAsync", HRESULT_CODE(error.code().value));
+            }
+            return false;
+        }
+        return true;
+    }
 
-            for (auto &&signal : std::as_const(completeSignals)) {
-                if (::CloseHandle(signal) == FALSE) {
-                    PrintError(L"CloseHandle", ::GetLastError());
+    [[nodiscard]] inline bool searchProducts(const std::vector<std::wstring> &productIds, std::vector<StoreItemDescriptor> &items) override
+    {
+        Watchdog::Ticket ticket = 0;
+        try {
+            std::vector<winrt::Windows::Foundation::IAsyncOperation<InstallControl::AppInstallItem>> searches = {};
+            searches.reserve(productIds.size());
+            for (auto &&productId : std::as_const(productIds)) {
+                searches.push_back(m_appInstallManager.SearchForUpdatesAsync(winrt::hstring(productId), {}));
+            }
+            // They all run at the same time, so they share one budget.
+            ticket = watch(WatchedPhase::Search, L"Microsoft Store updates", [searches](){
+                for (auto &&search : std::as_const(searches)) {
+                    search.Cancel();
+                }
+            });
+            std::vector<InstallControl::AppInstallItem> found = {};
+            for (auto &&search : std::as_const(searches)) {
+                if (const InstallControl::AppInstallItem update = search.get()) {
+                    found.push_back(update);
                 }
             }
+            unwatch(ticket);
+            attach(std::move(found), items);
+        } catch (const winrt::hresult_error &error) {
+            unwatch(ticket);
+            if (!isCancelled()) {
+                PrintError(L"AppInstallManager::SearchForUpdatesAsync", HRESULT_CODE(error.code().value));
+            }
+            return false;
         }
+        return true;
     }
 
-    PrintSuccess(L"All your Microsoft Store applications are update to date!");
-}
-
-static inline void UpdateSystem()
-{
-    PrintToConsole(L"Start updating Windows ......", ConsoleTextColor::Cyan, false);
+    inline void pause(const std::size_t index) override
+    {
+        m_items.at(index).Pause();
+    }
 
-    [[maybe_unused]] static const bool win10 = ::IsWindows10OrGreater();
+    inline void cancel(const std::size_t index) override
+    {
+        m_items.at(index).Cancel();
+    }
 
-    while (true) {
-#if 0
-        Microsoft::WRL::ComPtr<IAutomaticUpdates2> pAutomaticUpdates = nullptr;
-        HRESULT hr = ::CoCreateInstance(CLSID_AutomaticUpdates, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(pAutomaticUpdates.GetAddressOf()));
-        if (FAILED(hr)) {
-            PrintError(L"CoCreateInstance", HRESULT_CODE(hr));
-            return;
+    [[nodiscard]] inline bool start(const std::size_t index) override
+    {
+        // Whatever is still held back would stay paused in the store's queue forever.
+        if (isCancelled()) {
+            m_items.at(index).Cancel();
+            return false;
         }
-#if 0 // "EnableService()" always fail, don't know why.
-        hr = pAutomaticUpdates->EnableService();
-        if (FAILED(hr)) {
-            PrintError(L"IAutomaticUpdates2::EnableService", HRESULT_CODE(hr));
-            return;
+        {
+            const InstallControl::AppInstallItem item = m_items.at(index);
+            const Watchdog::Ticket ticket = watch(WatchedPhase::Store, std::wstring(item.PackageFamilyName()), [item](){ item.Cancel(); });
+            const std::scoped_lock lock(m_ticketMutex);
+            m_tickets.at(index) = ticket;
         }
-#endif
-        Microsoft::WRL::ComPtr<IAutomaticUpdatesSettings3> pAutomaticUpdatesSettings = nullptr;
-        hr = pAutomaticUpdates->get_Settings(reinterpret_cast<IAutomaticUpdatesSettings **>(pAutomaticUpdatesSettings.GetAddressOf()));
-        if (FAILED(hr)) {
-            PrintError(L"IAutomaticUpdates2::get_Settings", HRESULT_CODE(hr));
-            return;
+        switch (state(index)) {
+        case StoreItemState::Paused:
+            m_items.at(index).Restart();
+            break;
+        case StoreItemState::Completed:
+        case StoreItemState::Canceled:
+        case StoreItemState::Error:
+            // Finished before it got its slot, "Completed" may have fired already.
+            m_completionQueue->post(index);
+            break;
+        default:
+            break;
         }
-        hr = pAutomaticUpdatesSettings->Refresh();
-        if (FAILED(hr)) {
-            PrintError(L"IAutomaticUpdatesSettings3::Refresh", HRESULT_CODE(hr));
-            return;
+        return true;
+    }
+
+    [[nodiscard]] inline StoreItemState state(const std::size_t index) const override
+    {
+        switch (m_items.at(index).GetCurrentStatus().InstallState()) {
+        case InstallControl::AppInstallState::Paused:
+        case InstallControl::AppInstallState::PausedLowBattery:
+        case InstallControl::AppInstallState::PausedWiFiRecommended:
+        case InstallControl::AppInstallState::PausedWiFiRequired:
+            return StoreItemState::Paused;
+        case InstallControl::AppInstallState::Pending:
+        case InstallControl::AppInstallState::ReadyToDownload:
+            return StoreItemState::Queued;
+        case InstallControl::AppInstallState::Completed:
+            return StoreItemState::Completed;
+        case InstallControl::AppInstallState::Canceled:
+            return StoreItemState::Canceled;
+        case InstallControl::AppInstallState::Error:
+            return StoreItemState::Error;
+        default:
+            return StoreItemState::Running;
         }
-        hr = pAutomaticUpdatesSettings->put_NotificationLevel(aunlScheduledInstallation);
-        if (FAILED(hr)) {
-            PrintError(L"IAutomaticUpdatesSettings3::put_NotificationLevel", HRESULT_CODE(hr));
-            return;
+    }
+
+    [[nodiscard]] inline int32_t errorCode(const std::size_t index) const override
+    {
+        return int32_t(m_items.at(index).GetCurrentStatus().ErrorCode().value);
+    }
+
+    [[nodiscard]] inline bool waitForCompletion(std::size_t &index) override
+    {
+        index = m_completionQueue->wait();
+        Watchdog::Ticket ticket = 0;
+        {
+            const std::scoped_lock lock(m_ticketMutex);
+            if (index < m_tickets.size()) {
+                ticket = std::exchange(m_tickets.at(index), 0);
+            }
         }
-        hr = pAutomaticUpdatesSettings->put_IncludeRecommendedUpdates(VARIANT_TRUE);
-        if (FAILED(hr)) {
-            PrintError(L"IAutomaticUpdatesSettings3::put_IncludeRecommendedUpdates", HRESULT_CODE(hr));
-            return;
+        unwatch(ticket);
+        return true;
+    }
+
+private:
+    [[nodiscard]] inline bool isCancelled() const
+    {
+        return (m_watchdog && m_watchdog->token().isCancelled());
+    }
+
+    [[nodiscard]] inline Watchdog::Ticket watch(const WatchedPhase phase, std::wstring what, Watchdog::AbortHandler abort)
+    {
+        if (!m_watchdog) {
+            return 0;
         }
-        hr = pAutomaticUpdatesSettings->put_FeaturedUpdatesEnabled(VARIANT_TRUE);
-        if (FAILED(hr)) {
-            PrintError(L"IAutomaticUpdatesSettings3::put_FeaturedUpdatesEnabled", HRESULT_CODE(hr));
-            return;
+        const Watchdog::Ticket ticket = m_watchdog->watch(phase, std::move(what));
+        m_watchdog->arm(ticket, std::move(abort));
+        return ticket;
+    }
+
+    inline void unwatch(const Watchdog::Ticket ticket)
+    {
+        if (m_watchdog && (ticket > 0)) {
+            m_watchdog->finish(ticket);
         }
-        hr = pAutomaticUpdatesSettings->put_NonAdministratorsElevated(VARIANT_TRUE);
-        if (FAILED(hr)) {
-            PrintError(L"IAutomaticUpdatesSettings3::put_NonAdministratorsElevated", HRESULT_CODE(hr));
-            return;
+    }
+
+    inline void attach(std::vector<InstallControl::AppInstallItem> &&found, std::vector<StoreItemDescriptor> &items)
+    {
+        m_completionQueue = std::make_shared<CompletionQueue>();
+        {
+            const std::scoped_lock lock(m_ticketMutex);
+            m_tickets.assign(found.size(), 0);
         }
-        hr = pAutomaticUpdatesSettings->Save();
-        if (FAILED(hr)) {
+        items.clear();
+        items.reserve(found.size());
+        for (std::size_t index = 0; index != found.size(); ++index) {
+            InstallControl::AppInstallItem &update = found.at(index);
+            // Usually only known once the download began, the planner copes with 0.
+            items.push_back(StoreItemDescriptor{ update.ProductId().c_str(), update.PackageFamilyName().c_str(), update.GetCurrentStatus().DownloadSizeInBytes() });
+
+            update.Completed([completionQueue = m_completionQueue, index](InstallControl::AppInstallItem const &sender, winrt::Windows::Foundation::IInspectable const &args){
+                UNREFERENCED_PARAMETER(args);
+                UNREFERENCED_PARAMETER(sender);
+                completionQueue->post(index);
+            });
+
+            update.StatusChanged([this, index](InstallControl::AppInstallItem const &sender, winrt::Windows::Foundation::IInspectable const &args){
+                UNREFERENCED_PARAMETER(args);
+
+                if (m_watchdog) {
+                    const std::scoped_lock lock(m_ticketMutex);
+                    if ((index < m_tickets.size()) && (m_tickets.at(index) > 0)) {
+                        m_watchdog->progress(m_tickets.at(index));
+                    }
+                }
+                if (m_progressHandler) {
+                    m_progressHandler(index, sender.PackageFamilyName(), sender.GetCurrentStatus().PercentComplete());
+                }
+            });
+        }
+        m_items = std::move(found);
+    }
+
+    InstallControl::AppInstallManager m_appInstallManager = {};
+    std::vector<InstallControl::AppInstallItem> m_items = {};
+    std::shared_ptr<CompletionQueue> m_completionQueue = std::make_shared<CompletionQueue>();
+    ProgressHandler m_progressHandler = nullptr;
+    Watchdog *m_watchdog = nullptr;
+    std::mutex m_ticketMutex;
+    std::vector<Watchdog::Ticket> m_tickets = {}; // By item, 0 while it's not watched.
+};
+
+// "storeBackend" is created on first use and kept, whoever owns it decides how long it stays warm.
+[[nodiscard]] static inline bool UpdateMicrosoftStoreApps(std::optional<InstallControlStoreBackend> &storeBackend, const UpdateOptions &options, SessionRecorder *recorder, Watchdog *watchdog, ThroughputHistory *history)
+{
+    static const bool win10 = ::IsWindows10OrGreater();
+    if (!win10) {
+        return true;
+    }
+
+    PrintToConsole(L"Start updating Microsoft Store applications ......", ConsoleTextColor::Cyan, false);
+
+    if (!storeBackend) {
+        storeBackend.emplace();
+    }
+    std::unique_ptr<RecordingStoreBackend> recordingBackend = {};
+    if (recorder) {
+        recorder->target(SessionTarget::Store, options, {}, {});
+        recordingBackend = std::make_unique<RecordingStoreBackend>(*storeBackend, *recorder);
+    }
+    StoreBackend &backend = (recordingBackend ? static_cast<StoreBackend &>(*recordingBackend) : *storeBackend);
+    ConsoleReporter reporter(ProgressSource::Store);
+    StoreUpdater updater(backend, reporter, options);
+    storeBackend->setWatchdog(watchdog);
+    updater.setCancellationToken(watchdog ? &watchdog->token() : nullptr);
+    updater.setThroughputHistory(history);
+    const bool succeeded = updater.run();
+    storeBackend->setWatchdog(nullptr);
+    return succeeded;
+}
+
+[[nodiscard]] static inline uint64_t DecimalToUInt64(const DECIMAL &value)
+{
+    ULONG64 result = 0;
+    if (FAILED(::VarUI8FromDec(&value, &result))) {
+        return 0;
+    }
+    return result;
+}
+
+template <typename Interface, typename Job, typename Args>
+class WuaJobCallback final : public Microsoft::WRL::RuntimeClass<Microsoft::WRL::RuntimeClassFlags<Microsoft::WRL::ClassicCom>, Interface>
+{
+public:
+    using Handler = std::function<void(Job *, Args *)>;
+
+    explicit WuaJobCallback(Handler handler) : m_handler(std::move(handler))
+    {
+    }
+
+    ~WuaJobCallback() override = default;
+
+    HRESULT STDMETHODCALLTYPE Invoke(Job *job, Args *args) override
+    {
+        if (m_handler) {
+            m_handler(job, args);
+        }
+        return S_OK;
+    }
+
+private:
+    Handler m_handler = nullptr;
+};
+
+using DownloadProgressChangedCallback = WuaJobCallback<IDownloadProgressChangedCallback, IDownloadJob, IDownloadProgressChangedCallbackArgs>;
+using DownloadCompletedCallback = WuaJobCallback<IDownloadCompletedCallback, IDownloadJob, IDownloadCompletedCallbackArgs>;
+using InstallationProgressChangedCallback = WuaJobCallback<IInstallationProgressChangedCallback, IInstallationJob, IInstallationProgressChangedCallbackArgs>;
+using InstallationCompletedCallback = WuaJobCallback<IInstallationCompletedCallback, IInstallationJob, IInstallationCompletedCallbackArgs>;
+using SearchCompletedCallback = WuaJobCallback<ISearchCompletedCallback, ISearchJob, ISearchCompletedCallbackArgs>;
+
+[[nodiscard]] static inline bool GetUpdateIdentity(IUpdate *update, std::wstring &id, LONG &revision)
+{
+    Microsoft::WRL::ComPtr<IUpdateIdentity> pUpdateIdentity = nullptr;
+    HRESULT hr = update->get_Identity(pUpdateIdentity.GetAddressOf());
+    if (FAILED(hr)) {
+        PrintError(L"IUpdate::get_Identity", HRESULT_CODE(hr));
+        return false;
+    }
+    ScopedBSTR updateId = {};
+    hr = pUpdateIdentity->get_UpdateID(updateId.address());
+    if (FAILED(hr)) {
+        PrintError(L"IUpdateIdentity::get_UpdateID", HRESULT_CODE(hr));
+        return false;
+    }
+    hr = pUpdateIdentity->get_RevisionNumber(&revision);
+    if (FAILED(hr)) {
+        PrintError(L"IUpdateIdentity::get_RevisionNumber", HRESULT_CODE(hr));
+        return false;
+    }
+    id = updateId.toString();
+    return true;
+}
+
+[[nodiscard]] static inline bool GetUpdateDescriptor(IUpdate *update, UpdateDescriptor &descriptor)
+{
+    LONG revision = 0;
+    if (!GetUpdateIdentity(update, descriptor.id, revision)) {
+        return false;
+    }
+    descriptor.revision = int32_t(revision);
+    ScopedBSTR title = {};
+    HRESULT hr = update->get_Title(title.address());
+    if (FAILED(hr)) {
+        PrintError(L"IUpdate::get_Title", HRESULT_CODE(hr));
+        return false;
+    }
+    descriptor.title = title.toString();
+    DECIMAL maxDownloadSize = {};
+    hr = update->get_MaxDownloadSize(&maxDownloadSize);
+    if (FAILED(hr)) {
+        PrintError(L"IUpdate::get_MaxDownloadSize", HRESULT_CODE(hr));
+        return false;
+    }
+    descriptor.maxDownloadSize = DecimalToUInt64(maxDownloadSize);
+    VARIANT_BOOL downloaded = VARIANT_FALSE;
+    hr = update->get_IsDownloaded(&downloaded);
+    if (FAILED(hr)) {
+        PrintError(L"IUpdate::get_IsDownloaded", HRESULT_CODE(hr));
+        return false;
+    }
+    descriptor.downloaded = (downloaded != VARIANT_FALSE);
+    ScopedBSTR severity = {};
+    hr = update->get_MsrcSeverity(severity.address());
+    if (FAILED(hr)) {
+        PrintError(L"IUpdate::get_MsrcSeverity", HRESULT_CODE(hr));
+        return false;
+    }
+    descriptor.severity = ParseMsrcSeverity(severity.toString());
+    Microsoft::WRL::ComPtr<IStringCollection> pKBArticleIDs = nullptr;
+    hr = update->get_KBArticleIDs(pKBArticleIDs.GetAddressOf());
+    if (FAILED(hr)) {
+        PrintError(L"IUpdate::get_KBArticleIDs", HRESULT_CODE(hr));
+        return false;
+    }
+    descriptor.kb = 0;
+    LONG kbCount = 0;
+    if (SUCCEEDED(pKBArticleIDs->get_Count(&kbCount)) && (kbCount > 0)) {
+        ScopedBSTR kb = {};
+        if (SUCCEEDED(pKBArticleIDs->get_Item(0, kb.address())) && kb) {
+            descriptor.kb = uint32_t(std::wcstoul(kb.data(), nullptr, 10));
+        }
+    }
+    ::UpdateType type = utSoftware;
+    hr = update->get_Type(&type);
+    if (FAILED(hr)) {
+        PrintError(L"IUpdate::get_Type", HRESULT_CODE(hr));
+        return false;
+    }
+    descriptor.type = ((type == utDriver) ? UpdateType::Driver : UpdateType::Software);
+    Microsoft::WRL::ComPtr<IInstallationBehavior> pInstallationBehavior = nullptr;
+    hr = update->get_InstallationBehavior(pInstallationBehavior.GetAddressOf());
+    if (FAILED(hr)) {
+        PrintError(L"IUpdate::get_InstallationBehavior", HRESULT_CODE(hr));
+        return false;
+    }
+    InstallationImpact impact = iiNormal;
+    hr = pInstallationBehavior->get_Impact(&impact);
+    if (FAILED(hr)) {
+        PrintError(L"IInstallationBehavior::get_Impact", HRESULT_CODE(hr));
+        return false;
+    }
+    descriptor.impact = InstallImpact(impact);
+    InstallationRebootBehavior rebootBehavior = irbNeverReboots;
+    hr = pInstallationBehavior->get_RebootBehavior(&rebootBehavior);
+    if (FAILED(hr)) {
+        PrintError(L"IInstallationBehavior::get_RebootBehavior", HRESULT_CODE(hr));
+        return false;
+    }
+    descriptor.rebootBehavior = RebootBehavior(rebootBehavior);
+    VARIANT_BOOL canRequestUserInput = VARIANT_FALSE;
+    hr = pInstallationBehavior->get_CanRequestUserInput(&canRequestUserInput);
+    if (FAILED(hr)) {
+        PrintError(L"IInstallationBehavior::get_CanRequestUserInput", HRESULT_CODE(hr));
+        return false;
+    }
+    descriptor.canRequestUserInput = (canRequestUserInput != VARIANT_FALSE);
+    Microsoft::WRL::ComPtr<ICategoryCollection> pCategories = nullptr;
+    hr = update->get_Categories(pCategories.GetAddressOf());
+    if (FAILED(hr)) {
+        PrintError(L"IUpdate::get_Categories", HRESULT_CODE(hr));
+        return false;
+    }
+    descriptor.categories.clear();
+    LONG categoryCount = 0;
+    if (SUCCEEDED(pCategories->get_Count(&categoryCount))) {
+        for (LONG index = 0; index != categoryCount; ++index) {
+            Microsoft::WRL::ComPtr<ICategory> pCategory = nullptr;
+            ScopedBSTR categoryId = {};
+            UpdateGuid guid = {};
+            if (SUCCEEDED(pCategories->get_Item(index, pCategory.GetAddressOf())) && SUCCEEDED(pCategory->get_CategoryID(categoryId.address())) && categoryId && ParseUpdateGuid(categoryId.data(), guid)) {
+                descriptor.categories.push_back(FormatUpdateGuid(guid));
+            }
+        }
+    }
+    return true;
+}
+
+// Drives "SystemUpdater" with WUA, downloads and installs go through "BeginDownload()" and
+// "BeginInstall()". Every update gets its own single item collection and a downloader of its
+// own while it downloads, the installer is shared because WUA only installs one batch at a
+// time anyway. The completion callbacks may arrive on any thread, they only queue the
+// finished index, the "End*()" calls happen in "waitForCompletion()". Searches are
+// asynchronous as well, so that a watchdog can abort every job through "RequestAbort()",
+// which completes it as aborted.
+class WuaUpdateBackend final : public SystemUpdateBackend, public HistorySource
+{
+public:
+    WuaUpdateBackend()
+    {
+        m_completedEvent = ::CreateEventExW(nullptr, nullptr, 0, EVENT_ALL_ACCESS);
+        if (!m_completedEvent) {
+            PrintError(L"CreateEventExW", ::GetLastError());
+        }
+    }
+
+    ~WuaUpdateBackend() override
+    {
+        setWatchdog(nullptr);
+        if (m_completedEvent) {
+            if (::CloseHandle(m_completedEvent) == FALSE) {
+                PrintError(L"CloseHandle", ::GetLastError());
+            }
+            m_completedEvent = nullptr;
+        }
+    }
+
+    // Everything created here lives as long as the backend, one instance can serve any
+    // number of runs without paying for the COM activation and the session setup again.
+    [[nodiscard]] inline bool initialize()
+    {
+        if (!m_completedEvent) {
+            return false;
+        }
+        if (isInitialized()) {
+            return true;
+        }
+        const TraceSpan span("CreateSession");
+#if 0
+        Microsoft::WRL::ComPtr<IAutomaticUpdates2> pAutomaticUpdates = nullptr;
+        HRESULT hr = ::CoCreateInstance(CLSID_AutomaticUpdates, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(pAutomaticUpdates.GetAddressOf()));
+        if (FAILED(hr)) {
+            PrintError(L"CoCreateInstance", HRESULT_CODE(hr));
+            return false;
+        }
+#if 0 // "EnableService()" always fail, don't know why.
+        hr = pAutomaticUpdates->EnableService();
+        if (FAILED(hr)) {
+            PrintError(L"IAutomaticUpdates2::EnableService", HRESULT_CODE(hr));
+            return false;
+        }
+#endif
+        Microsoft::WRL::ComPtr<IAutomaticUpdatesSettings3> pAutomaticUpdatesSettings = nullptr;
+        hr = pAutomaticUpdates->get_Settings(reinterpret_cast<IAutomaticUpdatesSettings **>(pAutomaticUpdatesSettings.GetAddressOf()));
+        if (FAILED(hr)) {
+            PrintError(L"IAutomaticUpdates2::get_Settings", HRESULT_CODE(hr));
+            return false;
+        }
+        hr = pAutomaticUpdatesSettings->Refresh();
+        if (FAILED(hr)) {
+            PrintError(L"IAutomaticUpdatesSettings3::Refresh", HRESULT_CODE(hr));
+            return false;
+        }
+        hr = pAutomaticUpdatesSettings->put_NotificationLevel(aunlScheduledInstallation);
+        if (FAILED(hr)) {
+            PrintError(L"IAutomaticUpdatesSettings3::put_NotificationLevel", HRESULT_CODE(hr));
+            return false;
+        }
+        hr = pAutomaticUpdatesSettings->put_IncludeRecommendedUpdates(VARIANT_TRUE);
+        if (FAILED(hr)) {
+            PrintError(L"IAutomaticUpdatesSettings3::put_IncludeRecommendedUpdates", HRESULT_CODE(hr));
+            return false;
+        }
+        hr = pAutomaticUpdatesSettings->put_FeaturedUpdatesEnabled(VARIANT_TRUE);
+        if (FAILED(hr)) {
+            PrintError(L"IAutomaticUpdatesSettings3::put_FeaturedUpdatesEnabled", HRESULT_CODE(hr));
+            return false;
+        }
+        hr = pAutomaticUpdatesSettings->put_NonAdministratorsElevated(VARIANT_TRUE);
+        if (FAILED(hr)) {
+            PrintError(L"IAutomaticUpdatesSettings3::put_NonAdministratorsElevated", HRESULT_CODE(hr));
+            return false;
+        }
+        hr = pAutomaticUpdatesSettings->Save();
+        if (FAILED(hr)) {
             PrintError(L"IAutomaticUpdatesSettings3::Save", HRESULT_CODE(hr));
-            return;
+            return false;
         }
         hr = pAutomaticUpdates->DetectNow();
         if (FAILED(hr)) {
             PrintError(L"IAutomaticUpdates2::DetectNow", HRESULT_CODE(hr));
-            return;
+            return false;
+        }
+        Microsoft::WRL::ComPtr<IAutomaticUpdatesResults> pAutomaticUpdatesResults = nullptr;
+        hr = pAutomaticUpdates->get_Results(pAutomaticUpdatesResults.GetAddressOf());
+        if (FAILED(hr)) {
+            PrintError(L"IAutomaticUpdates2::get_Results", HRESULT_CODE(hr));
+            return false;
+        }
+#endif
+        HRESULT hr = ::CoCreateInstance(CLSID_UpdateSession, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(m_session.ReleaseAndGetAddressOf()));
+        if (FAILED(hr)) {
+            PrintError(L"CoCreateInstance", HRESULT_CODE(hr));
+            return false;
+        }
+        const ScopedBSTR appId(kAppName);
+        hr = m_session->put_ClientApplicationID(appId);
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateSession3::put_ClientApplicationID", HRESULT_CODE(hr));
+            return false;
+        }
+        hr = m_session->CreateUpdateSearcher(reinterpret_cast<IUpdateSearcher **>(m_searcher.ReleaseAndGetAddressOf()));
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateSession3::CreateUpdateSearcher", HRESULT_CODE(hr));
+            return false;
+        }
+#if 0 // "put_CanAutomaticallyUpgradeService()" always fail, don't know why.
+        hr = m_searcher->put_CanAutomaticallyUpgradeService(VARIANT_TRUE);
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateSearcher3::put_CanAutomaticallyUpgradeService", HRESULT_CODE(hr));
+            return false;
+        }
+#endif
+        hr = m_searcher->put_ServerSelection(ssWindowsUpdate);
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateSearcher3::put_ServerSelection", HRESULT_CODE(hr));
+            return false;
+        }
+        hr = m_searcher->put_IncludePotentiallySupersededUpdates(VARIANT_FALSE);
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateSearcher3::put_IncludePotentiallySupersededUpdates", HRESULT_CODE(hr));
+            return false;
+        }
+        // Only ever installs one update at a time, "beginInstall()" hands it the update.
+        hr = m_session->CreateUpdateInstaller(reinterpret_cast<IUpdateInstaller **>(m_installer.ReleaseAndGetAddressOf()));
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateSession3::CreateUpdateInstaller", HRESULT_CODE(hr));
+            return false;
+        }
+        hr = m_installer->put_ForceQuiet(VARIANT_TRUE);
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateInstaller4::put_ForceQuiet", HRESULT_CODE(hr));
+            return false;
+        }
+        if (m_win10) {
+            hr = m_installer->put_AttemptCloseAppsIfNecessary(VARIANT_TRUE);
+            if (FAILED(hr)) {
+                PrintError(L"IUpdateInstaller4::put_AttemptCloseAppsIfNecessary", HRESULT_CODE(hr));
+                return false;
+            }
+        }
+        m_initialized = true;
+        return true;
+    }
+
+    [[nodiscard]] inline bool isInitialized() const
+    {
+        return m_initialized;
+    }
+
+    // An empty "serviceId" searches Windows Update itself, anything else has to be a service
+    // registered with WUA already, such as an offline scan package.
+    [[nodiscard]] inline bool setSearchService(const std::wstring &serviceId)
+    {
+        HRESULT hr = m_searcher->put_ServerSelection(serviceId.empty() ? ssWindowsUpdate : ssOthers);
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateSearcher3::put_ServerSelection", HRESULT_CODE(hr));
+            return false;
+        }
+        if (serviceId.empty()) {
+            return true;
+        }
+        const ScopedBSTR id(serviceId.c_str());
+        hr = m_searcher->put_ServiceID(id);
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateSearcher3::put_ServiceID", HRESULT_CODE(hr));
+            return false;
+        }
+        return true;
+    }
+
+    inline void setProgressHandler(ProgressHandler handler) override
+    {
+        m_progressHandler = std::move(handler);
+    }
+
+    // Only for the duration of one run. A cancelled run wakes up "backOff()" right away.
+    inline void setWatchdog(Watchdog *watchdog)
+    {
+        if (m_watchdog) {
+            m_watchdog->token().unsubscribe(m_subscription);
+        }
+        m_watchdog = watchdog;
+        m_subscription = 0;
+        if (m_watchdog && m_completedEvent) {
+            m_subscription = m_watchdog->token().subscribe([this](){
+                if (::SetEvent(m_completedEvent) == FALSE) {
+                    PrintError(L"SetEvent", ::GetLastError());
+                }
+            });
+        }
+    }
+
+    [[nodiscard]] inline bool search(const bool online, const std::wstring &criteria, std::vector<UpdateDescriptor> &updates) override
+    {
+        HRESULT hr = m_searcher->put_Online(online ? VARIANT_TRUE : VARIANT_FALSE);
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateSearcher3::put_Online", HRESULT_CODE(hr));
+            return false;
+        }
+        const ScopedBSTR criteriaString(criteria.c_str());
+        const auto onCompleted = Microsoft::WRL::Make<SearchCompletedCallback>([this](ISearchJob *, ISearchCompletedCallbackArgs *){
+            m_searchCompleted = true;
+            if (::SetEvent(m_completedEvent) == FALSE) {
+                PrintError(L"SetEvent", ::GetLastError());
+            }
+        });
+        m_searchCompleted = false;
+        const Watchdog::Ticket ticket = watch(WatchedPhase::Search, (online ? L"Windows updates online" : L"Windows updates offline"));
+        Microsoft::WRL::ComPtr<ISearchJob> pSearchJob = nullptr;
+        VARIANT state;
+        ::VariantInit(&state);
+        hr = m_searcher->BeginSearch(criteriaString, onCompleted.Get(), state, pSearchJob.GetAddressOf());
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateSearcher3::BeginSearch", HRESULT_CODE(hr));
+            unwatch(ticket);
+            return false;
+        }
+        arm(ticket, [pSearchJob](){
+            if (FAILED(pSearchJob->RequestAbort())) {
+                // ###
+            }
+        });
+        const bool completed = waitForEvent([this](){ return m_searchCompleted.load(); });
+        unwatch(ticket);
+        if (!completed) {
+            return false;
+        }
+        Microsoft::WRL::ComPtr<ISearchResult> pSearchResult = nullptr;
+        hr = m_searcher->EndSearch(pSearchJob.Get(), pSearchResult.GetAddressOf());
+        if (FAILED(pSearchJob->CleanUp())) {
+            // ###
+        }
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateSearcher3::EndSearch", HRESULT_CODE(hr));
+            return false;
+        }
+        OperationResultCode searchResultCode = orcNotStarted;
+        hr = pSearchResult->get_ResultCode(&searchResultCode);
+        if (FAILED(hr)) {
+            PrintError(L"ISearchResult::get_ResultCode", HRESULT_CODE(hr));
+            return false;
+        }
+        if (searchResultCode != orcSucceeded) {
+            return false;
+        }
+        hr = pSearchResult->get_Updates(m_candidates.ReleaseAndGetAddressOf());
+        if (FAILED(hr)) {
+            PrintError(L"ISearchResult::get_Updates", HRESULT_CODE(hr));
+            return false;
+        }
+        LONG count = 0;
+        hr = m_candidates->get_Count(&count);
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateCollection::get_Count", HRESULT_CODE(hr));
+            return false;
+        }
+        updates.clear();
+        updates.resize(std::size_t(std::max(count, LONG(0))));
+        const TraceSpan span("ExtractMetadata");
+        return extract(updates);
+    }
+
+    [[nodiscard]] inline bool select(const std::vector<std::size_t> &candidates) override
+    {
+        if (!m_candidates) {
+            return false;
+        }
+        HRESULT hr = ::CoCreateInstance(CLSID_UpdateCollection, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(m_updates.ReleaseAndGetAddressOf()));
+        if (FAILED(hr)) {
+            PrintError(L"CoCreateInstance", HRESULT_CODE(hr));
+            return false;
+        }
+        for (auto &&candidate : std::as_const(candidates)) {
+            Microsoft::WRL::ComPtr<IUpdate> pUpdate = nullptr;
+            hr = m_candidates->get_Item(LONG(candidate), pUpdate.GetAddressOf());
+            if (FAILED(hr)) {
+                PrintError(L"IUpdateCollection::get_Item", HRESULT_CODE(hr));
+                return false;
+            }
+            LONG newIndex = 0;
+            hr = m_updates->Add(pUpdate.Get(), &newIndex);
+            if (FAILED(hr)) {
+                PrintError(L"IUpdateCollection::Add", HRESULT_CODE(hr));
+                return false;
+            }
+        }
+        m_jobs.clear();
+        m_jobs.resize(candidates.size());
+        return true;
+    }
+
+    inline void prioritize(const std::size_t index, const DownloadPriority priority) override
+    {
+        if (index < m_jobs.size()) {
+            m_jobs.at(index).priority = priority;
+        }
+    }
+
+    // The payloads end up below "%SystemRoot%\SoftwareDistribution".
+    [[nodiscard]] inline uint64_t freeDiskSpace() override
+    {
+        wchar_t directory[MAX_PATH] = {};
+        if (::GetWindowsDirectoryW(directory, MAX_PATH) == 0) {
+            PrintError(L"GetWindowsDirectoryW", ::GetLastError());
+            return UINT64_MAX;
+        }
+        ULARGE_INTEGER available = {};
+        if (::GetDiskFreeSpaceExW(directory, &available, nullptr, nullptr) == FALSE) {
+            PrintError(L"GetDiskFreeSpaceExW", ::GetLastError());
+            return UINT64_MAX;
+        }
+        return uint64_t(available.QuadPart);
+    }
+
+    // Synchronous, there is nothing to abort. If it hangs the watchdog gives up on the process.
+    [[nodiscard]] inline bool commit() override
+    {
+        if (!m_win10) {
+            return true;
+        }
+        const Watchdog::Ticket ticket = watch(WatchedPhase::Commit, L"the installed Windows updates");
+        const HRESULT hr = m_installer->Commit(0);
+        unwatch(ticket);
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateInstaller4::Commit", HRESULT_CODE(hr));
+            return false;
+        }
+        return true;
+    }
+
+    // Nothing is in flight, so the completion event is only set by a cancelled run.
+    inline void backOff(const std::chrono::milliseconds delay) override
+    {
+        if (!m_completedEvent) {
+            ::Sleep(DWORD(delay.count()));
+            return;
+        }
+        if (::ResetEvent(m_completedEvent) == FALSE) {
+            PrintError(L"ResetEvent", ::GetLastError());
+        }
+        if (m_watchdog && m_watchdog->token().isCancelled()) {
+            return;
+        }
+        if (::WaitForSingleObject(m_completedEvent, DWORD(delay.count())) == WAIT_FAILED) {
+            PrintError(L"WaitForSingleObject", ::GetLastError());
+        }
+    }
+
+    [[nodiscard]] inline std::wstring title(const std::size_t index) const
+    {
+        Microsoft::WRL::ComPtr<IUpdate> pUpdate = nullptr;
+        if (FAILED(m_updates->get_Item(LONG(index), pUpdate.GetAddressOf()))) {
+            return {};
+        }
+        BSTR title = nullptr;
+        if (FAILED(pUpdate->get_Title(&title)) || !title) {
+            return {};
+        }
+        const std::wstring result(title);
+        ::SysFreeString(title);
+        return result;
+    }
+
+    [[nodiscard]] inline bool beginDownload(const std::size_t index) override
+    {
+        if (!m_completedEvent || (index >= m_jobs.size())) {
+            return false;
+        }
+        Microsoft::WRL::ComPtr<IUpdateCollection> pSingleUpdate = nullptr;
+        if (!makeSingleUpdateCollection(index, pSingleUpdate)) {
+            return false;
+        }
+        Job &job = m_jobs.at(index);
+        if (Tracer::instance().isEnabled()) {
+            job.downloadStart = Tracer::instance().now();
+        }
+        // A downloader runs one job at a time, finished ones are parked for the next download.
+        HRESULT hr = S_OK;
+        if (m_idleDownloaders.empty()) {
+            hr = m_session->CreateUpdateDownloader(job.downloader.ReleaseAndGetAddressOf());
+            if (FAILED(hr)) {
+                PrintError(L"IUpdateSession3::CreateUpdateDownloader", HRESULT_CODE(hr));
+                return false;
+            }
+        } else {
+            job.downloader = std::move(m_idleDownloaders.back());
+            m_idleDownloaders.pop_back();
+        }
+        hr = job.downloader->put_Updates(pSingleUpdate.Get());
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateDownloader::put_Updates", HRESULT_CODE(hr));
+            return false;
+        }
+        hr = job.downloader->put_Priority(static_cast<::DownloadPriority>(job.priority));
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateDownloader::put_Priority", HRESULT_CODE(hr));
+            return false;
+        }
+        // Watched before it starts, the progress callbacks need to know the ticket.
+        const Watchdog::Ticket ticket = (m_watchdog ? m_watchdog->watch(WatchedPhase::Download, title(index)) : 0);
+        const auto onProgressChanged = Microsoft::WRL::Make<DownloadProgressChangedCallback>([this, index, watchdog = m_watchdog, ticket](IDownloadJob *, IDownloadProgressChangedCallbackArgs *args){
+            if (watchdog) {
+                watchdog->progress(ticket);
+            }
+            if (!m_progressHandler || !args) {
+                return;
+            }
+            Microsoft::WRL::ComPtr<IDownloadProgress> pProgress = nullptr;
+            if (FAILED(args->get_Progress(pProgress.GetAddressOf()))) {
+                return;
+            }
+            LONG percent = 0;
+            DECIMAL bytesDownloaded = {};
+            DECIMAL bytesToDownload = {};
+            if (FAILED(pProgress->get_PercentComplete(&percent)) || FAILED(pProgress->get_TotalBytesDownloaded(&bytesDownloaded)) || FAILED(pProgress->get_TotalBytesToDownload(&bytesToDownload))) {
+                return;
+            }
+            m_progressHandler(PipelineStage::Download, index, int(percent), DecimalToUInt64(bytesDownloaded), DecimalToUInt64(bytesToDownload));
+        });
+        const auto onCompleted = Microsoft::WRL::Make<DownloadCompletedCallback>([this, index](IDownloadJob *, IDownloadCompletedCallbackArgs *){ post(PipelineStage::Download, index); });
+        VARIANT state;
+        ::VariantInit(&state);
+        hr = job.downloader->BeginDownload(onProgressChanged.Get(), onCompleted.Get(), state, job.downloadJob.ReleaseAndGetAddressOf());
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateDownloader::BeginDownload", HRESULT_CODE(hr));
+            unwatch(ticket);
+            job.downloader.Reset();
+            return false;
+        }
+        job.ticket = ticket;
+        arm(ticket, [pDownloadJob = job.downloadJob](){
+            if (FAILED(pDownloadJob->RequestAbort())) {
+                // ###
+            }
+        });
+        return true;
+    }
+
+    [[nodiscard]] inline bool beginInstall(const std::size_t index) override
+    {
+        if (!m_completedEvent || (index >= m_jobs.size())) {
+            return false;
+        }
+        Microsoft::WRL::ComPtr<IUpdateCollection> pSingleUpdate = nullptr;
+        if (!makeSingleUpdateCollection(index, pSingleUpdate)) {
+            return false;
+        }
+        if (Tracer::instance().isEnabled()) {
+            m_jobs.at(index).installStart = Tracer::instance().now();
+        }
+        HRESULT hr = m_installer->put_Updates(pSingleUpdate.Get());
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateInstaller4::put_Updates", HRESULT_CODE(hr));
+            return false;
+        }
+        const Watchdog::Ticket ticket = (m_watchdog ? m_watchdog->watch(WatchedPhase::Install, title(index)) : 0);
+        const auto onProgressChanged = Microsoft::WRL::Make<InstallationProgressChangedCallback>([this, index, watchdog = m_watchdog, ticket](IInstallationJob *, IInstallationProgressChangedCallbackArgs *args){
+            if (watchdog) {
+                watchdog->progress(ticket);
+            }
+            if (!m_progressHandler || !args) {
+                return;
+            }
+            Microsoft::WRL::ComPtr<IInstallationProgress> pProgress = nullptr;
+            LONG percent = 0;
+            if (FAILED(args->get_Progress(pProgress.GetAddressOf())) || FAILED(pProgress->get_PercentComplete(&percent))) {
+                return;
+            }
+            m_progressHandler(PipelineStage::Install, index, int(percent), 0, 0);
+        });
+        const auto onCompleted = Microsoft::WRL::Make<InstallationCompletedCallback>([this, index](IInstallationJob *, IInstallationCompletedCallbackArgs *){ post(PipelineStage::Install, index); });
+        VARIANT state;
+        ::VariantInit(&state);
+        Job &job = m_jobs.at(index);
+        hr = m_installer->BeginInstall(onProgressChanged.Get(), onCompleted.Get(), state, job.installationJob.ReleaseAndGetAddressOf());
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateInstaller4::BeginInstall", HRESULT_CODE(hr));
+            unwatch(ticket);
+            return false;
+        }
+        job.ticket = ticket;
+        arm(ticket, [pInstallationJob = job.installationJob](){
+            if (FAILED(pInstallationJob->RequestAbort())) {
+                // ###
+            }
+        });
+        return true;
+    }
+
+    // Doesn't give up on its own, an aborted job still completes. One that doesn't is the
+    // watchdog's business.
+    [[nodiscard]] inline bool waitForCompletion(PipelineCompletion &completion) override
+    {
+        const bool completed = waitForEvent([this, &completion](){
+            const std::scoped_lock lock(m_mutex);
+            if (m_completed.empty()) {
+                return false;
+            }
+            completion = m_completed.front();
+            m_completed.pop_front();
+            return true;
+        });
+        if (!completed) {
+            return false;
+        }
+        Job &job = m_jobs.at(completion.index);
+        unwatch(std::exchange(job.ticket, 0));
+        OperationResultCode resultCode = orcNotStarted;
+        HRESULT resultHr = S_OK;
+        if (completion.stage == PipelineStage::Download) {
+            Microsoft::WRL::ComPtr<IDownloadResult> pDownloadResult = nullptr;
+            HRESULT hr = job.downloader->EndDownload(job.downloadJob.Get(), pDownloadResult.GetAddressOf());
+            if (FAILED(hr)) {
+                PrintError(L"IUpdateDownloader::EndDownload", HRESULT_CODE(hr));
+                resultCode = orcFailed;
+                resultHr = hr;
+            } else {
+                // The job only contains this one update, its own result is the precise one.
+                Microsoft::WRL::ComPtr<IUpdateDownloadResult> pUpdateResult = nullptr;
+                hr = pDownloadResult->GetUpdateResult(0, pUpdateResult.GetAddressOf());
+                if (FAILED(hr)) {
+                    PrintError(L"IDownloadResult::GetUpdateResult", HRESULT_CODE(hr));
+                    resultCode = orcFailed;
+                    resultHr = hr;
+                } else {
+                    hr = pUpdateResult->get_ResultCode(&resultCode);
+                    if (FAILED(hr)) {
+                        PrintError(L"IUpdateDownloadResult::get_ResultCode", HRESULT_CODE(hr));
+                        resultCode = orcFailed;
+                    }
+                    if (FAILED(pUpdateResult->get_HResult(reinterpret_cast<LONG *>(&resultHr)))) {
+                        resultHr = S_OK;
+                    }
+                }
+            }
+            if (FAILED(job.downloadJob->CleanUp())) {
+                // ###
+            }
+            job.downloadJob.Reset();
+            m_idleDownloaders.push_back(std::move(job.downloader));
+        } else {
+            Microsoft::WRL::ComPtr<IInstallationResult> pInstallationResult = nullptr;
+            HRESULT hr = m_installer->EndInstall(job.installationJob.Get(), pInstallationResult.GetAddressOf());
+            if (FAILED(hr)) {
+                PrintError(L"IUpdateInstaller4::EndInstall", HRESULT_CODE(hr));
+                resultCode = orcFailed;
+                resultHr = hr;
+            } else {
+                Microsoft::WRL::ComPtr<IUpdateInstallationResult> pUpdateResult = nullptr;
+                hr = pInstallationResult->GetUpdateResult(0, pUpdateResult.GetAddressOf());
+                if (FAILED(hr)) {
+                    PrintError(L"IInstallationResult::GetUpdateResult", HRESULT_CODE(hr));
+                    resultCode = orcFailed;
+                    resultHr = hr;
+                } else {
+                    hr = pUpdateResult->get_ResultCode(&resultCode);
+                    if (FAILED(hr)) {
+                        PrintError(L"IUpdateInstallationResult::get_ResultCode", HRESULT_CODE(hr));
+                        resultCode = orcFailed;
+                    }
+                    if (FAILED(pUpdateResult->get_HResult(reinterpret_cast<LONG *>(&resultHr)))) {
+                        resultHr = S_OK;
+                    }
+                }
+            }
+            if (FAILED(job.installationJob->CleanUp())) {
+                // ###
+            }
+            job.installationJob.Reset();
+        }
+        completion.result = static_cast<OperationResult>(resultCode);
+        completion.hresult = resultHr;
+        if (Tracer::instance().isEnabled()) {
+            const bool download = (completion.stage == PipelineStage::Download);
+            Tracer::instance().async(EncodeUtf8(title(completion.index)), (download ? "download" : "install"), completion.index, (download ? job.downloadStart : job.installStart), Tracer::instance().now());
+        }
+        return true;
+    }
+
+    [[nodiscard]] inline bool historyCount(std::size_t &count) override
+    {
+        LONG total = 0;
+        const HRESULT hr = m_searcher->GetTotalHistoryCount(&total);
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateSearcher3::GetTotalHistoryCount", HRESULT_CODE(hr));
+            return false;
+        }
+        count = std::size_t(std::max(total, LONG(0)));
+        return true;
+    }
+
+    [[nodiscard]] inline bool queryHistory(const std::size_t start, const std::size_t count, std::vector<HistoryEntry> &entries) override
+    {
+        Microsoft::WRL::ComPtr<IUpdateHistoryEntryCollection> pHistory = nullptr;
+        HRESULT hr = m_searcher->QueryHistory(LONG(start), LONG(count), pHistory.GetAddressOf());
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateSearcher3::QueryHistory", HRESULT_CODE(hr));
+            return false;
+        }
+        LONG size = 0;
+        hr = pHistory->get_Count(&size);
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateHistoryEntryCollection::get_Count", HRESULT_CODE(hr));
+            return false;
+        }
+        for (LONG index = 0; index < size; ++index) {
+            Microsoft::WRL::ComPtr<IUpdateHistoryEntry> pEntry = nullptr;
+            hr = pHistory->get_Item(index, pEntry.GetAddressOf());
+            if (FAILED(hr)) {
+                PrintError(L"IUpdateHistoryEntryCollection::get_Item", HRESULT_CODE(hr));
+                return false;
+            }
+            HistoryEntry &entry = entries.emplace_back();
+            DATE date = 0.0;
+            hr = pEntry->get_Date(&date);
+            if (FAILED(hr)) {
+                PrintError(L"IUpdateHistoryEntry::get_Date", HRESULT_CODE(hr));
+                return false;
+            }
+            // An OLE date counts days since 1899-12-30, WUA's are in UTC.
+            entry.timestamp = std::llround((date - 25569.0) * 86400000.0);
+            ::UpdateOperation operation = uoInstallation;
+            hr = pEntry->get_Operation(&operation);
+            if (FAILED(hr)) {
+                PrintError(L"IUpdateHistoryEntry::get_Operation", HRESULT_CODE(hr));
+                return false;
+            }
+            entry.operation = HistoryOperation(operation);
+            OperationResultCode resultCode = orcNotStarted;
+            hr = pEntry->get_ResultCode(&resultCode);
+            if (FAILED(hr)) {
+                PrintError(L"IUpdateHistoryEntry::get_ResultCode", HRESULT_CODE(hr));
+                return false;
+            }
+            entry.result = static_cast<OperationResult>(resultCode);
+            LONG resultHr = S_OK;
+            if (FAILED(pEntry->get_HResult(&resultHr))) {
+                // ###
+            }
+            entry.hresult = int32_t(resultHr);
+            Microsoft::WRL::ComPtr<IUpdateIdentity> pUpdateIdentity = nullptr;
+            hr = pEntry->get_UpdateIdentity(pUpdateIdentity.GetAddressOf());
+            if (FAILED(hr)) {
+                PrintError(L"IUpdateHistoryEntry::get_UpdateIdentity", HRESULT_CODE(hr));
+                return false;
+            }
+            ScopedBSTR updateId = {};
+            LONG revision = 0;
+            if (SUCCEEDED(pUpdateIdentity->get_UpdateID(updateId.address())) && SUCCEEDED(pUpdateIdentity->get_RevisionNumber(&revision))) {
+                entry.id = updateId.toString();
+                entry.revision = int32_t(revision);
+            }
+            ScopedBSTR title = {};
+            if (SUCCEEDED(pEntry->get_Title(title.address())) && title) {
+                entry.title = title.toString();
+            }
+            ScopedBSTR clientApplicationId = {};
+            if (SUCCEEDED(pEntry->get_ClientApplicationID(clientApplicationId.address())) && clientApplicationId) {
+                entry.clientApplicationId = clientApplicationId.toString();
+            }
+        }
+        return true;
+    }
+
+private:
+    [[nodiscard]] inline Watchdog::Ticket watch(const WatchedPhase phase, std::wstring what)
+    {
+        return (m_watchdog ? m_watchdog->watch(phase, std::move(what)) : 0);
+    }
+
+    inline void arm(const Watchdog::Ticket ticket, Watchdog::AbortHandler abort)
+    {
+        if (m_watchdog) {
+            m_watchdog->arm(ticket, std::move(abort));
+        }
+    }
+
+    inline void unwatch(const Watchdog::Ticket ticket)
+    {
+        if (m_watchdog && (ticket > 0)) {
+            m_watchdog->finish(ticket);
+        }
+    }
+
+    // Waits until "ready()" holds, it's checked whenever the completion event is set.
+    [[nodiscard]] inline bool waitForEvent(const std::function<bool()> &ready)
+    {
+        while (!ready()) {
+            // Pumps COM calls while waiting, in a single threaded apartment the callbacks
+            // are delivered through the message queue. The worker threads are in the MTA.
+            DWORD index = 0;
+            const HRESULT hr = ::CoWaitForMultipleHandles(COWAIT_DISPATCH_CALLS | COWAIT_DISPATCH_WINDOW_MESSAGES, INFINITE, 1, &m_completedEvent, &index);
+            if (FAILED(hr)) {
+                PrintError(L"CoWaitForMultipleHandles", HRESULT_CODE(hr));
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Every property read is a call into the update service, a large catalog is read by
+    // several MTA threads at once. Each of them fills its own slots of "updates".
+    [[nodiscard]] inline bool extract(std::vector<UpdateDescriptor> &updates) const
+    {
+        std::atomic<std::size_t> next = 0;
+        std::atomic_bool failed = false;
+        const auto work = [this, &updates, &next, &failed](){
+            while (!failed.load(std::memory_order_relaxed)) {
+                const std::size_t index = next.fetch_add(1, std::memory_order_relaxed);
+                if (index >= updates.size()) {
+                    return;
+                }
+                Microsoft::WRL::ComPtr<IUpdate> pUpdate = nullptr;
+                const HRESULT hr = m_candidates->get_Item(LONG(index), pUpdate.GetAddressOf());
+                if (FAILED(hr)) {
+                    PrintError(L"IUpdateCollection::get_Item", HRESULT_CODE(hr));
+                    failed = true;
+                    return;
+                }
+                if (!GetUpdateDescriptor(pUpdate.Get(), updates.at(index))) {
+                    failed = true;
+                    return;
+                }
+            }
+        };
+        const std::size_t workerCount = GetExtractionWorkerCount(updates.size());
+        std::vector<std::thread> workers = {};
+        workers.reserve(workerCount - 1);
+        for (std::size_t worker = 1; worker < workerCount; ++worker) {
+            workers.emplace_back([&work](){
+                const HRESULT hr = ::CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+                work();
+                if (SUCCEEDED(hr)) {
+                    ::CoUninitialize();
+                }
+            });
+        }
+        work();
+        for (auto &&worker : workers) {
+            worker.join();
+        }
+        return !failed;
+    }
+
+    struct Job
+    {
+        Microsoft::WRL::ComPtr<IUpdateDownloader> downloader = nullptr;
+        Microsoft::WRL::ComPtr<IDownloadJob> downloadJob = nullptr;
+        Microsoft::WRL::ComPtr<IInstallationJob> installationJob = nullptr;
+        DownloadPriority priority = DownloadPriority::Normal;
+        Watchdog::Ticket ticket = 0; // Of the running download or installation.
+        uint64_t downloadStart = 0; // Tracer timestamps, only set while tracing.
+        uint64_t installStart = 0;
+    };
+
+    [[nodiscard]] inline bool makeSingleUpdateCollection(const std::size_t index, Microsoft::WRL::ComPtr<IUpdateCollection> &collection) const
+    {
+        Microsoft::WRL::ComPtr<IUpdate> pUpdate = nullptr;
+        HRESULT hr = m_updates->get_Item(LONG(index), pUpdate.GetAddressOf());
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateCollection::get_Item", HRESULT_CODE(hr));
+            return false;
+        }
+        hr = ::CoCreateInstance(CLSID_UpdateCollection, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(collection.ReleaseAndGetAddressOf()));
+        if (FAILED(hr)) {
+            PrintError(L"CoCreateInstance", HRESULT_CODE(hr));
+            return false;
+        }
+        LONG newIndex = 0;
+        hr = collection->Add(pUpdate.Get(), &newIndex);
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateCollection::Add", HRESULT_CODE(hr));
+            return false;
+        }
+        return true;
+    }
+
+    inline void post(const PipelineStage stage, const std::size_t index)
+    {
+        {
+            const std::scoped_lock lock(m_mutex);
+            PipelineCompletion completion = {};
+            completion.stage = stage;
+            completion.index = index;
+            m_completed.push_back(completion);
+        }
+        if (::SetEvent(m_completedEvent) == FALSE) {
+            PrintError(L"SetEvent", ::GetLastError());
+        }
+    }
+
+    Microsoft::WRL::ComPtr<IUpdateSession3> m_session = nullptr;
+    Microsoft::WRL::ComPtr<IUpdateSearcher3> m_searcher = nullptr;
+    Microsoft::WRL::ComPtr<IUpdateCollection> m_candidates = nullptr; // The last search result.
+    Microsoft::WRL::ComPtr<IUpdateCollection> m_updates = nullptr; // The selected candidates.
+    Microsoft::WRL::ComPtr<IUpdateInstaller4> m_installer = nullptr;
+    std::vector<Microsoft::WRL::ComPtr<IUpdateDownloader>> m_idleDownloaders = {};
+    std::vector<Job> m_jobs = {};
+    HANDLE m_completedEvent = nullptr;
+    std::mutex m_mutex;
+    std::deque<PipelineCompletion> m_completed = {};
+    ProgressHandler m_progressHandler = nullptr;
+    Watchdog *m_watchdog = nullptr;
+    CancellationToken::Subscription m_subscription = 0;
+    std::atomic_bool m_searchCompleted = false;
+    bool m_win10 = ::IsWindows10OrGreater();
+    bool m_initialized = false;
+};
+
+[[nodiscard]] static inline bool RunSimulation(const std::size_t count, const UpdateOptions &options)
+{
+    PrintToConsole(L"Simulating " + std::to_wstring(count) + L" updates with a pipeline depth of " + std::to_wstring(options.pipelineDepth) + L" ......", ConsoleTextColor::Cyan, false);
+    SimulationProfile profile = {};
+    profile.updateCount = count;
+    SimulatedUpdateBackend backend(profile);
+    ConsoleReporter reporter = {};
+    SystemUpdater updater(backend, reporter, options);
+    if (!updater.run()) {
+        PrintError(L"The simulated update failed.");
+        return false;
+    }
+    const uint64_t serial = backend.serialTime();
+    const uint64_t elapsed = backend.now();
+    PrintInfo(L"Simulated run: " + std::to_wstring(elapsed) + L" ms, downloading and installing one after another alone: " + std::to_wstring(serial) + L" ms.");
+    return true;
+}
+
+[[nodiscard]] static inline int64_t GetCurrentUnixTime()
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Everything we persist lives in "%ProgramData%\WinUpdate", shared by all users since
+// Windows Update itself is a machine wide thing.
+[[nodiscard]] static inline std::wstring GetDataFilePath(const std::wstring_view fileName)
+{
+    wchar_t buffer[MAX_PATH] = {};
+    const HRESULT hr = ::SHGetFolderPathW(nullptr, CSIDL_COMMON_APPDATA, nullptr, SHGFP_TYPE_CURRENT, buffer);
+    if (FAILED(hr)) {
+        PrintError(L"SHGetFolderPathW", HRESULT_CODE(hr));
+        return {};
+    }
+    const std::wstring directory = std::wstring(buffer) + L"\\WinUpdate";
+    if ((::CreateDirectoryW(directory.c_str(), nullptr) == FALSE) && (::GetLastError() != ERROR_ALREADY_EXISTS)) {
+        PrintError(L"CreateDirectoryW", ::GetLastError());
+        return {};
+    }
+    return (directory + L'\\' + std::wstring(fileName));
+}
+
+// Writes into a temporary file first and swaps it in afterwards, readers either see the
+// old or the new content, never something half written.
+[[nodiscard]] static inline bool WriteFileAtomically(const std::wstring &path, const void *data, const std::size_t size)
+{
+    if (path.empty()) {
+        return false;
+    }
+    const std::wstring tempPath = path + L".tmp";
+    const HANDLE hFile = ::CreateFileW(tempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        PrintError(L"CreateFileW", ::GetLastError());
+        return false;
+    }
+    DWORD written = 0;
+    const bool ok = ((::WriteFile(hFile, data, DWORD(size), &written, nullptr) != FALSE) && (written == DWORD(size)));
+    if (!ok) {
+        PrintError(L"WriteFile", ::GetLastError());
+    }
+    if (::CloseHandle(hFile) == FALSE) {
+        PrintError(L"CloseHandle", ::GetLastError());
+    }
+    if (!ok) {
+        ::DeleteFileW(tempPath.c_str());
+        return false;
+    }
+    if (::MoveFileExW(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) == FALSE) {
+        PrintError(L"MoveFileExW", ::GetLastError());
+        return false;
+    }
+    return true;
+}
+
+// A read only mapped view of a whole file.
+struct MappedFile
+{
+    MappedFile() = default;
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    // Missing files are expected (first run), so only unexpected failures are reported.
+    [[nodiscard]] inline bool open(const std::wstring &path)
+    {
+        close();
+        if (path.empty()) {
+            return false;
+        }
+        m_file = ::CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE) {
+            const DWORD dwError = ::GetLastError();
+            if ((dwError != ERROR_FILE_NOT_FOUND) && (dwError != ERROR_PATH_NOT_FOUND)) {
+                PrintError(L"CreateFileW", dwError);
+            }
+            return false;
+        }
+        LARGE_INTEGER fileSize = {};
+        if (::GetFileSizeEx(m_file, &fileSize) == FALSE) {
+            PrintError(L"GetFileSizeEx", ::GetLastError());
+            close();
+            return false;
+        }
+        if (fileSize.QuadPart < 1) {
+            close();
+            return false;
+        }
+        m_mapping = ::CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!m_mapping) {
+            PrintError(L"CreateFileMappingW", ::GetLastError());
+            close();
+            return false;
+        }
+        m_view = ::MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!m_view) {
+            PrintError(L"MapViewOfFile", ::GetLastError());
+            close();
+            return false;
+        }
+        m_size = std::size_t(fileSize.QuadPart);
+        return true;
+    }
+
+    inline void close()
+    {
+        if (m_view) {
+            if (::UnmapViewOfFile(m_view) == FALSE) {
+                PrintError(L"UnmapViewOfFile", ::GetLastError());
+            }
+            m_view = nullptr;
+        }
+        if (m_mapping) {
+            if (::CloseHandle(m_mapping) == FALSE) {
+                PrintError(L"CloseHandle", ::GetLastError());
+            }
+            m_mapping = nullptr;
+        }
+        if (m_file != INVALID_HANDLE_VALUE) {
+            if (::CloseHandle(m_file) == FALSE) {
+                PrintError(L"CloseHandle", ::GetLastError());
+            }
+            m_file = INVALID_HANDLE_VALUE;
+        }
+        m_size = 0;
+    }
+
+    [[nodiscard]] inline const void *data() const
+    {
+        return m_view;
+    }
+
+    [[nodiscard]] inline std::size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+    const void *m_view = nullptr;
+    std::size_t m_size = 0;
+};
+
+// Written strictly front to back and never rewritten, a crash leaves a file that is still
+// readable up to the last write. "durable" files keep what was there and every write goes
+// straight to the disk, which is what the checkpoint journal needs. The only way back is
+// cutting off a tail that a crash left half written.
+class AppendOnlyFile
+{
+public:
+    AppendOnlyFile() = default;
+
+    ~AppendOnlyFile()
+    {
+        close();
+    }
+
+    AppendOnlyFile(const AppendOnlyFile &) = delete;
+    AppendOnlyFile &operator=(const AppendOnlyFile &) = delete;
+
+    [[nodiscard]] inline bool open(const std::wstring &path, const bool durable = false)
+    {
+        close();
+        if (path.empty()) {
+            return false;
+        }
+        const DWORD disposition = (durable ? OPEN_ALWAYS : CREATE_ALWAYS);
+        const DWORD flags = (FILE_ATTRIBUTE_NORMAL | (durable ? FILE_FLAG_WRITE_THROUGH : FILE_FLAG_SEQUENTIAL_SCAN));
+        m_file = ::CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, disposition, flags, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE) {
+            PrintError(L"CreateFileW", ::GetLastError());
+            return false;
+        }
+        // Not opened for appending only, "truncate" needs to be able to cut the file short.
+        if (durable && (::SetFilePointerEx(m_file, {}, nullptr, FILE_END) == FALSE)) {
+            PrintError(L"SetFilePointerEx", ::GetLastError());
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    // Drops everything after the first "size" bytes, the next write continues from there.
+    [[nodiscard]] inline bool truncate(const std::size_t size)
+    {
+        LARGE_INTEGER position = {};
+        position.QuadPart = LONGLONG(size);
+        if (::SetFilePointerEx(m_file, position, nullptr, FILE_BEGIN) == FALSE) {
+            PrintError(L"SetFilePointerEx", ::GetLastError());
+            return false;
+        }
+        if (::SetEndOfFile(m_file) == FALSE) {
+            PrintError(L"SetEndOfFile", ::GetLastError());
+            return false;
+        }
+        return true;
+    }
+
+    inline void close()
+    {
+        if (m_file == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        if (::CloseHandle(m_file) == FALSE) {
+            PrintError(L"CloseHandle", ::GetLastError());
+        }
+        m_file = INVALID_HANDLE_VALUE;
+    }
+
+    [[nodiscard]] inline bool write(const void *data, const std::size_t size)
+    {
+        DWORD written = 0;
+        if ((::WriteFile(m_file, data, DWORD(size), &written, nullptr) == FALSE) || (written != DWORD(size))) {
+            PrintError(L"WriteFile", ::GetLastError());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+};
+
+// Ties the cache to the search it came from, a different filter means a different search.
+// A scan package finds other updates than Windows Update, its results get a cache key of their own.
+[[nodiscard]] static inline uint32_t GetSearchCriteriaHash(const UpdateFilter &filter, const uint32_t scanPackageHash)
+{
+    std::wstring criteria = BuildSearchCriteria(filter, {});
+    if (scanPackageHash != 0) {
+        criteria += (L" @" + std::to_wstring(scanPackageHash));
+    }
+    return CalculateChecksum(criteria.data(), criteria.size() * sizeof(wchar_t));
+}
+
+// An offline scan package and what we know about its registration.
+struct ScanPackage
+{
+    std::wstring path = {}; // Absolute, WUA opens it from its own process.
+    ScanPackageRecord record = {};
+    bool dirty = false; // "record" differs from what's saved.
+};
+
+// Works out which package "path" is without asking WUA, so that it can be part of the search
+// cache key. The whole package is only hashed if it changed since the last run.
+[[nodiscard]] static inline bool IdentifyScanPackage(const std::wstring &path, ScanPackage &package)
+{
+    wchar_t buffer[MAX_PATH] = {};
+    const DWORD length = ::GetFullPathNameW(path.c_str(), DWORD(std::size(buffer)), buffer, nullptr);
+    if ((length < 1) || (length >= std::size(buffer))) {
+        PrintError(L"GetFullPathNameW", ::GetLastError());
+        return false;
+    }
+    package.path.assign(buffer, length);
+    WIN32_FILE_ATTRIBUTE_DATA attributes = {};
+    if (::GetFileAttributesExW(package.path.c_str(), GetFileExInfoStandard, &attributes) == FALSE) {
+        PrintError(L"GetFileAttributesExW", ::GetLastError());
+        return false;
+    }
+    const uint64_t size = ((uint64_t(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow);
+    const uint64_t lastWriteTime = ((uint64_t(attributes.ftLastWriteTime.dwHighDateTime) << 32) | attributes.ftLastWriteTime.dwLowDateTime);
+    const uint32_t pathHash = GetScanPackagePathHash(package.path);
+    ScanPackageRecord saved = {};
+    {
+        MappedFile file = {};
+        if (file.open(GetDataFilePath(kScanPackageFileName)) && ParseScanPackageRecord(file.data(), file.size(), saved)
+            && (saved.size == size) && (saved.lastWriteTime == lastWriteTime) && (saved.pathHash == pathHash)) {
+            package.record = saved;
+            package.dirty = false;
+            return true;
+        }
+    }
+    PrintInfo(L"Hashing the offline scan package ......");
+    const HANDLE file = ::CreateFileW(package.path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        PrintError(L"CreateFileW", ::GetLastError());
+        return false;
+    }
+    std::vector<uint8_t> chunk(kScanPackageChunkSize);
+    uint32_t contentHash = kChecksumSeed;
+    bool hashed = false;
+    while (true) {
+        DWORD bytesRead = 0;
+        if (::ReadFile(file, chunk.data(), kScanPackageChunkSize, &bytesRead, nullptr) == FALSE) {
+            PrintError(L"ReadFile", ::GetLastError());
+            break;
+        }
+        if (bytesRead < 1) {
+            hashed = true;
+            break;
+        }
+        contentHash = CalculateChecksum(chunk.data(), bytesRead, contentHash);
+    }
+    if (::CloseHandle(file) == FALSE) {
+        PrintError(L"CloseHandle", ::GetLastError());
+    }
+    if (!hashed) {
+        return false;
+    }
+    package.record = ScanPackageRecord{};
+    package.record.size = size;
+    package.record.lastWriteTime = lastWriteTime;
+    package.record.contentHash = contentHash;
+    package.record.pathHash = pathHash;
+    // Staged again with the same content, the registration still holds.
+    if ((saved.contentHash == package.record.contentHash) && (saved.pathHash == pathHash)) {
+        std::memcpy(package.record.serviceId, saved.serviceId, sizeof(saved.serviceId));
+    }
+    package.dirty = true;
+    return true;
+}
+
+// Makes sure WUA has a service for "package", registering it only if the one we made
+// earlier is gone or was made for another package. Registrations of ours that no longer
+// match are removed, WUA would keep them around forever otherwise.
+[[nodiscard]] static inline bool RegisterScanPackage(ScanPackage &package)
+{
+    Microsoft::WRL::ComPtr<IUpdateServiceManager2> pServiceManager = nullptr;
+    HRESULT hr = ::CoCreateInstance(CLSID_UpdateServiceManager, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(pServiceManager.GetAddressOf()));
+    if (FAILED(hr)) {
+        PrintError(L"CoCreateInstance", HRESULT_CODE(hr));
+        return false;
+    }
+    const ScopedBSTR appId(kAppName);
+    hr = pServiceManager->put_ClientApplicationID(appId);
+    if (FAILED(hr)) {
+        PrintError(L"IUpdateServiceManager2::put_ClientApplicationID", HRESULT_CODE(hr));
+        return false;
+    }
+    Microsoft::WRL::ComPtr<IUpdateServiceCollection> pServices = nullptr;
+    hr = pServiceManager->get_Services(pServices.GetAddressOf());
+    if (FAILED(hr)) {
+        PrintError(L"IUpdateServiceManager2::get_Services", HRESULT_CODE(hr));
+        return false;
+    }
+    LONG count = 0;
+    hr = pServices->get_Count(&count);
+    if (FAILED(hr)) {
+        PrintError(L"IUpdateServiceCollection::get_Count", HRESULT_CODE(hr));
+        return false;
+    }
+    const std::wstring wanted = GetScanPackageServiceId(package.record);
+    bool registered = false;
+    std::vector<std::wstring> stale = {};
+    for (LONG index = 0; index != count; ++index) {
+        Microsoft::WRL::ComPtr<IUpdateService> pService = nullptr;
+        ScopedBSTR serviceId = {};
+        if (FAILED(pServices->get_Item(index, pService.GetAddressOf())) || FAILED(pService->get_ServiceID(serviceId.address()))) {
+            continue; // ###
+        }
+        const std::wstring id = serviceId.toString();
+        if (!wanted.empty() && (id == wanted)) {
+            registered = true;
+            continue;
+        }
+        ScopedBSTR name = {};
+        VARIANT_BOOL scanPackage = VARIANT_FALSE;
+        if (SUCCEEDED(pService->get_Name(name.address())) && (name.toString() == kScanPackageServiceName) && SUCCEEDED(pService->get_IsScanPackageService(&scanPackage)) && (scanPackage != VARIANT_FALSE)) {
+            stale.push_back(id);
+        }
+    }
+    for (auto &&id : std::as_const(stale)) {
+        const ScopedBSTR serviceId(id.c_str());
+        if (FAILED(pServiceManager->RemoveService(serviceId))) {
+            // ###
+        }
+    }
+    if (!registered) {
+        PrintInfo(L"Registering the offline scan package with Windows Update ......");
+        const ScopedBSTR serviceName(kScanPackageServiceName);
+        const ScopedBSTR location(package.path.c_str());
+        Microsoft::WRL::ComPtr<IUpdateService> pService = nullptr;
+        hr = pServiceManager->AddScanPackageService(serviceName, location, 0, pService.GetAddressOf());
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateServiceManager2::AddScanPackageService", HRESULT_CODE(hr));
+            return false;
+        }
+        ScopedBSTR serviceId = {};
+        hr = pService->get_ServiceID(serviceId.address());
+        if (FAILED(hr)) {
+            PrintError(L"IUpdateService::get_ServiceID", HRESULT_CODE(hr));
+            return false;
+        }
+        if (!SetScanPackageServiceId(package.record, serviceId.toString())) {
+            PrintError(L"The offline scan package got a service ID we can't remember: " + serviceId.toString());
+            return false;
+        }
+        package.dirty = true;
+        EmitEvent("scan_package_registered", { { "service", serviceId.toString() }, { "size", package.record.size } });
+    }
+    if (package.dirty) {
+        SealScanPackageRecord(package.record);
+        if (WriteFileAtomically(GetDataFilePath(kScanPackageFileName), &package.record, sizeof(package.record))) {
+            package.dirty = false;
+        } else {
+            PrintError(L"Failed to save the offline scan package registration, it will be registered again next time.");
+        }
+    }
+    return true;
+}
+
+// Points the searches of "backend" at "package", or at Windows Update without one.
+[[nodiscard]] static inline bool SelectSearchService(WuaUpdateBackend &backend, ScanPackage *package)
+{
+    if (!package) {
+        return backend.setSearchService({});
+    }
+    if (!RegisterScanPackage(*package)) {
+        return false;
+    }
+    return backend.setSearchService(GetScanPackageServiceId(package->record));
+}
+
+static inline void SaveSearchCache(const std::vector<UpdateDescriptor> &updates, const uint32_t criteria)
+{
+    std::vector<SearchCacheRecord> records(updates.size());
+    for (std::size_t index = 0; index != updates.size(); ++index) {
+        if (!ToSearchCacheRecord(updates.at(index), records.at(index))) {
+            PrintError(L"Unexpected update ID: " + updates.at(index).id);
+            return;
+        }
+    }
+    const std::vector<uint8_t> buffer = SerializeSearchCache(GetCurrentUnixTime(), criteria, records);
+    if (!WriteFileAtomically(GetDataFilePath(kSearchCacheFileName), buffer.data(), buffer.size())) {
+        PrintError(L"Failed to save the search cache.");
+    }
+}
+
+// The metrics file is rewritten as a whole after every run. A failed run carries over when
+// the last successful one happened, the file is all there is to remember it by.
+static inline void SaveMetrics(const std::wstring &path, const bool succeeded)
+{
+    int64_t lastSuccess = 0;
+    if (!succeeded) {
+        MappedFile file = {};
+        if (file.open(path)) {
+            lastSuccess = ParseLastSuccessTimestamp(std::string_view(static_cast<const char *>(file.data()), file.size()));
+        }
+    }
+    const std::string text = SerializeMetrics(RunMetrics::instance().snapshot(), succeeded, GetCurrentUnixTime(), lastSuccess);
+    if (!WriteFileAtomically(path, text.data(), text.size())) {
+        PrintError(L"Failed to save the metrics to " + path);
+    }
+}
+
+// A missing or broken history just means the estimates start from scratch.
+static inline void LoadThroughputHistory(ThroughputHistory &history)
+{
+    MappedFile file = {};
+    if (file.open(GetDataFilePath(kThroughputHistoryFileName))) {
+        (void)history.load(file.data(), file.size());
+    }
+}
+
+static inline void SaveThroughputHistory(const ThroughputHistory &history)
+{
+    if (history.isEmpty()) {
+        return;
+    }
+    const std::vector<uint8_t> buffer = history.serialize();
+    if (!WriteFileAtomically(GetDataFilePath(kThroughputHistoryFileName), buffer.data(), buffer.size())) {
+        PrintError(L"Failed to save the throughput history.");
+    }
+}
+
+// Asks WUA itself, updates installed by earlier runs or by Windows count as well.
+[[nodiscard]] static inline bool IsRebootRequired()
+{
+    Microsoft::WRL::ComPtr<ISystemInformation> pSystemInformation = nullptr;
+    HRESULT hr = ::CoCreateInstance(CLSID_SystemInformation, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(pSystemInformation.GetAddressOf()));
+    if (FAILED(hr)) {
+        PrintError(L"CoCreateInstance", HRESULT_CODE(hr));
+        return false;
+    }
+    VARIANT_BOOL rebootRequired = VARIANT_FALSE;
+    hr = pSystemInformation->get_RebootRequired(&rebootRequired);
+    if (FAILED(hr)) {
+        PrintError(L"ISystemInformation::get_RebootRequired", HRESULT_CODE(hr));
+        return false;
+    }
+    return (rebootRequired != VARIANT_FALSE);
+}
+
+// Same as above, "wuaBackend" keeps its session, searcher and installer between calls.
+[[nodiscard]] static inline bool UpdateSystem(std::optional<WuaUpdateBackend> &wuaBackend, const UpdateOptions &options, SessionRecorder *recorder, Watchdog *watchdog, ThroughputHistory *history)
+{
+    PrintToConsole(L"Start updating Windows ......", ConsoleTextColor::Cyan, false);
+
+    // Whatever an interrupted run got done, the journal is reopened to continue it.
+    const std::wstring journalPath = GetDataFilePath(kCheckpointFileName);
+    std::vector<uint8_t> journalData = {};
+    {
+        MappedFile journalFile = {};
+        if (journalFile.open(journalPath)) {
+            const auto journalBytes = static_cast<const uint8_t *>(journalFile.data());
+            journalData.assign(journalBytes, journalBytes + journalFile.size());
+        }
+    }
+    CheckpointJournal journal = {};
+    const bool journalIsNew = journal.load(journalData.data(), journalData.size());
+    if (!journal.empty()) {
+        PrintInfo(L"Resuming the interrupted Windows update ......");
+    }
+
+    // A fresh enough cache that says there's nothing to install lets us return without
+    // touching COM at all. If it lists updates, an offline search has to confirm it.
+    ScanPackage scanPackage = {};
+    if (!options.scanPackage.empty() && !IdentifyScanPackage(options.scanPackage, scanPackage)) {
+        return false;
+    }
+    MappedFile cacheFile = {};
+    SearchCacheView cache = {};
+    bool cacheIsFresh = false;
+    const uint32_t criteriaHash = GetSearchCriteriaHash(options.filter, scanPackage.record.contentHash);
+    if ((options.cacheTtl > 0) && cacheFile.open(GetDataFilePath(kSearchCacheFileName)) && cache.attach(cacheFile.data(), cacheFile.size()) && (cache.criteria() == criteriaHash)) {
+        const int64_t age = GetCurrentUnixTime() - cache.timestamp();
+        cacheIsFresh = ((age >= 0) && (age < (int64_t(options.cacheTtl) * 60)));
+        if (cacheIsFresh && (cache.size() < 1) && journal.empty()) {
+            PrintSuccess(L"Your Windows is update to date! (checked " + std::to_wstring(age / 60) + L" minutes ago)");
+            return true;
+        }
+    }
+    if (!cacheIsFresh) {
+        cacheFile.close();
+    }
+
+    if (!wuaBackend) {
+        wuaBackend.emplace();
+    }
+    if (!wuaBackend->initialize() || !SelectSearchService(*wuaBackend, (options.scanPackage.empty() ? nullptr : &scanPackage))) {
+        return false;
+    }
+    std::unique_ptr<RecordingSystemBackend> recordingBackend = {};
+    if (recorder) {
+        // The cache and the journal decide what happens, the replay needs the same ones.
+        const auto cacheBytes = static_cast<const uint8_t *>(cacheFile.data());
+        recorder->target(SessionTarget::System, options, (cacheIsFresh ? std::vector<uint8_t>(cacheBytes, cacheBytes + cacheFile.size()) : std::vector<uint8_t>{}), journalData);
+        recordingBackend = std::make_unique<RecordingSystemBackend>(*wuaBackend, *recorder);
+    }
+    SystemUpdateBackend &backend = (recordingBackend ? static_cast<SystemUpdateBackend &>(*recordingBackend) : *wuaBackend);
+    ConsoleReporter reporter = {};
+    SystemUpdater updater(backend, reporter, options);
+    // The cache is only consulted before the first online search, the mapping has to be
+    // gone by the time the file gets replaced.
+    updater.setOnlineSearchHandler([&cacheFile, criteriaHash](const std::vector<UpdateDescriptor> &updates){
+        cacheFile.close();
+        SaveSearchCache(updates, criteriaHash);
+    });
+    AppendOnlyFile journalFile = {};
+    if (journalIsNew) {
+        ::DeleteFileW(journalPath.c_str()); // ### Usually there is none.
+    }
+    if (journalFile.open(journalPath, true)) {
+        const std::vector<uint8_t> header = CheckpointJournal::header();
+        if (journalIsNew ? journalFile.write(header.data(), header.size()) : journalFile.truncate(journal.intactSize())) {
+            journal.setSink([&journalFile](const void *data, const std::size_t size){ return journalFile.write(data, size); });
+        }
+    }
+    updater.setCheckpointJournal(&journal);
+    updater.setThroughputHistory(history);
+    wuaBackend->setWatchdog(watchdog);
+    updater.setCancellationToken(watchdog ? &watchdog->token() : nullptr);
+    const bool succeeded = updater.run(cacheIsFresh ? &cache : nullptr);
+    wuaBackend->setWatchdog(nullptr);
+    journal.setSink(nullptr);
+    journalFile.close();
+    // Nothing left to resume. A failed run keeps its journal for the next attempt.
+    if (succeeded && (::DeleteFileW(journalPath.c_str()) == FALSE) && (::GetLastError() != ERROR_FILE_NOT_FOUND)) {
+        PrintError(L"DeleteFileW", ::GetLastError());
+    }
+    return succeeded;
+}
+
+static inline void ReportDeadline(const WatchedPhase phase, const std::wstring_view what, const std::chrono::milliseconds elapsed, const std::chrono::milliseconds idle)
+{
+    if (what.empty()) {
+        EmitEvent("deadline_exceeded", { { "phase", "run" }, { "elapsed_ms", uint64_t(elapsed.count()) } });
+        PrintError(L"The run didn't finish within " + std::to_wstring(elapsed.count() / 1000) + L" seconds, aborting everything still in flight ......");
+        return;
+    }
+    EmitEvent("deadline_exceeded", { { "phase", GetWatchedPhaseName(phase) }, { "what", what }, { "elapsed_ms", uint64_t(elapsed.count()) }, { "idle_ms", uint64_t(idle.count()) } });
+    PrintError(L"Deadline exceeded while " + DescribeWatchedOperation(phase, what) + L": running for " + std::to_wstring(elapsed.count() / 1000) + L" seconds, no progress for the last " + std::to_wstring(idle.count() / 1000) + L". Aborting everything still in flight ......");
+}
+
+// Starts "watchdog" for one run. Something that doesn't even react to being aborted can
+// only be a hung service, the process is killed then, any later call would hang as well.
+// The checkpoint journal is written as progress is made, the next run picks it up.
+static inline void SuperviseRun(Watchdog &watchdog)
+{
+    watchdog.setExpiryHandler(ReportDeadline);
+    watchdog.setAbandonHandler([&watchdog](){
+        EmitEvent("abandoned", { { "reason", std::wstring_view(watchdog.token().reason()) } });
+        PrintError(L"Nothing reacted to the cancellation for " + std::to_wstring(kAbortGracePeriod.count() / 1000) + L" seconds, giving up.");
+        ConsoleWriter::instance().flush();
+        ::TerminateProcess(::GetCurrentProcess(), UINT(kDeadlineExitCode));
+    });
+    watchdog.start();
+}
+
+// Only searches and prints what an update would install, most severe and largest first.
+[[nodiscard]] static inline bool ListUpdates(const UpdateOptions &options)
+{
+    // Searching an offline scan package needs no connection at all.
+    ScanPackage scanPackage = {};
+    if (options.scanPackage.empty()) {
+        if (!IsInternetAvailable()) {
+            PrintError(L"You need to connect to the Internet first!");
+            return false;
+        }
+    } else if (!IdentifyScanPackage(options.scanPackage, scanPackage)) {
+        return false;
+    }
+    PrintToConsole(L"Searching for Windows updates ......", ConsoleTextColor::Cyan, false);
+    WuaUpdateBackend backend = {};
+    if (!backend.initialize() || !SelectSearchService(backend, (options.scanPackage.empty() ? nullptr : &scanPackage))) {
+        return false;
+    }
+    UpdateIndex index = {};
+    std::vector<UpdateDescriptor> updates = {};
+    {
+        Watchdog watchdog(options.deadlines);
+        SuperviseRun(watchdog);
+        backend.setWatchdog(&watchdog);
+        const bool searched = backend.search(true, BuildSearchCriteria(options.filter, {}), updates);
+        backend.setWatchdog(nullptr);
+        if (!searched) {
+            PrintError(watchdog.token().isCancelled() ? (L"Stopped, " + watchdog.token().reason() + L'.') : std::wstring(L"Failed to search for Windows updates."));
+            return false;
+        }
+        index.assign(updates);
+    }
+    std::vector<UpdateIndex::Row> rows = index.select(options.filter);
+    index.sort(rows, UpdateIndexKey::Size);
+    index.sort(rows, UpdateIndexKey::Severity);
+    for (auto &&row : std::as_const(rows)) {
+        std::wstring line = L"[" + Utf8ToUtf16(GetSeverityName(index.severity(row))) + L"] ";
+        if (index.kb(row) > 0) {
+            line += L"KB" + std::to_wstring(index.kb(row)) + L' ';
+        }
+        line += std::wstring(index.title(row)) + L" (" + std::to_wstring(index.maxDownloadSize(row) >> 20) + L" MiB";
+        line += ((index.type(row) == UpdateType::Driver) ? L", driver)" : L")");
+        PrintInfo(line);
+    }
+    // The waves a run would install them in. All but the exclusive ones share a single
+    // commit, every exclusive update adds one more, that's what a maintenance window has to fit.
+    std::vector<std::size_t> candidates(rows.cbegin(), rows.cend());
+    const std::vector<InstallWave> waves = PlanInstallWaves(index, PlanDownloads(index, candidates, UINT64_MAX).order);
+    for (std::size_t number = 0; number != waves.size(); ++number) {
+        const InstallWave &wave = waves.at(number);
+        PrintInfo(L"Install wave " + std::to_wstring(number + 1) + L'/' + std::to_wstring(waves.size()) + L": " + std::to_wstring(wave.updates.size()) + L" update(s), " + DescribeInstallWaveKind(wave.kind) + L", " + std::to_wstring(wave.downloadSize >> 20) + L" MiB to download.");
+    }
+    PrintSuccess(std::to_wstring(rows.size()) + L" Windows update(s), " + std::to_wstring(index.downloadSize(rows) >> 20) + L" MiB to download.");
+    return true;
+}
+
+static inline void PrintEstimate(const std::wstring_view what, const DurationEstimate &estimate)
+{
+    std::wstring line = (std::wstring(what) + L"about " + FormatDuration(estimate.expected) + L" (" + FormatDuration(estimate.low) + L" to " + FormatDuration(estimate.high));
+    line += ((estimate.samples > 0) ? (L", from " + std::to_wstring(estimate.samples) + L" observation(s))") : std::wstring(L", no history yet, a rough guess)"));
+    PrintInfo(line);
+}
+
+// Searches like a run would, then tells how long getting through what it found is going
+// to take, from what earlier runs on this machine observed. Nothing is downloaded or
+// installed, and the Store items the search queued are cancelled again.
+[[nodiscard]] static inline bool PlanRun(const bool updateStoreApps, const bool updateSystem, const UpdateOptions &options)
+{
+    if (!IsInternetAvailable()) {
+        PrintError(L"You need to connect to the Internet first!");
+        return false;
+    }
+    ThroughputHistory history = {};
+    LoadThroughputHistory(history);
+    Watchdog watchdog(options.deadlines);
+    SuperviseRun(watchdog);
+    std::vector<UpdateDescriptor> updates = {};
+    std::vector<std::size_t> order = {};
+    if (updateSystem) {
+        PrintToConsole(L"Searching for Windows updates ......", ConsoleTextColor::Cyan, false);
+        ScanPackage scanPackage = {};
+        if (!options.scanPackage.empty() && !IdentifyScanPackage(options.scanPackage, scanPackage)) {
+            return false;
+        }
+        WuaUpdateBackend backend = {};
+        if (!backend.initialize() || !SelectSearchService(backend, (options.scanPackage.empty() ? nullptr : &scanPackage))) {
+            return false;
+        }
+        ConsoleReporter reporter = {};
+        SystemUpdater updater(backend, reporter, options);
+        backend.setWatchdog(&watchdog);
+        updater.setCancellationToken(&watchdog.token());
+        const bool searched = updater.preview(updates, order);
+        backend.setWatchdog(nullptr);
+        if (!searched) {
+            return false;
+        }
+    }
+    std::vector<StoreItemDescriptor> storeItems = {};
+    if (updateStoreApps && ::IsWindows10OrGreater()) {
+        PrintToConsole(L"Searching for Microsoft Store updates ......", ConsoleTextColor::Cyan, false);
+        InstallControlStoreBackend backend = {};
+        ConsoleReporter reporter(ProgressSource::Store);
+        StoreUpdater updater(backend, reporter, options);
+        backend.setWatchdog(&watchdog);
+        updater.setCancellationToken(&watchdog.token());
+        const bool searched = updater.preview(storeItems);
+        backend.setWatchdog(nullptr);
+        if (!searched) {
+            return false;
+        }
+    }
+    watchdog.stop();
+    const RunForecast forecast = ForecastRun(history, updates, order, storeItems, options.storeMaxInFlight);
+    EmitEvent("forecast", { { "windows_count", uint64_t(forecast.windowsUpdates) }, { "download_bytes", forecast.downloadSize }, { "windows_s", forecast.windows.expected }, { "windows_low_s", forecast.windows.low }, { "windows_high_s", forecast.windows.high },
+        { "store_count", uint64_t(forecast.storeItems) }, { "store_s", forecast.store.expected }, { "store_low_s", forecast.store.low }, { "store_high_s", forecast.store.high }, { "total_s", forecast.total.expected }, { "total_high_s", forecast.total.high } });
+    if (updateSystem) {
+        PrintInfo(std::to_wstring(forecast.windowsUpdates) + L" Windows update(s), " + std::to_wstring(forecast.downloadSize >> 20) + L" MiB to download, " + std::to_wstring(forecast.installsWithHistory) + L" of them installed on this machine before.");
+        PrintEstimate(L"  Downloading takes ", forecast.download);
+        PrintEstimate(L"  Installing takes ", forecast.install);
+    }
+    if (updateStoreApps) {
+        PrintInfo(std::to_wstring(forecast.storeItems) + L" Microsoft Store application(s) to update.");
+        PrintEstimate(L"  Updating them takes ", forecast.store);
+    }
+    PrintSuccess(L"Expect the run to take about " + FormatDuration(forecast.total.expected) + L", plan for up to " + FormatDuration(forecast.total.high) + L'.');
+    return true;
+}
+
+// Appends what's new in the Windows Update history to "path". The high-water mark is kept
+// next to it, so every destination has its own. A full export starts the file over.
+[[nodiscard]] static inline bool ExportUpdateHistory(const std::wstring &path, const bool full)
+{
+    PrintToConsole(L"Exporting the Windows Update history ......", ConsoleTextColor::Cyan, false);
+    WuaUpdateBackend backend = {};
+    if (!backend.initialize()) {
+        return false;
+    }
+    const std::wstring markPath = (path + L".mark");
+    HistoryMark since = {};
+    if (!full) {
+        MappedFile markFile = {};
+        if (markFile.open(markPath)) {
+            since = ParseHistoryMark(markFile.data(), markFile.size());
+        }
+    }
+    HistoryExport result = {};
+    {
+        AppendOnlyFile output = {};
+        if (!output.open(path, !full)) {
+            return false;
+        }
+        if (!ExportHistory(backend, since, [&output](const std::string_view lines){ return output.write(lines.data(), lines.size()); }, result)) {
+            PrintError(L"Failed to export the Windows Update history.");
+            return false;
+        }
+    }
+    // Only once the entries are on the disk, a failed export is done again next time.
+    if ((result.exported > 0) && !WriteFileAtomically(markPath, &result.mark, sizeof(result.mark))) {
+        PrintError(L"Failed to save the history mark to " + markPath);
+        return false;
+    }
+    PrintSuccess(L"Exported " + std::to_wstring(result.exported) + L" new of " + std::to_wstring(result.total) + L" history entries to " + path);
+    return true;
+}
+
+[[nodiscard]] static inline bool ReplaySessionLog(const std::wstring &path, const double speed)
+{
+    PrintToConsole(L"Replaying " + path + L" ......", ConsoleTextColor::Cyan, false);
+    MappedFile file = {};
+    if (!file.open(path)) {
+        PrintError(L"Failed to open the session log " + path);
+        return false;
+    }
+    const auto data = static_cast<const uint8_t *>(file.data());
+    SessionReplay replay = {};
+    replay.setSpeed(speed);
+    if (!replay.open(std::vector<uint8_t>(data, data + file.size()))) {
+        PrintError(L"Not a session log: " + path);
+        return false;
+    }
+    file.close();
+    ConsoleReporter reporter = {};
+    return ReplaySession(replay, reporter);
+}
+
+// The whole executor: "job" continues on a thread pool thread, which lives in the MTA,
+// so blocking there doesn't hold up anything else. Whoever awaits the result is the join point.
+[[nodiscard]] static inline winrt::Windows::Foundation::IAsyncOperation<bool> RunOnWorkerThread(const std::function<bool()> job)
+{
+    co_await winrt::resume_background();
+    co_return job();
+}
+
+// The COM and WinRT objects behind both update paths, creating them is a good part of what
+// a check costs. A one shot run throws them away afterwards, the daemon keeps them warm.
+struct UpdateSessions
+{
+    std::optional<InstallControlStoreBackend> store = std::nullopt;
+    std::optional<WuaUpdateBackend> system = std::nullopt;
+};
+
+// Returns the exit code, "kDeadlineExitCode" if the run was stopped because something ran
+// out of time. Everything that didn't make it is left for the next run.
+[[nodiscard]] static inline int RunUpdates(UpdateSessions &sessions, const bool updateStoreApps, const bool updateSystem, const UpdateOptions &options, SessionRecorder *recorder)
+{
+    RunMetrics::instance().reset();
+    ProgressPublisher::instance().reset();
+    if (!IsInternetAvailable()) {
+        PrintError(L"You need to connect to the Internet first!");
+        return EXIT_FAILURE;
+    }
+    Watchdog watchdog(options.deadlines);
+    SuperviseRun(watchdog);
+    // Whatever the run observes improves the next "--plan", failed runs included.
+    ThroughputHistory history = {};
+    LoadThroughputHistory(history);
+    // The Store and Windows Update are unrelated services, so both paths run side by side
+    // and the whole thing takes as long as the slower one. A session log is a single
+    // sequence though, recording runs them one after the other.
+    bool succeeded = true;
+    std::vector<winrt::Windows::Foundation::IAsyncOperation<bool>> jobs = {};
+    const auto join = [&succeeded](const winrt::Windows::Foundation::IAsyncOperation<bool> &job){
+        if (!job.get()) {
+            succeeded = false;
+        }
+    };
+    if (updateStoreApps) {
+        jobs.push_back(RunOnWorkerThread([&sessions, &options, recorder, &watchdog, &history](){ return UpdateMicrosoftStoreApps(sessions.store, options, recorder, &watchdog, &history); }));
+        if (recorder) {
+            join(jobs.back());
+            jobs.pop_back();
+        }
+    }
+    if (updateSystem) {
+        jobs.push_back(RunOnWorkerThread([&sessions, &options, recorder, &watchdog, &history](){ return UpdateSystem(sessions.system, options, recorder, &watchdog, &history); }));
+    }
+    for (auto &&job : std::as_const(jobs)) {
+        join(job);
+    }
+    watchdog.stop();
+    SaveThroughputHistory(history);
+    if (updateSystem) {
+        RunMetrics::instance().setRebootRequired(IsRebootRequired());
+    }
+    if (watchdog.token().isCancelled()) {
+        PrintError(L"Stopped, " + watchdog.token().reason() + L". Whatever is left will be done by the next run.");
+        return kDeadlineExitCode;
+    }
+    return (succeeded ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+[[nodiscard]] static inline bool RequestRescan()
+{
+    const HANDLE rescanEvent = ::OpenEventW(EVENT_MODIFY_STATE, FALSE, kRescanEventName);
+    if (!rescanEvent) {
+        const DWORD dwError = ::GetLastError();
+        if (dwError == ERROR_FILE_NOT_FOUND) {
+            PrintError(L"No daemon is running.");
+        } else {
+            PrintError(L"OpenEventW", dwError);
+        }
+        return false;
+    }
+    const bool ok = (::SetEvent(rescanEvent) != FALSE);
+    if (!ok) {
+        PrintError(L"SetEvent", ::GetLastError());
+    }
+    if (::CloseHandle(rescanEvent) == FALSE) {
+        PrintError(L"CloseHandle", ::GetLastError());
+    }
+    return ok;
+}
+
+// Publishes the progress snapshot for as long as it lives. Only one updater can do that,
+// one started while another is running leaves the region to the first.
+class ProgressRegion
+{
+public:
+    ProgressRegion() = default;
+
+    ~ProgressRegion()
+    {
+        close();
+    }
+
+    ProgressRegion(const ProgressRegion &) = delete;
+    ProgressRegion &operator=(const ProgressRegion &) = delete;
+
+    [[nodiscard]] inline bool open()
+    {
+        close();
+        m_mapping = ::CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, DWORD(kProgressRegionSize), kProgressRegionName);
+        if (!m_mapping) {
+            PrintError(L"CreateFileMappingW", ::GetLastError());
+            return false;
+        }
+        if (::GetLastError() == ERROR_ALREADY_EXISTS) {
+            PrintInfo(L"Another instance is publishing its progress already, this one won't.");
+            close();
+            return false;
+        }
+        m_view = ::MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, kProgressRegionSize);
+        if (!m_view) {
+            PrintError(L"MapViewOfFile", ::GetLastError());
+            close();
+            return false;
+        }
+        ProgressPublisher::instance().attach(m_view, uint32_t(::GetCurrentProcessId()));
+        return true;
+    }
+
+    inline void close()
+    {
+        if (m_view) {
+            ProgressPublisher::instance().attach(nullptr, 0);
+            if (::UnmapViewOfFile(m_view) == FALSE) {
+                PrintError(L"UnmapViewOfFile", ::GetLastError());
+            }
+            m_view = nullptr;
+        }
+        if (m_mapping) {
+            if (::CloseHandle(m_mapping) == FALSE) {
+                PrintError(L"CloseHandle", ::GetLastError());
+            }
+            m_mapping = nullptr;
+        }
+    }
+
+private:
+    HANDLE m_mapping = nullptr;
+    void *m_view = nullptr;
+};
+
+static constexpr const std::array<std::wstring_view, 2> kProgressTargetNames = { L"Windows", L"Microsoft Store" }; // By "MetricTarget".
+
+// The reading side, what a monitoring agent would do. The region is only mapped for the
+// copy, so that it goes away with the updater. "quiet" leaves a missing region unreported.
+[[nodiscard]] static inline bool ReadSharedProgress(ProgressSnapshot &snapshot, DWORD &processId, const bool quiet)
+{
+    const HANDLE mapping = ::OpenFileMappingW(FILE_MAP_READ, FALSE, kProgressRegionName);
+    if (!mapping) {
+        const DWORD dwError = ::GetLastError();
+        if (dwError == ERROR_FILE_NOT_FOUND) {
+            if (!quiet) {
+                PrintError(L"No update is running.");
+            }
+        } else {
+            PrintError(L"OpenFileMappingW", dwError);
+        }
+        return false;
+    }
+    const void *view = ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, kProgressRegionSize);
+    if (!view) {
+        PrintError(L"MapViewOfFile", ::GetLastError());
+        ::CloseHandle(mapping); // ###
+        return false;
+    }
+    const bool ok = ReadProgressSnapshot(view, kProgressRegionSize, snapshot);
+    processId = static_cast<const ProgressRegionHeader *>(view)->processId;
+    if (::UnmapViewOfFile(view) == FALSE) {
+        PrintError(L"UnmapViewOfFile", ::GetLastError());
+    }
+    if (::CloseHandle(mapping) == FALSE) {
+        PrintError(L"CloseHandle", ::GetLastError());
+    }
+    if (!ok) {
+        PrintError(L"The progress of the running update could not be read.");
+        return false;
+    }
+    return true;
+}
+
+// "Windows: updating, 3 done, 0 failed, 7 in this pass, 120/800 MiB"
+[[nodiscard]] static inline std::wstring DescribeProgressTarget(const std::size_t target, const ProgressTarget &state)
+{
+    std::wstring text = (std::wstring(kProgressTargetNames.at(target)) + L": " + Utf8ToUtf16(GetProgressPhaseName(state.phase)) + L", " + std::to_wstring(state.completed) + L" done, " + std::to_wstring(state.failed) + L" failed");
+    if (state.planned > 0) {
+        text += (L", " + std::to_wstring(state.planned) + L" in this pass");
+    }
+    if (state.bytesTotal > 0) {
+        text += (L", " + std::to_wstring(state.bytesDone >> 20) + L'/' + std::to_wstring(state.bytesTotal >> 20) + L" MiB");
+    }
+    return text;
+}
+
+[[nodiscard]] static inline bool ShowProgress()
+{
+    ProgressSnapshot snapshot = {};
+    DWORD processId = 0;
+    if (!ReadSharedProgress(snapshot, processId, false)) {
+        return false;
+    }
+    PrintInfo(L"Process " + std::to_wstring(processId) + L", last update " + std::to_wstring(std::max(int64_t(0), (GetCurrentUnixTime() * 1000) - snapshot.updated) / 1000) + L" seconds ago.");
+    for (std::size_t target = 0; target != kProgressTargetNames.size(); ++target) {
+        const ProgressTarget &state = snapshot.targets[target];
+        if (state.phase == ProgressPhase::Idle) {
+            continue;
         }
-        Microsoft::WRL::ComPtr<IAutomaticUpdatesResults> pAutomaticUpdatesResults = nullptr;
-        hr = pAutomaticUpdates->get_Results(pAutomaticUpdatesResults.GetAddressOf());
-        if (FAILED(hr)) {
-            PrintError(L"IAutomaticUpdates2::get_Results", HRESULT_CODE(hr));
-            return;
+        PrintInfo(DescribeProgressTarget(target, state));
+        if (state.failed > 0) {
+            PrintInfo(L"  Last error: " + GetSystemErrorMessage(DWORD(state.lastError)));
         }
-        break;
-#else
-        Microsoft::WRL::ComPtr<IUpdateSession3> pUpdateSession = nullptr;
-        HRESULT hr = ::CoCreateInstance(CLSID_UpdateSession, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(pUpdateSession.GetAddressOf()));
-        if (FAILED(hr)) {
-            PrintError(L"CoCreateInstance", HRESULT_CODE(hr));
-            return;
+        for (auto &&item : state.items) {
+            if (item.active != 0) {
+                PrintInfo(std::wstring((PipelineStage(item.stage) == PipelineStage::Download) ? L"  Downloading " : L"  Installing ") + GetProgressName(item.name) + L": " + std::to_wstring(item.percent) + L'%');
+            }
         }
-        const BSTR appId = ScopedBSTR(kAppName);
-        hr = pUpdateSession->put_ClientApplicationID(appId);
-        if (FAILED(hr)) {
-            PrintError(L"IUpdateSession3::put_ClientApplicationID", HRESULT_CODE(hr));
-            return;
+    }
+    return true;
+}
+
+// Held by the instance doing the updating for as long as it's running. A leader that
+// crashed leaves the mutex abandoned, which is as good as released.
+class LeaderLock
+{
+public:
+    LeaderLock() = default;
+
+    ~LeaderLock()
+    {
+        release();
+    }
+
+    LeaderLock(const LeaderLock &) = delete;
+    LeaderLock &operator=(const LeaderLock &) = delete;
+
+    // Returns false if the lock is still taken after "timeout" milliseconds.
+    [[nodiscard]] inline bool acquire(const DWORD timeout)
+    {
+        if (m_owned) {
+            return true;
         }
-        Microsoft::WRL::ComPtr<IUpdateSearcher3> pUpdateSearcher = nullptr;
-        hr = pUpdateSession->CreateUpdateSearcher(reinterpret_cast<IUpdateSearcher **>(pUpdateSearcher.GetAddressOf()));
-        if (FAILED(hr)) {
-            PrintError(L"IUpdateSession3::CreateUpdateSearcher", HRESULT_CODE(hr));
-            return;
+        if (!m_mutex) {
+            m_mutex = ::CreateMutexW(nullptr, FALSE, kLeaderMutexName);
+            if (!m_mutex) {
+                PrintError(L"CreateMutexW", ::GetLastError());
+                return false;
+            }
         }
-#if 0 // "put_CanAutomaticallyUpgradeService()" always fail, don't know why.
-        hr = pUpdateSearcher->put_CanAutomaticallyUpgradeService(VARIANT_TRUE);
-        if (FAILED(hr)) {
-            PrintError(L"IUpdateSearcher3::put_CanAutomaticallyUpgradeService", HRESULT_CODE(hr));
-            return;
+        const DWORD result = ::WaitForSingleObject(m_mutex, timeout);
+        if ((result == WAIT_OBJECT_0) || (result == WAIT_ABANDONED)) {
+            m_owned = true;
+            return true;
         }
-#endif
-        hr = pUpdateSearcher->put_Online(VARIANT_TRUE);
-        if (FAILED(hr)) {
-            PrintError(L"IUpdateSearcher3::put_Online", HRESULT_CODE(hr));
-            return;
+        if (result != WAIT_TIMEOUT) {
+            PrintError(L"WaitForSingleObject", ::GetLastError());
         }
-        hr = pUpdateSearcher->put_ServerSelection(ssWindowsUpdate);
-        if (FAILED(hr)) {
-            PrintError(L"IUpdateSearcher3::put_ServerSelection", HRESULT_CODE(hr));
-            return;
+        return false;
+    }
+
+    inline void release()
+    {
+        if (m_owned) {
+            if (::ReleaseMutex(m_mutex) == FALSE) {
+                PrintError(L"ReleaseMutex", ::GetLastError());
+            }
+            m_owned = false;
         }
-        hr = pUpdateSearcher->put_IncludePotentiallySupersededUpdates(VARIANT_FALSE);
-        if (FAILED(hr)) {
-            PrintError(L"IUpdateSearcher3::put_IncludePotentiallySupersededUpdates", HRESULT_CODE(hr));
-            return;
+        if (m_mutex) {
+            if (::CloseHandle(m_mutex) == FALSE) {
+                PrintError(L"CloseHandle", ::GetLastError());
+            }
+            m_mutex = nullptr;
         }
-        const BSTR criteria = ScopedBSTR(L"( IsInstalled = 0 AND IsHidden = 0 )");
-        Microsoft::WRL::ComPtr<ISearchResult> pSearchResult = nullptr;
-        hr = pUpdateSearcher->Search(criteria, pSearchResult.GetAddressOf());
-        if (FAILED(hr)) {
-            PrintError(L"IUpdateSearcher3::Search", HRESULT_CODE(hr));
-            return;
+    }
+
+private:
+    HANDLE m_mutex = nullptr;
+    bool m_owned = false;
+};
+
+// The leader's end of the pipe: every follower sends one "CoordinationRequest" and gets
+// "Accepted" right away, then "Finished" once the pass covering it is done. Each follower
+// gets a thread of its own while it waits, there are only ever a handful of them. All
+// pipe I/O is overlapped, so that "stop()" can interrupt whatever is pending.
+class CoordinationServer
+{
+public:
+    explicit CoordinationServer(RunCoordinator &coordinator) : m_coordinator(coordinator)
+    {
+    }
+
+    ~CoordinationServer()
+    {
+        stop();
+    }
+
+    CoordinationServer(const CoordinationServer &) = delete;
+    CoordinationServer &operator=(const CoordinationServer &) = delete;
+
+    // "onRequest" is called once a request was merged, a daemon uses it to wake up.
+    [[nodiscard]] inline bool start(std::function<void()> onRequest)
+    {
+        m_onRequest = std::move(onRequest);
+        m_stopEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (!m_stopEvent) {
+            PrintError(L"CreateEventW", ::GetLastError());
+            return false;
         }
-        OperationResultCode searchResultCode = orcNotStarted;
-        hr = pSearchResult->get_ResultCode(&searchResultCode);
-        if (FAILED(hr)) {
-            PrintError(L"ISearchResult::get_ResultCode", HRESULT_CODE(hr));
-            return;
+        // Being the first instance makes sure nobody else squats on the name.
+        const HANDLE pipe = createPipe(true);
+        if (!pipe) {
+            return false;
         }
-        if (searchResultCode != orcSucceeded) {
-            PrintError(L"Failed to search for Windows updates.");
+        m_listener = std::thread([this, pipe](){ listen(pipe); });
+        return true;
+    }
+
+    // Followers waiting for a pass that will never come are told to take over themselves.
+    inline void stop()
+    {
+        if (!m_stopEvent) {
             return;
         }
-        Microsoft::WRL::ComPtr<IUpdateCollection> pUpdateCollection = nullptr;
-        hr = pSearchResult->get_Updates(pUpdateCollection.GetAddressOf());
-        if (FAILED(hr)) {
-            PrintError(L"ISearchResult::get_Updates", HRESULT_CODE(hr));
-            return;
+        m_coordinator.shutdown();
+        if (::SetEvent(m_stopEvent) == FALSE) {
+            PrintError(L"SetEvent", ::GetLastError());
         }
-        LONG updateCount = 0;
-        hr = pUpdateCollection->get_Count(&updateCount);
-        if (FAILED(hr)) {
-            PrintError(L"IUpdateCollection::get_Count", HRESULT_CODE(hr));
-            return;
+        if (m_listener.joinable()) {
+            m_listener.join();
         }
-        if (updateCount < 1) {
-            break;
+        for (auto &&client : m_clients) {
+            client.thread.join();
         }
-        Microsoft::WRL::ComPtr<IUpdateDownloader> pUpdateDownloader = nullptr;
-        hr = pUpdateSession->CreateUpdateDownloader(pUpdateDownloader.GetAddressOf());
-        if (FAILED(hr)) {
-            PrintError(L"IUpdateSession3::CreateUpdateDownloader", HRESULT_CODE(hr));
-            return;
+        m_clients.clear();
+        ::CloseHandle(m_stopEvent); // ###
+        m_stopEvent = nullptr;
+    }
+
+private:
+    struct Client
+    {
+        std::thread thread = {};
+        std::atomic_bool finished = false;
+    };
+
+    [[nodiscard]] inline HANDLE createPipe(const bool first)
+    {
+        const HANDLE pipe = ::CreateNamedPipeW(kCoordinationPipeName, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+            PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, PIPE_UNLIMITED_INSTANCES,
+            DWORD(sizeof(CoordinationReply) * 2), DWORD(sizeof(CoordinationRequest)), 0, nullptr);
+        if (pipe == INVALID_HANDLE_VALUE) {
+            PrintError(L"CreateNamedPipeW", ::GetLastError());
+            return nullptr;
         }
-        hr = pUpdateDownloader->put_Updates(pUpdateCollection.Get());
-        if (FAILED(hr)) {
-            PrintError(L"IUpdateDownloader::put_Updates", HRESULT_CODE(hr));
-            return;
+        return pipe;
+    }
+
+    // Runs one overlapped operation on "pipe" to its end, or until "stop()" interrupts it.
+    [[nodiscard]] inline bool complete(const HANDLE pipe, const std::function<BOOL(OVERLAPPED *)> &operation, DWORD &transferred)
+    {
+        OVERLAPPED overlapped = {};
+        overlapped.hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (!overlapped.hEvent) {
+            PrintError(L"CreateEventW", ::GetLastError());
+            return false;
         }
-        Microsoft::WRL::ComPtr<IDownloadResult> pDownloadResult = nullptr;
-        hr = pUpdateDownloader->Download(pDownloadResult.GetAddressOf());
-        if (FAILED(hr)) {
-            PrintError(L"IUpdateDownloader::Download", HRESULT_CODE(hr));
-            return;
+        bool ok = false;
+        if (operation(&overlapped) != FALSE) {
+            ok = (::GetOverlappedResult(pipe, &overlapped, &transferred, FALSE) != FALSE);
+        } else {
+            const DWORD dwError = ::GetLastError();
+            if (dwError == ERROR_PIPE_CONNECTED) {
+                ok = true;
+            } else if (dwError == ERROR_IO_PENDING) {
+                const std::array<HANDLE, 2> handles = { overlapped.hEvent, m_stopEvent };
+                if (::WaitForMultipleObjects(DWORD(handles.size()), handles.data(), FALSE, INFINITE) != WAIT_OBJECT_0) {
+                    ::CancelIoEx(pipe, &overlapped); // ###
+                }
+                // Whatever happened, the operation must be over before "overlapped" goes away.
+                ok = (::GetOverlappedResult(pipe, &overlapped, &transferred, TRUE) != FALSE);
+            }
         }
-        OperationResultCode downloadResultCode = orcNotStarted;
-        hr = pDownloadResult->get_ResultCode(&downloadResultCode);
-        if (FAILED(hr)) {
-            PrintError(L"IDownloadResult::get_ResultCode", HRESULT_CODE(hr));
-            return;
+        ::CloseHandle(overlapped.hEvent); // ###
+        return ok;
+    }
+
+    [[nodiscard]] inline bool send(const HANDLE pipe, const CoordinationReply &reply)
+    {
+        DWORD transferred = 0;
+        return (complete(pipe, [pipe, &reply](OVERLAPPED *overlapped){ return ::WriteFile(pipe, &reply, DWORD(sizeof(reply)), nullptr, overlapped); }, transferred) && (transferred == sizeof(reply)));
+    }
+
+    inline void listen(HANDLE pipe)
+    {
+        while (pipe) {
+            DWORD transferred = 0;
+            if (!complete(pipe, [pipe](OVERLAPPED *overlapped){ return ::ConnectNamedPipe(pipe, overlapped); }, transferred)) {
+                ::CloseHandle(pipe); // ###
+                if (::WaitForSingleObject(m_stopEvent, 0) == WAIT_OBJECT_0) {
+                    break;
+                }
+                pipe = createPipe(false);
+                continue;
+            }
+            // Threads of followers that are done are cleaned up whenever a new one comes in.
+            m_clients.remove_if([](Client &client){
+                if (!client.finished) {
+                    return false;
+                }
+                client.thread.join();
+                return true;
+            });
+            Client &client = m_clients.emplace_back();
+            client.thread = std::thread([this, pipe, &client](){
+                serve(pipe);
+                ::CloseHandle(pipe); // ### Anything not read yet stays readable for the follower.
+                client.finished = true;
+            });
+            pipe = createPipe(false);
         }
-        if (downloadResultCode != orcSucceeded) {
-            PrintError(L"Failed to download Windows updates.");
+    }
+
+    inline void serve(const HANDLE pipe)
+    {
+        CoordinationRequest request = {};
+        DWORD transferred = 0;
+        if (!complete(pipe, [pipe, &request](OVERLAPPED *overlapped){ return ::ReadFile(pipe, &request, DWORD(sizeof(request)), nullptr, overlapped); }, transferred)
+            || (transferred != sizeof(request)) || !IsValidCoordinationRequest(request)) {
             return;
         }
-        Microsoft::WRL::ComPtr<IUpdateInstaller4> pUpdateInstaller = nullptr;
-        hr = pUpdateSession->CreateUpdateInstaller(reinterpret_cast<IUpdateInstaller **>(pUpdateInstaller.GetAddressOf()));
-        if (FAILED(hr)) {
-            PrintError(L"IUpdateSession3::CreateUpdateInstaller", HRESULT_CODE(hr));
+        CoordinationReply reply = {};
+        const std::optional<uint64_t> pass = m_coordinator.submit(request.targets);
+        if (!pass.has_value()) {
+            (void)send(pipe, reply);
             return;
         }
-        hr = pUpdateInstaller->put_Updates(pUpdateCollection.Get());
-        if (FAILED(hr)) {
-            PrintError(L"IUpdateInstaller4::put_Updates", HRESULT_CODE(hr));
+        PrintInfo(L"Process " + std::to_wstring(request.processId) + L" asked for an update as well, it's merged into the next pass.");
+        EmitEvent("coordination_request", { { "process", request.processId }, { "targets", request.targets }, { "pass", pass.value() } });
+        if (m_onRequest) {
+            m_onRequest();
+        }
+        reply.kind = CoordinationReplyKind::Accepted;
+        reply.pass = pass.value();
+        if (!send(pipe, reply)) {
             return;
         }
-        hr = pUpdateInstaller->put_ForceQuiet(VARIANT_TRUE);
-        if (FAILED(hr)) {
-            PrintError(L"IUpdateInstaller4::put_ForceQuiet", HRESULT_CODE(hr));
+        const std::optional<int> exitCode = m_coordinator.wait(pass.value());
+        reply.kind = (exitCode.has_value() ? CoordinationReplyKind::Finished : CoordinationReplyKind::Rejected);
+        reply.exitCode = exitCode.value_or(0);
+        (void)send(pipe, reply);
+    }
+
+    RunCoordinator &m_coordinator;
+    std::function<void()> m_onRequest = nullptr;
+    HANDLE m_stopEvent = nullptr;
+    std::thread m_listener = {};
+    std::list<Client> m_clients = {}; // Only touched by the listener, and by "stop()" once it's gone.
+};
+
+// Mirrors the leader's progress into our own console while we wait, one line whenever a
+// target enters another phase and the details in the title, like the leader does.
+class ProgressFollower
+{
+public:
+    inline void poll()
+    {
+        ProgressSnapshot snapshot = {};
+        DWORD processId = 0;
+        if (!ReadSharedProgress(snapshot, processId, true)) {
             return;
         }
-        if (win10) {
-            hr = pUpdateInstaller->put_AttemptCloseAppsIfNecessary(VARIANT_TRUE);
-            if (FAILED(hr)) {
-                PrintError(L"IUpdateInstaller4::put_AttemptCloseAppsIfNecessary", HRESULT_CODE(hr));
-                return;
+        for (std::size_t target = 0; target != kProgressTargetNames.size(); ++target) {
+            const ProgressTarget &state = snapshot.targets[target];
+            if (state.phase == ProgressPhase::Idle) {
+                continue;
+            }
+            const std::wstring description = DescribeProgressTarget(target, state);
+            if (state.phase != m_phases.at(target)) {
+                m_phases.at(target) = state.phase;
+                PrintInfo(description);
             }
+            ProgressBoard::instance().update((MetricTarget(target) == MetricTarget::Windows) ? ProgressSource::Windows : ProgressSource::Store, description);
         }
-        Microsoft::WRL::ComPtr<IInstallationResult> pInstallationResult = nullptr;
-        hr = pUpdateInstaller->Install(pInstallationResult.GetAddressOf());
-        if (FAILED(hr)) {
-            PrintError(L"IUpdateInstaller4::Install", HRESULT_CODE(hr));
-            return;
+    }
+
+private:
+    std::array<ProgressPhase, 2> m_phases = { ProgressPhase::Idle, ProgressPhase::Idle };
+};
+
+// Hands "targets" to the running leader and waits for the pass covering them. Returns its
+// exit code, nothing if there's no leader to attach to (anymore), in which case the caller
+// should become the next one.
+[[nodiscard]] static inline std::optional<int> AttachToLeader(const uint32_t targets, const Deadline &deadline)
+{
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    while (true) {
+        pipe = ::CreateFileW(kCoordinationPipeName, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+        if (pipe != INVALID_HANDLE_VALUE) {
+            break;
         }
-        OperationResultCode installationResultCode = orcNotStarted;
-        hr = pInstallationResult->get_ResultCode(&installationResultCode);
-        if (FAILED(hr)) {
-            PrintError(L"IInstallationResult::get_ResultCode", HRESULT_CODE(hr));
-            return;
+        const DWORD dwError = ::GetLastError();
+        if (dwError != ERROR_PIPE_BUSY) {
+            if (dwError != ERROR_FILE_NOT_FOUND) {
+                PrintError(L"CreateFileW", dwError);
+            }
+            return std::nullopt;
         }
-        if (installationResultCode != orcSucceeded) {
-            PrintError(L"Failed to install Windows updates.");
-            return;
+        if (::WaitNamedPipeW(kCoordinationPipeName, kPipeConnectTimeout) == FALSE) {
+            return std::nullopt;
         }
-        if (win10) {
-            hr = pUpdateInstaller->Commit(0);
-            if (FAILED(hr)) {
-                PrintError(L"IUpdateInstaller4::Commit", HRESULT_CODE(hr));
-                return;
+    }
+    std::optional<int> result = std::nullopt;
+    const auto receive = [pipe, &deadline, &result](CoordinationReply &reply, ProgressFollower &follower){
+        while (true) {
+            DWORD available = 0;
+            if (::PeekNamedPipe(pipe, nullptr, 0, nullptr, &available, nullptr) == FALSE) {
+                return false;
+            }
+            if (available >= sizeof(reply)) {
+                DWORD transferred = 0;
+                return ((::ReadFile(pipe, &reply, DWORD(sizeof(reply)), &transferred, nullptr) != FALSE) && (transferred == sizeof(reply)) && (reply.magic == kCoordinationReplyMagic));
+            }
+            if (deadline.hasExpired()) {
+                PrintError(L"Stopped waiting for the running update, it took longer than the time limit.");
+                result = kDeadlineExitCode;
+                return false;
             }
+            follower.poll();
+            ::Sleep(kFollowInterval);
         }
-#endif
+    };
+    DWORD mode = PIPE_READMODE_MESSAGE;
+    if (::SetNamedPipeHandleState(pipe, &mode, nullptr, nullptr) == FALSE) {
+        PrintError(L"SetNamedPipeHandleState", ::GetLastError());
+    } else {
+        CoordinationRequest request = {};
+        request.targets = targets;
+        request.processId = uint32_t(::GetCurrentProcessId());
+        DWORD transferred = 0;
+        CoordinationReply reply = {};
+        ProgressFollower follower = {};
+        if ((::WriteFile(pipe, &request, DWORD(sizeof(request)), &transferred, nullptr) != FALSE) && receive(reply, follower) && (reply.kind == CoordinationReplyKind::Accepted)) {
+            PrintInfo(L"Another instance is updating right now, following it instead of starting over.");
+            if (receive(reply, follower) && (reply.kind == CoordinationReplyKind::Finished)) {
+                follower.poll();
+                PrintInfo(L"The update this instance was waiting for is done.");
+                result = reply.exitCode;
+            }
+        }
+    }
+    if (::CloseHandle(pipe) == FALSE) {
+        PrintError(L"CloseHandle", ::GetLastError());
+    }
+    return result;
+}
+
+// Returns the exit code for "targets" if another instance took care of them, nothing if
+// this one holds "lock" now and has to do the update itself. Without "attach" it waits
+// for the running instance to finish instead of following it.
+[[nodiscard]] static inline std::optional<int> JoinRunningUpdate(LeaderLock &lock, const uint32_t targets, const bool attach, const Deadline &deadline)
+{
+    if (lock.acquire(0)) {
+        return std::nullopt;
+    }
+    if (attach) {
+        if (const std::optional<int> exitCode = AttachToLeader(targets, deadline)) {
+            return exitCode;
+        }
+        // The leader is on its way out, or not listening yet.
+    }
+    PrintInfo(L"Another instance is updating right now, waiting for it to finish first.");
+    ConsoleWriter::instance().flush();
+    const auto timeout = (deadline.isInfinite() ? DWORD{ INFINITE } : DWORD(std::min<int64_t>(deadline.remaining().count(), INFINITE - 1)));
+    if (lock.acquire(timeout)) {
+        return std::nullopt;
+    }
+    if (deadline.hasExpired()) {
+        PrintError(L"Stopped waiting for the running update, it took longer than the time limit.");
+        return kDeadlineExitCode;
+    }
+    return EXIT_FAILURE;
+}
+
+// Never returns unless the rescan event can't be used. Scans every "interval" minutes and
+// whenever another instance started with "--rescan" signals the event in between, or
+// attaches to it with a request of its own, which is then merged into the next pass.
+[[nodiscard]] static inline bool RunDaemon(const uint32_t interval, const bool updateStoreApps, const bool updateSystem, const UpdateOptions &options, const std::wstring &metricsPath)
+{
+    const HANDLE rescanEvent = ::CreateEventW(nullptr, FALSE, FALSE, kRescanEventName);
+    if (!rescanEvent) {
+        PrintError(L"CreateEventW", ::GetLastError());
+        return false;
+    }
+    if (::GetLastError() == ERROR_ALREADY_EXISTS) {
+        PrintInfo(L"Another daemon may be running already, both of them will answer \"--rescan\".");
+    }
+    RunCoordinator coordinator = {};
+    CoordinationServer server(coordinator);
+    if (!server.start([rescanEvent](){ ::SetEvent(rescanEvent); })) {
+        PrintError(L"Other instances can't attach to the daemon, they will wait for it instead.");
+    }
+    const uint32_t ownTargets = GetRunTargets(updateStoreApps, updateSystem);
+    UpdateSessions sessions = {};
+    bool succeeded = true;
+    while (true) {
+        (void)coordinator.submit(ownTargets);
+        const uint32_t targets = coordinator.beginPass(false);
+        const int result = RunUpdates(sessions, ((targets & kStoreTarget) != 0), ((targets & kSystemTarget) != 0), options, nullptr);
+        coordinator.finishPass(result);
+        if (!metricsPath.empty()) {
+            SaveMetrics(metricsPath, (result == EXIT_SUCCESS));
+        }
+        if (result == kDeadlineExitCode) {
+            // Whatever got stuck may have left its session in a bad state.
+            sessions.store.reset();
+            sessions.system.reset();
+        }
+        if (result != EXIT_SUCCESS) {
+            PrintError(L"The last check failed, trying again at the next one.");
+        }
+        PrintInfo(L"Checking again in " + std::to_wstring(interval) + L" minutes, or when \"--rescan\" asks for it.");
+        ConsoleWriter::instance().flush();
+        const DWORD waitResult = ::WaitForSingleObject(rescanEvent, DWORD(interval) * 60 * 1000);
+        if ((waitResult != WAIT_OBJECT_0) && (waitResult != WAIT_TIMEOUT)) {
+            PrintError(L"WaitForSingleObject", ::GetLastError());
+            succeeded = false;
+            break;
+        }
+    }
+    server.stop();
+    if (::CloseHandle(rescanEvent) == FALSE) {
+        PrintError(L"CloseHandle", ::GetLastError());
+    }
+    return succeeded;
+}
+
+// Turns stdout into a pure NDJSON stream, the human readable text moves to stderr.
+static inline void EnableEventStream()
+{
+    const HANDLE hStdOut = ::GetStdHandle(STD_OUTPUT_HANDLE);
+    if (!hStdOut || (hStdOut == INVALID_HANDLE_VALUE)) {
+        PrintError(L"GetStdHandle", ::GetLastError());
+        return;
+    }
+    ConsoleWriter::instance().flush();
+    ConsoleWriter::instance().reserveStandardOutput();
+    EventStream::instance().setWriter([hStdOut](const std::string_view line){
+        static std::mutex mutex;
+        const std::scoped_lock lock(mutex);
+        DWORD written = 0;
+        if (::WriteFile(hStdOut, line.data(), DWORD(line.size()), &written, nullptr) == FALSE) {
+            // ###
+        }
+    });
+}
+
+// COM and WinRT are only brought up for the paths that talk to Windows Update or the
+// Store, "--help", "--version", simulations and replays never pay for them.
+class ScopedApartment
+{
+public:
+    ScopedApartment()
+    {
+        winrt::init_apartment(winrt::apartment_type::multi_threaded);
+    }
+
+    ~ScopedApartment()
+    {
+        winrt::uninit_apartment();
     }
 
-    PrintSuccess(L"Your Windows is update to date!");
+    ScopedApartment(const ScopedApartment &) = delete;
+    ScopedApartment &operator=(const ScopedApartment &) = delete;
+};
+
+// Only wait for <ENTER> if somebody can press it, a pipe or a file would hang us forever.
+[[nodiscard]] static inline bool IsInteractiveConsole()
+{
+    const HANDLE hStdIn = ::GetStdHandle(STD_INPUT_HANDLE);
+    if (!hStdIn || (hStdIn == INVALID_HANDLE_VALUE)) {
+        return false;
+    }
+    DWORD mode = 0;
+    return (::GetConsoleMode(hStdIn, &mode) != FALSE);
 }
 
 static inline void InitializeConsole()
@@ -636,38 +3450,265 @@ EXTERN_C int WINAPI wmain(int argc, wchar_t *argv[])
     std::setlocale(LC_ALL, "en_US.UTF-8");
     WinUpdate::InitializeConsole();
 
-    winrt::init_apartment(winrt::apartment_type::single_threaded);
+    // Only set once a real run finished, "--help" and "--version" never wait.
+    bool waitForExit = false;
 
-    if (WinUpdate::IsInternetAvailable()) {
-        const SysCmdLine::Option updateStoreAppsOption("update-store-apps", "Update Microsoft Store applications");
-        const SysCmdLine::Option updateSystemOption("update-system", "Update Windows");
-        SysCmdLine::Command rootCommand(SysCmdLine::appName(), "A convenient tool to update Microsoft Store applications and Windows.");
-        rootCommand.addVersionOption("1.0.0.0");
-        rootCommand.addHelpOption(true, true);
-        rootCommand.addOption(updateStoreAppsOption);
-        rootCommand.addOption(updateSystemOption);
-        rootCommand.setHandler([&updateStoreAppsOption, &updateSystemOption](const SysCmdLine::Parser &parser) -> int {
-            if (parser.optionIsSet(updateStoreAppsOption)) {
-                WinUpdate::UpdateMicrosoftStoreApps();
+    const SysCmdLine::Option updateStoreAppsOption("update-store-apps", "Update Microsoft Store applications");
+    const SysCmdLine::Option updateSystemOption("update-system", "Update Windows");
+    const SysCmdLine::Option pipelineDepthOption("pipeline-depth", "How many Windows updates may be downloaded ahead of the installer", { SysCmdLine::Argument("depth", "Pipeline depth") });
+    const SysCmdLine::Option storeMaxInFlightOption("store-max-in-flight", "How many Microsoft Store applications may be updated at the same time", { SysCmdLine::Argument("count", "Maximum concurrent updates") });
+    const SysCmdLine::Option storePriorityOption("store-priority", "Package family names (or prefixes) to update first, separated by semicolons", { SysCmdLine::Argument("packages", "Package list") });
+    const SysCmdLine::Option filterOption("filter", "Rules the updates have to match, e.g. \"type=software; category!=Drivers; severity>=important; size<=2048; package!=Microsoft.Xbox\"", { SysCmdLine::Argument("rules", "Filter rules") });
+    const SysCmdLine::Option listOption("list", "Only list the Windows updates that would be installed");
+    const SysCmdLine::Option planOption("plan", "Only estimate how long updating would take, from what earlier runs on this machine observed");
+    const SysCmdLine::Option incrementalOption("incremental", "Only look for follow-on updates after the first pass instead of rescanning everything");
+    const SysCmdLine::Option retriesOption("retries", "How many times a failed Windows update is tried again on its own", { SysCmdLine::Argument("count", "Retries per update") });
+    const SysCmdLine::Option retryBudgetOption("retry-budget", "How many retries the whole run may spend", { SysCmdLine::Argument("count", "Total retries") });
+    const SysCmdLine::Option timeoutOption("timeout", "Stop the whole run after this many minutes, the exit code is 124 then", { SysCmdLine::Argument("minutes", "Total time budget") });
+    const SysCmdLine::Option searchTimeoutOption("search-timeout", "Abort a single search after this many minutes", { SysCmdLine::Argument("minutes", "Search time budget") });
+    const SysCmdLine::Option downloadTimeoutOption("download-timeout", "Abort a single Windows update download after this many minutes", { SysCmdLine::Argument("minutes", "Download time budget") });
+    const SysCmdLine::Option installTimeoutOption("install-timeout", "Abort a single Windows update installation after this many minutes", { SysCmdLine::Argument("minutes", "Installation time budget") });
+    const SysCmdLine::Option storeTimeoutOption("store-timeout", "Abort a single Microsoft Store application update after this many minutes", { SysCmdLine::Argument("minutes", "Store update time budget") });
+    const SysCmdLine::Option cacheTtlOption("cache-ttl", "Trust the last Windows Update search for this many minutes", { SysCmdLine::Argument("minutes", "Cache lifetime") });
+    const SysCmdLine::Option scanPackageOption("scan-package", "Search this offline scan package (wsusscn2.cab) instead of Windows Update, it's registered once and reused while it doesn't change", { SysCmdLine::Argument("file", "Scan package path") });
+    const SysCmdLine::Option outputOption("output", "Output format, \"text\" (default) or \"ndjson\"", { SysCmdLine::Argument("format", "Output format") });
+    const SysCmdLine::Option traceOption("trace", "Write a Chrome/Perfetto trace of the run to the given file", { SysCmdLine::Argument("file", "Trace file path") });
+    const SysCmdLine::Option metricsOption("metrics", "Write Prometheus metrics of every run to the given file, for node-exporter's textfile collector", { SysCmdLine::Argument("file", "Metrics file path") });
+    const SysCmdLine::Option simulateOption("simulate", "Run the update pipeline against a simulated catalog instead of Windows Update", { SysCmdLine::Argument("count", "Simulated update count") });
+    const SysCmdLine::Option recordOption("record", "Record everything Windows Update and the Microsoft Store answered into the given file", { SysCmdLine::Argument("file", "Session log path") });
+    const SysCmdLine::Option replayOption("replay", "Replay a recorded session instead of updating anything", { SysCmdLine::Argument("file", "Session log path") });
+    const SysCmdLine::Option replaySpeedOption("replay-speed", "Replay speed, 1 is the recorded pace and 0 (default) as fast as possible", { SysCmdLine::Argument("factor", "Speed factor") });
+    const SysCmdLine::Option noWaitOption("no-wait", "Exit right away instead of waiting for <ENTER>, for scripts and scheduled tasks");
+    const SysCmdLine::Option daemonOption("daemon", "Keep running and check for updates on a schedule, the sessions stay warm between the checks", { SysCmdLine::Argument("minutes", "Check interval") });
+    const SysCmdLine::Option historyOption("history", "Append the Windows Update history entries added since the last export to the given file, as JSON lines", { SysCmdLine::Argument("file", "History file path") });
+    const SysCmdLine::Option fullHistoryOption("full-history", "Export the whole history again instead, replacing the file");
+    const SysCmdLine::Option progressOption("progress", "Show the progress of the update that's running right now");
+    const SysCmdLine::Option rescanOption("rescan", "Ask a running daemon to check for updates right now");
+    SysCmdLine::Command rootCommand(SysCmdLine::appName(), "A convenient tool to update Microsoft Store applications and Windows.");
+    rootCommand.addVersionOption("1.0.0.0");
+    rootCommand.addHelpOption(true, true);
+    rootCommand.addOption(updateStoreAppsOption);
+    rootCommand.addOption(updateSystemOption);
+    rootCommand.addOption(pipelineDepthOption);
+    rootCommand.addOption(storeMaxInFlightOption);
+    rootCommand.addOption(storePriorityOption);
+    rootCommand.addOption(filterOption);
+    rootCommand.addOption(listOption);
+    rootCommand.addOption(planOption);
+    rootCommand.addOption(incrementalOption);
+    rootCommand.addOption(retriesOption);
+    rootCommand.addOption(retryBudgetOption);
+    rootCommand.addOption(timeoutOption);
+    rootCommand.addOption(searchTimeoutOption);
+    rootCommand.addOption(downloadTimeoutOption);
+    rootCommand.addOption(installTimeoutOption);
+    rootCommand.addOption(storeTimeoutOption);
+    rootCommand.addOption(cacheTtlOption);
+    rootCommand.addOption(scanPackageOption);
+    rootCommand.addOption(outputOption);
+    rootCommand.addOption(traceOption);
+    rootCommand.addOption(metricsOption);
+    rootCommand.addOption(simulateOption);
+    rootCommand.addOption(recordOption);
+    rootCommand.addOption(replayOption);
+    rootCommand.addOption(replaySpeedOption);
+    rootCommand.addOption(noWaitOption);
+    rootCommand.addOption(daemonOption);
+    rootCommand.addOption(rescanOption);
+    rootCommand.addOption(progressOption);
+    rootCommand.addOption(historyOption);
+    rootCommand.addOption(fullHistoryOption);
+    rootCommand.setHandler([&](const SysCmdLine::Parser &parser) -> int {
+        waitForExit = (!parser.optionIsSet(noWaitOption) && WinUpdate::IsInteractiveConsole());
+        if (parser.optionIsSet(outputOption)) {
+            const std::string format = parser.valueForOption(outputOption, "format").toString();
+            if (format == "ndjson") {
+                WinUpdate::EnableEventStream();
+            } else if (format != "text") {
+                WinUpdate::PrintError(L"Unknown output format: " + WinUpdate::Utf8ToUtf16(format));
+                return EXIT_FAILURE;
             }
-            if (parser.optionIsSet(updateSystemOption)) {
-                WinUpdate::UpdateSystem();
+        }
+        WinUpdate::UpdateOptions options = {};
+        if (parser.optionIsSet(pipelineDepthOption)) {
+            const int depth = parser.valueForOption(pipelineDepthOption, "depth").toInt();
+            if (depth > 0) {
+                options.pipelineDepth = std::size_t(depth);
             }
-            return EXIT_SUCCESS;
-        });
-        SysCmdLine::Parser parser(rootCommand);
-        parser.setDisplayOptions(SysCmdLine::Parser::ShowOptionalOptionsOnUsage);
-        parser.setText(SysCmdLine::Parser::Top, "Thanks a lot for using Windows Updater, a small tool from wangwenx190's utility tools collection.");
-        parser.setText(SysCmdLine::Parser::Bottom, "Please checkout https://github.com/wangwenx190/winupdate/ for more information.");
-        parser.invoke(SysCmdLine::commandLineArguments(), EXIT_FAILURE, SysCmdLine::Parser::IgnoreCommandCase | SysCmdLine::Parser::IgnoreOptionCase | SysCmdLine::Parser::AllowDosStyleOptions);
-    } else {
-        WinUpdate::PrintError(L"You need to connect to the Internet first!");
-    }
+        }
+        if (parser.optionIsSet(storeMaxInFlightOption)) {
+            const int count = parser.valueForOption(storeMaxInFlightOption, "count").toInt();
+            if (count > 0) {
+                options.storeMaxInFlight = std::size_t(count);
+            }
+        }
+        if (parser.optionIsSet(storePriorityOption)) {
+            options.storePriority = WinUpdate::SplitList(WinUpdate::Utf8ToUtf16(parser.valueForOption(storePriorityOption, "packages").toString()));
+        }
+        if (parser.optionIsSet(filterOption)) {
+            std::wstring error = {};
+            if (!options.filter.parse(WinUpdate::Utf8ToUtf16(parser.valueForOption(filterOption, "rules").toString()), error)) {
+                WinUpdate::PrintError(L"Invalid filter: " + error);
+                return EXIT_FAILURE;
+            }
+        }
+        options.incremental = parser.optionIsSet(incrementalOption);
+        if (parser.optionIsSet(retriesOption)) {
+            const int count = parser.valueForOption(retriesOption, "count").toInt();
+            if (count >= 0) {
+                options.retryLimit = std::size_t(count);
+            }
+        }
+        if (parser.optionIsSet(retryBudgetOption)) {
+            const int count = parser.valueForOption(retryBudgetOption, "count").toInt();
+            if (count >= 0) {
+                options.retryBudget = std::size_t(count);
+            }
+        }
+        const auto parseMinutes = [&parser](const SysCmdLine::Option &option, std::chrono::seconds &budget){
+            if (parser.optionIsSet(option)) {
+                const int minutes = parser.valueForOption(option, "minutes").toInt();
+                if (minutes > 0) {
+                    budget = std::chrono::minutes(minutes);
+                }
+            }
+        };
+        parseMinutes(timeoutOption, options.deadlines.total);
+        parseMinutes(searchTimeoutOption, options.deadlines.search);
+        parseMinutes(downloadTimeoutOption, options.deadlines.download);
+        parseMinutes(installTimeoutOption, options.deadlines.install);
+        parseMinutes(storeTimeoutOption, options.deadlines.store);
+        if (parser.optionIsSet(cacheTtlOption)) {
+            const int minutes = parser.valueForOption(cacheTtlOption, "minutes").toInt();
+            if (minutes > 0) {
+                options.cacheTtl = uint32_t(minutes);
+            }
+        }
+        if (parser.optionIsSet(scanPackageOption)) {
+            options.scanPackage = WinUpdate::Utf8ToUtf16(parser.valueForOption(scanPackageOption, "file").toString());
+        }
+        if (parser.optionIsSet(simulateOption)) {
+            const int count = parser.valueForOption(simulateOption, "count").toInt();
+            return (WinUpdate::RunSimulation(std::size_t(count > 0 ? count : 100), options) ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        if (parser.optionIsSet(replayOption)) {
+            double speed = 0.0;
+            if (parser.optionIsSet(replaySpeedOption)) {
+                speed = std::wcstod(WinUpdate::Utf8ToUtf16(parser.valueForOption(replaySpeedOption, "factor").toString()).c_str(), nullptr);
+            }
+            return (WinUpdate::ReplaySessionLog(WinUpdate::Utf8ToUtf16(parser.valueForOption(replayOption, "file").toString()), speed) ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        if (parser.optionIsSet(rescanOption)) {
+            return (WinUpdate::RequestRescan() ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        if (parser.optionIsSet(progressOption)) {
+            return (WinUpdate::ShowProgress() ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        std::wstring metricsPath = {};
+        if (parser.optionIsSet(metricsOption)) {
+            metricsPath = WinUpdate::Utf8ToUtf16(parser.valueForOption(metricsOption, "file").toString());
+        }
+        const WinUpdate::ScopedApartment apartment = {};
+        if (parser.optionIsSet(listOption)) {
+            return (WinUpdate::ListUpdates(options) ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        if (parser.optionIsSet(planOption)) {
+            if (!parser.optionIsSet(updateStoreAppsOption) && !parser.optionIsSet(updateSystemOption)) {
+                WinUpdate::PrintError(L"The plan needs \"--update-store-apps\" and/or \"--update-system\".");
+                return EXIT_FAILURE;
+            }
+            return (WinUpdate::PlanRun(parser.optionIsSet(updateStoreAppsOption), parser.optionIsSet(updateSystemOption), options) ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        if (parser.optionIsSet(historyOption)) {
+            return (WinUpdate::ExportUpdateHistory(WinUpdate::Utf8ToUtf16(parser.valueForOption(historyOption, "file").toString()), parser.optionIsSet(fullHistoryOption)) ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        const bool updateStoreApps = parser.optionIsSet(updateStoreAppsOption);
+        const bool updateSystem = parser.optionIsSet(updateSystemOption);
+        const uint32_t targets = WinUpdate::GetRunTargets(updateStoreApps, updateSystem);
+        // Only one instance updates at a time, the others hand it their targets and follow it.
+        // A daemon, and runs that record or trace, need a run of their own, they wait for their
+        // turn instead. The time limit applies to the waiting as well, except for the daemon.
+        WinUpdate::LeaderLock leaderLock = {};
+        if (targets != 0) {
+            const bool daemon = parser.optionIsSet(daemonOption);
+            const bool attach = (!daemon && !parser.optionIsSet(recordOption) && !parser.optionIsSet(traceOption));
+            const WinUpdate::Deadline deadline = (daemon ? WinUpdate::Deadline{} : WinUpdate::Deadline::after(options.deadlines.total));
+            if (const std::optional<int> exitCode = WinUpdate::JoinRunningUpdate(leaderLock, targets, attach, deadline)) {
+                return exitCode.value();
+            }
+        }
+        // Monitoring agents can follow a run through the snapshot, "--progress" shows it.
+        WinUpdate::ProgressRegion progressRegion = {};
+        if (targets != 0) {
+            (void)progressRegion.open();
+        }
+        if (parser.optionIsSet(daemonOption)) {
+            if (!parser.optionIsSet(updateStoreAppsOption) && !parser.optionIsSet(updateSystemOption)) {
+                WinUpdate::PrintError(L"The daemon needs \"--update-store-apps\" and/or \"--update-system\".");
+                return EXIT_FAILURE;
+            }
+            const int minutes = parser.valueForOption(daemonOption, "minutes").toInt();
+            return (WinUpdate::RunDaemon(uint32_t(minutes > 0 ? minutes : 60), parser.optionIsSet(updateStoreAppsOption), parser.optionIsSet(updateSystemOption), options, metricsPath) ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        std::wstring tracePath = {};
+        if (parser.optionIsSet(traceOption)) {
+            tracePath = WinUpdate::Utf8ToUtf16(parser.valueForOption(traceOption, "file").toString());
+            WinUpdate::Tracer::instance().enable();
+        }
+        int exitCode = EXIT_SUCCESS;
+        WinUpdate::AppendOnlyFile sessionLog = {};
+        std::unique_ptr<WinUpdate::SessionRecorder> recorder = {};
+        if (parser.optionIsSet(recordOption)) {
+            if (!sessionLog.open(WinUpdate::Utf8ToUtf16(parser.valueForOption(recordOption, "file").toString()))) {
+                return EXIT_FAILURE;
+            }
+            recorder = std::make_unique<WinUpdate::SessionRecorder>([&sessionLog](const void *data, const std::size_t size){ return sessionLog.write(data, size); });
+        }
+        if (targets != 0) {
+            // Whoever attaches meanwhile gets another pass, the exit code is the one of our own.
+            WinUpdate::RunCoordinator coordinator = {};
+            WinUpdate::CoordinationServer server(coordinator);
+            (void)server.start(nullptr);
+            (void)coordinator.submit(targets);
+            WinUpdate::UpdateSessions sessions = {};
+            bool first = true;
+            while (const uint32_t passTargets = coordinator.beginPass(true)) {
+                if (!first) {
+                    WinUpdate::PrintInfo(L"Another pass for the instances that attached meanwhile.");
+                }
+                const int result = WinUpdate::RunUpdates(sessions, ((passTargets & WinUpdate::kStoreTarget) != 0), ((passTargets & WinUpdate::kSystemTarget) != 0), options, recorder.get());
+                coordinator.finishPass(result);
+                if (!metricsPath.empty()) {
+                    WinUpdate::SaveMetrics(metricsPath, (result == EXIT_SUCCESS));
+                }
+                if (first) {
+                    exitCode = result;
+                    first = false;
+                }
+            }
+            server.stop();
+        }
+        if (!tracePath.empty()) {
+            const std::string trace = WinUpdate::Tracer::instance().serialize();
+            if (WinUpdate::WriteFileAtomically(tracePath, trace.data(), trace.size())) {
+                WinUpdate::PrintInfo(L"The trace has been saved to " + tracePath);
+            }
+        }
+        return exitCode;
+    });
+    SysCmdLine::Parser parser(rootCommand);
+    parser.setDisplayOptions(SysCmdLine::Parser::ShowOptionalOptionsOnUsage);
+    parser.setText(SysCmdLine::Parser::Top, "Thanks a lot for using Windows Updater, a small tool from wangwenx190's utility tools collection.");
+    parser.setText(SysCmdLine::Parser::Bottom, "Please checkout https://github.com/wangwenx190/winupdate/ for more information.");
+    const int exitCode = parser.invoke(SysCmdLine::commandLineArguments(), EXIT_FAILURE, SysCmdLine::Parser::IgnoreCommandCase | SysCmdLine::Parser::IgnoreOptionCase | SysCmdLine::Parser::AllowDosStyleOptions);
 
-    winrt::uninit_apartment();
+    if (waitForExit) {
+        WinUpdate::PrintToConsole(L"\n\n\n--- PRESS THE <ENTER> KEY TO EXIT ---", WinUpdate::ConsoleTextColor::Magenta, false);
+        WinUpdate::ConsoleWriter::instance().flush();
+        std::getchar();
+    }
 
-    WinUpdate::PrintToConsole(L"\n\n\n--- PRESS THE <ENTER> KEY TO EXIT ---", WinUpdate::ConsoleTextColor::Magenta, false);
-    std::getchar();
+    WinUpdate::ConsoleWriter::instance().shutdown();
 
-    return EXIT_SUCCESS;
+    return exitCode;
 }
@@ -0,0 +1,264 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+
+namespace WinUpdate
+{
+
+enum class MetricTarget : uint8_t
+{
+    Windows,
+    Store
+};
+
+enum class MetricPhase : uint8_t
+{
+    DownloadInstall,
+    Commit,
+    Windows,
+    Store
+};
+
+static constexpr const std::array<std::string_view, 2> kMetricTargetNames = { "windows", "store" };
+static constexpr const std::array<std::string_view, 4> kMetricPhaseNames = { "download_install", "commit", "windows", "store" };
+
+// Plain copy of "RunMetrics", durations in milliseconds.
+struct RunMetricsSnapshot
+{
+    std::array<uint64_t, 2> searchCount = {};
+    std::array<uint64_t, 2> searchTime = {};
+    std::array<uint64_t, 4> phaseTime = {};
+    uint64_t downloadedBytes = 0;
+    uint64_t updatesFound = 0;
+    uint64_t updatesInstalled = 0;
+    uint64_t updatesFailed = 0;
+    uint64_t storeItemsUpdated = 0;
+    uint64_t storeItemsFailed = 0;
+    bool rebootRequired = false;
+};
+
+// What one run did, for the metrics file. Every counter is a relaxed atomic: they're bumped
+// from progress and completion callbacks on arbitrary threads and only read once the run
+// is over, so there's nothing to order and nothing to wait for. The byte counter is the only
+// one touched per progress callback, it gets a cache line of its own.
+class RunMetrics
+{
+public:
+    [[nodiscard]] static inline RunMetrics &instance()
+    {
+        static RunMetrics metrics = {};
+        return metrics;
+    }
+
+    // A daemon reports every run on its own.
+    inline void reset()
+    {
+        m_downloadedBytes.store(0, std::memory_order_relaxed);
+        for (std::size_t index = 0; index != m_searchCount.size(); ++index) {
+            m_searchCount.at(index).store(0, std::memory_order_relaxed);
+            m_searchTime.at(index).store(0, std::memory_order_relaxed);
+        }
+        for (auto &&phaseTime : m_phaseTime) {
+            phaseTime.store(0, std::memory_order_relaxed);
+        }
+        m_updatesFound.store(0, std::memory_order_relaxed);
+        m_updatesInstalled.store(0, std::memory_order_relaxed);
+        m_updatesFailed.store(0, std::memory_order_relaxed);
+        m_storeItemsUpdated.store(0, std::memory_order_relaxed);
+        m_storeItemsFailed.store(0, std::memory_order_relaxed);
+        m_rebootRequired.store(false, std::memory_order_relaxed);
+    }
+
+    inline void recordSearch(const MetricTarget target, const uint64_t milliseconds)
+    {
+        m_searchCount.at(std::size_t(target)).fetch_add(1, std::memory_order_relaxed);
+        m_searchTime.at(std::size_t(target)).fetch_add(milliseconds, std::memory_order_relaxed);
+    }
+
+    inline void recordPhase(const MetricPhase phase, const uint64_t milliseconds)
+    {
+        m_phaseTime.at(std::size_t(phase)).fetch_add(milliseconds, std::memory_order_relaxed);
+    }
+
+    inline void addDownloadedBytes(const uint64_t bytes)
+    {
+        m_downloadedBytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    inline void addUpdatesFound(const uint64_t count)
+    {
+        m_updatesFound.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    inline void addUpdateInstalled()
+    {
+        m_updatesInstalled.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline void addUpdatesFailed(const uint64_t count)
+    {
+        m_updatesFailed.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    inline void addStoreItem(const bool succeeded)
+    {
+        (succeeded ? m_storeItemsUpdated : m_storeItemsFailed).fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline void setRebootRequired(const bool required)
+    {
+        m_rebootRequired.store(required, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] inline RunMetricsSnapshot snapshot() const
+    {
+        RunMetricsSnapshot snapshot = {};
+        for (std::size_t index = 0; index != m_searchCount.size(); ++index) {
+            snapshot.searchCount.at(index) = m_searchCount.at(index).load(std::memory_order_relaxed);
+            snapshot.searchTime.at(index) = m_searchTime.at(index).load(std::memory_order_relaxed);
+        }
+        for (std::size_t index = 0; index != m_phaseTime.size(); ++index) {
+            snapshot.phaseTime.at(index) = m_phaseTime.at(index).load(std::memory_order_relaxed);
+        }
+        snapshot.downloadedBytes = m_downloadedBytes.load(std::memory_order_relaxed);
+        snapshot.updatesFound = m_updatesFound.load(std::memory_order_relaxed);
+        snapshot.updatesInstalled = m_updatesInstalled.load(std::memory_order_relaxed);
+        snapshot.updatesFailed = m_updatesFailed.load(std::memory_order_relaxed);
+        snapshot.storeItemsUpdated = m_storeItemsUpdated.load(std::memory_order_relaxed);
+        snapshot.storeItemsFailed = m_storeItemsFailed.load(std::memory_order_relaxed);
+        snapshot.rebootRequired = m_rebootRequired.load(std::memory_order_relaxed);
+        return snapshot;
+    }
+
+private:
+    RunMetrics() = default;
+    ~RunMetrics() = default;
+
+    RunMetrics(const RunMetrics &) = delete;
+    RunMetrics &operator=(const RunMetrics &) = delete;
+
+    alignas(64) std::atomic<uint64_t> m_downloadedBytes = 0;
+    alignas(64) std::array<std::atomic<uint64_t>, 2> m_searchCount = {};
+    std::array<std::atomic<uint64_t>, 2> m_searchTime = {};
+    std::array<std::atomic<uint64_t>, 4> m_phaseTime = {};
+    std::atomic<uint64_t> m_updatesFound = 0;
+    std::atomic<uint64_t> m_updatesInstalled = 0;
+    std::atomic<uint64_t> m_updatesFailed = 0;
+    std::atomic<uint64_t> m_storeItemsUpdated = 0;
+    std::atomic<uint64_t> m_storeItemsFailed = 0;
+    std::atomic_bool m_rebootRequired = false;
+};
+
+static constexpr const std::string_view kLastSuccessMetricName = "winupdate_last_success_timestamp_seconds";
+
+// The Prometheus text exposition format, as node-exporter's textfile collector reads it.
+// "lastSuccess" is 0 if there never was a successful run.
+[[nodiscard]] static inline std::string SerializeMetrics(const RunMetricsSnapshot &metrics, const bool succeeded, const int64_t timestamp, const int64_t lastSuccess)
+{
+    std::string text = {};
+    text.reserve(4096);
+    const auto header = [&text](const std::string_view name, const std::string_view type, const std::string_view help){
+        text.append("# HELP ").append(name).append(1, ' ').append(help).append("\n# TYPE ").append(name).append(1, ' ').append(type).append(1, '\n');
+    };
+    const auto sample = [&text](const std::string_view name, const std::string_view labels, const double value){
+        char buffer[32] = {};
+        std::snprintf(buffer, sizeof(buffer), "%.15g", value);
+        text.append(name);
+        if (!labels.empty()) {
+            text.append(1, '{').append(labels).append(1, '}');
+        }
+        text.append(1, ' ').append(buffer).append(1, '\n');
+    };
+    const auto label = [](const std::string_view key, const std::string_view value){
+        return (std::string(key) + "=\"" + std::string(value) + '"');
+    };
+
+    header("winupdate_search_duration_seconds", "summary", "Time spent searching for updates.");
+    for (std::size_t index = 0; index != kMetricTargetNames.size(); ++index) {
+        const std::string target = label("target", kMetricTargetNames.at(index));
+        sample("winupdate_search_duration_seconds_sum", target, double(metrics.searchTime.at(index)) / 1000.0);
+        sample("winupdate_search_duration_seconds_count", target, double(metrics.searchCount.at(index)));
+    }
+    header("winupdate_phase_duration_seconds", "gauge", "Time spent in each phase of the last run.");
+    for (std::size_t index = 0; index != kMetricPhaseNames.size(); ++index) {
+        sample("winupdate_phase_duration_seconds", label("phase", kMetricPhaseNames.at(index)), double(metrics.phaseTime.at(index)) / 1000.0);
+    }
+    header("winupdate_downloaded_bytes", "gauge", "Bytes of Windows updates downloaded by the last run.");
+    sample("winupdate_downloaded_bytes", {}, double(metrics.downloadedBytes));
+    // Downloads overlap with installations, so this is what the whole pipeline achieved.
+    const uint64_t pipelineTime = metrics.phaseTime.at(std::size_t(MetricPhase::DownloadInstall));
+    header("winupdate_download_throughput_bytes_per_second", "gauge", "Bytes downloaded per second of the download and install phase.");
+    sample("winupdate_download_throughput_bytes_per_second", {}, ((pipelineTime > 0) ? (double(metrics.downloadedBytes) * 1000.0 / double(pipelineTime)) : 0.0));
+    header("winupdate_updates_found", "gauge", "Windows updates the last run set out to install.");
+    sample("winupdate_updates_found", {}, double(metrics.updatesFound));
+    header("winupdate_updates_installed", "gauge", "Windows updates the last run installed.");
+    sample("winupdate_updates_installed", {}, double(metrics.updatesInstalled));
+    header("winupdate_updates_failed", "gauge", "Windows updates the last run gave up on.");
+    sample("winupdate_updates_failed", {}, double(metrics.updatesFailed));
+    header("winupdate_reboot_required", "gauge", "Whether Windows needs a reboot to finish installing updates.");
+    sample("winupdate_reboot_required", {}, (metrics.rebootRequired ? 1.0 : 0.0));
+    header("winupdate_store_items_updated", "gauge", "Microsoft Store applications the last run updated.");
+    sample("winupdate_store_items_updated", {}, double(metrics.storeItemsUpdated));
+    header("winupdate_store_items_failed", "gauge", "Microsoft Store applications the last run failed to update.");
+    sample("winupdate_store_items_failed", {}, double(metrics.storeItemsFailed));
+    header("winupdate_last_run_success", "gauge", "Whether the last run succeeded.");
+    sample("winupdate_last_run_success", {}, (succeeded ? 1.0 : 0.0));
+    header("winupdate_last_run_timestamp_seconds", "gauge", "Unix time the last run finished.");
+    sample("winupdate_last_run_timestamp_seconds", {}, double(timestamp));
+    header(kLastSuccessMetricName, "gauge", "Unix time the last successful run finished.");
+    sample(kLastSuccessMetricName, {}, double(succeeded ? timestamp : lastSuccess));
+    return text;
+}
+
+// The last success of an earlier metrics file, a failed run has to carry it over. 0 if
+// there is none.
+[[nodiscard]] static inline int64_t ParseLastSuccessTimestamp(const std::string_view text)
+{
+    std::size_t offset = 0;
+    while (offset < text.size()) {
+        std::size_t end = text.find('\n', offset);
+        if (end == std::string_view::npos) {
+            end = text.size();
+        }
+        const std::string_view line = text.substr(offset, end - offset);
+        offset = (end + 1);
+        if ((line.size() > (kLastSuccessMetricName.size() + 1)) && (line.substr(0, kLastSuccessMetricName.size()) == kLastSuccessMetricName) && (line.at(kLastSuccessMetricName.size()) == ' ')) {
+            const std::string value(line.substr(kLastSuccessMetricName.size() + 1));
+            return int64_t(std::strtod(value.c_str(), nullptr));
+        }
+    }
+    return 0;
+}
+
+} // namespace WinUpdate
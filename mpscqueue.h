@@ -0,0 +1,93 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+namespace WinUpdate
+{
+
+// Multi-producer single-consumer queue (Dmitry Vyukov's intrusive design). "push()" is
+// wait-free and may be called from any thread, "pop()" must only be called from the one
+// consumer thread. A "pop()" racing with an unfinished "push()" simply reports empty, the
+// element shows up in a later call.
+template <typename T>
+class MpscQueue
+{
+public:
+    MpscQueue() = default;
+
+    ~MpscQueue()
+    {
+        Node *node = m_tail;
+        while (node) {
+            Node *next = node->next.load(std::memory_order_relaxed);
+            if (node != &m_stub) {
+                delete node;
+            }
+            node = next;
+        }
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    inline void push(T value)
+    {
+        const auto node = new Node;
+        node->value = std::move(value);
+        Node *previous = m_head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    [[nodiscard]] inline bool pop(T &value)
+    {
+        Node *tail = m_tail;
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (!next) {
+            return false;
+        }
+        value = std::move(next->value);
+        m_tail = next;
+        if (tail != &m_stub) {
+            delete tail;
+        }
+        return true;
+    }
+
+private:
+    struct Node
+    {
+        std::atomic<Node *> next = nullptr;
+        T value = {};
+    };
+
+    Node m_stub = {};
+    std::atomic<Node *> m_head = &m_stub;
+    Node *m_tail = &m_stub;
+};
+
+} // namespace WinUpdate
@@ -0,0 +1,841 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "backend.h"
+#include "scheduler.h"
+#include "searchcache.h"
+#include "checkpoint.h"
+#include "planner.h"
+#include "filter.h"
+#include "updateindex.h"
+#include "deadline.h"
+#include "metrics.h"
+#include "forecast.h"
+#include "progress.h"
+#include "events.h"
+#include "tracing.h"
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+namespace WinUpdate
+{
+
+static constexpr const auto kDefaultPipelineDepth = std::size_t{ 2 };
+static constexpr const auto kDefaultStoreMaxInFlight = std::size_t{ 4 };
+static constexpr const auto kDefaultRetryLimit = std::size_t{ 3 };
+static constexpr const auto kDefaultRetryBudget = std::size_t{ 16 };
+static constexpr const auto kDefaultRetryDelay = std::chrono::milliseconds{ 5000 };
+static constexpr const auto kMaximumRetryDelay = std::chrono::milliseconds{ 120000 };
+
+static constexpr const std::array<std::wstring_view, 7> kStoreFrameworkPackages =
+{
+    L"Microsoft.VCLibs.",
+    L"Microsoft.NET.Native.",
+    L"Microsoft.UI.Xaml.",
+    L"Microsoft.WindowsAppRuntime.",
+    L"Microsoft.Services.Store.Engagement",
+    L"Microsoft.StorePurchaseApp",
+    L"Microsoft.DesktopAppInstaller"
+};
+
+struct UpdateOptions
+{
+    std::size_t pipelineDepth = kDefaultPipelineDepth;
+    std::size_t storeMaxInFlight = kDefaultStoreMaxInFlight;
+    std::vector<std::wstring> storePriority = {};
+    bool incremental = false;
+    uint32_t cacheTtl = 0; // Minutes, 0 disables the search cache.
+    std::size_t retryLimit = kDefaultRetryLimit; // Retries per failed update.
+    std::size_t retryBudget = kDefaultRetryBudget; // Retries for the whole run.
+    std::chrono::milliseconds retryDelay = kDefaultRetryDelay; // Doubles with every retry.
+    UpdateFilter filter = {}; // What to leave alone, applies to both targets.
+    DeadlineBudget deadlines = {}; // Enforced by whoever runs the watchdog.
+    std::wstring scanPackage = {}; // Offline scan package searched instead of Windows Update, empty for none.
+};
+
+// Where the orchestration sends its human readable messages.
+class UpdateReporter
+{
+public:
+    virtual ~UpdateReporter() = default;
+
+    virtual void info(const std::wstring_view message) = 0;
+    virtual void success(const std::wstring_view message) = 0;
+    // "code" is the HRESULT behind the failure, 0 if there is none.
+    virtual void error(const std::wstring_view message, const int32_t code) = 0;
+    // Short lived status, only the latest one matters. Called from any thread.
+    virtual void progress(const std::wstring_view status) = 0;
+};
+
+// Lower value means the package gets a download slot earlier. Packages explicitly asked for
+// come first, then frameworks, since the applications depending on them can't finish without them.
+[[nodiscard]] static inline int GetStorePackagePriority(const std::wstring_view packageFamilyName, const std::vector<std::wstring> &preferredPackages)
+{
+    for (std::size_t index = 0; index != preferredPackages.size(); ++index) {
+        if (StartsWithNoCase(packageFamilyName, preferredPackages.at(index))) {
+            return int(index);
+        }
+    }
+    const int base = int(preferredPackages.size());
+    for (auto &&framework : kStoreFrameworkPackages) {
+        if (StartsWithNoCase(packageFamilyName, framework)) {
+            return base;
+        }
+    }
+    return (base + 1);
+}
+
+// Updates an earlier pass already took care of, keyed by "UpdateID", valued by revision.
+using HandledUpdates = std::unordered_map<std::wstring, int32_t>;
+
+// WUA can't express "a newer revision of X" in its criteria language, so handled updates are
+// excluded by ID on the server side and newer revisions simply show up in the next full scan.
+// Whatever part of "filter" WUA understands narrows the search down as well.
+[[nodiscard]] static inline std::wstring BuildSearchCriteria(const UpdateFilter &filter, const HandledUpdates &excluded)
+{
+    std::wstring exclusions = {};
+    for (auto &&[id, revision] : std::as_const(excluded)) {
+        (void)revision;
+        exclusions += L" AND UpdateID != '" + id + L'\'';
+    }
+    std::wstring criteria = {};
+    for (auto &&term : filter.criteriaTerms()) {
+        if (!criteria.empty()) {
+            criteria += L" OR ";
+        }
+        criteria += L"( IsInstalled = 0 AND IsHidden = 0";
+        if (!term.empty()) {
+            criteria += L" AND " + term;
+        }
+        criteria += exclusions + L" )";
+    }
+    return criteria;
+}
+
+[[nodiscard]] static inline bool ToSearchCacheRecord(const UpdateDescriptor &update, SearchCacheRecord &record)
+{
+    if (!ParseUpdateGuid(update.id, record.id)) {
+        return false;
+    }
+    record.revision = update.revision;
+    record.kb = update.kb;
+    record.maxDownloadSize = update.maxDownloadSize;
+    return true;
+}
+
+// Whether an offline search produced exactly what the last online search found.
+[[nodiscard]] static inline bool MatchesSearchCache(const std::vector<UpdateDescriptor> &updates, const SearchCacheView &cache)
+{
+    if (updates.size() != cache.size()) {
+        return false;
+    }
+    for (auto &&update : std::as_const(updates)) {
+        UpdateGuid guid = {};
+        if (!ParseUpdateGuid(update.id, guid) || !cache.contains(guid, update.revision)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The Windows Update flow: search, download and install through the pipeline, commit,
+// and search again until nothing is left, since installing one update often unlocks the next.
+// An update that fails doesn't stop the others, it's retried on its own after everything
+// else of its pass was committed, and given up on once it ran out of retries. Updates
+// already downloaded, by WUA itself or an interrupted run, skip the download stage.
+class SystemUpdater
+{
+public:
+    using SearchHandler = std::function<void(const std::vector<UpdateDescriptor> &)>;
+
+    explicit SystemUpdater(SystemUpdateBackend &backend, UpdateReporter &reporter, const UpdateOptions &options)
+        : m_backend(backend), m_reporter(reporter), m_options(options)
+    {
+    }
+
+    // Called with the result of every online search, which is what the search cache stores.
+    inline void setOnlineSearchHandler(SearchHandler handler)
+    {
+        m_onlineSearchHandler = std::move(handler);
+    }
+
+    // Progress goes into "journal" as it's made, and what it says an interrupted run
+    // already did is not done again.
+    inline void setCheckpointJournal(CheckpointJournal *journal)
+    {
+        m_journal = journal;
+    }
+
+    // Once "token" is cancelled nothing new is started and "run()" returns false as soon as
+    // what's in flight is done. What got installed until then is still committed.
+    inline void setCancellationToken(const CancellationToken *token)
+    {
+        m_token = token;
+    }
+
+    // Download rates and installation times go into "history" as they're observed.
+    inline void setThroughputHistory(ThroughputHistory *history)
+    {
+        m_history = history;
+    }
+
+    // What "run()" would download and install in its first pass, without doing any of it:
+    // an online search, then the same selection and plan. "order" indexes "updates".
+    [[nodiscard]] inline bool preview(std::vector<UpdateDescriptor> &updates, std::vector<std::size_t> &order)
+    {
+        if (!search(true, BuildSearchCriteria(m_options.filter, {}), updates)) {
+            return false;
+        }
+        const std::vector<std::size_t> selection = selectUnhandled(updates, {});
+        order = (selection.empty() ? std::vector<std::size_t>{} : plan(updates, selection));
+        return true;
+    }
+
+    // "cache" is a fresh search cache, the first pass then tries to get away with an
+    // offline search that has to match it exactly.
+    [[nodiscard]] inline bool run(const SearchCacheView *cache = nullptr)
+    {
+        const bool succeeded = update(cache);
+        ProgressPublisher::instance().setPhase(MetricTarget::Windows, (succeeded ? ProgressPhase::Finished : ProgressPhase::Failed));
+        return succeeded;
+    }
+
+private:
+    [[nodiscard]] inline bool update(const SearchCacheView *cache)
+    {
+        const TraceSpan span("UpdateSystem");
+        const auto updateStart = std::chrono::steady_clock::now();
+        m_backend.setProgressHandler([this](const PipelineStage stage, const std::size_t index, const int percent, const uint64_t bytesDone, const uint64_t bytesTotal){
+            if (stage == PipelineStage::Download) {
+                EmitEvent("download_progress", { { "index", uint64_t(index) }, { "percent", int32_t(percent) }, { "bytes_done", bytesDone }, { "bytes_total", bytesTotal } });
+            } else {
+                EmitEvent("install_progress", { { "index", uint64_t(index) }, { "percent", int32_t(percent) } });
+            }
+            std::wstring title = {};
+            uint64_t downloaded = 0;
+            {
+                const std::scoped_lock lock(m_progressMutex);
+                if (index < m_progressTitles.size()) {
+                    title = m_progressTitles.at(index);
+                }
+                // WUA reports the running total of the update, the metrics want the increment.
+                if ((stage == PipelineStage::Download) && (index < m_progressBytes.size()) && (bytesDone > m_progressBytes.at(index))) {
+                    downloaded = (bytesDone - m_progressBytes.at(index));
+                    m_progressBytes.at(index) = bytesDone;
+                }
+            }
+            if (downloaded > 0) {
+                RunMetrics::instance().addDownloadedBytes(downloaded);
+            }
+            ProgressPublisher::instance().setItemProgress(MetricTarget::Windows, index, stage, title, percent, bytesDone, bytesTotal);
+            m_reporter.progress(std::wstring((stage == PipelineStage::Download) ? L"Downloading " : L"Installing ") + title + L": " + std::to_wstring(percent) + L'%');
+        });
+
+        if (m_journal && m_journal->hasUncommitted()) {
+            m_reporter.info(L"Committing what the interrupted run installed ......");
+            if (!commit()) {
+                return false;
+            }
+        }
+
+        HandledUpdates handledUpdates = {};
+        bool firstPass = true;
+        bool changed = false;
+
+        while (!isCancelled()) {
+            // In incremental mode the follow-up passes only look for what the previous pass
+            // unlocked: an offline scan against the metadata WUA already has, and an online
+            // scan only if that found nothing although the previous pass changed the system.
+            const bool incrementalPass = (m_options.incremental && !firstPass);
+            const std::wstring criteria = BuildSearchCriteria(m_options.filter, (incrementalPass ? handledUpdates : HandledUpdates{}));
+            std::vector<UpdateDescriptor> updates = {};
+            bool searched = false;
+            if (firstPass && cache) {
+                searched = (search(false, criteria, updates) && MatchesSearchCache(updates, *cache));
+                if (!searched) {
+                    m_reporter.info(L"The search cache doesn't match this machine anymore, searching online ......");
+                }
+            }
+            if (!searched && !search(!incrementalPass, criteria, updates)) {
+                return false;
+            }
+            if (firstPass) {
+                summarize();
+            }
+            std::vector<std::size_t> selection = selectUnhandled(updates, handledUpdates);
+            if (selection.empty() && incrementalPass && changed) {
+                if (!search(true, criteria, updates)) {
+                    return false;
+                }
+                selection = selectUnhandled(updates, handledUpdates);
+            }
+            firstPass = false;
+            changed = false;
+            RunMetrics::instance().addUpdatesFound(selection.size());
+            if (!selection.empty()) {
+                selection = plan(updates, selection);
+            }
+            if (selection.empty()) {
+                break;
+            }
+            // Everything that can share a pass goes through a single pipeline and a single
+            // commit, so it keeps the planned order (most severe and shortest first), the
+            // waves only tell apart what it contains. The exclusive ones follow one at a time
+            // with a commit of their own.
+            const std::vector<InstallWave> waves = planWaves(selection);
+            std::vector<std::size_t> batch = {};
+            batch.reserve(selection.size());
+            for (auto &&index : std::as_const(selection)) {
+                if (GetInstallWaveKind(m_index, UpdateIndex::Row(index)) != InstallWaveKind::Exclusive) {
+                    batch.push_back(index);
+                }
+            }
+            if (!batch.empty() && !install(updates, batch, handledUpdates, changed)) {
+                return false;
+            }
+            for (auto &&wave : std::as_const(waves)) {
+                if (isCancelled()) {
+                    break;
+                }
+                if ((wave.kind == InstallWaveKind::Exclusive) && !install(updates, wave.updates, handledUpdates, changed)) {
+                    return false;
+                }
+            }
+        }
+
+        const uint64_t updateTime = ElapsedMilliseconds(updateStart);
+        RunMetrics::instance().recordPhase(MetricPhase::Windows, updateTime);
+        RunMetrics::instance().addUpdatesFailed(m_abandoned.size());
+        EmitEvent("phase_finished", { { "phase", "windows" }, { "duration_ms", updateTime } });
+        if (isCancelled()) {
+            return false;
+        }
+        if (!m_abandoned.empty()) {
+            m_reporter.error(std::to_wstring(m_abandoned.size()) + L" Windows update(s) could not be installed, everything else is up to date.", 0);
+            return false;
+        }
+        m_reporter.success(L"Your Windows is update to date!");
+        return true;
+    }
+
+    [[nodiscard]] inline bool isCancelled() const
+    {
+        return (m_token && m_token->isCancelled());
+    }
+
+    // What the first search found, before anything is done about it.
+    inline void summarize()
+    {
+        const std::vector<UpdateIndex::Row> rows = m_index.select(m_options.filter);
+        const auto excluded = uint64_t(m_index.size() - rows.size());
+        if (excluded > 0) {
+            EmitEvent("filtered", { { "target", "windows" }, { "count", excluded } });
+            m_reporter.info(std::to_wstring(excluded) + L" Windows update(s) are excluded by the filter.");
+        }
+        if (rows.empty()) {
+            return;
+        }
+        const uint64_t downloadSize = m_index.downloadSize(rows);
+        const std::array<std::size_t, 5> severities = m_index.severityCounts(rows);
+        const std::size_t security = (severities.at(std::size_t(UpdateSeverity::Critical)) + severities.at(std::size_t(UpdateSeverity::Important)));
+        EmitEvent("catalog_summary", { { "count", uint64_t(rows.size()) }, { "download_bytes", downloadSize }, { "critical_or_important", uint64_t(security) } });
+        m_reporter.info(L"Found " + std::to_wstring(rows.size()) + L" Windows update(s), " + std::to_wstring(security) + L" of them critical or important, " + std::to_wstring(downloadSize >> 20) + L" MiB to download.");
+    }
+
+    // The progress callbacks only know the pipeline index.
+    inline void setProgressTitles(std::vector<std::wstring> &&titles)
+    {
+        const std::scoped_lock lock(m_progressMutex);
+        m_progressBytes.assign(titles.size(), 0);
+        m_progressTitles = std::move(titles);
+    }
+
+    // Returns whether the operation succeeded.
+    inline bool report(const UpdateDescriptor &update, const std::size_t index, const PipelineCompletion &completion)
+    {
+        EmitEvent((completion.stage == PipelineStage::Download) ? "download_finished" : "install_finished", { { "index", uint64_t(index) }, { "title", std::wstring_view(update.title) }, { "result", GetOperationResultName(completion.result) }, { "hresult", completion.hresult } });
+        if (!IsSucceeded(completion.result)) {
+            ProgressPublisher::instance().setItemFinished(MetricTarget::Windows, index, false, completion.hresult);
+            m_reporter.error(std::wstring(completion.stage == PipelineStage::Download ? L"Failed to download " : L"Failed to install ") + update.title, completion.hresult);
+            return false;
+        }
+        if (completion.stage == PipelineStage::Download) {
+            m_reporter.info(L"Downloaded " + update.title);
+        } else {
+            RunMetrics::instance().addUpdateInstalled();
+            ProgressPublisher::instance().setItemFinished(MetricTarget::Windows, index, true, 0);
+            if (m_history) {
+                m_history->recordInstall(update.kb, completion.duration);
+            }
+            m_reporter.success(L"Installed " + update.title);
+        }
+        if (m_journal) {
+            m_journal->record(update.id, update.revision, ((completion.stage == PipelineStage::Download) ? CheckpointState::Downloaded : CheckpointState::Installed));
+        }
+        return true;
+    }
+
+    // The download and install order for "selection", minus what doesn't fit on the disk.
+    // Those are given up on for this run, nothing that's still to come frees any space.
+    [[nodiscard]] inline std::vector<std::size_t> plan(const std::vector<UpdateDescriptor> &updates, const std::vector<std::size_t> &selection)
+    {
+        const TraceSpan span("Plan");
+        const uint64_t freeSpace = m_backend.freeDiskSpace();
+        DownloadPlan downloadPlan = PlanDownloads(m_index, selection, freeSpace);
+        EmitEvent("plan_ready", { { "count", uint64_t(downloadPlan.order.size()) }, { "download_bytes", downloadPlan.downloadSize }, { "free_bytes", freeSpace }, { "deferred", uint64_t(downloadPlan.deferred.size()) } });
+        for (auto &&index : std::as_const(downloadPlan.deferred)) {
+            const UpdateDescriptor &update = updates.at(index);
+            m_reporter.error(L"Not enough disk space to download " + update.title + L" (" + std::to_wstring(update.maxDownloadSize >> 20) + L" MiB).", 0);
+            m_abandoned.insert_or_assign(update.id, update.revision);
+        }
+        return std::move(downloadPlan.order);
+    }
+
+    // Downloads, installs and commits "batch" (indices into "updates") and retries whatever
+    // failed. Returns false if the run can't go on, a cancelled batch is not an error.
+    [[nodiscard]] inline bool install(const std::vector<UpdateDescriptor> &updates, const std::vector<std::size_t> &batch, HandledUpdates &handledUpdates, bool &changed)
+    {
+        if (!m_backend.select(batch)) {
+            m_reporter.error(L"Failed to prepare the Windows updates.", 0);
+            return false;
+        }
+        std::vector<std::wstring> titles(batch.size());
+        for (std::size_t position = 0; position != batch.size(); ++position) {
+            m_backend.prioritize(position, GetDownloadPriority(m_index, UpdateIndex::Row(batch.at(position))));
+            titles.at(position) = updates.at(batch.at(position)).title;
+        }
+        setProgressTitles(std::move(titles));
+        uint64_t batchSize = 0;
+        for (auto &&index : std::as_const(batch)) {
+            batchSize += m_index.downloadSize(UpdateIndex::Row(index));
+        }
+        ProgressPublisher::instance().setPlanned(MetricTarget::Windows, batch.size(), batchSize);
+        ProgressPublisher::instance().setPhase(MetricTarget::Windows, ProgressPhase::Updating);
+        std::vector<std::size_t> failures = {};
+        std::vector<bool> failed(batch.size(), false);
+        std::size_t installed = 0;
+        UpdatePipeline pipeline(m_backend, batch.size(), m_options.pipelineDepth);
+        pipeline.setCancellationToken(m_token);
+        std::size_t resumed = 0;
+        for (std::size_t position = 0; position != batch.size(); ++position) {
+            const UpdateDescriptor &update = updates.at(batch.at(position));
+            if (update.downloaded || (m_journal && (m_journal->state(update.id, update.revision) == CheckpointState::Downloaded))) {
+                pipeline.skipDownload(position);
+                ++resumed;
+            }
+        }
+        if (resumed > 0) {
+            m_reporter.info(std::to_wstring(resumed) + L" update(s) are already downloaded, installing them right away.");
+        }
+        // The downloads run side by side, the rate that counts is that of all of them together.
+        uint64_t downloadedBytes = 0;
+        auto downloadsFinished = std::chrono::steady_clock::now();
+        pipeline.setCompletionHandler([this, &updates, &batch, &failures, &failed, &installed, &downloadedBytes, &downloadsFinished](const PipelineCompletion &completion){
+            const UpdateDescriptor &update = updates.at(batch.at(completion.index));
+            if (report(update, completion.index, completion)) {
+                installed += ((completion.stage == PipelineStage::Install) ? 1 : 0);
+                if (completion.stage == PipelineStage::Download) {
+                    downloadedBytes += update.maxDownloadSize;
+                    downloadsFinished = std::chrono::steady_clock::now();
+                }
+            } else {
+                failures.push_back(completion.index);
+                failed.at(completion.index) = true;
+            }
+        });
+        const auto pipelineStart = std::chrono::steady_clock::now();
+        std::optional<TraceSpan> pipelineSpan(std::in_place, "DownloadInstall");
+        const bool pipelineSucceeded = pipeline.run();
+        pipelineSpan.reset();
+        const uint64_t pipelineTime = ElapsedMilliseconds(pipelineStart);
+        RunMetrics::instance().recordPhase(MetricPhase::DownloadInstall, pipelineTime);
+        if (m_history) {
+            m_history->recordDownload(downloadedBytes, std::chrono::duration_cast<std::chrono::milliseconds>(downloadsFinished - pipelineStart));
+        }
+        EmitEvent("phase_finished", { { "phase", "download_install" }, { "count", uint64_t(batch.size()) }, { "duration_ms", pipelineTime } });
+        if (!pipelineSucceeded && (pipeline.failedCount() < 1) && !isCancelled()) {
+            m_reporter.error(L"Failed to install Windows updates.", 0);
+            return false;
+        }
+        if ((installed > 0) && !commit()) {
+            return false;
+        }
+        if (isCancelled()) {
+            return true;
+        }
+        for (std::size_t position = 0; position != batch.size(); ++position) {
+            if (failed.at(position)) {
+                continue;
+            }
+            const UpdateDescriptor &update = updates.at(batch.at(position));
+            changed = true;
+            handledUpdates.insert_or_assign(update.id, update.revision);
+        }
+        for (auto &&position : std::as_const(failures)) {
+            const UpdateDescriptor &update = updates.at(batch.at(position));
+            if (retry(update, batch.at(position))) {
+                changed = true;
+                handledUpdates.insert_or_assign(update.id, update.revision);
+            } else {
+                m_abandoned.insert_or_assign(update.id, update.revision);
+            }
+        }
+        return true;
+    }
+
+    // Reported before anything is installed, it tells how many commits the pass is going to take.
+    [[nodiscard]] inline std::vector<InstallWave> planWaves(const std::vector<std::size_t> &order)
+    {
+        std::vector<InstallWave> waves = PlanInstallWaves(m_index, order);
+        EmitEvent("install_plan", { { "count", uint64_t(order.size()) }, { "waves", uint64_t(waves.size()) } });
+        for (std::size_t number = 0; number != waves.size(); ++number) {
+            const InstallWave &wave = waves.at(number);
+            EmitEvent("install_wave", { { "wave", uint64_t(number + 1) }, { "kind", GetInstallWaveKindName(wave.kind) }, { "count", uint64_t(wave.updates.size()) }, { "download_bytes", wave.downloadSize } });
+            m_reporter.info(L"Install wave " + std::to_wstring(number + 1) + L'/' + std::to_wstring(waves.size()) + L": " + std::to_wstring(wave.updates.size()) + L" update(s), " + DescribeInstallWaveKind(wave.kind) + L", " + std::to_wstring(wave.downloadSize >> 20) + L" MiB to download.");
+        }
+        return waves;
+    }
+
+    [[nodiscard]] inline bool commit()
+    {
+        ProgressPublisher::instance().setPhase(MetricTarget::Windows, ProgressPhase::Committing);
+        const auto commitStart = std::chrono::steady_clock::now();
+        {
+            const TraceSpan commitSpan("Commit");
+            if (!m_backend.commit()) {
+                return false;
+            }
+        }
+        if (m_journal) {
+            m_journal->markCommitted();
+        }
+        const uint64_t commitTime = ElapsedMilliseconds(commitStart);
+        RunMetrics::instance().recordPhase(MetricPhase::Commit, commitTime);
+        EmitEvent("phase_finished", { { "phase", "commit" }, { "duration_ms", commitTime } });
+        return true;
+    }
+
+    // Downloads and installs a single update again, waiting twice as long before every
+    // attempt. "candidate" indexes the current search result. Returns whether it's installed.
+    [[nodiscard]] inline bool retry(const UpdateDescriptor &update, const std::size_t candidate)
+    {
+        auto delay = m_options.retryDelay;
+        for (std::size_t attempt = 1; attempt <= m_options.retryLimit; ++attempt) {
+            if (isCancelled()) {
+                return false;
+            }
+            if (m_retriesUsed >= m_options.retryBudget) {
+                m_reporter.error(L"No retries left, giving up on " + update.title, 0);
+                return false;
+            }
+            ++m_retriesUsed;
+            EmitEvent("retry_scheduled", { { "title", std::wstring_view(update.title) }, { "attempt", uint64_t(attempt) }, { "delay_ms", uint64_t(delay.count()) } });
+            m_reporter.info(L"Retrying " + update.title + L" in " + std::to_wstring(delay.count() / 1000) + L" seconds (" + std::to_wstring(attempt) + L'/' + std::to_wstring(m_options.retryLimit) + L") ......");
+            {
+                const TraceSpan span("BackOff");
+                m_backend.backOff(delay);
+            }
+            delay = std::min(delay * 2, kMaximumRetryDelay);
+            if (!m_backend.select({ candidate })) {
+                m_reporter.error(L"Failed to prepare " + update.title, 0);
+                return false;
+            }
+            m_backend.prioritize(0, GetDownloadPriority(m_index, UpdateIndex::Row(candidate)));
+            setProgressTitles({ update.title });
+            ProgressPublisher::instance().setPhase(MetricTarget::Windows, ProgressPhase::Updating);
+            bool installed = false;
+            UpdatePipeline pipeline(m_backend, 1, 1);
+            pipeline.setCancellationToken(m_token);
+            pipeline.setCompletionHandler([this, &update, &installed](const PipelineCompletion &completion){
+                installed = (report(update, 0, completion) && (completion.stage == PipelineStage::Install));
+            });
+            const TraceSpan span("Retry");
+            if (pipeline.run() && installed) {
+                return commit();
+            }
+        }
+        return false;
+    }
+
+    [[nodiscard]] inline bool search(const bool online, const std::wstring &criteria, std::vector<UpdateDescriptor> &updates)
+    {
+        const TraceSpan span(online ? "SearchOnline" : "SearchOffline");
+        EmitEvent("search_started", { { "target", "windows" }, { "online", online } });
+        ProgressPublisher::instance().setPhase(MetricTarget::Windows, ProgressPhase::Searching);
+        const auto searchStart = std::chrono::steady_clock::now();
+        if (!m_backend.search(online, criteria, updates)) {
+            if (!isCancelled()) {
+                m_reporter.error(L"Failed to search for Windows updates.", 0);
+            }
+            return false;
+        }
+        const uint64_t searchTime = ElapsedMilliseconds(searchStart);
+        RunMetrics::instance().recordSearch(MetricTarget::Windows, searchTime);
+        EmitEvent("search_finished", { { "target", "windows" }, { "online", online }, { "count", uint64_t(updates.size()) }, { "duration_ms", searchTime } });
+        // Selection and planning only look at the index, "updates" is what gets handed back
+        // to the backend and reported.
+        m_index.assign(updates);
+        if (online && m_onlineSearchHandler) {
+            m_onlineSearchHandler(updates);
+        }
+        return true;
+    }
+
+    // Drops every update whose exact revision was already handled by an earlier pass, and
+    // the ones that were given up on in any case, they would only fail again. So are the
+    // ones the filter excludes, nothing of them gets downloaded.
+    [[nodiscard]] inline std::vector<std::size_t> selectUnhandled(const std::vector<UpdateDescriptor> &updates, const HandledUpdates &handled) const
+    {
+        std::vector<std::size_t> selection = {};
+        selection.reserve(updates.size());
+        for (auto &&row : m_index.select(m_options.filter)) {
+            const std::size_t index = row;
+            const auto abandoned = m_abandoned.find(updates.at(index).id);
+            if ((abandoned != m_abandoned.cend()) && (abandoned->second >= updates.at(index).revision)) {
+                continue;
+            }
+            // Installed by an interrupted run, it only shows up until the next reboot.
+            if (m_journal && (m_journal->state(updates.at(index).id, updates.at(index).revision) >= CheckpointState::Installed)) {
+                continue;
+            }
+            if (m_options.incremental) {
+                const auto it = handled.find(updates.at(index).id);
+                if ((it != handled.cend()) && (it->second >= updates.at(index).revision)) {
+                    continue;
+                }
+            }
+            selection.push_back(index);
+        }
+        return selection;
+    }
+
+    SystemUpdateBackend &m_backend;
+    UpdateReporter &m_reporter;
+    UpdateOptions m_options = {};
+    SearchHandler m_onlineSearchHandler = nullptr;
+    CheckpointJournal *m_journal = nullptr;
+    std::mutex m_progressMutex;
+    std::vector<std::wstring> m_progressTitles = {}; // Of the current selection, by pipeline index.
+    std::vector<uint64_t> m_progressBytes = {}; // Downloaded so far, same indexes.
+    HandledUpdates m_abandoned = {}; // Failed updates that ran out of retries.
+    UpdateIndex m_index = {}; // Of the latest search, rows are indices into its result.
+    const CancellationToken *m_token = nullptr;
+    ThroughputHistory *m_history = nullptr;
+    std::size_t m_retriesUsed = 0;
+};
+
+// The Microsoft Store flow: search, let at most "storeMaxInFlight" items run at a time in
+// priority and size order, and search again until a pass doesn't update anything.
+class StoreUpdater
+{
+public:
+    explicit StoreUpdater(StoreBackend &backend, UpdateReporter &reporter, const UpdateOptions &options)
+        : m_backend(backend), m_reporter(reporter), m_options(options)
+    {
+    }
+
+    // Same as for "SystemUpdater", the backend is expected to not start anything new either.
+    inline void setCancellationToken(const CancellationToken *token)
+    {
+        m_token = token;
+    }
+
+    // How long every application took goes into "history".
+    inline void setThroughputHistory(ThroughputHistory *history)
+    {
+        m_history = history;
+    }
+
+    // What "run()" would update in its first pass. The store queues everything a search
+    // finds, so all of it is taken out of the queue again right away.
+    [[nodiscard]] inline bool preview(std::vector<StoreItemDescriptor> &items)
+    {
+        std::vector<StoreItemDescriptor> found = {};
+        if (!m_backend.searchAll(found)) {
+            if (!isCancelled()) {
+                m_reporter.error(L"Failed to search for Microsoft Store updates.", 0);
+            }
+            return false;
+        }
+        items.clear();
+        for (std::size_t index = 0; index != found.size(); ++index) {
+            m_backend.cancel(index);
+            if (m_options.filter.matches(found.at(index))) {
+                items.push_back(std::move(found.at(index)));
+            }
+        }
+        return true;
+    }
+
+    [[nodiscard]] inline bool run()
+    {
+        const bool succeeded = update();
+        ProgressPublisher::instance().setPhase(MetricTarget::Store, (succeeded ? ProgressPhase::Finished : ProgressPhase::Failed));
+        return succeeded;
+    }
+
+private:
+    [[nodiscard]] inline bool update()
+    {
+        const TraceSpan span("UpdateMicrosoftStoreApps");
+        const auto updateStart = std::chrono::steady_clock::now();
+        m_backend.setProgressHandler([this](const std::size_t index, const std::wstring_view packageFamilyName, const double percent){
+            EmitEvent("store_item_progress", { { "package", packageFamilyName }, { "percent", percent } });
+            ProgressPublisher::instance().setItemProgress(MetricTarget::Store, index, PipelineStage::Download, packageFamilyName, int(percent), 0, 0);
+            m_reporter.progress(L"Downloading " + std::wstring(packageFamilyName) + L": " + std::to_wstring(percent) + L'%');
+        });
+
+        // Products updated by the previous pass. In incremental mode only these are asked
+        // for follow-on updates, everything else was already up to date a moment ago.
+        std::vector<std::wstring> updatedProducts = {};
+        bool firstPass = true;
+
+        while (!isCancelled()) {
+            std::vector<StoreItemDescriptor> items = {};
+            EmitEvent("search_started", { { "target", "store" }, { "online", true } });
+            ProgressPublisher::instance().setPhase(MetricTarget::Store, ProgressPhase::Searching);
+            const auto searchStart = std::chrono::steady_clock::now();
+            bool searched = false;
+            {
+                const TraceSpan searchSpan("Search");
+                searched = ((firstPass || !m_options.incremental) ? m_backend.searchAll(items) : m_backend.searchProducts(updatedProducts, items));
+            }
+            if (!searched) {
+                if (!isCancelled()) {
+                    m_reporter.error(L"Failed to search for Microsoft Store updates.", 0);
+                }
+                return false;
+            }
+            const uint64_t searchTime = ElapsedMilliseconds(searchStart);
+            RunMetrics::instance().recordSearch(MetricTarget::Store, searchTime);
+            EmitEvent("search_finished", { { "target", "store" }, { "online", true }, { "count", uint64_t(items.size()) }, { "duration_ms", searchTime } });
+            firstPass = false;
+            updatedProducts.clear();
+
+            if (items.empty()) {
+                break;
+            }
+
+            // The store queues everything it found right away, what the filter excludes
+            // is taken out of the queue again before it gets anywhere.
+            std::vector<PlanItem> plan = {};
+            plan.reserve(items.size());
+            std::size_t excluded = 0;
+            for (std::size_t index = 0; index != items.size(); ++index) {
+                if (!m_options.filter.matches(items.at(index))) {
+                    m_backend.cancel(index);
+                    ++excluded;
+                    continue;
+                }
+                plan.push_back(PlanItem{ index, GetStorePackagePriority(items.at(index).packageFamilyName, m_options.storePriority), items.at(index).downloadSize });
+            }
+            if (excluded > 0) {
+                EmitEvent("filtered", { { "target", "store" }, { "count", uint64_t(excluded) } });
+                m_reporter.info(std::to_wstring(excluded) + L" Microsoft Store update(s) are excluded by the filter.");
+            }
+
+            // Hold back whatever doesn't get a slot so that the running downloads don't fight
+            // for the bandwidth. Same plan as for Windows updates: by package priority, then
+            // smallest first.
+            PlanShortestFirst(plan);
+            uint64_t planSize = 0;
+            for (auto &&item : std::as_const(plan)) {
+                planSize += item.size;
+            }
+            ProgressPublisher::instance().setPlanned(MetricTarget::Store, plan.size(), planSize);
+            ProgressPublisher::instance().setPhase(MetricTarget::Store, ProgressPhase::Updating);
+            BoundedScheduler scheduler(m_options.storeMaxInFlight);
+            for (std::size_t position = 0; position != plan.size(); ++position) {
+                scheduler.add(plan.at(position).index, int(position));
+            }
+            if (plan.size() > m_options.storeMaxInFlight) {
+                for (auto &&item : std::as_const(plan)) {
+                    m_backend.pause(item.index);
+                }
+            }
+
+            std::vector<uint64_t> startTimes(items.size(), 0);
+            std::vector<std::optional<std::chrono::steady_clock::time_point>> started(items.size());
+            const TraceSpan updateSpan("DownloadInstall");
+            const std::size_t finished = scheduler.run([this](std::size_t &index){ return m_backend.waitForCompletion(index); }, [this, &items, &startTimes, &started](const std::size_t index) -> bool {
+                m_reporter.info(L"Updating " + items.at(index).packageFamilyName + L" ......");
+                if (Tracer::instance().isEnabled()) {
+                    startTimes.at(index) = Tracer::instance().now();
+                }
+                started.at(index) = std::chrono::steady_clock::now();
+                return m_backend.start(index);
+            }, [this, &items, &updatedProducts, &startTimes, &started](const std::size_t index){
+                const StoreItemDescriptor &item = items.at(index);
+                const bool succeeded = (m_backend.state(index) == StoreItemState::Completed);
+                const int32_t code = m_backend.errorCode(index);
+                if (Tracer::instance().isEnabled()) {
+                    Tracer::instance().async(EncodeUtf8(item.packageFamilyName), "store_item", index, startTimes.at(index), Tracer::instance().now());
+                }
+                RunMetrics::instance().addStoreItem(succeeded);
+                ProgressPublisher::instance().setItemFinished(MetricTarget::Store, index, succeeded, code);
+                // Items that finished while they were held back took no time worth knowing.
+                if (succeeded && m_history && started.at(index)) {
+                    m_history->recordStoreItem(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - *started.at(index)));
+                }
+                EmitEvent("store_item_finished", { { "package", std::wstring_view(item.packageFamilyName) }, { "result", succeeded ? "succeeded" : "failed" }, { "hresult", code } });
+                if (succeeded) {
+                    m_reporter.success(item.packageFamilyName + L" has been successfully updated.");
+                    updatedProducts.push_back(item.productId);
+                } else {
+                    m_reporter.error(L"Failed to update " + item.packageFamilyName, code);
+                }
+            });
+            if (finished < 1) {
+                break;
+            }
+        }
+
+        const uint64_t updateTime = ElapsedMilliseconds(updateStart);
+        RunMetrics::instance().recordPhase(MetricPhase::Store, updateTime);
+        EmitEvent("phase_finished", { { "phase", "store" }, { "duration_ms", updateTime } });
+        if (isCancelled()) {
+            return false;
+        }
+        m_reporter.success(L"All your Microsoft Store applications are update to date!");
+        return true;
+    }
+
+    [[nodiscard]] inline bool isCancelled() const
+    {
+        return (m_token && m_token->isCancelled());
+    }
+
+    StoreBackend &m_backend;
+    UpdateReporter &m_reporter;
+    UpdateOptions m_options = {};
+    const CancellationToken *m_token = nullptr;
+    ThroughputHistory *m_history = nullptr;
+};
+
+} // namespace WinUpdate
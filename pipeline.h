@@ -0,0 +1,267 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "deadline.h"
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <vector>
+#include <functional>
+
+namespace WinUpdate
+{
+
+// Same values as WUA's "OperationResultCode", so the Windows backend can cast directly.
+enum class OperationResult : uint8_t
+{
+    NotStarted,
+    InProgress,
+    Succeeded,
+    SucceededWithErrors,
+    Failed,
+    Aborted
+};
+
+enum class PipelineStage : uint8_t
+{
+    Download,
+    Install
+};
+
+struct PipelineCompletion
+{
+    PipelineStage stage = PipelineStage::Download;
+    std::size_t index = 0;
+    OperationResult result = OperationResult::NotStarted;
+    int32_t hresult = 0;
+    std::chrono::milliseconds duration = {}; // Since the operation was started, filled in by the pipeline.
+};
+
+// Asynchronous download/install primitives the pipeline is driven by. Implementations
+// start the operation in "begin*()" and report it later through "waitForCompletion()",
+// which blocks until at least one started operation has finished.
+class PipelineBackend
+{
+public:
+    virtual ~PipelineBackend() = default;
+
+    [[nodiscard]] virtual bool beginDownload(const std::size_t index) = 0;
+    [[nodiscard]] virtual bool beginInstall(const std::size_t index) = 0;
+    [[nodiscard]] virtual bool waitForCompletion(PipelineCompletion &completion) = 0;
+};
+
+[[nodiscard]] static inline const char *GetOperationResultName(const OperationResult result)
+{
+    switch (result) {
+    case OperationResult::NotStarted:
+        return "not_started";
+    case OperationResult::InProgress:
+        return "in_progress";
+    case OperationResult::Succeeded:
+        return "succeeded";
+    case OperationResult::SucceededWithErrors:
+        return "succeeded_with_errors";
+    case OperationResult::Failed:
+        return "failed";
+    case OperationResult::Aborted:
+        return "aborted";
+    }
+    return "unknown";
+}
+
+[[nodiscard]] static inline bool IsSucceeded(const OperationResult result)
+{
+    return ((result == OperationResult::Succeeded) || (result == OperationResult::SucceededWithErrors));
+}
+
+// Downloads up to "depth" updates ahead of the installer and installs them strictly in
+// order, one at a time (WUA refuses concurrent installations anyway). Installing update N
+// therefore overlaps with downloading update N+1 ... N+depth, nothing past that is started
+// before N is done, however quickly the downloads finish. A failed update is skipped
+// and never holds back the others, it's up to the caller to try it again.
+class UpdatePipeline
+{
+public:
+    using CompletionHandler = std::function<void(const PipelineCompletion &)>;
+
+    explicit UpdatePipeline(PipelineBackend &backend, const std::size_t count, const std::size_t depth)
+        : m_backend(backend), m_count(count), m_depth(depth < 1 ? 1 : depth), m_states(count, ItemState::Pending), m_started(count)
+    {
+    }
+
+    // Also called for operations that could not even be started, with an "hresult" of 0.
+    inline void setCompletionHandler(CompletionHandler handler)
+    {
+        m_handler = std::move(handler);
+    }
+
+    // For updates whose payload is already there, they go straight to the installer.
+    inline void skipDownload(const std::size_t index)
+    {
+        if (m_states.at(index) == ItemState::Pending) {
+            m_states.at(index) = ItemState::Downloaded;
+        }
+    }
+
+    // Once "token" is cancelled nothing new is started, what's in flight is still waited for.
+    inline void setCancellationToken(const CancellationToken *token)
+    {
+        m_token = token;
+    }
+
+    // Returns false if any update failed. Only a failing "waitForCompletion()" stops the
+    // pipeline early, since nothing can be known about the operations in flight after that.
+    // A cancelled pipeline returns false as well, with whatever it didn't get to left alone.
+    [[nodiscard]] inline bool run()
+    {
+        schedule();
+        while (m_inFlight > 0) {
+            PipelineCompletion completion = {};
+            if (!m_backend.waitForCompletion(completion)) {
+                return false;
+            }
+            --m_inFlight;
+            completion.duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_started.at(completion.index));
+            const bool succeeded = IsSucceeded(completion.result);
+            if (completion.stage == PipelineStage::Download) {
+                --m_downloading;
+                m_states.at(completion.index) = (succeeded ? ItemState::Downloaded : ItemState::Failed);
+            } else {
+                m_installing = false;
+                m_states.at(completion.index) = (succeeded ? ItemState::Installed : ItemState::Failed);
+                ++m_nextInstall;
+            }
+            finish(completion);
+            schedule();
+        }
+        return ((m_failed == 0) && (m_nextInstall == m_count));
+    }
+
+    [[nodiscard]] inline std::size_t failedCount() const
+    {
+        return m_failed;
+    }
+
+private:
+    enum class ItemState : uint8_t
+    {
+        Pending,
+        Downloaded,
+        Installed,
+        Failed
+    };
+
+    inline void finish(const PipelineCompletion &completion)
+    {
+        if (!IsSucceeded(completion.result)) {
+            ++m_failed;
+        }
+        if (m_handler) {
+            m_handler(completion);
+        }
+    }
+
+    inline void fail(const PipelineStage stage, const std::size_t index)
+    {
+        m_states.at(index) = ItemState::Failed;
+        PipelineCompletion completion = {};
+        completion.stage = stage;
+        completion.index = index;
+        completion.result = OperationResult::Failed;
+        finish(completion);
+    }
+
+    [[nodiscard]] inline bool isCancelled() const
+    {
+        return (m_token && m_token->isCancelled());
+    }
+
+    // Skipping failed updates moves the installer on, which opens the download window again.
+    inline void schedule()
+    {
+        std::size_t nextInstall = 0;
+        do {
+            nextInstall = m_nextInstall;
+            fillDownloadWindow();
+            tryStartInstall();
+        } while (m_nextInstall != nextInstall);
+    }
+
+    inline void fillDownloadWindow()
+    {
+        while (!isCancelled() && (m_downloading < m_depth) && (m_nextDownload <= (m_nextInstall + m_depth)) && (m_nextDownload < m_count)) {
+            const std::size_t index = m_nextDownload++;
+            if (m_states.at(index) != ItemState::Pending) {
+                continue;
+            }
+            m_started.at(index) = std::chrono::steady_clock::now();
+            if (!m_backend.beginDownload(index)) {
+                fail(PipelineStage::Download, index);
+                continue;
+            }
+            ++m_downloading;
+            ++m_inFlight;
+        }
+    }
+
+    inline void tryStartInstall()
+    {
+        while (!isCancelled() && !m_installing && (m_nextInstall < m_count)) {
+            const ItemState state = m_states.at(m_nextInstall);
+            if (state == ItemState::Failed) {
+                ++m_nextInstall;
+                continue;
+            }
+            if (state != ItemState::Downloaded) {
+                return;
+            }
+            m_started.at(m_nextInstall) = std::chrono::steady_clock::now();
+            if (m_backend.beginInstall(m_nextInstall)) {
+                m_installing = true;
+                ++m_inFlight;
+                return;
+            }
+            fail(PipelineStage::Install, m_nextInstall);
+            ++m_nextInstall;
+        }
+    }
+
+    PipelineBackend &m_backend;
+    std::size_t m_count = 0;
+    std::size_t m_depth = 1;
+    std::vector<ItemState> m_states = {};
+    std::vector<std::chrono::steady_clock::time_point> m_started = {}; // Of the current operation, by index.
+    std::size_t m_nextDownload = 0;
+    std::size_t m_nextInstall = 0;
+    std::size_t m_downloading = 0;
+    std::size_t m_inFlight = 0;
+    std::size_t m_failed = 0;
+    bool m_installing = false;
+    CompletionHandler m_handler = nullptr;
+    const CancellationToken *m_token = nullptr;
+};
+
+} // namespace WinUpdate
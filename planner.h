@@ -0,0 +1,200 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "backend.h"
+#include "updateindex.h"
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <iterator>
+
+namespace WinUpdate
+{
+
+// Anything this large is a feature update or similar, it must not crowd out the rest.
+static constexpr const uint64_t kLargeDownloadSize = 1ull << 30;
+// Kept free on top of the planned downloads, installing needs room as well.
+static constexpr const uint64_t kDiskSpaceReserve = 512ull << 20;
+
+[[nodiscard]] static inline DownloadPriority GetDownloadPriority(const UpdateIndex &index, const UpdateIndex::Row row)
+{
+    const UpdateSeverity severity = index.severity(row);
+    if ((severity == UpdateSeverity::Critical) || (severity == UpdateSeverity::Important)) {
+        return DownloadPriority::High;
+    }
+    return ((index.maxDownloadSize(row) >= kLargeDownloadSize) ? DownloadPriority::Low : DownloadPriority::Normal);
+}
+
+struct PlanItem
+{
+    std::size_t index = 0;
+    int rank = 0; // Lower goes first.
+    uint64_t size = 0; // Bytes, 0 if unknown.
+};
+
+// Shortest job first within a rank: with a shared link that's what minimizes the mean
+// completion time. Unknown sizes go last within their rank, ties keep their order.
+static inline void PlanShortestFirst(std::vector<PlanItem> &items)
+{
+    std::stable_sort(items.begin(), items.end(), [](const PlanItem &lhs, const PlanItem &rhs){
+        if (lhs.rank != rhs.rank) {
+            return (lhs.rank < rhs.rank);
+        }
+        if ((lhs.size == 0) || (rhs.size == 0)) {
+            return ((lhs.size != 0) && (rhs.size == 0));
+        }
+        return (lhs.size < rhs.size);
+    });
+}
+
+// Security fixes first, by severity, then everything else.
+[[nodiscard]] static inline int GetSeverityRank(const UpdateSeverity severity)
+{
+    return (int(UpdateSeverity::Critical) - int(severity));
+}
+
+struct DownloadPlan
+{
+    std::vector<std::size_t> order = {}; // Candidate indices, in download and install order.
+    std::vector<std::size_t> deferred = {}; // Didn't fit on the disk.
+    uint64_t downloadSize = 0; // Bytes still to download for "order".
+};
+
+// Orders "selection" (rows of "index") and leaves out whatever doesn't fit into
+// "freeSpace" any more, in plan order. Already downloaded payloads take no more space.
+[[nodiscard]] static inline DownloadPlan PlanDownloads(const UpdateIndex &index, const std::vector<std::size_t> &selection, const uint64_t freeSpace)
+{
+    std::vector<PlanItem> items = {};
+    items.reserve(selection.size());
+    for (auto &&row : std::as_const(selection)) {
+        items.push_back(PlanItem{ row, GetSeverityRank(index.severity(UpdateIndex::Row(row))), index.maxDownloadSize(UpdateIndex::Row(row)) });
+    }
+    PlanShortestFirst(items);
+    DownloadPlan plan = {};
+    plan.order.reserve(items.size());
+    const uint64_t budget = ((freeSpace > kDiskSpaceReserve) ? (freeSpace - kDiskSpaceReserve) : 0);
+    for (auto &&item : std::as_const(items)) {
+        const uint64_t size = index.downloadSize(UpdateIndex::Row(item.index));
+        if ((plan.downloadSize + size) > budget) {
+            plan.deferred.push_back(item.index);
+            continue;
+        }
+        plan.downloadSize += size;
+        plan.order.push_back(item.index);
+    }
+    return plan;
+}
+
+// Only the exclusive wave changes how updates are installed: every update WUA wants
+// installed exclusively gets a pass of its own after the shared batch. The quiet,
+// interactive and reboot waves all go into that one batch in the planned order, they are
+// only broken down this way to tell what to expect from it.
+enum class InstallWaveKind : uint8_t
+{
+    Quiet,
+    Interactive,
+    Reboot,
+    Exclusive
+};
+
+[[nodiscard]] static inline const char *GetInstallWaveKindName(const InstallWaveKind kind)
+{
+    switch (kind) {
+    case InstallWaveKind::Quiet:
+        return "quiet";
+    case InstallWaveKind::Interactive:
+        return "interactive";
+    case InstallWaveKind::Reboot:
+        return "reboot";
+    case InstallWaveKind::Exclusive:
+        return "exclusive";
+    }
+    return "unknown";
+}
+
+// For the console, what sets the updates of such a wave apart.
+[[nodiscard]] static inline const wchar_t *DescribeInstallWaveKind(const InstallWaveKind kind)
+{
+    switch (kind) {
+    case InstallWaveKind::Quiet:
+        return L"no reboot";
+    case InstallWaveKind::Interactive:
+        return L"may ask for user input";
+    case InstallWaveKind::Reboot:
+        return L"may need a reboot";
+    case InstallWaveKind::Exclusive:
+        return L"must be installed on its own";
+    }
+    return L"unknown";
+}
+
+[[nodiscard]] static inline InstallWaveKind GetInstallWaveKind(const UpdateIndex &index, const UpdateIndex::Row row)
+{
+    if (index.impact(row) == InstallImpact::RequiresExclusiveHandling) {
+        return InstallWaveKind::Exclusive;
+    }
+    if (index.rebootBehavior(row) != RebootBehavior::NeverReboots) {
+        return InstallWaveKind::Reboot;
+    }
+    return (index.canRequestUserInput(row) ? InstallWaveKind::Interactive : InstallWaveKind::Quiet);
+}
+
+struct InstallWave
+{
+    InstallWaveKind kind = InstallWaveKind::Quiet;
+    std::vector<std::size_t> updates = {}; // Candidate indices, in install order.
+    uint64_t downloadSize = 0; // Bytes still to download for "updates".
+};
+
+// Splits "order" (rows of "index", e.g. a "DownloadPlan") into install waves.
+// Every update keeps its place relative to the others of its wave, empty waves are left out.
+// The non-exclusive waves describe what a shared batch contains, the batch itself is
+// installed in "order" so that a critical update needing a reboot isn't held back.
+[[nodiscard]] static inline std::vector<InstallWave> PlanInstallWaves(const UpdateIndex &index, const std::vector<std::size_t> &order)
+{
+    std::array<InstallWave, 3> shared = { InstallWave{ InstallWaveKind::Quiet }, InstallWave{ InstallWaveKind::Interactive }, InstallWave{ InstallWaveKind::Reboot } };
+    std::vector<InstallWave> exclusive = {};
+    for (auto &&row : std::as_const(order)) {
+        const InstallWaveKind kind = GetInstallWaveKind(index, UpdateIndex::Row(row));
+        InstallWave &wave = ((kind == InstallWaveKind::Exclusive) ? exclusive.emplace_back(InstallWave{ kind }) : shared.at(std::size_t(kind)));
+        wave.updates.push_back(row);
+        wave.downloadSize += index.downloadSize(UpdateIndex::Row(row));
+    }
+    std::vector<InstallWave> waves = {};
+    waves.reserve(shared.size() + exclusive.size());
+    for (auto &&wave : shared) {
+        if (!wave.updates.empty()) {
+            waves.push_back(std::move(wave));
+        }
+    }
+    std::move(exclusive.begin(), exclusive.end(), std::back_inserter(waves));
+    return waves;
+}
+
+} // namespace WinUpdate
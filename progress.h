@@ -0,0 +1,361 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "pipeline.h"
+#include "metrics.h"
+#include "events.h"
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+
+namespace WinUpdate
+{
+
+// A live picture of the run in a named shared memory region, for monitoring agents that
+// would otherwise scrape the console title. The region is a small header followed by one
+// fixed layout "ProgressSnapshot", protected by a sequence lock: the writer makes the
+// sequence odd, updates the snapshot and makes it even again, a reader copies the snapshot
+// and retries if the sequence was odd or changed meanwhile. Readers therefore never hold
+// up the updater and need no syscall into it, they can sample as often as they like.
+// Everything is little endian and naturally aligned, strings are UTF-16.
+static constexpr const uint32_t kProgressMagic = 0x50525557; // "WURP"
+static constexpr const uint32_t kProgressVersion = 1;
+static constexpr const std::size_t kProgressItemSlots = 8; // Items shown at the same time, per target.
+static constexpr const std::size_t kProgressNameLength = 64; // Code units, terminator included.
+static constexpr const std::size_t kProgressReadAttempts = 64;
+
+// Where a target is, "Failed" and "Finished" stay until the next run.
+enum class ProgressPhase : uint8_t
+{
+    Idle,
+    Searching,
+    Updating, // Downloading and installing, side by side.
+    Committing,
+    Finished,
+    Failed
+};
+
+[[nodiscard]] static inline const char *GetProgressPhaseName(const ProgressPhase phase)
+{
+    switch (phase) {
+    case ProgressPhase::Idle:
+        return "idle";
+    case ProgressPhase::Searching:
+        return "searching";
+    case ProgressPhase::Updating:
+        return "updating";
+    case ProgressPhase::Committing:
+        return "committing";
+    case ProgressPhase::Finished:
+        return "finished";
+    case ProgressPhase::Failed:
+        return "failed";
+    }
+    return "unknown";
+}
+
+// A slot is free while "active" is 0.
+struct ProgressItem
+{
+    uint32_t index = 0; // Within the current pass.
+    uint8_t active = 0;
+    uint8_t stage = 0; // A "PipelineStage", always "Download" for Store items.
+    uint16_t percent = 0;
+    uint64_t bytesDone = 0; // 0 if the backend doesn't say.
+    uint64_t bytesTotal = 0;
+    char16_t name[kProgressNameLength] = {};
+};
+static_assert(sizeof(ProgressItem) == 152);
+
+struct ProgressTarget
+{
+    ProgressPhase phase = ProgressPhase::Idle;
+    uint8_t reserved[3] = {};
+    uint32_t planned = 0; // Items in the current pass.
+    uint32_t completed = 0; // Over the whole run.
+    uint32_t failed = 0; // Over the whole run.
+    int32_t lastError = 0; // HRESULT of the latest failure.
+    uint32_t reserved2 = 0;
+    uint64_t bytesDone = 0; // Over the whole run.
+    uint64_t bytesTotal = 0; // Of the current pass, 0 if unknown.
+    ProgressItem items[kProgressItemSlots] = {};
+};
+static_assert(sizeof(ProgressTarget) == 1256);
+
+struct ProgressSnapshot
+{
+    int64_t started = 0; // Of the run, milliseconds since the Unix epoch, 0 before the first one.
+    int64_t updated = 0; // Same clock.
+    ProgressTarget targets[2] = {}; // By "MetricTarget".
+};
+static_assert(sizeof(ProgressSnapshot) % sizeof(uint64_t) == 0);
+static_assert(std::is_trivially_copyable_v<ProgressSnapshot>);
+
+struct ProgressRegionHeader
+{
+    uint32_t magic = kProgressMagic;
+    uint32_t version = kProgressVersion;
+    uint32_t size = 0; // Of the whole region.
+    uint32_t processId = 0; // Of the updater.
+    uint64_t sequence = 0; // Odd while the snapshot is being written.
+    uint64_t reserved = 0;
+};
+static_assert(sizeof(ProgressRegionHeader) == 32);
+
+static constexpr const std::size_t kProgressRegionSize = (sizeof(ProgressRegionHeader) + sizeof(ProgressSnapshot));
+
+// The snapshot is copied a word at a time through relaxed atomics, the sequence provides
+// the ordering. That keeps a torn read well defined, it's thrown away anyway.
+static inline void CopyProgressWords(void *destination, const void *source, const std::size_t size, const bool toShared)
+{
+    const auto to = static_cast<uint64_t *>(destination);
+    const auto from = static_cast<const uint64_t *>(source);
+    for (std::size_t index = 0; index != (size / sizeof(uint64_t)); ++index) {
+        if (toShared) {
+            std::atomic_ref<uint64_t>(to[index]).store(from[index], std::memory_order_relaxed);
+        } else {
+            to[index] = std::atomic_ref<uint64_t>(const_cast<uint64_t &>(from[index])).load(std::memory_order_relaxed);
+        }
+    }
+}
+
+static inline void CopyProgressName(char16_t (&destination)[kProgressNameLength], const std::wstring_view name)
+{
+    std::size_t length = 0;
+    ForEachCodePoint(name, [&destination, &length](const uint32_t cp){
+        const std::size_t units = ((cp >= 0x10000) ? 2 : 1);
+        if ((length + units) >= kProgressNameLength) {
+            return;
+        }
+        if (units == 2) {
+            destination[length++] = char16_t(0xD800 + ((cp - 0x10000) >> 10));
+            destination[length++] = char16_t(0xDC00 + ((cp - 0x10000) & 0x3FF));
+        } else {
+            destination[length++] = char16_t(cp);
+        }
+    });
+    std::fill(std::begin(destination) + length, std::end(destination), char16_t(0));
+}
+
+[[nodiscard]] static inline std::wstring GetProgressName(const char16_t (&name)[kProgressNameLength])
+{
+    std::wstring result = {};
+    for (std::size_t index = 0; (index != kProgressNameLength) && (name[index] != 0); ++index) {
+        result.push_back(wchar_t(name[index]));
+    }
+    return result;
+}
+
+// Returns false unless "region" holds an intact region of our version and a consistent
+// snapshot could be taken within "kProgressReadAttempts" tries.
+[[nodiscard]] static inline bool ReadProgressSnapshot(const void *region, const std::size_t size, ProgressSnapshot &snapshot)
+{
+    if (!region || (size < kProgressRegionSize)) {
+        return false;
+    }
+    const auto header = static_cast<const ProgressRegionHeader *>(region);
+    if ((header->magic != kProgressMagic) || (header->version != kProgressVersion) || (header->size < kProgressRegionSize)) {
+        return false;
+    }
+    const std::atomic_ref<uint64_t> sequence(const_cast<uint64_t &>(header->sequence));
+    for (std::size_t attempt = 0; attempt != kProgressReadAttempts; ++attempt) {
+        const uint64_t before = sequence.load(std::memory_order_acquire);
+        if ((before & 1) != 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        CopyProgressWords(&snapshot, header + 1, sizeof(snapshot), false);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence.load(std::memory_order_relaxed) == before) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The writing side, fed from the same places as "RunMetrics". Until a region is attached
+// every call returns right away. Writers only ever wait for each other, for as long as
+// it takes to copy one target, the readers never hold them up.
+class ProgressPublisher
+{
+public:
+    [[nodiscard]] static inline ProgressPublisher &instance()
+    {
+        static ProgressPublisher publisher = {};
+        return publisher;
+    }
+
+    // "region" must be at least "kProgressRegionSize" bytes and outlive the publisher,
+    // or be detached again with a null pointer.
+    inline void attach(void *region, const uint32_t processId)
+    {
+        if (region) {
+            ProgressRegionHeader header = {};
+            header.size = uint32_t(kProgressRegionSize);
+            header.processId = processId;
+            std::memcpy(region, &header, sizeof(header));
+            CopyProgressWords(static_cast<ProgressRegionHeader *>(region) + 1, &m_snapshot, sizeof(m_snapshot), true);
+        }
+        m_region.store(static_cast<ProgressRegionHeader *>(region), std::memory_order_release);
+    }
+
+    // A new run, everything of the previous one is cleared.
+    inline void reset()
+    {
+        update([](ProgressSnapshot &snapshot){
+            snapshot = ProgressSnapshot{};
+            snapshot.started = now();
+        }, std::nullopt);
+    }
+
+    inline void setPhase(const MetricTarget target, const ProgressPhase phase)
+    {
+        update([target, phase](ProgressSnapshot &snapshot){
+            ProgressTarget &state = snapshot.targets[std::size_t(target)];
+            state.phase = phase;
+            if (phase != ProgressPhase::Updating) {
+                for (auto &&item : state.items) {
+                    item = ProgressItem{};
+                }
+            }
+        }, target);
+    }
+
+    // What the current pass is going to do.
+    inline void setPlanned(const MetricTarget target, const std::size_t count, const uint64_t bytesTotal)
+    {
+        update([target, count, bytesTotal](ProgressSnapshot &snapshot){
+            ProgressTarget &state = snapshot.targets[std::size_t(target)];
+            state.planned = uint32_t(count);
+            state.bytesTotal = bytesTotal;
+        }, target);
+    }
+
+    // "bytesDone" is the running total of the item, like WUA reports it.
+    inline void setItemProgress(const MetricTarget target, const std::size_t index, const PipelineStage stage, const std::wstring_view name, const int percent, const uint64_t bytesDone, const uint64_t bytesTotal)
+    {
+        update([&](ProgressSnapshot &snapshot){
+            ProgressTarget &state = snapshot.targets[std::size_t(target)];
+            ProgressItem *slot = find(state, index);
+            if (!slot) {
+                slot = find(state, std::nullopt);
+                if (!slot) {
+                    return;
+                }
+                *slot = ProgressItem{};
+                slot->index = uint32_t(index);
+                slot->active = 1;
+                CopyProgressName(slot->name, name);
+            }
+            if ((slot->stage != uint8_t(stage)) || (bytesDone < slot->bytesDone)) {
+                slot->bytesDone = 0;
+            }
+            state.bytesDone += (bytesDone - slot->bytesDone);
+            slot->stage = uint8_t(stage);
+            slot->percent = uint16_t(std::clamp(percent, 0, 100));
+            slot->bytesDone = bytesDone;
+            slot->bytesTotal = bytesTotal;
+        }, target);
+    }
+
+    // The item's slot is freed for the next one.
+    inline void setItemFinished(const MetricTarget target, const std::size_t index, const bool succeeded, const int32_t hresult)
+    {
+        update([target, index, succeeded, hresult](ProgressSnapshot &snapshot){
+            ProgressTarget &state = snapshot.targets[std::size_t(target)];
+            if (ProgressItem *slot = find(state, index)) {
+                *slot = ProgressItem{};
+            }
+            if (succeeded) {
+                ++state.completed;
+            } else {
+                ++state.failed;
+                state.lastError = hresult;
+            }
+        }, target);
+    }
+
+private:
+    [[nodiscard]] static inline int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // The active slot of "index", or the first free one without an index.
+    [[nodiscard]] static inline ProgressItem *find(ProgressTarget &state, const std::optional<std::size_t> index)
+    {
+        for (auto &&item : state.items) {
+            if (index ? ((item.active != 0) && (item.index == *index)) : (item.active == 0)) {
+                return &item;
+            }
+        }
+        return nullptr;
+    }
+
+    // Changes the private copy and publishes the part that changed, the whole snapshot
+    // if "target" is empty.
+    template <typename Function>
+    inline void update(Function &&function, const std::optional<MetricTarget> target)
+    {
+        ProgressRegionHeader *region = m_region.load(std::memory_order_acquire);
+        if (!region) {
+            return;
+        }
+        const std::atomic_ref<uint64_t> sequence(region->sequence);
+        uint64_t current = sequence.load(std::memory_order_relaxed);
+        while (((current & 1) != 0) || !sequence.compare_exchange_weak(current, (current + 1), std::memory_order_acquire, std::memory_order_relaxed)) {
+            if ((current & 1) != 0) {
+                std::this_thread::yield();
+                current = sequence.load(std::memory_order_relaxed);
+            }
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        function(m_snapshot);
+        m_snapshot.updated = now();
+        const auto shared = reinterpret_cast<ProgressSnapshot *>(region + 1);
+        CopyProgressWords(&shared->updated, &m_snapshot.updated, sizeof(m_snapshot.updated), true);
+        if (target) {
+            CopyProgressWords(&shared->targets[std::size_t(*target)], &m_snapshot.targets[std::size_t(*target)], sizeof(ProgressTarget), true);
+        } else {
+            CopyProgressWords(shared, &m_snapshot, sizeof(m_snapshot), true);
+        }
+        sequence.store((current + 2), std::memory_order_release);
+    }
+
+    std::atomic<ProgressRegionHeader *> m_region = nullptr;
+    ProgressSnapshot m_snapshot = {}; // Only touched while the sequence is odd.
+};
+
+} // namespace WinUpdate
@@ -0,0 +1,1013 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "orchestrator.h"
+#include <cstring>
+#include <algorithm>
+#include <utility>
+#include <mutex>
+#include <thread>
+
+namespace WinUpdate
+{
+
+// A session log is everything the backends answered during a run, so that the run can be
+// fed through the orchestration again without Windows Update or the Store. It's append
+// only: a small header, then records of
+//   type (1 byte), microseconds since the previous record (varint), payload size (varint), payload
+// Integers in payloads are LEB128 varints, strings are a varint byte count plus UTF-8.
+// A log cut short by a crash is still readable up to its last complete record.
+static constexpr const uint32_t kSessionLogMagic = 0x4C525557; // "WURL"
+static constexpr const uint8_t kSessionLogVersion = 5;
+static constexpr const std::size_t kSessionLogFlushThreshold = 64 * 1024;
+
+enum class SessionRecordType : uint8_t
+{
+    Target = 1,
+    SystemSearch,
+    SystemSelect,
+    SystemBegin,
+    SystemCompletion,
+    SystemProgress,
+    SystemCommit,
+    StoreSearch,
+    StorePause,
+    StoreStart,
+    StoreCompletion,
+    StoreProgress,
+    SystemDiskSpace,
+    StoreCancel
+};
+
+enum class SessionTarget : uint8_t
+{
+    Store,
+    System
+};
+
+static inline void AppendVarint(std::vector<uint8_t> &out, uint64_t value)
+{
+    while (value >= 0x80) {
+        out.push_back(uint8_t(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(uint8_t(value));
+}
+
+static inline void AppendLogString(std::vector<uint8_t> &out, const std::wstring_view text)
+{
+    const std::string utf8 = EncodeUtf8(text);
+    AppendVarint(out, utf8.size());
+    out.insert(out.end(), utf8.cbegin(), utf8.cend());
+}
+
+// Reads one record payload, any overrun makes it invalid for good instead of throwing.
+class SessionLogReader
+{
+public:
+    SessionLogReader() = default;
+
+    explicit SessionLogReader(const uint8_t *data, const std::size_t size) : m_data(data), m_size(size)
+    {
+    }
+
+    [[nodiscard]] inline bool isValid() const
+    {
+        return m_valid;
+    }
+
+    [[nodiscard]] inline bool atEnd() const
+    {
+        return (m_offset >= m_size);
+    }
+
+    [[nodiscard]] inline uint8_t readByte()
+    {
+        if (m_offset >= m_size) {
+            m_valid = false;
+            return 0;
+        }
+        return m_data[m_offset++];
+    }
+
+    [[nodiscard]] inline bool readBool()
+    {
+        return (readByte() != 0);
+    }
+
+    [[nodiscard]] inline uint64_t readVarint()
+    {
+        uint64_t value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            const uint8_t byte = readByte();
+            value |= (uint64_t(byte & 0x7F) << shift);
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+        m_valid = false;
+        return 0;
+    }
+
+    [[nodiscard]] inline std::wstring readString()
+    {
+        const std::string_view bytes = readBytes();
+        return DecodeUtf8(bytes);
+    }
+
+    [[nodiscard]] inline std::string_view readBytes()
+    {
+        const uint64_t length = readVarint();
+        if (!m_valid || (length > (m_size - m_offset))) {
+            m_valid = false;
+            return {};
+        }
+        const std::string_view bytes(reinterpret_cast<const char *>(m_data + m_offset), std::size_t(length));
+        m_offset += std::size_t(length);
+        return bytes;
+    }
+
+private:
+    const uint8_t *m_data = nullptr;
+    std::size_t m_size = 0;
+    std::size_t m_offset = 0;
+    bool m_valid = true;
+};
+
+// Builds the log in memory and hands it to the sink in large chunks. Thread safe, the
+// progress callbacks come from the backends' own threads.
+class SessionRecorder
+{
+public:
+    using Sink = std::function<bool(const void *, const std::size_t)>;
+
+    explicit SessionRecorder(Sink sink) : m_sink(std::move(sink))
+    {
+        m_buffer.reserve(kSessionLogFlushThreshold * 2);
+        m_buffer.resize(sizeof(kSessionLogMagic));
+        std::memcpy(m_buffer.data(), &kSessionLogMagic, sizeof(kSessionLogMagic));
+        m_buffer.push_back(kSessionLogVersion);
+    }
+
+    ~SessionRecorder()
+    {
+        flush();
+    }
+
+    SessionRecorder(const SessionRecorder &) = delete;
+    SessionRecorder &operator=(const SessionRecorder &) = delete;
+
+    // Starts the records of one updater. "cache" is the search cache and "journal" the
+    // checkpoint journal it was given, if any.
+    inline void target(const SessionTarget target, const UpdateOptions &options, const std::vector<uint8_t> &cache, const std::vector<uint8_t> &journal)
+    {
+        std::vector<uint8_t> payload = {};
+        payload.push_back(uint8_t(target));
+        AppendVarint(payload, options.pipelineDepth);
+        AppendVarint(payload, options.storeMaxInFlight);
+        payload.push_back(options.incremental ? 1 : 0);
+        AppendVarint(payload, options.storePriority.size());
+        for (auto &&package : std::as_const(options.storePriority)) {
+            AppendLogString(payload, package);
+        }
+        AppendVarint(payload, cache.size());
+        payload.insert(payload.end(), cache.cbegin(), cache.cend());
+        AppendVarint(payload, journal.size());
+        payload.insert(payload.end(), journal.cbegin(), journal.cend());
+        AppendVarint(payload, options.retryLimit);
+        AppendVarint(payload, options.retryBudget);
+        AppendVarint(payload, uint64_t(options.retryDelay.count()));
+        AppendLogString(payload, options.filter.source());
+        append(SessionRecordType::Target, payload);
+    }
+
+    inline void append(const SessionRecordType type, const std::vector<uint8_t> &payload)
+    {
+        const std::scoped_lock lock(m_mutex);
+        const auto now = std::chrono::steady_clock::now();
+        m_buffer.push_back(uint8_t(type));
+        AppendVarint(m_buffer, uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(now - m_last).count()));
+        AppendVarint(m_buffer, payload.size());
+        m_buffer.insert(m_buffer.end(), payload.cbegin(), payload.cend());
+        m_last = now;
+        if (m_buffer.size() >= kSessionLogFlushThreshold) {
+            flushLocked();
+        }
+    }
+
+    inline void flush()
+    {
+        const std::scoped_lock lock(m_mutex);
+        flushLocked();
+    }
+
+    // False once the sink failed, nothing is recorded from then on.
+    [[nodiscard]] inline bool isHealthy() const
+    {
+        const std::scoped_lock lock(m_mutex);
+        return m_healthy;
+    }
+
+private:
+    inline void flushLocked()
+    {
+        if (m_buffer.empty()) {
+            return;
+        }
+        if (m_healthy && m_sink) {
+            m_healthy = m_sink(m_buffer.data(), m_buffer.size());
+        }
+        m_buffer.clear();
+    }
+
+    Sink m_sink = nullptr;
+    mutable std::mutex m_mutex;
+    std::vector<uint8_t> m_buffer = {};
+    std::chrono::steady_clock::time_point m_last = std::chrono::steady_clock::now();
+    bool m_healthy = true;
+};
+
+class RecordingSystemBackend final : public SystemUpdateBackend
+{
+public:
+    explicit RecordingSystemBackend(SystemUpdateBackend &backend, SessionRecorder &recorder) : m_backend(backend), m_recorder(recorder)
+    {
+        m_backend.setProgressHandler([this](const PipelineStage stage, const std::size_t index, const int percent, const uint64_t bytesDone, const uint64_t bytesTotal){
+            std::vector<uint8_t> payload = {};
+            payload.push_back(uint8_t(stage));
+            AppendVarint(payload, index);
+            AppendVarint(payload, uint64_t(std::max(percent, 0)));
+            AppendVarint(payload, bytesDone);
+            AppendVarint(payload, bytesTotal);
+            m_recorder.append(SessionRecordType::SystemProgress, payload);
+            if (m_progressHandler) {
+                m_progressHandler(stage, index, percent, bytesDone, bytesTotal);
+            }
+        });
+    }
+
+    ~RecordingSystemBackend() override
+    {
+        m_backend.setProgressHandler(nullptr);
+    }
+
+    inline void setProgressHandler(ProgressHandler handler) override
+    {
+        m_progressHandler = std::move(handler);
+    }
+
+    [[nodiscard]] inline bool search(const bool online, const std::wstring &criteria, std::vector<UpdateDescriptor> &updates) override
+    {
+        const bool ok = m_backend.search(online, criteria, updates);
+        std::vector<uint8_t> payload = {};
+        payload.push_back(online ? 1 : 0);
+        payload.push_back(ok ? 1 : 0);
+        AppendVarint(payload, (ok ? updates.size() : 0));
+        for (std::size_t index = 0; ok && (index != updates.size()); ++index) {
+            const UpdateDescriptor &update = updates.at(index);
+            AppendLogString(payload, update.id);
+            AppendVarint(payload, uint32_t(update.revision));
+            AppendLogString(payload, update.title);
+            AppendVarint(payload, update.kb);
+            AppendVarint(payload, update.maxDownloadSize);
+            payload.push_back(update.downloaded ? 1 : 0);
+            payload.push_back(uint8_t(update.severity));
+            payload.push_back(uint8_t(update.type));
+            payload.push_back(uint8_t(update.impact));
+            payload.push_back(uint8_t(update.rebootBehavior));
+            payload.push_back(update.canRequestUserInput ? 1 : 0);
+            AppendVarint(payload, update.categories.size());
+            for (auto &&category : std::as_const(update.categories)) {
+                AppendLogString(payload, category);
+            }
+        }
+        m_recorder.append(SessionRecordType::SystemSearch, payload);
+        return ok;
+    }
+
+    [[nodiscard]] inline bool select(const std::vector<std::size_t> &candidates) override
+    {
+        const bool ok = m_backend.select(candidates);
+        std::vector<uint8_t> payload = {};
+        payload.push_back(ok ? 1 : 0);
+        AppendVarint(payload, candidates.size());
+        for (auto &&candidate : std::as_const(candidates)) {
+            AppendVarint(payload, candidate);
+        }
+        m_recorder.append(SessionRecordType::SystemSelect, payload);
+        return ok;
+    }
+
+    inline void prioritize(const std::size_t index, const DownloadPriority priority) override
+    {
+        m_backend.prioritize(index, priority);
+    }
+
+    [[nodiscard]] inline uint64_t freeDiskSpace() override
+    {
+        const uint64_t space = m_backend.freeDiskSpace();
+        std::vector<uint8_t> payload = {};
+        AppendVarint(payload, space);
+        m_recorder.append(SessionRecordType::SystemDiskSpace, payload);
+        return space;
+    }
+
+    [[nodiscard]] inline bool beginDownload(const std::size_t index) override
+    {
+        return recordBegin(PipelineStage::Download, index, m_backend.beginDownload(index));
+    }
+
+    [[nodiscard]] inline bool beginInstall(const std::size_t index) override
+    {
+        return recordBegin(PipelineStage::Install, index, m_backend.beginInstall(index));
+    }
+
+    [[nodiscard]] inline bool waitForCompletion(PipelineCompletion &completion) override
+    {
+        const bool ok = m_backend.waitForCompletion(completion);
+        std::vector<uint8_t> payload = {};
+        payload.push_back(ok ? 1 : 0);
+        payload.push_back(uint8_t(completion.stage));
+        AppendVarint(payload, completion.index);
+        payload.push_back(uint8_t(completion.result));
+        AppendVarint(payload, uint32_t(completion.hresult));
+        m_recorder.append(SessionRecordType::SystemCompletion, payload);
+        return ok;
+    }
+
+    [[nodiscard]] inline bool commit() override
+    {
+        const bool ok = m_backend.commit();
+        m_recorder.append(SessionRecordType::SystemCommit, { uint8_t(ok ? 1 : 0) });
+        return ok;
+    }
+
+    // Not a record of its own, the timestamp of whatever follows covers the wait.
+    inline void backOff(const std::chrono::milliseconds delay) override
+    {
+        m_backend.backOff(delay);
+    }
+
+private:
+    [[nodiscard]] inline bool recordBegin(const PipelineStage stage, const std::size_t index, const bool ok)
+    {
+        std::vector<uint8_t> payload = {};
+        payload.push_back(uint8_t(stage));
+        AppendVarint(payload, index);
+        payload.push_back(ok ? 1 : 0);
+        m_recorder.append(SessionRecordType::SystemBegin, payload);
+        return ok;
+    }
+
+    SystemUpdateBackend &m_backend;
+    SessionRecorder &m_recorder;
+    ProgressHandler m_progressHandler = nullptr;
+};
+
+class RecordingStoreBackend final : public StoreBackend
+{
+public:
+    explicit RecordingStoreBackend(StoreBackend &backend, SessionRecorder &recorder) : m_backend(backend), m_recorder(recorder)
+    {
+        m_backend.setProgressHandler([this](const std::size_t index, const std::wstring_view packageFamilyName, const double percent){
+            std::vector<uint8_t> payload = {};
+            AppendVarint(payload, index);
+            AppendVarint(payload, uint64_t(std::clamp(percent, 0.0, 100.0) * 100.0));
+            m_recorder.append(SessionRecordType::StoreProgress, payload);
+            if (m_progressHandler) {
+                m_progressHandler(index, packageFamilyName, percent);
+            }
+        });
+    }
+
+    ~RecordingStoreBackend() override
+    {
+        m_backend.setProgressHandler(nullptr);
+    }
+
+    inline void setProgressHandler(ProgressHandler handler) override
+    {
+        m_progressHandler = std::move(handler);
+    }
+
+    [[nodiscard]] inline bool searchAll(std::vector<StoreItemDescriptor> &items) override
+    {
+        return recordSearch(false, items, m_backend.searchAll(items));
+    }
+
+    [[nodiscard]] inline bool searchProducts(const std::vector<std::wstring> &productIds, std::vector<StoreItemDescriptor> &items) override
+    {
+        return recordSearch(true, items, m_backend.searchProducts(productIds, items));
+    }
+
+    inline void pause(const std::size_t index) override
+    {
+        m_backend.pause(index);
+        std::vector<uint8_t> payload = {};
+        AppendVarint(payload, index);
+        m_recorder.append(SessionRecordType::StorePause, payload);
+    }
+
+    inline void cancel(const std::size_t index) override
+    {
+        m_backend.cancel(index);
+        std::vector<uint8_t> payload = {};
+        AppendVarint(payload, index);
+        m_recorder.append(SessionRecordType::StoreCancel, payload);
+    }
+
+    [[nodiscard]] inline bool start(const std::size_t index) override
+    {
+        const bool ok = m_backend.start(index);
+        std::vector<uint8_t> payload = {};
+        AppendVarint(payload, index);
+        payload.push_back(ok ? 1 : 0);
+        m_recorder.append(SessionRecordType::StoreStart, payload);
+        return ok;
+    }
+
+    [[nodiscard]] inline StoreItemState state(const std::size_t index) const override
+    {
+        return m_backend.state(index);
+    }
+
+    [[nodiscard]] inline int32_t errorCode(const std::size_t index) const override
+    {
+        return m_backend.errorCode(index);
+    }
+
+    // The state right after the completion is what the orchestration looks at, so that's
+    // what gets recorded along with it.
+    [[nodiscard]] inline bool waitForCompletion(std::size_t &index) override
+    {
+        const bool ok = m_backend.waitForCompletion(index);
+        std::vector<uint8_t> payload = {};
+        payload.push_back(ok ? 1 : 0);
+        AppendVarint(payload, (ok ? index : 0));
+        payload.push_back(uint8_t(ok ? m_backend.state(index) : StoreItemState::Error));
+        AppendVarint(payload, uint32_t(ok ? m_backend.errorCode(index) : 0));
+        m_recorder.append(SessionRecordType::StoreCompletion, payload);
+        return ok;
+    }
+
+private:
+    [[nodiscard]] inline bool recordSearch(const bool products, const std::vector<StoreItemDescriptor> &items, const bool ok)
+    {
+        std::vector<uint8_t> payload = {};
+        payload.push_back(products ? 1 : 0);
+        payload.push_back(ok ? 1 : 0);
+        AppendVarint(payload, (ok ? items.size() : 0));
+        for (std::size_t index = 0; ok && (index != items.size()); ++index) {
+            AppendLogString(payload, items.at(index).productId);
+            AppendLogString(payload, items.at(index).packageFamilyName);
+            AppendVarint(payload, items.at(index).downloadSize);
+        }
+        m_recorder.append(SessionRecordType::StoreSearch, payload);
+        return ok;
+    }
+
+    StoreBackend &m_backend;
+    SessionRecorder &m_recorder;
+    ProgressHandler m_progressHandler = nullptr;
+};
+
+// Walks a session log in order. The replay backends ask for the record type they expect
+// next, progress records on the way are delivered to the progress handlers. Anything
+// unexpected means the orchestration took a different path than when it was recorded.
+class SessionReplay
+{
+public:
+    SessionReplay() = default;
+    ~SessionReplay() = default;
+
+    SessionReplay(const SessionReplay &) = delete;
+    SessionReplay &operator=(const SessionReplay &) = delete;
+
+    [[nodiscard]] inline bool open(std::vector<uint8_t> data)
+    {
+        m_data = std::move(data);
+        m_records.clear();
+        m_next = 0;
+        m_diverged = false;
+        uint32_t magic = 0;
+        if (m_data.size() < (sizeof(magic) + 1)) {
+            return false;
+        }
+        std::memcpy(&magic, m_data.data(), sizeof(magic));
+        if ((magic != kSessionLogMagic) || (m_data.at(sizeof(magic)) != kSessionLogVersion)) {
+            return false;
+        }
+        SessionLogReader reader(m_data.data(), m_data.size());
+        for (std::size_t skip = 0; skip != (sizeof(magic) + 1); ++skip) {
+            (void)reader.readByte();
+        }
+        uint64_t timestamp = 0;
+        while (!reader.atEnd()) {
+            Record record = {};
+            record.type = SessionRecordType(reader.readByte());
+            timestamp += reader.readVarint();
+            record.timestamp = timestamp;
+            const std::string_view payload = reader.readBytes();
+            if (!reader.isValid()) {
+                break; // Cut short, keep what's complete.
+            }
+            record.payload = reinterpret_cast<const uint8_t *>(payload.data());
+            record.size = payload.size();
+            m_records.push_back(record);
+        }
+        return true;
+    }
+
+    // 0 replays as fast as possible, 1 at the recorded pace, 2 twice as fast and so on.
+    inline void setSpeed(const double speed)
+    {
+        m_speed = std::max(speed, 0.0);
+    }
+
+    [[nodiscard]] inline std::size_t size() const
+    {
+        return m_records.size();
+    }
+
+    [[nodiscard]] inline bool hasDiverged() const
+    {
+        return m_diverged;
+    }
+
+    inline void setSystemProgressHandler(SystemUpdateBackend::ProgressHandler handler)
+    {
+        m_systemProgressHandler = std::move(handler);
+    }
+
+    inline void setStoreProgressHandler(std::function<void(const std::size_t, const double)> handler)
+    {
+        m_storeProgressHandler = std::move(handler);
+    }
+
+    // The next updater to run, false at the end of the log.
+    [[nodiscard]] inline bool nextTarget(SessionTarget &target, UpdateOptions &options, std::vector<uint8_t> &cache, std::vector<uint8_t> &journal)
+    {
+        while ((m_next < m_records.size()) && (m_records.at(m_next).type != SessionRecordType::Target)) {
+            ++m_next; // Whatever an aborted updater left behind.
+        }
+        SessionLogReader reader = {};
+        if (!next(SessionRecordType::Target, reader)) {
+            return false;
+        }
+        target = SessionTarget(reader.readByte());
+        options.pipelineDepth = std::size_t(reader.readVarint());
+        options.storeMaxInFlight = std::size_t(reader.readVarint());
+        options.incremental = reader.readBool();
+        options.storePriority.resize(std::size_t(std::min(reader.readVarint(), uint64_t(1024))));
+        for (auto &&package : options.storePriority) {
+            package = reader.readString();
+        }
+        const std::string_view bytes = reader.readBytes();
+        cache.assign(bytes.cbegin(), bytes.cend());
+        const std::string_view journalBytes = reader.readBytes();
+        journal.assign(journalBytes.cbegin(), journalBytes.cend());
+        options.retryLimit = std::size_t(reader.readVarint());
+        options.retryBudget = std::size_t(reader.readVarint());
+        options.retryDelay = std::chrono::milliseconds(reader.readVarint());
+        std::wstring error = {};
+        if (!options.filter.parse(reader.readString(), error)) {
+            return false;
+        }
+        return reader.isValid();
+    }
+
+    [[nodiscard]] inline bool next(const SessionRecordType type, SessionLogReader &payload)
+    {
+        while (!m_diverged && (m_next < m_records.size())) {
+            const Record &record = m_records.at(m_next++);
+            pace(record.timestamp);
+            SessionLogReader reader(record.payload, record.size);
+            if (record.type == SessionRecordType::SystemProgress) {
+                deliverSystemProgress(reader);
+                continue;
+            }
+            if (record.type == SessionRecordType::StoreProgress) {
+                deliverStoreProgress(reader);
+                continue;
+            }
+            if (record.type != type) {
+                m_diverged = true;
+                return false;
+            }
+            payload = reader;
+            return true;
+        }
+        if (type != SessionRecordType::Target) {
+            m_diverged = true;
+        }
+        return false;
+    }
+
+    inline void diverge()
+    {
+        m_diverged = true;
+    }
+
+private:
+    struct Record
+    {
+        SessionRecordType type = SessionRecordType::Target;
+        uint64_t timestamp = 0; // Microseconds since recording started.
+        const uint8_t *payload = nullptr;
+        std::size_t size = 0;
+    };
+
+    inline void pace(const uint64_t timestamp)
+    {
+        if (m_speed <= 0.0) {
+            return;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        if (!m_paced) {
+            m_paced = true;
+            m_origin = now;
+            m_originTimestamp = timestamp;
+            return;
+        }
+        const auto due = (m_origin + std::chrono::microseconds(uint64_t(double(timestamp - m_originTimestamp) / m_speed)));
+        if (due > now) {
+            std::this_thread::sleep_until(due);
+        }
+    }
+
+    inline void deliverSystemProgress(SessionLogReader &reader) const
+    {
+        const auto stage = PipelineStage(reader.readByte());
+        const auto index = std::size_t(reader.readVarint());
+        const auto percent = int(reader.readVarint());
+        const uint64_t bytesDone = reader.readVarint();
+        const uint64_t bytesTotal = reader.readVarint();
+        if (reader.isValid() && m_systemProgressHandler) {
+            m_systemProgressHandler(stage, index, percent, bytesDone, bytesTotal);
+        }
+    }
+
+    inline void deliverStoreProgress(SessionLogReader &reader) const
+    {
+        const auto index = std::size_t(reader.readVarint());
+        const double percent = (double(reader.readVarint()) / 100.0);
+        if (reader.isValid() && m_storeProgressHandler) {
+            m_storeProgressHandler(index, percent);
+        }
+    }
+
+    std::vector<uint8_t> m_data = {};
+    std::vector<Record> m_records = {};
+    std::size_t m_next = 0;
+    bool m_diverged = false;
+    double m_speed = 0.0;
+    bool m_paced = false;
+    std::chrono::steady_clock::time_point m_origin = {};
+    uint64_t m_originTimestamp = 0;
+    SystemUpdateBackend::ProgressHandler m_systemProgressHandler = nullptr;
+    std::function<void(const std::size_t, const double)> m_storeProgressHandler = nullptr;
+};
+
+class ReplaySystemBackend final : public SystemUpdateBackend
+{
+public:
+    explicit ReplaySystemBackend(SessionReplay &replay) : m_replay(replay)
+    {
+    }
+
+    ~ReplaySystemBackend() override
+    {
+        m_replay.setSystemProgressHandler(nullptr);
+    }
+
+    inline void setProgressHandler(ProgressHandler handler) override
+    {
+        m_replay.setSystemProgressHandler(std::move(handler));
+    }
+
+    [[nodiscard]] inline bool search(const bool online, const std::wstring &criteria, std::vector<UpdateDescriptor> &updates) override
+    {
+        (void)criteria;
+        SessionLogReader reader = {};
+        if (!m_replay.next(SessionRecordType::SystemSearch, reader)) {
+            return false;
+        }
+        if (reader.readBool() != online) {
+            m_replay.diverge();
+            return false;
+        }
+        const bool ok = reader.readBool();
+        updates.clear();
+        const uint64_t count = reader.readVarint();
+        for (uint64_t index = 0; reader.isValid() && (index != count); ++index) {
+            UpdateDescriptor update = {};
+            update.id = reader.readString();
+            update.revision = int32_t(uint32_t(reader.readVarint()));
+            update.title = reader.readString();
+            update.kb = uint32_t(reader.readVarint());
+            update.maxDownloadSize = reader.readVarint();
+            update.downloaded = reader.readBool();
+            update.severity = UpdateSeverity(reader.readByte());
+            update.type = UpdateType(reader.readByte());
+            update.impact = InstallImpact(reader.readByte());
+            update.rebootBehavior = RebootBehavior(reader.readByte());
+            update.canRequestUserInput = reader.readBool();
+            update.categories.resize(std::size_t(std::min(reader.readVarint(), uint64_t(64))));
+            for (auto &&category : update.categories) {
+                category = reader.readString();
+            }
+            updates.push_back(std::move(update));
+        }
+        return (ok && checked(reader));
+    }
+
+    [[nodiscard]] inline bool select(const std::vector<std::size_t> &candidates) override
+    {
+        SessionLogReader reader = {};
+        if (!m_replay.next(SessionRecordType::SystemSelect, reader)) {
+            return false;
+        }
+        const bool ok = reader.readBool();
+        if (reader.readVarint() != candidates.size()) {
+            m_replay.diverge();
+            return false;
+        }
+        m_selected = candidates.size();
+        return (ok && checked(reader));
+    }
+
+    inline void prioritize(const std::size_t index, const DownloadPriority priority) override
+    {
+        (void)index;
+        (void)priority;
+    }
+
+    // Nothing fits if the log doesn't say, rather than downloading what wasn't recorded.
+    [[nodiscard]] inline uint64_t freeDiskSpace() override
+    {
+        SessionLogReader reader = {};
+        if (!m_replay.next(SessionRecordType::SystemDiskSpace, reader)) {
+            return 0;
+        }
+        const uint64_t space = reader.readVarint();
+        return (checked(reader) ? space : 0);
+    }
+
+    [[nodiscard]] inline bool beginDownload(const std::size_t index) override
+    {
+        return replayBegin(PipelineStage::Download, index);
+    }
+
+    [[nodiscard]] inline bool beginInstall(const std::size_t index) override
+    {
+        return replayBegin(PipelineStage::Install, index);
+    }
+
+    [[nodiscard]] inline bool waitForCompletion(PipelineCompletion &completion) override
+    {
+        SessionLogReader reader = {};
+        if (!m_replay.next(SessionRecordType::SystemCompletion, reader)) {
+            return false;
+        }
+        const bool ok = reader.readBool();
+        const uint8_t stage = reader.readByte();
+        completion.index = std::size_t(reader.readVarint());
+        completion.result = OperationResult(reader.readByte());
+        completion.hresult = int32_t(uint32_t(reader.readVarint()));
+        // The pipeline indexes its state with whatever comes back, a broken log must not get that far.
+        if (!reader.isValid() || (ok && ((stage > uint8_t(PipelineStage::Install)) || (completion.index >= m_selected)))) {
+            m_replay.diverge();
+            return false;
+        }
+        completion.stage = PipelineStage(stage);
+        return ok;
+    }
+
+    [[nodiscard]] inline bool commit() override
+    {
+        SessionLogReader reader = {};
+        if (!m_replay.next(SessionRecordType::SystemCommit, reader)) {
+            return false;
+        }
+        const bool ok = reader.readBool();
+        return (ok && checked(reader));
+    }
+
+    // The pacing already reproduces the recorded wait, if wanted.
+    inline void backOff(const std::chrono::milliseconds delay) override
+    {
+        (void)delay;
+    }
+
+private:
+    [[nodiscard]] inline bool replayBegin(const PipelineStage stage, const std::size_t index)
+    {
+        SessionLogReader reader = {};
+        if (!m_replay.next(SessionRecordType::SystemBegin, reader)) {
+            return false;
+        }
+        if ((PipelineStage(reader.readByte()) != stage) || (reader.readVarint() != index)) {
+            m_replay.diverge();
+            return false;
+        }
+        const bool ok = reader.readBool();
+        return (ok && checked(reader));
+    }
+
+    [[nodiscard]] inline bool checked(const SessionLogReader &reader)
+    {
+        if (!reader.isValid()) {
+            m_replay.diverge();
+            return false;
+        }
+        return true;
+    }
+
+    SessionReplay &m_replay;
+    std::size_t m_selected = 0; // Candidates of the current pass, what completions may refer to.
+};
+
+class ReplayStoreBackend final : public StoreBackend
+{
+public:
+    explicit ReplayStoreBackend(SessionReplay &replay) : m_replay(replay)
+    {
+    }
+
+    ~ReplayStoreBackend() override
+    {
+        m_replay.setStoreProgressHandler(nullptr);
+    }
+
+    inline void setProgressHandler(ProgressHandler handler) override
+    {
+        if (!handler) {
+            m_replay.setStoreProgressHandler(nullptr);
+            return;
+        }
+        m_replay.setStoreProgressHandler([this, handler = std::move(handler)](const std::size_t index, const double percent){
+            handler(index, ((index < m_items.size()) ? std::wstring_view(m_items.at(index).packageFamilyName) : std::wstring_view{}), percent);
+        });
+    }
+
+    [[nodiscard]] inline bool searchAll(std::vector<StoreItemDescriptor> &items) override
+    {
+        return replaySearch(false, items);
+    }
+
+    [[nodiscard]] inline bool searchProducts(const std::vector<std::wstring> &productIds, std::vector<StoreItemDescriptor> &items) override
+    {
+        (void)productIds;
+        return replaySearch(true, items);
+    }
+
+    inline void pause(const std::size_t index) override
+    {
+        SessionLogReader reader = {};
+        if (m_replay.next(SessionRecordType::StorePause, reader) && (reader.readVarint() != index)) {
+            m_replay.diverge();
+        }
+    }
+
+    inline void cancel(const std::size_t index) override
+    {
+        SessionLogReader reader = {};
+        if (m_replay.next(SessionRecordType::StoreCancel, reader) && (reader.readVarint() != index)) {
+            m_replay.diverge();
+        }
+    }
+
+    [[nodiscard]] inline bool start(const std::size_t index) override
+    {
+        SessionLogReader reader = {};
+        if (!m_replay.next(SessionRecordType::StoreStart, reader)) {
+            return false;
+        }
+        if (reader.readVarint() != index) {
+            m_replay.diverge();
+            return false;
+        }
+        return (reader.readBool() && reader.isValid());
+    }
+
+    [[nodiscard]] inline StoreItemState state(const std::size_t index) const override
+    {
+        return ((index < m_states.size()) ? m_states.at(index).first : StoreItemState::Error);
+    }
+
+    [[nodiscard]] inline int32_t errorCode(const std::size_t index) const override
+    {
+        return ((index < m_states.size()) ? m_states.at(index).second : 0);
+    }
+
+    [[nodiscard]] inline bool waitForCompletion(std::size_t &index) override
+    {
+        SessionLogReader reader = {};
+        if (!m_replay.next(SessionRecordType::StoreCompletion, reader)) {
+            return false;
+        }
+        const bool ok = reader.readBool();
+        index = std::size_t(reader.readVarint());
+        const auto state = StoreItemState(reader.readByte());
+        const auto code = int32_t(uint32_t(reader.readVarint()));
+        if (!reader.isValid() || (ok && (index >= m_states.size()))) {
+            m_replay.diverge();
+            return false;
+        }
+        if (ok) {
+            m_states.at(index) = { state, code };
+        }
+        return ok;
+    }
+
+private:
+    [[nodiscard]] inline bool replaySearch(const bool products, std::vector<StoreItemDescriptor> &items)
+    {
+        SessionLogReader reader = {};
+        if (!m_replay.next(SessionRecordType::StoreSearch, reader)) {
+            return false;
+        }
+        if (reader.readBool() != products) {
+            m_replay.diverge();
+            return false;
+        }
+        const bool ok = reader.readBool();
+        items.clear();
+        const uint64_t count = reader.readVarint();
+        for (uint64_t index = 0; reader.isValid() && (index != count); ++index) {
+            StoreItemDescriptor item = {};
+            item.productId = reader.readString();
+            item.packageFamilyName = reader.readString();
+            item.downloadSize = reader.readVarint();
+            items.push_back(std::move(item));
+        }
+        if (!reader.isValid()) {
+            m_replay.diverge();
+            return false;
+        }
+        m_items = items;
+        m_states.assign(items.size(), { StoreItemState::Queued, 0 });
+        return ok;
+    }
+
+    SessionReplay &m_replay;
+    std::vector<StoreItemDescriptor> m_items = {};
+    std::vector<std::pair<StoreItemState, int32_t>> m_states = {};
+};
+
+// Runs every updater the log contains, with the options it was recorded with.
+[[nodiscard]] static inline bool ReplaySession(SessionReplay &replay, UpdateReporter &reporter)
+{
+    bool succeeded = true;
+    SessionTarget target = SessionTarget::Store;
+    UpdateOptions options = {};
+    std::vector<uint8_t> cacheData = {};
+    std::vector<uint8_t> journalData = {};
+    while (replay.nextTarget(target, options, cacheData, journalData)) {
+        if (target == SessionTarget::Store) {
+            ReplayStoreBackend backend(replay);
+            StoreUpdater updater(backend, reporter, options);
+            succeeded = (updater.run() && succeeded);
+        } else {
+            ReplaySystemBackend backend(replay);
+            SystemUpdater updater(backend, reporter, options);
+            SearchCacheView cache = {};
+            const bool cacheIsValid = cache.attach(cacheData.data(), cacheData.size());
+            // Only read, the journal on disk belongs to the real runs.
+            CheckpointJournal journal = {};
+            (void)journal.load(journalData.data(), journalData.size());
+            updater.setCheckpointJournal(&journal);
+            succeeded = (updater.run(cacheIsValid ? &cache : nullptr) && succeeded);
+        }
+        if (replay.hasDiverged()) {
+            reporter.error(L"The replay diverged from the recorded session.", 0);
+            return false;
+        }
+    }
+    return succeeded;
+}
+
+} // namespace WinUpdate
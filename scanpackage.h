@@ -0,0 +1,113 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "searchcache.h"
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace WinUpdate
+{
+
+// An offline scan package (wsusscn2.cab) has to be registered with WUA as a service of its
+// own before it can be searched, which makes WUA unpack and index the whole catalog. The
+// registration survives the process, so we remember which package it was made for and
+// reuse it for as long as the package has the same path and content. One fixed size
+// record, little endian like everything else we persist.
+static constexpr const uint32_t kScanPackageMagic = 0x50535557; // "WUSP"
+static constexpr const uint32_t kScanPackageVersion = 1;
+static constexpr const std::size_t kScanPackageServiceIdLength = 40; // Code units, a GUID plus the terminator fits.
+
+struct ScanPackageRecord
+{
+    uint32_t magic = kScanPackageMagic;
+    uint32_t version = kScanPackageVersion;
+    uint64_t size = 0; // Of the package, in bytes.
+    uint64_t lastWriteTime = 0; // A FILETIME, only so that an untouched package isn't hashed again.
+    uint32_t contentHash = 0; // FNV-1a over the whole package.
+    uint32_t pathHash = 0; // FNV-1a over the lower case absolute path, WUA keeps reading it from there.
+    char16_t serviceId[kScanPackageServiceIdLength] = {}; // Empty until the package is registered.
+    uint32_t checksum = 0; // FNV-1a over everything before it.
+    uint32_t reserved = 0;
+};
+static_assert(sizeof(ScanPackageRecord) == 120);
+
+[[nodiscard]] static inline uint32_t GetScanPackagePathHash(const std::wstring_view path)
+{
+    std::u16string lower(path.size(), u'\0');
+    for (std::size_t index = 0; index != path.size(); ++index) {
+        const wchar_t ch = path.at(index);
+        lower.at(index) = char16_t(((ch >= L'A') && (ch <= L'Z')) ? (ch - L'A' + L'a') : ch);
+    }
+    return CalculateChecksum(lower.data(), lower.size() * sizeof(char16_t));
+}
+
+[[nodiscard]] static inline std::wstring GetScanPackageServiceId(const ScanPackageRecord &record)
+{
+    std::wstring id = {};
+    for (std::size_t index = 0; (index != kScanPackageServiceIdLength) && (record.serviceId[index] != u'\0'); ++index) {
+        id.push_back(wchar_t(record.serviceId[index]));
+    }
+    return id;
+}
+
+// Returns false if "id" doesn't fit, the record is left without one then.
+[[nodiscard]] static inline bool SetScanPackageServiceId(ScanPackageRecord &record, const std::wstring_view id)
+{
+    std::memset(record.serviceId, 0, sizeof(record.serviceId));
+    if (id.size() >= kScanPackageServiceIdLength) {
+        return false;
+    }
+    for (std::size_t index = 0; index != id.size(); ++index) {
+        record.serviceId[index] = char16_t(id.at(index));
+    }
+    return true;
+}
+
+static inline void SealScanPackageRecord(ScanPackageRecord &record)
+{
+    record.magic = kScanPackageMagic;
+    record.version = kScanPackageVersion;
+    record.checksum = CalculateChecksum(&record, offsetof(ScanPackageRecord, checksum));
+}
+
+[[nodiscard]] static inline bool ParseScanPackageRecord(const void *data, const std::size_t size, ScanPackageRecord &record)
+{
+    if (!data || (size != sizeof(ScanPackageRecord))) {
+        return false;
+    }
+    ScanPackageRecord parsed = {};
+    std::memcpy(&parsed, data, sizeof(parsed));
+    if ((parsed.magic != kScanPackageMagic) || (parsed.version != kScanPackageVersion) || (parsed.checksum != CalculateChecksum(&parsed, offsetof(ScanPackageRecord, checksum)))) {
+        return false;
+    }
+    record = parsed;
+    return true;
+}
+
+} // namespace WinUpdate
@@ -0,0 +1,173 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+namespace WinUpdate
+{
+
+// Completion notifications coming from arbitrary threads. Unlike an array of wait
+// handles there is no upper limit on how many producers can feed it.
+class CompletionQueue
+{
+public:
+    CompletionQueue() = default;
+    ~CompletionQueue() = default;
+
+    CompletionQueue(const CompletionQueue &) = delete;
+    CompletionQueue &operator=(const CompletionQueue &) = delete;
+
+    inline void post(const std::size_t index)
+    {
+        {
+            const std::scoped_lock lock(m_mutex);
+            m_items.push_back(index);
+        }
+        m_condition.notify_one();
+    }
+
+    [[nodiscard]] inline std::size_t wait()
+    {
+        std::unique_lock lock(m_mutex);
+        m_condition.wait(lock, [this](){ return !m_items.empty(); });
+        const std::size_t index = m_items.front();
+        m_items.pop_front();
+        return index;
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<std::size_t> m_items = {};
+};
+
+// Keeps at most "maxInFlight" items running, starting the remaining ones by ascending
+// priority (ties keep their original order) whenever a running item completes.
+class BoundedScheduler
+{
+public:
+    using Starter = std::function<bool(const std::size_t)>;
+    using CompletionHandler = std::function<void(const std::size_t)>;
+    using Waiter = std::function<bool(std::size_t &)>;
+
+    explicit BoundedScheduler(const std::size_t maxInFlight) : m_maxInFlight(maxInFlight < 1 ? 1 : maxInFlight)
+    {
+    }
+
+    inline void add(const std::size_t index, const int priority)
+    {
+        m_pending.push_back(Item{ index, priority });
+        if (index >= m_states.size()) {
+            m_states.resize(index + 1, State::Pending);
+        }
+    }
+
+    [[nodiscard]] inline std::size_t size() const
+    {
+        return m_pending.size();
+    }
+
+    // "start" returns false when an item could not be started, such an item never
+    // occupies a slot. Items may also finish on their own before they got a slot,
+    // they are reported once and skipped later. Returns how many items completed.
+    inline std::size_t run(CompletionQueue &queue, const Starter &start, const CompletionHandler &completed)
+    {
+        return run([&queue](std::size_t &index){ index = queue.wait(); return true; }, start, completed);
+    }
+
+    // Same as above, but the completions come from "wait", which returns false when it
+    // has nothing left to wait for. Whatever is still running at that point is abandoned.
+    inline std::size_t run(const Waiter &wait, const Starter &start, const CompletionHandler &completed)
+    {
+        std::stable_sort(m_pending.begin(), m_pending.end(), [](const Item &lhs, const Item &rhs){ return lhs.priority < rhs.priority; });
+        std::size_t next = 0;
+        std::size_t inFlight = 0;
+        std::size_t finished = 0;
+        const auto fill = [&](){
+            while ((inFlight < m_maxInFlight) && (next < m_pending.size())) {
+                const std::size_t index = m_pending.at(next++).index;
+                if (m_states.at(index) != State::Pending) {
+                    continue;
+                }
+                if (start(index)) {
+                    m_states.at(index) = State::Running;
+                    ++inFlight;
+                } else {
+                    m_states.at(index) = State::Finished;
+                }
+            }
+        };
+        fill();
+        while (inFlight > 0) {
+            std::size_t index = 0;
+            if (!wait(index)) {
+                break;
+            }
+            if ((index >= m_states.size()) || (m_states.at(index) == State::Finished)) {
+                continue;
+            }
+            if (m_states.at(index) == State::Running) {
+                --inFlight;
+            }
+            m_states.at(index) = State::Finished;
+            ++finished;
+            if (completed) {
+                completed(index);
+            }
+            fill();
+        }
+        m_pending.clear();
+        m_states.clear();
+        return finished;
+    }
+
+private:
+    enum class State : uint8_t
+    {
+        Pending,
+        Running,
+        Finished
+    };
+
+    struct Item
+    {
+        std::size_t index = 0;
+        int priority = 0;
+    };
+
+    std::size_t m_maxInFlight = 1;
+    std::vector<Item> m_pending = {};
+    std::vector<State> m_states = {};
+};
+
+} // namespace WinUpdate
@@ -0,0 +1,213 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <array>
+#include <vector>
+#include <string>
+#include <string_view>
+
+namespace WinUpdate
+{
+
+// The cache is a flat array of fixed size records behind a small header, so that it can
+// be used straight from a memory mapped view without any parsing. All fields are little
+// endian and naturally aligned.
+static constexpr const uint32_t kSearchCacheMagic = 0x43535557; // "WUSC"
+static constexpr const uint32_t kSearchCacheVersion = 2;
+
+using UpdateGuid = std::array<uint8_t, 16>;
+
+struct SearchCacheHeader
+{
+    uint32_t magic = kSearchCacheMagic;
+    uint32_t version = kSearchCacheVersion;
+    int64_t timestamp = 0; // Seconds since the Unix epoch, UTC.
+    uint32_t count = 0;
+    uint32_t checksum = 0; // FNV-1a over all records.
+    uint32_t criteria = 0; // FNV-1a over the search criteria, a different search can't use it.
+    uint32_t reserved = 0;
+};
+static_assert(sizeof(SearchCacheHeader) == 32);
+
+struct SearchCacheRecord
+{
+    UpdateGuid id = {};
+    int32_t revision = 0;
+    uint32_t kb = 0; // First KB article number, 0 if there is none.
+    uint64_t maxDownloadSize = 0;
+};
+static_assert(sizeof(SearchCacheRecord) == 32);
+
+static constexpr const uint32_t kChecksumSeed = 2166136261u;
+
+// Pass the checksum of what came before as "seed" to continue it over data read in pieces.
+[[nodiscard]] static inline uint32_t CalculateChecksum(const void *data, const std::size_t size, const uint32_t seed = kChecksumSeed)
+{
+    uint32_t hash = seed;
+    const auto bytes = static_cast<const uint8_t *>(data);
+    for (std::size_t index = 0; index != size; ++index) {
+        hash = ((hash ^ bytes[index]) * 16777619u);
+    }
+    return hash;
+}
+
+// Accepts the "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx" form WUA uses for update IDs, the
+// bytes are stored in text order, which is all a cache key needs.
+[[nodiscard]] static inline bool ParseUpdateGuid(const std::wstring_view text, UpdateGuid &guid)
+{
+    std::size_t byte = 0;
+    int high = -1;
+    for (auto &&ch : text) {
+        int nibble = -1;
+        if ((ch >= L'0') && (ch <= L'9')) {
+            nibble = (ch - L'0');
+        } else if ((ch >= L'a') && (ch <= L'f')) {
+            nibble = (ch - L'a' + 10);
+        } else if ((ch >= L'A') && (ch <= L'F')) {
+            nibble = (ch - L'A' + 10);
+        } else if ((ch == L'-') || (ch == L'{') || (ch == L'}')) {
+            continue;
+        } else {
+            return false;
+        }
+        if (high < 0) {
+            high = nibble;
+            continue;
+        }
+        if (byte >= guid.size()) {
+            return false;
+        }
+        guid.at(byte++) = uint8_t((high << 4) | nibble);
+        high = -1;
+    }
+    return ((byte == guid.size()) && (high < 0));
+}
+
+[[nodiscard]] static inline std::wstring FormatUpdateGuid(const UpdateGuid &guid)
+{
+    static constexpr const wchar_t kDigits[] = L"0123456789abcdef";
+    std::wstring text = {};
+    text.reserve(36);
+    for (std::size_t index = 0; index != guid.size(); ++index) {
+        if ((index == 4) || (index == 6) || (index == 8) || (index == 10)) {
+            text.push_back(L'-');
+        }
+        text.push_back(kDigits[guid.at(index) >> 4]);
+        text.push_back(kDigits[guid.at(index) & 0x0F]);
+    }
+    return text;
+}
+
+// A non-owning view over a serialized cache, typically a mapped file.
+class SearchCacheView
+{
+public:
+    SearchCacheView() = default;
+    ~SearchCacheView() = default;
+
+    // Returns false for anything which is not a complete, intact cache of our version.
+    [[nodiscard]] inline bool attach(const void *data, const std::size_t size)
+    {
+        m_header = nullptr;
+        m_records = nullptr;
+        if (!data || (size < sizeof(SearchCacheHeader))) {
+            return false;
+        }
+        const auto header = static_cast<const SearchCacheHeader *>(data);
+        if ((header->magic != kSearchCacheMagic) || (header->version != kSearchCacheVersion)) {
+            return false;
+        }
+        if ((size - sizeof(SearchCacheHeader)) != (std::size_t(header->count) * sizeof(SearchCacheRecord))) {
+            return false;
+        }
+        const auto records = reinterpret_cast<const SearchCacheRecord *>(header + 1);
+        if (CalculateChecksum(records, header->count * sizeof(SearchCacheRecord)) != header->checksum) {
+            return false;
+        }
+        m_header = header;
+        m_records = records;
+        return true;
+    }
+
+    [[nodiscard]] inline bool isValid() const
+    {
+        return (m_header != nullptr);
+    }
+
+    [[nodiscard]] inline int64_t timestamp() const
+    {
+        return (m_header ? m_header->timestamp : 0);
+    }
+
+    [[nodiscard]] inline uint32_t criteria() const
+    {
+        return (m_header ? m_header->criteria : 0);
+    }
+
+    [[nodiscard]] inline std::size_t size() const
+    {
+        return (m_header ? std::size_t(m_header->count) : 0);
+    }
+
+    [[nodiscard]] inline const SearchCacheRecord &at(const std::size_t index) const
+    {
+        return m_records[index];
+    }
+
+    [[nodiscard]] inline bool contains(const UpdateGuid &id, const int32_t revision) const
+    {
+        for (std::size_t index = 0; index != size(); ++index) {
+            if ((m_records[index].id == id) && (m_records[index].revision == revision)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    const SearchCacheHeader *m_header = nullptr;
+    const SearchCacheRecord *m_records = nullptr;
+};
+
+[[nodiscard]] static inline std::vector<uint8_t> SerializeSearchCache(const int64_t timestamp, const uint32_t criteria, const std::vector<SearchCacheRecord> &records)
+{
+    SearchCacheHeader header = {};
+    header.timestamp = timestamp;
+    header.criteria = criteria;
+    header.count = uint32_t(records.size());
+    header.checksum = CalculateChecksum(records.data(), records.size() * sizeof(SearchCacheRecord));
+    std::vector<uint8_t> buffer(sizeof(header) + records.size() * sizeof(SearchCacheRecord));
+    std::memcpy(buffer.data(), &header, sizeof(header));
+    if (!records.empty()) {
+        std::memcpy(buffer.data() + sizeof(header), records.data(), records.size() * sizeof(SearchCacheRecord));
+    }
+    return buffer;
+}
+
+} // namespace WinUpdate
@@ -0,0 +1,526 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "backend.h"
+#include "searchcache.h"
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <chrono>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <random>
+#include <utility>
+#include <functional>
+#include <algorithm>
+
+namespace WinUpdate
+{
+
+// Everything the simulated engines are generated from. Times are virtual milliseconds,
+// rates are per 10,000.
+struct SimulationProfile
+{
+    uint32_t seed = 1;
+    std::size_t updateCount = 100;
+    std::size_t storeItemCount = 20;
+    uint64_t minLatency = 200; // Per request, before the transfer can start.
+    uint64_t maxLatency = 2000;
+    uint64_t minPayloadSize = 1ull << 20; // Bytes.
+    uint64_t maxPayloadSize = 384ull << 20;
+    uint64_t bandwidth = 12500; // Bytes per virtual millisecond, 100 Mbit/s.
+    uint64_t minInstallTime = 1000;
+    uint64_t maxInstallTime = 21000;
+    uint64_t onlineSearchTime = 15000;
+    uint64_t offlineSearchTime = 2000;
+    uint64_t productSearchTime = 1500; // A single Store product.
+    uint64_t commitTime = 3000;
+    uint32_t failureRate = 0; // How often an operation fails once before it works.
+    uint32_t followOnRate = 0; // How often an update is only offered after an earlier one got installed.
+    uint64_t freeDiskSpace = UINT64_MAX; // Bytes.
+};
+
+static constexpr const int32_t kSimulatedFailure = int32_t(0x80004005); // E_FAIL
+
+struct SimulatedUpdate
+{
+    UpdateDescriptor descriptor = {};
+    uint64_t latency = 0;
+    uint64_t downloadTime = 0;
+    uint64_t installTime = 0;
+    uint32_t downloadFailures = 0; // Attempts that fail before one succeeds.
+    uint32_t installFailures = 0;
+    std::size_t unlockedBy = SIZE_MAX; // Only offered once this update is installed.
+};
+
+struct SimulatedStoreItem
+{
+    StoreItemDescriptor descriptor = {};
+    uint64_t latency = 0;
+    uint64_t downloadTime = 0;
+    uint64_t installTime = 0;
+    uint32_t failures = 0;
+};
+
+// "std::uniform_int_distribution" is implementation defined, the raw engine output is
+// not, so every platform generates exactly the same catalog from the same seed.
+[[nodiscard]] static inline uint64_t PickSimulatedValue(std::mt19937_64 &engine, const uint64_t minimum, const uint64_t maximum)
+{
+    return ((maximum > minimum) ? (minimum + (engine() % (maximum - minimum + 1))) : minimum);
+}
+
+[[nodiscard]] static inline bool RollSimulatedChance(std::mt19937_64 &engine, const uint32_t rate)
+{
+    return ((rate > 0) && ((engine() % 10000) < rate));
+}
+
+// Derived from what's already there, the catalog of a given seed stays the same.
+[[nodiscard]] static inline std::wstring_view GetSimulatedClassification(const UpdateDescriptor &update)
+{
+    static constexpr const std::array<std::size_t, 3> kOthers = { 8, 7, 1 }; // Updates, Update Rollups, Definition Updates.
+    if (update.type == UpdateType::Driver) {
+        return kUpdateClassifications.at(2).id;
+    }
+    if (update.severity != UpdateSeverity::Unspecified) {
+        return kUpdateClassifications.at(4).id;
+    }
+    return kUpdateClassifications.at(kOthers.at((update.kb / 5) % kOthers.size())).id;
+}
+
+[[nodiscard]] static inline std::vector<SimulatedUpdate> GenerateSimulatedUpdates(const SimulationProfile &profile)
+{
+    std::mt19937_64 engine(profile.seed);
+    std::vector<SimulatedUpdate> catalog(profile.updateCount);
+    for (std::size_t index = 0; index != catalog.size(); ++index) {
+        SimulatedUpdate &update = catalog.at(index);
+        UpdateGuid guid = {};
+        for (auto &&byte : guid) {
+            byte = uint8_t(engine());
+        }
+        update.descriptor.id = FormatUpdateGuid(guid);
+        update.descriptor.revision = int32_t(1 + (engine() % 300));
+        update.descriptor.kb = uint32_t(5000000 + (engine() % 100000));
+        update.descriptor.title = L"Simulated update #" + std::to_wstring(index + 1) + L" (KB" + std::to_wstring(update.descriptor.kb) + L')';
+        update.descriptor.severity = UpdateSeverity(update.descriptor.kb % 5);
+        update.descriptor.type = (((update.descriptor.kb % 13) == 0) ? UpdateType::Driver : UpdateType::Software);
+        update.descriptor.impact = (((update.descriptor.kb % 17) == 0) ? InstallImpact::RequiresExclusiveHandling : InstallImpact::Normal);
+        update.descriptor.rebootBehavior = (((update.descriptor.kb % 7) == 0) ? RebootBehavior::AlwaysRequiresReboot : (((update.descriptor.kb % 7) == 1) ? RebootBehavior::CanRequestReboot : RebootBehavior::NeverReboots));
+        update.descriptor.canRequestUserInput = ((update.descriptor.kb % 11) == 0);
+        update.descriptor.categories = { std::wstring(GetSimulatedClassification(update.descriptor)) };
+        update.descriptor.maxDownloadSize = PickSimulatedValue(engine, profile.minPayloadSize, profile.maxPayloadSize);
+        update.latency = PickSimulatedValue(engine, profile.minLatency, profile.maxLatency);
+        update.downloadTime = (update.descriptor.maxDownloadSize / std::max(profile.bandwidth, uint64_t(1)));
+        update.installTime = PickSimulatedValue(engine, profile.minInstallTime, profile.maxInstallTime);
+        update.downloadFailures = (RollSimulatedChance(engine, profile.failureRate) ? 1 : 0);
+        update.installFailures = (RollSimulatedChance(engine, profile.failureRate) ? 1 : 0);
+        if ((index > 0) && RollSimulatedChance(engine, profile.followOnRate)) {
+            update.unlockedBy = std::size_t(engine() % index);
+        }
+    }
+    return catalog;
+}
+
+[[nodiscard]] static inline std::vector<SimulatedStoreItem> GenerateSimulatedStoreItems(const SimulationProfile &profile)
+{
+    // A realistic share of framework packages so that the priority ordering has work to do.
+    static constexpr const std::wstring_view kFrameworks[] = { L"Microsoft.VCLibs.140.00", L"Microsoft.NET.Native.Runtime.2.2", L"Microsoft.UI.Xaml.2.8" };
+    std::mt19937_64 engine(profile.seed ^ 0x5354'4F52'4500'0000ull);
+    std::vector<SimulatedStoreItem> catalog(profile.storeItemCount);
+    for (std::size_t index = 0; index != catalog.size(); ++index) {
+        SimulatedStoreItem &item = catalog.at(index);
+        item.descriptor.productId = L"9SIM" + std::to_wstring(100000 + index);
+        const uint64_t kind = (engine() % 8);
+        item.descriptor.packageFamilyName = ((kind < std::size(kFrameworks)) ? std::wstring(kFrameworks[kind]) : (L"Simulated.App" + std::to_wstring(index + 1))) + L"_8wekyb3d8bbwe";
+        item.latency = PickSimulatedValue(engine, profile.minLatency, profile.maxLatency);
+        item.descriptor.downloadSize = PickSimulatedValue(engine, profile.minPayloadSize, profile.maxPayloadSize / 4);
+        item.downloadTime = (item.descriptor.downloadSize / std::max(profile.bandwidth, uint64_t(1)));
+        item.installTime = PickSimulatedValue(engine, profile.minInstallTime / 2, profile.maxInstallTime / 4);
+        item.failures = (RollSimulatedChance(engine, profile.failureRate) ? 1 : 0);
+    }
+    return catalog;
+}
+
+// A deterministic discrete-event stand-in for WUA: nothing really sleeps, every
+// operation is scheduled on a virtual clock which "waitForCompletion()" advances.
+// Downloads share one link and are served back to back, so a deeper pipeline can only
+// hide the per-request latency, just like on a real machine. Installed updates are no
+// longer offered, follow-on updates show up once what they depend on is installed.
+// The criteria are not interpreted, "SystemUpdater" filters what it handled by itself.
+class SimulatedUpdateBackend final : public SystemUpdateBackend
+{
+public:
+    explicit SimulatedUpdateBackend(const SimulationProfile &profile)
+        : m_profile(profile), m_catalog(GenerateSimulatedUpdates(profile)), m_installed(m_catalog.size(), false), m_downloaded(m_catalog.size(), false)
+    {
+    }
+
+    ~SimulatedUpdateBackend() override = default;
+
+    // Nothing is transferred for real, so there's no progress to report.
+    inline void setProgressHandler(ProgressHandler handler) override
+    {
+        (void)handler;
+    }
+
+    [[nodiscard]] inline bool search(const bool online, const std::wstring &criteria, std::vector<UpdateDescriptor> &updates) override
+    {
+        (void)criteria;
+        m_now += (online ? m_profile.onlineSearchTime : m_profile.offlineSearchTime);
+        m_candidates.clear();
+        updates.clear();
+        for (std::size_t index = 0; index != m_catalog.size(); ++index) {
+            const SimulatedUpdate &update = m_catalog.at(index);
+            if (m_installed.at(index) || ((update.unlockedBy != SIZE_MAX) && !m_installed.at(update.unlockedBy))) {
+                continue;
+            }
+            m_candidates.push_back(index);
+            updates.push_back(update.descriptor);
+            updates.back().downloaded = m_downloaded.at(index);
+        }
+        return true;
+    }
+
+    [[nodiscard]] inline bool select(const std::vector<std::size_t> &candidates) override
+    {
+        if (m_installing || !m_events.empty()) {
+            return false;
+        }
+        m_selected.clear();
+        m_selected.reserve(candidates.size());
+        for (auto &&candidate : candidates) {
+            if (candidate >= m_candidates.size()) {
+                return false;
+            }
+            m_selected.push_back(m_candidates.at(candidate));
+        }
+        return true;
+    }
+
+    [[nodiscard]] inline bool beginDownload(const std::size_t index) override
+    {
+        if (index >= m_selected.size()) {
+            return false;
+        }
+        SimulatedUpdate &update = m_catalog.at(m_selected.at(index));
+        const uint64_t start = std::max(m_now + update.latency, m_linkFreeAt);
+        m_linkFreeAt = start + update.downloadTime;
+        m_events.push(Event{ m_linkFreeAt, m_sequence++, PipelineStage::Download, index, consumeFailure(update.downloadFailures) });
+        return true;
+    }
+
+    [[nodiscard]] inline bool beginInstall(const std::size_t index) override
+    {
+        if ((index >= m_selected.size()) || m_installing) {
+            return false;
+        }
+        SimulatedUpdate &update = m_catalog.at(m_selected.at(index));
+        m_installing = true;
+        m_events.push(Event{ m_now + update.installTime, m_sequence++, PipelineStage::Install, index, consumeFailure(update.installFailures) });
+        return true;
+    }
+
+    [[nodiscard]] inline bool waitForCompletion(PipelineCompletion &completion) override
+    {
+        if (m_events.empty()) {
+            return false;
+        }
+        const Event event = m_events.top();
+        m_events.pop();
+        m_now = event.time;
+        if (event.stage == PipelineStage::Install) {
+            m_installing = false;
+            if (!event.failed) {
+                m_installed.at(m_selected.at(event.index)) = true;
+                m_completionTimes += m_now;
+            }
+        } else if (!event.failed) {
+            m_downloaded.at(m_selected.at(event.index)) = true;
+        }
+        completion.stage = event.stage;
+        completion.index = event.index;
+        completion.result = (event.failed ? OperationResult::Failed : OperationResult::Succeeded);
+        completion.hresult = (event.failed ? kSimulatedFailure : 0);
+        return true;
+    }
+
+    // A single link has nothing to prioritize, the plan order is all that matters.
+    inline void prioritize(const std::size_t index, const DownloadPriority priority) override
+    {
+        (void)index;
+        (void)priority;
+    }
+
+    [[nodiscard]] inline uint64_t freeDiskSpace() override
+    {
+        return m_profile.freeDiskSpace;
+    }
+
+    [[nodiscard]] inline bool commit() override
+    {
+        m_now += m_profile.commitTime;
+        return true;
+    }
+
+    inline void backOff(const std::chrono::milliseconds delay) override
+    {
+        m_now += uint64_t(delay.count());
+    }
+
+    // Virtual time elapsed since the first operation started.
+    [[nodiscard]] inline uint64_t now() const
+    {
+        return m_now;
+    }
+
+    // What the old strictly phased download-everything-then-install-everything flow costs.
+    [[nodiscard]] inline uint64_t serialTime() const
+    {
+        uint64_t total = 0;
+        for (auto &&update : std::as_const(m_catalog)) {
+            total += (update.latency + update.downloadTime + update.installTime);
+        }
+        return total;
+    }
+
+    [[nodiscard]] inline std::size_t installedCount() const
+    {
+        return std::size_t(std::count(m_installed.cbegin(), m_installed.cend(), true));
+    }
+
+    // When an update got installed on average, what the download order is optimized for.
+    [[nodiscard]] inline uint64_t meanCompletionTime() const
+    {
+        const std::size_t count = installedCount();
+        return ((count > 0) ? (m_completionTimes / count) : 0);
+    }
+
+private:
+    struct Event
+    {
+        uint64_t time = 0;
+        uint64_t sequence = 0;
+        PipelineStage stage = PipelineStage::Download;
+        std::size_t index = 0;
+        bool failed = false;
+
+        [[nodiscard]] inline bool operator>(const Event &other) const
+        {
+            return ((time != other.time) ? (time > other.time) : (sequence > other.sequence));
+        }
+    };
+
+    [[nodiscard]] static inline bool consumeFailure(uint32_t &failures)
+    {
+        if (failures < 1) {
+            return false;
+        }
+        --failures;
+        return true;
+    }
+
+    SimulationProfile m_profile = {};
+    std::vector<SimulatedUpdate> m_catalog = {};
+    std::vector<bool> m_installed = {};
+    std::vector<bool> m_downloaded = {};
+    std::vector<std::size_t> m_candidates = {}; // Catalog indices of the last search.
+    std::vector<std::size_t> m_selected = {}; // Catalog indices by pipeline index.
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> m_events = {};
+    uint64_t m_now = 0;
+    uint64_t m_linkFreeAt = 0;
+    uint64_t m_sequence = 0;
+    uint64_t m_completionTimes = 0; // Sum over all installed updates.
+    bool m_installing = false;
+};
+
+// The Store counterpart. Unlike the real install queue nothing starts on its own, items
+// wait in "Queued" until "start()" is called. Downloads share the link, installs don't.
+class SimulatedStoreBackend final : public StoreBackend
+{
+public:
+    explicit SimulatedStoreBackend(const SimulationProfile &profile)
+        : m_profile(profile), m_catalog(GenerateSimulatedStoreItems(profile)), m_updated(m_catalog.size(), false)
+    {
+    }
+
+    ~SimulatedStoreBackend() override = default;
+
+    inline void setProgressHandler(ProgressHandler handler) override
+    {
+        (void)handler;
+    }
+
+    [[nodiscard]] inline bool searchAll(std::vector<StoreItemDescriptor> &items) override
+    {
+        m_now += m_profile.onlineSearchTime;
+        reset();
+        items.clear();
+        for (std::size_t index = 0; index != m_catalog.size(); ++index) {
+            if (m_updated.at(index)) {
+                continue;
+            }
+            m_items.push_back(Item{ index, StoreItemState::Queued, 0 });
+            items.push_back(m_catalog.at(index).descriptor);
+        }
+        return true;
+    }
+
+    // Products that were just updated never have another update waiting.
+    [[nodiscard]] inline bool searchProducts(const std::vector<std::wstring> &productIds, std::vector<StoreItemDescriptor> &items) override
+    {
+        m_now += (m_profile.productSearchTime * productIds.size());
+        reset();
+        items.clear();
+        return true;
+    }
+
+    inline void pause(const std::size_t index) override
+    {
+        if ((index < m_items.size()) && (m_items.at(index).state == StoreItemState::Queued)) {
+            m_items.at(index).state = StoreItemState::Paused;
+        }
+    }
+
+    inline void cancel(const std::size_t index) override
+    {
+        if ((index < m_items.size()) && !IsFinished(m_items.at(index).state)) {
+            m_items.at(index).state = StoreItemState::Canceled;
+        }
+    }
+
+    [[nodiscard]] inline bool start(const std::size_t index) override
+    {
+        if (index >= m_items.size()) {
+            return false;
+        }
+        Item &item = m_items.at(index);
+        if (IsFinished(item.state)) {
+            m_ready.push_back(index);
+            return true;
+        }
+        if (item.state == StoreItemState::Running) {
+            return true;
+        }
+        const SimulatedStoreItem &entry = m_catalog.at(item.catalogIndex);
+        const uint64_t downloadStart = std::max(m_now + entry.latency, m_linkFreeAt);
+        m_linkFreeAt = downloadStart + entry.downloadTime;
+        item.state = StoreItemState::Running;
+        m_events.push(Event{ m_linkFreeAt + entry.installTime, m_sequence++, index });
+        return true;
+    }
+
+    [[nodiscard]] inline StoreItemState state(const std::size_t index) const override
+    {
+        return ((index < m_items.size()) ? m_items.at(index).state : StoreItemState::Error);
+    }
+
+    [[nodiscard]] inline int32_t errorCode(const std::size_t index) const override
+    {
+        return ((index < m_items.size()) ? m_items.at(index).errorCode : kSimulatedFailure);
+    }
+
+    [[nodiscard]] inline bool waitForCompletion(std::size_t &index) override
+    {
+        if (!m_ready.empty()) {
+            index = m_ready.front();
+            m_ready.pop_front();
+            return true;
+        }
+        if (m_events.empty()) {
+            return false;
+        }
+        const Event event = m_events.top();
+        m_events.pop();
+        m_now = event.time;
+        Item &item = m_items.at(event.index);
+        SimulatedStoreItem &entry = m_catalog.at(item.catalogIndex);
+        if (entry.failures > 0) {
+            --entry.failures;
+            item.state = StoreItemState::Error;
+            item.errorCode = kSimulatedFailure;
+        } else {
+            item.state = StoreItemState::Completed;
+            m_updated.at(item.catalogIndex) = true;
+            m_completionTimes += m_now;
+            ++m_completions;
+        }
+        index = event.index;
+        return true;
+    }
+
+    [[nodiscard]] inline uint64_t now() const
+    {
+        return m_now;
+    }
+
+    [[nodiscard]] inline uint64_t meanCompletionTime() const
+    {
+        return ((m_completions > 0) ? (m_completionTimes / m_completions) : 0);
+    }
+
+private:
+    struct Item
+    {
+        std::size_t catalogIndex = 0;
+        StoreItemState state = StoreItemState::Queued;
+        int32_t errorCode = 0;
+    };
+
+    struct Event
+    {
+        uint64_t time = 0;
+        uint64_t sequence = 0;
+        std::size_t index = 0;
+
+        [[nodiscard]] inline bool operator>(const Event &other) const
+        {
+            return ((time != other.time) ? (time > other.time) : (sequence > other.sequence));
+        }
+    };
+
+    inline void reset()
+    {
+        m_items.clear();
+        m_ready.clear();
+        m_events = {};
+    }
+
+    SimulationProfile m_profile = {};
+    std::vector<SimulatedStoreItem> m_catalog = {};
+    std::vector<bool> m_updated = {};
+    std::vector<Item> m_items = {};
+    std::deque<std::size_t> m_ready = {};
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> m_events = {};
+    uint64_t m_now = 0;
+    uint64_t m_linkFreeAt = 0;
+    uint64_t m_sequence = 0;
+    uint64_t m_completionTimes = 0;
+    std::size_t m_completions = 0;
+};
+
+} // namespace WinUpdate
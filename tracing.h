@@ -0,0 +1,170 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "events.h"
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <utility>
+
+namespace WinUpdate
+{
+
+// Collects spans in memory and serializes them as Chrome trace-event JSON, which both
+// chrome://tracing and https://ui.perfetto.dev can open. While disabled every span costs
+// a single relaxed atomic load.
+class Tracer
+{
+public:
+    [[nodiscard]] static inline Tracer &instance()
+    {
+        static Tracer tracer = {};
+        return tracer;
+    }
+
+    inline void enable()
+    {
+        m_enabled.store(true, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] inline bool isEnabled() const
+    {
+        return m_enabled.load(std::memory_order_relaxed);
+    }
+
+    // Microseconds since the tracer was created.
+    [[nodiscard]] inline uint64_t now() const
+    {
+        return uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start).count());
+    }
+
+    // A span which started and ended on the calling thread, rendered nested on its track.
+    inline void complete(const std::string_view name, const std::string_view category, const uint64_t start, const uint64_t end)
+    {
+        record(Event{ std::string(name), std::string(category), 'X', start, ((end > start) ? (end - start) : 0), currentThreadId(), 0 });
+    }
+
+    // A span which may overlap others freely (one update's download while another one
+    // installs, say), rendered on its own row keyed by category and id.
+    inline void async(const std::string_view name, const std::string_view category, const uint64_t id, const uint64_t start, const uint64_t end)
+    {
+        record(Event{ std::string(name), std::string(category), 'b', start, 0, currentThreadId(), id });
+        record(Event{ std::string(name), std::string(category), 'e', ((end > start) ? end : start), 0, currentThreadId(), id });
+    }
+
+    [[nodiscard]] inline std::string serialize()
+    {
+        const std::scoped_lock lock(m_mutex);
+        std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        bool first = true;
+        for (auto &&event : std::as_const(m_events)) {
+            if (!first) {
+                json += ",\n";
+            }
+            first = false;
+            json += "{\"name\":";
+            AppendJsonString(json, std::string_view(event.name));
+            json += ",\"cat\":";
+            AppendJsonString(json, std::string_view(event.category));
+            json += ",\"ph\":\"";
+            json.push_back(event.phase);
+            json += "\",\"ts\":" + std::to_string(event.timestamp);
+            if (event.phase == 'X') {
+                json += ",\"dur\":" + std::to_string(event.duration);
+            } else {
+                json += ",\"id\":" + std::to_string(event.id);
+            }
+            json += ",\"pid\":1,\"tid\":" + std::to_string(event.thread) + '}';
+        }
+        json += "\n]}\n";
+        return json;
+    }
+
+private:
+    struct Event
+    {
+        std::string name = {};
+        std::string category = {};
+        char phase = 'X';
+        uint64_t timestamp = 0;
+        uint64_t duration = 0;
+        uint32_t thread = 0;
+        uint64_t id = 0;
+    };
+
+    Tracer() = default;
+
+    // Small stable numbers read much better in the trace viewers than OS thread IDs.
+    [[nodiscard]] static inline uint32_t currentThreadId()
+    {
+        static std::atomic<uint32_t> counter = 0;
+        thread_local const uint32_t id = ++counter;
+        return id;
+    }
+
+    inline void record(Event &&event)
+    {
+        const std::scoped_lock lock(m_mutex);
+        m_events.push_back(std::move(event));
+    }
+
+    std::atomic<bool> m_enabled = false;
+    std::chrono::steady_clock::time_point m_start = std::chrono::steady_clock::now();
+    std::mutex m_mutex;
+    std::vector<Event> m_events = {};
+};
+
+// Records the lifetime of the enclosing scope. "name" and "category" must outlive it,
+// string literals are what all callers use.
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char *name, const char *category = "phase") : m_name(name), m_category(category)
+    {
+        if (Tracer::instance().isEnabled()) {
+            m_start = Tracer::instance().now();
+            m_active = true;
+        }
+    }
+
+    ~TraceSpan()
+    {
+        if (m_active) {
+            Tracer::instance().complete(m_name, m_category, m_start, Tracer::instance().now());
+        }
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+    const char *m_name = nullptr;
+    const char *m_category = nullptr;
+    uint64_t m_start = 0;
+    bool m_active = false;
+};
+
+} // namespace WinUpdate
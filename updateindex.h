@@ -0,0 +1,424 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023 by wangwenx190 (Yuhang Zhao)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "backend.h"
+#include "filter.h"
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+namespace WinUpdate
+{
+
+static constexpr const std::size_t kStringPoolChunkSize = 16 * 1024; // Characters.
+// Below this a search result is read on the calling thread, a worker thread costs more
+// than it saves. Above it every worker gets at least this many updates.
+static constexpr const std::size_t kParallelExtractionThreshold = 128;
+static constexpr const std::size_t kMaximumExtractionWorkers = 8;
+
+// How many threads should copy "count" updates out of a search result.
+[[nodiscard]] static inline std::size_t GetExtractionWorkerCount(const std::size_t count)
+{
+    if (count < kParallelExtractionThreshold) {
+        return 1;
+    }
+    const std::size_t cores = std::max(std::size_t(std::thread::hardware_concurrency()), std::size_t(1));
+    return std::clamp(count / kParallelExtractionThreshold, std::size_t(1), std::min(cores, kMaximumExtractionWorkers));
+}
+
+// Every distinct string is stored once and referred to by a 32 bit handle. The text lives
+// in large chunks that never move, so the views handed out stay valid until "clear()",
+// which keeps the chunks around for the next round.
+class StringPool
+{
+public:
+    using Handle = uint32_t;
+
+    StringPool() = default;
+    ~StringPool() = default;
+
+    StringPool(const StringPool &) = delete;
+    StringPool &operator=(const StringPool &) = delete;
+
+    [[nodiscard]] inline Handle intern(const std::wstring_view text)
+    {
+        const auto it = m_lookup.find(text);
+        if (it != m_lookup.cend()) {
+            return it->second;
+        }
+        const std::wstring_view stored = store(text);
+        const auto handle = Handle(m_strings.size());
+        m_strings.push_back(stored);
+        m_lookup.emplace(stored, handle);
+        return handle;
+    }
+
+    // Returns false if "text" was never interned, nothing can refer to it then.
+    [[nodiscard]] inline bool find(const std::wstring_view text, Handle &handle) const
+    {
+        const auto it = m_lookup.find(text);
+        if (it == m_lookup.cend()) {
+            return false;
+        }
+        handle = it->second;
+        return true;
+    }
+
+    [[nodiscard]] inline std::wstring_view view(const Handle handle) const
+    {
+        return m_strings.at(handle);
+    }
+
+    [[nodiscard]] inline std::size_t size() const
+    {
+        return m_strings.size();
+    }
+
+    inline void clear()
+    {
+        m_strings.clear();
+        m_lookup.clear();
+        m_chunk = 0;
+        m_used = 0;
+    }
+
+    [[nodiscard]] inline std::size_t memoryUsage() const
+    {
+        std::size_t bytes = (m_strings.capacity() * sizeof(std::wstring_view)) + (m_lookup.size() * (sizeof(std::wstring_view) + sizeof(Handle) + (2 * sizeof(void *))));
+        for (auto &&chunk : std::as_const(m_chunks)) {
+            bytes += (chunk.capacity * sizeof(wchar_t));
+        }
+        return bytes;
+    }
+
+private:
+    struct Chunk
+    {
+        std::unique_ptr<wchar_t[]> data = nullptr;
+        std::size_t capacity = 0;
+    };
+
+    [[nodiscard]] inline std::wstring_view store(const std::wstring_view text)
+    {
+        if (text.empty()) {
+            return {};
+        }
+        while ((m_chunk < m_chunks.size()) && ((m_chunks.at(m_chunk).capacity - m_used) < text.size())) {
+            ++m_chunk;
+            m_used = 0;
+        }
+        if (m_chunk >= m_chunks.size()) {
+            const std::size_t capacity = std::max(kStringPoolChunkSize, text.size());
+            m_chunks.push_back(Chunk{ std::make_unique<wchar_t[]>(capacity), capacity });
+            m_chunk = (m_chunks.size() - 1);
+            m_used = 0;
+        }
+        wchar_t *destination = (m_chunks.at(m_chunk).data.get() + m_used);
+        std::copy(text.cbegin(), text.cend(), destination);
+        m_used += text.size();
+        return std::wstring_view(destination, text.size());
+    }
+
+    std::vector<Chunk> m_chunks = {};
+    std::size_t m_chunk = 0; // The one being filled.
+    std::size_t m_used = 0; // Characters used in it.
+    std::vector<std::wstring_view> m_strings = {};
+    std::unordered_map<std::wstring_view, Handle> m_lookup = {};
+};
+
+enum class UpdateIndexKey : uint8_t
+{
+    Severity,
+    Size,
+    Kb,
+    Title
+};
+
+// The metadata of a search result as columns: every query only walks the arrays it
+// needs, and the strings are interned, category IDs in particular repeat a lot. Rows are
+// in search result order. "clear()" keeps all the capacity, an index that is refilled on
+// every search doesn't grow beyond the largest catalog it saw.
+class UpdateIndex
+{
+public:
+    using Row = uint32_t;
+
+    UpdateIndex() = default;
+    ~UpdateIndex() = default;
+
+    UpdateIndex(const UpdateIndex &) = delete;
+    UpdateIndex &operator=(const UpdateIndex &) = delete;
+
+    inline void clear()
+    {
+        m_strings.clear();
+        m_ids.clear();
+        m_titles.clear();
+        m_revisions.clear();
+        m_kbs.clear();
+        m_sizes.clear();
+        m_severities.clear();
+        m_flags.clear();
+        m_categoryOffsets.clear();
+        m_categories.clear();
+    }
+
+    inline void reserve(const std::size_t count)
+    {
+        m_ids.reserve(count);
+        m_titles.reserve(count);
+        m_revisions.reserve(count);
+        m_kbs.reserve(count);
+        m_sizes.reserve(count);
+        m_severities.reserve(count);
+        m_flags.reserve(count);
+        m_categoryOffsets.reserve(count + 1);
+    }
+
+    inline Row append(const UpdateDescriptor &update)
+    {
+        if (m_categoryOffsets.empty()) {
+            m_categoryOffsets.push_back(0);
+        }
+        const auto row = Row(m_ids.size());
+        m_ids.push_back(m_strings.intern(update.id));
+        m_titles.push_back(m_strings.intern(update.title));
+        m_revisions.push_back(update.revision);
+        m_kbs.push_back(update.kb);
+        m_sizes.push_back(update.maxDownloadSize);
+        m_severities.push_back(update.severity);
+        m_flags.push_back(uint8_t((update.downloaded ? kDownloadedFlag : 0) | ((update.type == UpdateType::Driver) ? kDriverFlag : 0) | (update.canRequestUserInput ? kUserInputFlag : 0)
+            | (uint8_t(update.impact) << kImpactShift) | (uint8_t(update.rebootBehavior) << kRebootShift)));
+        for (auto &&category : std::as_const(update.categories)) {
+            m_categories.push_back(m_strings.intern(category));
+        }
+        m_categoryOffsets.push_back(uint32_t(m_categories.size()));
+        return row;
+    }
+
+    inline void assign(const std::vector<UpdateDescriptor> &updates)
+    {
+        clear();
+        reserve(updates.size());
+        for (auto &&update : std::as_const(updates)) {
+            append(update);
+        }
+    }
+
+    [[nodiscard]] inline std::size_t size() const
+    {
+        return m_ids.size();
+    }
+
+    [[nodiscard]] inline std::wstring_view id(const Row row) const
+    {
+        return m_strings.view(m_ids.at(row));
+    }
+
+    [[nodiscard]] inline std::wstring_view title(const Row row) const
+    {
+        return m_strings.view(m_titles.at(row));
+    }
+
+    [[nodiscard]] inline int32_t revision(const Row row) const
+    {
+        return m_revisions.at(row);
+    }
+
+    [[nodiscard]] inline uint32_t kb(const Row row) const
+    {
+        return m_kbs.at(row);
+    }
+
+    [[nodiscard]] inline uint64_t maxDownloadSize(const Row row) const
+    {
+        return m_sizes.at(row);
+    }
+
+    [[nodiscard]] inline UpdateSeverity severity(const Row row) const
+    {
+        return m_severities.at(row);
+    }
+
+    [[nodiscard]] inline bool isDownloaded(const Row row) const
+    {
+        return ((m_flags.at(row) & kDownloadedFlag) != 0);
+    }
+
+    [[nodiscard]] inline UpdateType type(const Row row) const
+    {
+        return (((m_flags.at(row) & kDriverFlag) != 0) ? UpdateType::Driver : UpdateType::Software);
+    }
+
+    [[nodiscard]] inline InstallImpact impact(const Row row) const
+    {
+        return InstallImpact((m_flags.at(row) >> kImpactShift) & kTwoBitMask);
+    }
+
+    [[nodiscard]] inline RebootBehavior rebootBehavior(const Row row) const
+    {
+        return RebootBehavior((m_flags.at(row) >> kRebootShift) & kTwoBitMask);
+    }
+
+    [[nodiscard]] inline bool canRequestUserInput(const Row row) const
+    {
+        return ((m_flags.at(row) & kUserInputFlag) != 0);
+    }
+
+    [[nodiscard]] inline bool hasCategory(const Row row, const std::wstring_view categoryId) const
+    {
+        StringPool::Handle handle = 0;
+        if (!m_strings.find(categoryId, handle)) {
+            return false;
+        }
+        const auto begin = (m_categories.cbegin() + m_categoryOffsets.at(row));
+        const auto end = (m_categories.cbegin() + m_categoryOffsets.at(row + 1));
+        return (std::find(begin, end, handle) != end);
+    }
+
+    // The rows "filter" lets through, in search result order.
+    [[nodiscard]] inline std::vector<Row> select(const UpdateFilter &filter) const
+    {
+        return selectIf([this, &filter](const Row row){
+            return filter.matchesUpdate(m_kbs[row], m_severities[row], m_sizes[row], type(row), [this, row](const std::wstring_view categoryId){ return hasCategory(row, categoryId); });
+        });
+    }
+
+    template <typename Predicate>
+    [[nodiscard]] inline std::vector<Row> selectIf(Predicate &&predicate) const
+    {
+        std::vector<Row> rows = {};
+        for (Row row = 0; row != Row(size()); ++row) {
+            if (predicate(row)) {
+                rows.push_back(row);
+            }
+        }
+        return rows;
+    }
+
+    // Most severe, largest, highest KB first, titles alphabetically. Stable, so sorting by
+    // a second key first gives a secondary order.
+    inline void sort(std::vector<Row> &rows, const UpdateIndexKey key) const
+    {
+        switch (key) {
+        case UpdateIndexKey::Severity:
+            std::stable_sort(rows.begin(), rows.end(), [this](const Row lhs, const Row rhs){ return (m_severities[lhs] > m_severities[rhs]); });
+            break;
+        case UpdateIndexKey::Size:
+            std::stable_sort(rows.begin(), rows.end(), [this](const Row lhs, const Row rhs){ return (m_sizes[lhs] > m_sizes[rhs]); });
+            break;
+        case UpdateIndexKey::Kb:
+            std::stable_sort(rows.begin(), rows.end(), [this](const Row lhs, const Row rhs){ return (m_kbs[lhs] > m_kbs[rhs]); });
+            break;
+        case UpdateIndexKey::Title:
+            std::stable_sort(rows.begin(), rows.end(), [this](const Row lhs, const Row rhs){ return (title(lhs) < title(rhs)); });
+            break;
+        }
+    }
+
+    // Bytes still to download for "row", a payload already on the disk doesn't count.
+    [[nodiscard]] inline uint64_t downloadSize(const Row row) const
+    {
+        return (isDownloaded(row) ? 0 : m_sizes.at(row));
+    }
+
+    [[nodiscard]] inline uint64_t downloadSize(const std::vector<Row> &rows) const
+    {
+        uint64_t bytes = 0;
+        for (auto &&row : std::as_const(rows)) {
+            bytes += (isDownloaded(row) ? 0 : m_sizes[row]);
+        }
+        return bytes;
+    }
+
+    // How many of "rows" there are per "UpdateSeverity".
+    [[nodiscard]] inline std::array<std::size_t, 5> severityCounts(const std::vector<Row> &rows) const
+    {
+        std::array<std::size_t, 5> counts = {};
+        for (auto &&row : std::as_const(rows)) {
+            ++counts.at(std::size_t(m_severities[row]));
+        }
+        return counts;
+    }
+
+    [[nodiscard]] inline UpdateDescriptor descriptor(const Row row) const
+    {
+        UpdateDescriptor update = {};
+        update.id = id(row);
+        update.revision = revision(row);
+        update.title = title(row);
+        update.kb = kb(row);
+        update.maxDownloadSize = maxDownloadSize(row);
+        update.downloaded = isDownloaded(row);
+        update.severity = severity(row);
+        update.type = type(row);
+        update.impact = impact(row);
+        update.rebootBehavior = rebootBehavior(row);
+        update.canRequestUserInput = canRequestUserInput(row);
+        for (uint32_t index = m_categoryOffsets.at(row); index != m_categoryOffsets.at(row + 1); ++index) {
+            update.categories.emplace_back(m_strings.view(m_categories.at(index)));
+        }
+        return update;
+    }
+
+    // Roughly what the index holds on to, capacity included.
+    [[nodiscard]] inline std::size_t memoryUsage() const
+    {
+        return (m_strings.memoryUsage()
+            + ((m_ids.capacity() + m_titles.capacity() + m_categories.capacity() + m_categoryOffsets.capacity()) * sizeof(uint32_t))
+            + (m_revisions.capacity() * sizeof(int32_t)) + (m_kbs.capacity() * sizeof(uint32_t)) + (m_sizes.capacity() * sizeof(uint64_t))
+            + m_severities.capacity() + m_flags.capacity());
+    }
+
+private:
+    static constexpr const uint8_t kDownloadedFlag = 0x01;
+    static constexpr const uint8_t kDriverFlag = 0x02;
+    static constexpr const uint8_t kUserInputFlag = 0x04;
+    // "InstallImpact" and "RebootBehavior" take two bits each.
+    static constexpr const uint8_t kImpactShift = 3;
+    static constexpr const uint8_t kRebootShift = 5;
+    static constexpr const uint8_t kTwoBitMask = 0x03;
+
+    StringPool m_strings = {};
+    std::vector<StringPool::Handle> m_ids = {};
+    std::vector<StringPool::Handle> m_titles = {};
+    std::vector<int32_t> m_revisions = {};
+    std::vector<uint32_t> m_kbs = {};
+    std::vector<uint64_t> m_sizes = {};
+    std::vector<UpdateSeverity> m_severities = {};
+    std::vector<uint8_t> m_flags = {};
+    std::vector<uint32_t> m_categoryOffsets = {}; // Row N's categories are [N, N + 1).
+    std::vector<StringPool::Handle> m_categories = {};
+};
+
+} // namespace WinUpdate